@@ -34,6 +34,9 @@
 #define NBDKIT_RANDOM_H
 
 #include <stdint.h>
+#include <string.h>
+
+#include "byte-swapping.h"
 
 /* Generate pseudo-random numbers, quickly, with explicit state.
  *
@@ -103,4 +106,53 @@ xrandom (struct random_state *state)
   return result_starstar;
 }
 
+/* Counter-mode generator.  This returns word n of the stream
+ * identified by key, ie. splitmix64 (key + (n+1) * 0x9e3779b97f4a7c15).
+ * Because there is no state, any word of the stream can be computed
+ * directly and many words can be computed in parallel.
+ */
+static inline uint64_t
+xrandom_at (uint64_t key, uint64_t n)
+{
+  uint64_t seed = key + n * 0x9e3779b97f4a7c15;
+  return snext (&seed);
+}
+
+/* Fill buf with bytes [offset, offset+count-1] of the counter-mode
+ * stream, where the stream is the sequence of words from xrandom_at
+ * stored in little endian order.  The output is the same on all
+ * platforms.
+ */
+static inline void __attribute__ ((__nonnull__ (2)))
+xrandom_fill (uint64_t key, void *buf, uint64_t count, uint64_t offset)
+{
+  unsigned char *b = buf;
+  uint64_t n = offset >> 3, w;
+  unsigned o = offset & 7, m;
+
+  /* Unaligned head. */
+  if (o > 0 && count > 0) {
+    w = htole64 (xrandom_at (key, n));
+    m = count < 8-o ? count : 8-o;
+    memcpy (b, (char *)&w + o, m);
+    b += m;
+    count -= m;
+    n++;
+  }
+
+  /* Whole words.  Iterations are independent so the compiler and CPU
+   * are free to overlap or vectorize them.
+   */
+  for (; count >= 8; b += 8, count -= 8, n++) {
+    w = htole64 (xrandom_at (key, n));
+    memcpy (b, &w, 8);
+  }
+
+  /* Tail. */
+  if (count > 0) {
+    w = htole64 (xrandom_at (key, n));
+    memcpy (b, &w, count);
+  }
+}
+
 #endif /* NBDKIT_RANDOM_H */
@@ -35,9 +35,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <inttypes.h>
+#include <string.h>
 
 #include "array-size.h"
+#include "bench.h"
 #include "random.h"
 
 /* This works by comparing the result to some known test vectors.  It
@@ -161,8 +164,40 @@ UINT64_C (0xc6ca62fc772728b0),
 } },
 };
 
-int
-main (void)
+/* Known vectors for the counter-mode generator, xrandom_at. */
+struct {
+  uint64_t key;
+  uint64_t n[6];
+  uint64_t vector[6];
+} counter_tests[] = {
+  { 0, { 0, 1, 2, 3, 1000, UINT64_C (0x1fffffffffffffff) }, {
+UINT64_C (0xe220a8397b1dcdaf),
+UINT64_C (0x6e789e6aa1b965f4),
+UINT64_C (0x06c45d188009454f),
+UINT64_C (0xf88bb8a8724c81ec),
+UINT64_C (0x2cfa2f23425329e1),
+UINT64_C (0x8f2863e4608dd63a),
+} },
+  { 1, { 0, 1, 2, 3, 1000, UINT64_C (0x1fffffffffffffff) }, {
+UINT64_C (0x910a2dec89025cc1),
+UINT64_C (0xbeeb8da1658eec67),
+UINT64_C (0xf893a2eefb32555e),
+UINT64_C (0x71c18690ee42c90b),
+UINT64_C (0x7760003b54a685ae),
+UINT64_C (0xe7c357073b77c763),
+} },
+  { 0xffffffff, { 0, 1, 2, 3, 1000, UINT64_C (0x1fffffffffffffff) }, {
+UINT64_C (0x73b13ba2aff181c0),
+UINT64_C (0x612043051340d3b4),
+UINT64_C (0xee4ac9ff47275e73),
+UINT64_C (0x12f4eeb73ced4b8e),
+UINT64_C (0x87d6bae07532f39c),
+UINT64_C (0x4a642857537dd0f0),
+} },
+};
+
+static unsigned
+test_xrandom (void)
 {
   size_t i, j;
   uint64_t r;
@@ -183,6 +218,125 @@ main (void)
     }
   }
 
+  return errors;
+}
+
+static unsigned
+test_xrandom_at (void)
+{
+  size_t i, j;
+  uint64_t r;
+  unsigned errors = 0;
+
+  for (i = 0; i < ARRAY_SIZE (counter_tests); ++i) {
+    printf ("key: %" PRIu64 "\n", counter_tests[i].key);
+    for (j = 0; j < ARRAY_SIZE (counter_tests[i].n); ++j) {
+      r = xrandom_at (counter_tests[i].key, counter_tests[i].n[j]);
+      if (counter_tests[i].vector[j] != r) {
+        printf ("\texpected: 0x%" PRIx64 "\tactual: 0x%" PRIx64 "\n",
+                counter_tests[i].vector[j], r);
+        errors++;
+      }
+    }
+  }
+
+  return errors;
+}
+
+/* Check that xrandom_fill returns the same bytes whatever the
+ * alignment and length of the request.
+ */
+static unsigned
+test_xrandom_fill (void)
+{
+  unsigned char expected[256], actual[256];
+  uint64_t offset, count;
+  unsigned errors = 0;
+
+  xrandom_fill (1, expected, sizeof expected, 0);
+  if (expected[0] != 0xc1 || expected[7] != 0x91 || expected[8] != 0x67) {
+    printf ("xrandom_fill is not little endian\n");
+    errors++;
+  }
+
+  for (offset = 0; offset < 24; ++offset) {
+    for (count = 0; count <= sizeof expected - offset; count += 7) {
+      memset (actual, 0, sizeof actual);
+      xrandom_fill (1, actual, count, offset);
+      if (memcmp (actual, &expected[offset], count) != 0) {
+        printf ("xrandom_fill: offset %" PRIu64 " count %" PRIu64
+                " does not match\n", offset, count);
+        errors++;
+      }
+    }
+  }
+
+  return errors;
+}
+
+#define BENCH_SIZE (64 * 1024 * 1024)
+
+/* Compare generating random data using xoshiro256** seeded per byte
+ * (the original method used by nbdkit-random-plugin), and the
+ * counter-mode generator.
+ */
+static void
+bench_fill (void)
+{
+  unsigned char *buf;
+  struct bench b;
+  uint64_t i, s;
+
+  buf = malloc (BENCH_SIZE);
+  if (buf == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+
+  bench_start (&b);
+  for (i = 0; i < BENCH_SIZE; ++i) {
+    struct random_state state;
+
+    xsrandom (i, &state);
+    xrandom (&state);
+    xrandom (&state);
+    s = xrandom (&state);
+    buf[i] = s & 255;
+  }
+  bench_stop (&b);
+  printf ("bench_fill: xoshiro per byte: %d MB in %.6f s, %.1f MB/s\n",
+          BENCH_SIZE >> 20, bench_sec (&b),
+          (BENCH_SIZE >> 20) / bench_sec (&b));
+
+  bench_start (&b);
+  xrandom_fill (0, buf, BENCH_SIZE, 0);
+  bench_stop (&b);
+  printf ("bench_fill: counter mode:    %d MB in %.6f s, %.1f MB/s\n",
+          BENCH_SIZE >> 20, bench_sec (&b),
+          (BENCH_SIZE >> 20) / bench_sec (&b));
+
+  free (buf);
+}
+
+int
+main (void)
+{
+  const char *s;
+  bool bench;
+  unsigned errors = 0;
+
+  s = getenv ("NBDKIT_BENCH");
+  bench = s && strcmp (s, "1") == 0;
+
+  if (bench) {
+    bench_fill ();
+    exit (EXIT_SUCCESS);
+  }
+
+  errors += test_xrandom ();
+  errors += test_xrandom_at ();
+  errors += test_xrandom_fill ();
+
   if (errors > 0) {
     fprintf (stderr, "random vector does not match expected\n");
     exit (EXIT_FAILURE);
@@ -0,0 +1,373 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+
+#include "blkcache.h"
+
+/* Initial number of hash buckets.  Must be a power of 2. */
+#define INITIAL_BUCKETS 64
+
+struct block {
+  uint64_t number;              /* Block number (hash key). */
+  uint64_t start;               /* Offset in the uncompressed data. */
+  uint64_t size;                /* Uncompressed size of the block. */
+  char *data;                   /* NULL until filled. */
+  bool failed;                  /* Filling failed, waiters must retry. */
+  bool in_cache;                /* Linked into the hash table and LRU list. */
+  unsigned refs;                /* References held by callers. */
+
+  struct block *hnext;          /* Next block in the same hash bucket. */
+  struct block *prev, *next;    /* LRU list, most recently used first. */
+};
+
+struct blkcache {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;          /* Signalled when a block is filled. */
+
+  size_t maxdepth;
+  uint64_t maxsize;
+
+  struct block **buckets;
+  size_t nr_buckets;
+  struct block *head, *tail;
+  size_t nr_blocks;             /* Number of blocks in the cache. */
+  uint64_t used;                /* Bytes of filled blocks in the cache. */
+
+  blkcache_stats stats;
+};
+
+blkcache *
+new_blkcache (size_t maxdepth, uint64_t maxsize)
+{
+  blkcache *c;
+
+  c = calloc (1, sizeof *c);
+  if (!c) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
+  c->buckets = calloc (INITIAL_BUCKETS, sizeof (struct block *));
+  if (!c->buckets) {
+    nbdkit_error ("calloc: %m");
+    free (c);
+    return NULL;
+  }
+  c->nr_buckets = INITIAL_BUCKETS;
+  c->maxdepth = maxdepth;
+  c->maxsize = maxsize;
+  pthread_mutex_init (&c->lock, NULL);
+  pthread_cond_init (&c->cond, NULL);
+
+  return c;
+}
+
+static void
+free_block (struct block *b)
+{
+  free (b->data);
+  free (b);
+}
+
+void
+free_blkcache (blkcache *c)
+{
+  struct block *b, *next;
+
+  /* All references must have been dropped by now. */
+  for (b = c->head; b != NULL; b = next) {
+    next = b->next;
+    free_block (b);
+  }
+  free (c->buckets);
+  pthread_mutex_destroy (&c->lock);
+  pthread_cond_destroy (&c->cond);
+  free (c);
+}
+
+static size_t
+hash (const blkcache *c, uint64_t number)
+{
+  /* Fibonacci hashing, since block numbers are sequential. */
+  return (number * UINT64_C (0x9e3779b97f4a7c15)) >> 32 & (c->nr_buckets-1);
+}
+
+/* Double the number of hash buckets.  Failure is not fatal, the
+ * chains just get longer.  Lock must be held.
+ */
+static void
+grow_buckets (blkcache *c)
+{
+  struct block **old = c->buckets;
+  const size_t old_nr = c->nr_buckets;
+  struct block *b, *hnext;
+  size_t i, h;
+
+  c->buckets = calloc (old_nr * 2, sizeof (struct block *));
+  if (c->buckets == NULL) {
+    c->buckets = old;
+    return;
+  }
+  c->nr_buckets = old_nr * 2;
+
+  for (i = 0; i < old_nr; ++i) {
+    for (b = old[i]; b != NULL; b = hnext) {
+      hnext = b->hnext;
+      h = hash (c, b->number);
+      b->hnext = c->buckets[h];
+      c->buckets[h] = b;
+    }
+  }
+  free (old);
+}
+
+/* Lock must be held. */
+static struct block *
+lookup (blkcache *c, uint64_t number)
+{
+  struct block *b;
+
+  for (b = c->buckets[hash (c, number)]; b != NULL; b = b->hnext)
+    if (b->number == number)
+      return b;
+  return NULL;
+}
+
+/* LRU list manipulation.  Lock must be held. */
+static void
+lru_unlink (blkcache *c, struct block *b)
+{
+  if (b->prev) b->prev->next = b->next; else c->head = b->next;
+  if (b->next) b->next->prev = b->prev; else c->tail = b->prev;
+  b->prev = b->next = NULL;
+}
+
+static void
+lru_push_front (blkcache *c, struct block *b)
+{
+  b->prev = NULL;
+  b->next = c->head;
+  if (c->head) c->head->prev = b; else c->tail = b;
+  c->head = b;
+}
+
+/* Remove a block from the hash table and LRU list.  The block is
+ * freed if nothing references it.  Lock must be held.
+ */
+static void
+remove_block (blkcache *c, struct block *b)
+{
+  struct block **p;
+
+  for (p = &c->buckets[hash (c, b->number)]; *p != b; p = &(*p)->hnext)
+    ;
+  *p = b->hnext;
+  lru_unlink (c, b);
+  b->in_cache = false;
+  c->nr_blocks--;
+  if (b->data)
+    c->used -= b->size;
+
+  if (b->refs == 0)
+    free_block (b);
+}
+
+/* Evict least recently used filled blocks until the cache is within
+ * its limits, but never evict 'keep'.  Lock must be held.
+ */
+static void
+evict (blkcache *c, struct block *keep)
+{
+  struct block *b, *prev;
+
+  for (b = c->tail;
+       b != NULL && (c->used > c->maxsize || c->nr_blocks > c->maxdepth);
+       b = prev) {
+    prev = b->prev;
+    /* Blocks being filled are not counted in c->used and cannot be
+     * evicted because other threads may be waiting for them.
+     */
+    if (b == keep || b->data == NULL)
+      continue;
+    remove_block (c, b);
+    c->stats.evictions++;
+  }
+}
+
+/* Lock must be held. */
+static struct block *
+new_placeholder (blkcache *c, uint64_t number, uint64_t start, uint64_t size)
+{
+  struct block *b;
+  size_t h;
+
+  b = calloc (1, sizeof *b);
+  if (b == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  b->number = number;
+  b->start = start;
+  b->size = size;
+  b->in_cache = true;
+  b->refs = 1;
+
+  if (c->nr_blocks >= c->nr_buckets * 2)
+    grow_buckets (c);
+  h = hash (c, number);
+  b->hnext = c->buckets[h];
+  c->buckets[h] = b;
+  lru_push_front (c, b);
+  c->nr_blocks++;
+
+  return b;
+}
+
+block *
+get_block (blkcache *c, uint64_t number, uint64_t start, uint64_t size,
+           bool *fill)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+  struct block *b;
+
+  *fill = false;
+
+  for (;;) {
+    b = lookup (c, number);
+    if (b == NULL) {
+      c->stats.misses++;
+      b = new_placeholder (c, number, start, size);
+      if (b)
+        *fill = true;
+      return b;
+    }
+
+    b->refs++;
+    if (b->data == NULL) {
+      /* Another thread is uncompressing this block, wait for it. */
+      while (b->data == NULL && !b->failed)
+        pthread_cond_wait (&c->cond, &c->lock);
+      if (b->failed) {
+        /* It failed, so retry ourselves to get the error. */
+        if (--b->refs == 0)
+          free_block (b);
+        continue;
+      }
+    }
+
+    c->stats.hits++;
+    if (b->in_cache) {
+      lru_unlink (c, b);
+      lru_push_front (c, b);
+    }
+    return b;
+  }
+}
+
+block *
+reserve_block (blkcache *c, uint64_t number, uint64_t start, uint64_t size)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+
+  if (lookup (c, number) != NULL)
+    return NULL;
+  c->stats.misses++;
+  return new_placeholder (c, number, start, size);
+}
+
+void
+fill_block (blkcache *c, block *b, char *data)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+
+  if (data != NULL) {
+    b->data = data;
+    c->used += b->size;
+    if (c->used > c->stats.max_used)
+      c->stats.max_used = c->used;
+    evict (c, b);
+  }
+  else {
+    b->failed = true;
+    remove_block (c, b);        /* Not freed, because we hold a reference. */
+  }
+
+  pthread_cond_broadcast (&c->cond);
+}
+
+void
+put_block (blkcache *c, block *b)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+
+  if (--b->refs == 0 && !b->in_cache)
+    free_block (b);
+}
+
+uint64_t
+block_start (const block *b)
+{
+  return b->start;
+}
+
+uint64_t
+block_size (const block *b)
+{
+  return b->size;
+}
+
+const char *
+block_data (const block *b)
+{
+  return b->data;
+}
+
+void
+blkcache_get_stats (blkcache *c, blkcache_stats *ret)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+
+  memcpy (ret, &c->stats, sizeof (c->stats));
+}
@@ -0,0 +1,104 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_BLKCACHE_H
+#define NBDKIT_BLKCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Cache of uncompressed blocks, indexed by block number.  This is
+ * used by filters which uncompress files made of independently
+ * compressed blocks, such as xz blocks or zstd frames.
+ *
+ * The cache is safe to use from multiple threads.  Blocks returned
+ * by get_block are reference counted, so they stay valid until the
+ * caller calls put_block even if they are evicted in the meantime.
+ */
+typedef struct blkcache blkcache;
+typedef struct block block;
+
+typedef struct blkcache_stats {
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+  uint64_t max_used;
+} blkcache_stats;
+
+/* Create a cache holding at most maxdepth blocks and at most maxsize
+ * bytes of uncompressed data.  The most recently used block is always
+ * kept, even if it alone is larger than maxsize.
+ */
+extern blkcache *new_blkcache (size_t maxdepth, uint64_t maxsize);
+extern void free_blkcache (blkcache *) __attribute__ ((__nonnull__ (1)));
+
+/* Look up block number 'number' (which covers [start, start+size) of
+ * the uncompressed data) and return a reference to it.
+ *
+ * If another thread is uncompressing the block this waits for it.
+ * If the block is not in the cache an empty placeholder is returned
+ * and *fill is set to true, in which case the caller must uncompress
+ * the block and call fill_block.
+ */
+extern block *get_block (blkcache *, uint64_t number,
+                         uint64_t start, uint64_t size, bool *fill)
+  __attribute__ ((__nonnull__ (1, 5)));
+
+/* Like get_block, but for prefetching.  Returns NULL if the block is
+ * already cached or being uncompressed.  Otherwise returns a
+ * placeholder which the caller must fill.
+ */
+extern block *reserve_block (blkcache *, uint64_t number,
+                             uint64_t start, uint64_t size)
+  __attribute__ ((__nonnull__ (1)));
+
+/* Fill a placeholder returned by get_block or reserve_block with the
+ * uncompressed data (which the cache takes ownership of), or with
+ * NULL if uncompressing failed.  Waiting threads are woken.
+ */
+extern void fill_block (blkcache *, block *, char *data)
+  __attribute__ ((__nonnull__ (1, 2)));
+
+/* Drop a reference returned by get_block or reserve_block. */
+extern void put_block (blkcache *, block *)
+  __attribute__ ((__nonnull__ (1, 2)));
+
+/* Get the start, size and data of a filled block. */
+extern uint64_t block_start (const block *) __attribute__ ((__nonnull__ (1)));
+extern uint64_t block_size (const block *) __attribute__ ((__nonnull__ (1)));
+extern const char *block_data (const block *)
+  __attribute__ ((__nonnull__ (1)));
+
+extern void blkcache_get_stats (blkcache *, blkcache_stats *ret)
+  __attribute__ ((__nonnull__ (1, 2)));
+
+#endif /* NBDKIT_BLKCACHE_H */
@@ -0,0 +1,183 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+#include "string-vector.h"
+
+#include "diskpool.h"
+
+struct diskpool {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;          /* Signals the background thread. */
+  size_t size;
+  diskpool_create_fn create;
+  diskpool_remove_fn remove;
+
+  string_vector disks;          /* Disks ready to be used. */
+  bool started;                 /* Background thread was started. */
+  bool stop;                    /* Tells the background thread to exit. */
+  bool failed;                  /* Last create failed. */
+  pthread_t thread;
+
+  /* Statistics, printed in debug output when the pool is freed. */
+  size_t hits, misses;
+};
+
+diskpool *
+new_diskpool (size_t size,
+              diskpool_create_fn create, diskpool_remove_fn remove)
+{
+  diskpool *p;
+
+  p = calloc (1, sizeof *p);
+  if (!p) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  p->size = size;
+  p->create = create;
+  p->remove = remove;
+  pthread_mutex_init (&p->lock, NULL);
+  pthread_cond_init (&p->cond, NULL);
+
+  return p;
+}
+
+static void *
+diskpool_thread (void *vp)
+{
+  diskpool *p = vp;
+  char *path;
+
+  pthread_mutex_lock (&p->lock);
+  while (!p->stop) {
+    /* If creating a disk failed, it would probably fail again, so
+     * don't try again until the next client takes a disk.
+     */
+    if (p->disks.len >= p->size || p->failed) {
+      pthread_cond_wait (&p->cond, &p->lock);
+      continue;
+    }
+
+    /* Don't hold the lock while the (slow) command runs. */
+    pthread_mutex_unlock (&p->lock);
+    path = p->create ();
+    pthread_mutex_lock (&p->lock);
+
+    if (path == NULL) {
+      nbdkit_debug ("diskpool: could not create disk, "
+                    "will try again when the next client connects");
+      p->failed = true;
+    }
+    else if (string_vector_append (&p->disks, path) == -1) {
+      nbdkit_error ("realloc: %m");
+      p->remove (path);
+      free (path);
+      p->failed = true;
+    }
+    else
+      nbdkit_debug ("diskpool: %zu/%zu disks ready", p->disks.len, p->size);
+  }
+  pthread_mutex_unlock (&p->lock);
+
+  return NULL;
+}
+
+int
+diskpool_start (diskpool *p)
+{
+  int err;
+
+  err = pthread_create (&p->thread, NULL, diskpool_thread, p);
+  if (err) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+  p->started = true;
+  return 0;
+}
+
+void
+free_diskpool (diskpool *p)
+{
+  size_t i;
+
+  if (p->started) {
+    pthread_mutex_lock (&p->lock);
+    p->stop = true;
+    pthread_cond_signal (&p->cond);
+    pthread_mutex_unlock (&p->lock);
+    pthread_join (p->thread, NULL);
+  }
+
+  nbdkit_debug ("diskpool: hits %zu misses %zu", p->hits, p->misses);
+
+  for (i = 0; i < p->disks.len; ++i)
+    p->remove (p->disks.ptr[i]);
+  string_vector_empty (&p->disks);
+  pthread_cond_destroy (&p->cond);
+  pthread_mutex_destroy (&p->lock);
+  free (p);
+}
+
+char *
+diskpool_get (diskpool *p)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&p->lock);
+  char *path = NULL;
+
+  if (p->disks.len > 0) {
+    path = p->disks.ptr[0];
+    string_vector_remove (&p->disks, 0);
+    p->hits++;
+  }
+  else
+    p->misses++;
+
+  /* Wake up the background thread to replace the disk. */
+  p->failed = false;
+  pthread_cond_signal (&p->cond);
+
+  return path;
+}
@@ -0,0 +1,77 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_DISKPOOL_H
+#define NBDKIT_DISKPOOL_H
+
+#include <stddef.h>
+
+/* Pool of disks which have been created ahead of time by a
+ * background thread.  This is used by plugins which create a new
+ * disk by running a command for each client (such as tmpdisk and
+ * ondemand), so that a client does not have to wait for the command
+ * to run when it connects.
+ *
+ * create is called from the background thread to create a new disk.
+ * It returns the path of the disk (which the pool frees), or NULL on
+ * error.  remove is called to delete disks which are still in the
+ * pool when it is freed.  The pool is safe to use from multiple
+ * threads.
+ */
+typedef struct diskpool diskpool;
+typedef char *(*diskpool_create_fn) (void);
+typedef void (*diskpool_remove_fn) (const char *path);
+
+extern diskpool *new_diskpool (size_t size,
+                               diskpool_create_fn create,
+                               diskpool_remove_fn remove)
+  __attribute__ ((__nonnull__ (2, 3)));
+
+/* Start the background thread which fills the pool.  Plugins must
+ * call this after forking (in .after_fork).  On error this calls
+ * nbdkit_error and returns -1.
+ */
+extern int diskpool_start (diskpool *) __attribute__ ((__nonnull__ (1)));
+
+/* Stop the background thread (waiting for any disk being created),
+ * remove the disks in the pool and free it.
+ */
+extern void free_diskpool (diskpool *) __attribute__ ((__nonnull__ (1)));
+
+/* Take a disk from the pool, returning its path which the caller
+ * must free.  The background thread then creates a new disk to
+ * replace it.  If the pool is empty this returns NULL, and the caller
+ * should create the disk itself.
+ */
+extern char *diskpool_get (diskpool *) __attribute__ ((__nonnull__ (1)));
+
+#endif /* NBDKIT_DISKPOOL_H */
@@ -0,0 +1,268 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+#include "utils.h"
+
+#include "fdcache.h"
+
+struct fdentry {
+  size_t i;                     /* File number. */
+  int fd;
+  unsigned refs;                /* Number of threads using the fd. */
+  uint64_t last_used;           /* Value of clock when last used. */
+};
+
+struct fdcache {
+  pthread_mutex_t lock;
+  size_t max;
+  struct fdentry *entries;      /* Array of up to max entries. */
+  size_t nr_entries;
+  uint64_t clock;
+
+  /* Statistics, printed in debug output when the cache is freed. */
+  size_t hits, misses, evictions;
+};
+
+fdcache *
+new_fdcache (size_t max)
+{
+  fdcache *c;
+
+  if (max == 0)
+    max = 1;
+
+  c = calloc (1, sizeof *c);
+  if (!c) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  c->entries = calloc (max, sizeof (struct fdentry));
+  if (!c->entries) {
+    nbdkit_error ("calloc: %m");
+    free (c);
+    return NULL;
+  }
+  c->max = max;
+  pthread_mutex_init (&c->lock, NULL);
+
+  return c;
+}
+
+void
+free_fdcache (fdcache *c)
+{
+  size_t j;
+
+  nbdkit_debug ("fdcache: hits %zu misses %zu evictions %zu",
+                c->hits, c->misses, c->evictions);
+
+  /* All references must have been dropped by now. */
+  for (j = 0; j < c->nr_entries; ++j)
+    close (c->entries[j].fd);
+  free (c->entries);
+  pthread_mutex_destroy (&c->lock);
+  free (c);
+}
+
+/* Find the entry for file number i.  Must be called with the lock
+ * held.
+ */
+static struct fdentry *
+find_entry (fdcache *c, size_t i)
+{
+  size_t j;
+
+  for (j = 0; j < c->nr_entries; ++j) {
+    if (c->entries[j].i == i)
+      return &c->entries[j];
+  }
+  return NULL;
+}
+
+/* Common code for fdcache_get and fdcache_readahead.  If report is
+ * false then failure to open the file is not reported (but -1 is
+ * still returned).
+ */
+static int
+get_fd (fdcache *c, size_t i, const char *path, bool report)
+{
+  struct fdentry *e;
+  size_t j;
+  int fd;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+    e = find_entry (c, i);
+    if (e) {
+      e->refs++;
+      e->last_used = ++c->clock;
+      c->hits++;
+      return e->fd;
+    }
+  }
+
+  /* Open the file without holding the lock. */
+  fd = open (path, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    if (report)
+      nbdkit_error ("open: %s: %m", path);
+    return -1;
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+  c->misses++;
+
+  /* Another thread might have opened the same file meanwhile. */
+  e = find_entry (c, i);
+  if (e) {
+    close (fd);
+    e->refs++;
+    e->last_used = ++c->clock;
+    return e->fd;
+  }
+
+  if (c->nr_entries < c->max)
+    e = &c->entries[c->nr_entries++];
+  else {
+    /* Evict the least recently used entry which is not in use. */
+    for (j = 0; j < c->nr_entries; ++j) {
+      if (c->entries[j].refs == 0 &&
+          (e == NULL || c->entries[j].last_used < e->last_used))
+        e = &c->entries[j];
+    }
+    /* If every entry is in use, return an uncached fd which is
+     * closed by fdcache_put.
+     */
+    if (e == NULL)
+      return fd;
+    close (e->fd);
+    c->evictions++;
+  }
+
+  e->i = i;
+  e->fd = fd;
+  e->refs = 1;
+  e->last_used = ++c->clock;
+  return fd;
+}
+
+int
+fdcache_get (fdcache *c, size_t i, const char *path)
+{
+  return get_fd (c, i, path, true);
+}
+
+void
+fdcache_put (fdcache *c, int fd)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+  size_t j;
+
+  for (j = 0; j < c->nr_entries; ++j) {
+    if (c->entries[j].fd == fd) {
+      c->entries[j].refs--;
+      return;
+    }
+  }
+
+  /* Not in the cache. */
+  close (fd);
+}
+
+void
+fdcache_flush (fdcache *c)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+  size_t j = 0;
+
+  while (j < c->nr_entries) {
+    if (c->entries[j].refs == 0) {
+      close (c->entries[j].fd);
+      c->entries[j] = c->entries[--c->nr_entries];
+    }
+    else
+      j++;
+  }
+}
+
+int
+fdcache_pread (fdcache *c, size_t i, const char *path,
+               void *buf, size_t count, uint64_t offset)
+{
+  int fd, err;
+
+  fd = fdcache_get (c, i, path);
+  if (fd == -1)
+    return -1;
+  if (full_pread (fd, buf, count, offset) == -1) {
+    err = errno;
+    if (err == EIO)
+      nbdkit_error ("pread: %s: unexpected end of file", path);
+    else
+      nbdkit_error ("pread: %s: %m", path);
+    fdcache_put (c, fd);
+    errno = err;
+    return -1;
+  }
+  fdcache_put (c, fd);
+  return 0;
+}
+
+void
+fdcache_readahead (fdcache *c, size_t i, const char *path,
+                   size_t count, uint64_t offset)
+{
+#if defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_WILLNEED)
+  int fd;
+
+  fd = get_fd (c, i, path, false);
+  if (fd == -1)
+    return;
+  posix_fadvise (fd, offset, count, POSIX_FADV_WILLNEED);
+  fdcache_put (c, fd);
+#endif
+}
@@ -0,0 +1,83 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_FDCACHE_H
+#define NBDKIT_FDCACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Cache of read-only file descriptors for host files, indexed by
+ * file number.  This is used by plugins which serve many host files
+ * through common/regions (such as floppy and iso) to avoid opening
+ * and closing a host file on every request.
+ *
+ * At most 'max' file descriptors are kept open.  When the cache is
+ * full the least recently used descriptor which is not being used
+ * by another thread is closed.  The cache is safe to use from
+ * multiple threads and is normally shared by all connections.
+ */
+typedef struct fdcache fdcache;
+
+extern fdcache *new_fdcache (size_t max);
+extern void free_fdcache (fdcache *) __attribute__ ((__nonnull__ (1)));
+
+/* Return a file descriptor for file number i, opening path if it is
+ * not already open.  The caller must call fdcache_put when it has
+ * finished with it.  On error this calls nbdkit_error and returns -1.
+ */
+extern int fdcache_get (fdcache *, size_t i, const char *path)
+  __attribute__ ((__nonnull__ (1, 3)));
+extern void fdcache_put (fdcache *, int fd) __attribute__ ((__nonnull__ (1)));
+
+/* Close all file descriptors which are not in use.  Plugins call
+ * this when the last connection closes, so that host files are not
+ * held open while the server is idle, and changes to host files are
+ * seen by later connections.
+ */
+extern void fdcache_flush (fdcache *) __attribute__ ((__nonnull__ (1)));
+
+/* Read count bytes at offset from file number i.  Short reads are
+ * retried, and end of file is an error.
+ */
+extern int fdcache_pread (fdcache *, size_t i, const char *path,
+                          void *buf, size_t count, uint64_t offset)
+  __attribute__ ((__nonnull__ (1, 3, 4)));
+
+/* Hint that count bytes at offset from file number i will be read
+ * soon.  This does not report errors.
+ */
+extern void fdcache_readahead (fdcache *, size_t i, const char *path,
+                               size_t count, uint64_t offset)
+  __attribute__ ((__nonnull__ (1, 3)));
+
+#endif /* NBDKIT_FDCACHE_H */
@@ -43,12 +43,19 @@
  * plugin returns the same immutable data for each pread call we make,
  * and optimize on this basis.
  *
+ * Alternately (cow-allocator=sparse|malloc|zstd) the overlay can be
+ * stored in memory using one of the allocators from
+ * common/allocators.  In this case the temporary file is only
+ * created if cow-memory-limit is set, and is used to hold blocks
+ * which are allocated after the in-memory overlay has reached the
+ * limit ("spilled" blocks).
+ *
  * A 2-bit per block bitmap is maintained in memory recording if each
  * block in the temporary file is:
  *
  *   00 = not allocated in the overlay (read through to the plugin)
- *   01 = allocated in the overlay
- *   10 = <unused>
+ *   01 = allocated in the overlay (memory allocator, or temporary file)
+ *   10 = allocated in the temporary file (spilled from memory)
  *   11 = trimmed in the overlay
  *
  * When reading a block we first check the bitmap to see if that file
@@ -65,8 +72,8 @@
  * above.  We could punch holes in the overlay as an optimization, but
  * for simplicity we do not do that yet.
  *
- * Since the overlay is a deleted temporary file, we can ignore FUA
- * and flush commands.
+ * Since the overlay is a deleted temporary file or memory, we can
+ * ignore FUA and flush commands.
  */
 
 #include <config.h>
@@ -91,6 +98,7 @@
 
 #include <nbdkit-filter.h>
 
+#include "allocator.h"
 #include "bitmap.h"
 #include "cleanup.h"
 #include "fdatasync.h"
@@ -102,9 +110,19 @@
 #include "cow.h"
 #include "blk.h"
 
-/* The temporary overlay. */
+/* The temporary overlay file.  This is -1 if the overlay is stored
+ * entirely in memory.
+ */
 static int fd = -1;
 
+/* The in-memory overlay, or NULL if cow-allocator=file. */
+static struct allocator *mem = NULL;
+
+/* Number of blocks currently stored in the in-memory overlay.  This
+ * is protected by the lock below.
+ */
+static uint64_t mem_blocks = 0;
+
 /* This lock protects the bitmap from parallel access. */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
@@ -114,6 +132,7 @@ static struct bitmap bm;
 enum bm_entry {
   BLOCK_NOT_ALLOCATED = 0,
   BLOCK_ALLOCATED = 1,
+  BLOCK_SPILLED = 2,
   BLOCK_TRIMMED = 3,
 };
 
@@ -123,6 +142,7 @@ state_to_string (enum bm_entry state)
   switch (state) {
   case BLOCK_NOT_ALLOCATED: return "not allocated";
   case BLOCK_ALLOCATED: return "allocated";
+  case BLOCK_SPILLED: return "spilled";
   case BLOCK_TRIMMED: return "trimmed";
   default: abort ();
   }
@@ -131,15 +151,13 @@ state_to_string (enum bm_entry state)
 /* Extra debugging (-D cow.verbose=1). */
 NBDKIT_DLL_PUBLIC int cow_debug_verbose = 0;
 
-int
-blk_init (void)
+static int
+create_overlay_file (void)
 {
   const char *tmpdir;
   size_t len;
   char *template;
 
-  bitmap_init (&bm, blksize, 2 /* bits per block */);
-
   tmpdir = getenv ("TMPDIR");
   if (!tmpdir)
     tmpdir = LARGE_TMPDIR;
@@ -175,11 +193,31 @@ blk_init (void)
   return 0;
 }
 
+int
+blk_init (void)
+{
+  bitmap_init (&bm, blksize, 2 /* bits per block */);
+
+  if (strcmp (cow_allocator, "file") != 0) {
+    mem = create_allocator (cow_allocator, cow_debug_verbose);
+    if (mem == NULL)
+      return -1;
+
+    /* Only create the temporary file if we may need to spill. */
+    if (cow_memory_limit == 0)
+      return 0;
+  }
+
+  return create_overlay_file ();
+}
+
 void
 blk_free (void)
 {
   if (fd >= 0)
     close (fd);
+  if (mem)
+    mem->f->free (mem);
 
   bitmap_free (&bm);
 }
@@ -200,7 +238,10 @@ blk_set_size (uint64_t new_size)
   if (bitmap_resize (&bm, size) == -1)
     return -1;
 
-  if (ftruncate (fd, ROUND_UP (size, blksize)) == -1) {
+  if (mem && mem->f->set_size_hint (mem, ROUND_UP (size, blksize)) == -1)
+    return -1;
+
+  if (fd >= 0 && ftruncate (fd, ROUND_UP (size, blksize)) == -1) {
     nbdkit_error ("ftruncate: %m");
     return -1;
   }
@@ -221,6 +262,131 @@ blk_status (uint64_t blknum, bool *present, bool *trimmed)
   *trimmed = state == BLOCK_TRIMMED;
 }
 
+/* Read nrblocks allocated blocks (all in the same state) from the
+ * overlay, either from memory or the temporary file.
+ */
+static int
+overlay_read (enum bm_entry state, uint8_t *block,
+              uint64_t nrblocks, off_t offset, int *err)
+{
+  if (state == BLOCK_ALLOCATED && mem) {
+    if (mem->f->read (mem, block, blksize * nrblocks, offset) == -1) {
+      *err = errno;
+      return -1;
+    }
+  }
+  else {
+    if (full_pread (fd, block, blksize * nrblocks, offset) == -1) {
+      *err = errno;
+      nbdkit_error ("pread: %m");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Update the bitmap for a block, keeping track of how many blocks
+ * are stored in memory.  Must be called with the lock held.
+ */
+static void
+set_state (uint64_t blknum, enum bm_entry new_state)
+{
+  enum bm_entry old_state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_ALLOCATED);
+
+  if (mem) {
+    if (old_state == BLOCK_ALLOCATED && new_state != BLOCK_ALLOCATED)
+      mem_blocks--;
+    else if (old_state != BLOCK_ALLOCATED && new_state == BLOCK_ALLOCATED)
+      mem_blocks++;
+  }
+  bitmap_set_blk (&bm, blknum, new_state);
+}
+
+/* Decide where a block should be stored.  Blocks already in the
+ * overlay stay where they are.  New blocks go into memory until
+ * cow-memory-limit is reached and then spill to the temporary file.
+ * Because the data is written after the lock is released this limit
+ * is approximate when there are parallel writers.
+ *
+ * Must be called with the lock held.
+ */
+static enum bm_entry
+choose_store (uint64_t blknum)
+{
+  enum bm_entry state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_ALLOCATED);
+
+  if (mem == NULL)
+    return BLOCK_ALLOCATED;
+  if (state == BLOCK_ALLOCATED || state == BLOCK_SPILLED)
+    return state;
+  if (cow_memory_limit == 0 ||
+      (mem_blocks + 1) * blksize <= cow_memory_limit)
+    return BLOCK_ALLOCATED;
+  return BLOCK_SPILLED;
+}
+
+/* Write a single block to the store chosen above. */
+static int
+store_block (enum bm_entry state, const uint8_t *block, off_t offset,
+             int *err)
+{
+  if (state == BLOCK_ALLOCATED && mem) {
+    if (mem->f->write (mem, block, blksize, offset) == -1) {
+      *err = errno;
+      return -1;
+    }
+  }
+  else {
+    if (full_pwrite (fd, block, blksize, offset) == -1) {
+      *err = errno;
+      nbdkit_error ("pwrite: %m");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Write nrblocks whole blocks into the overlay and mark them as
+ * allocated.
+ */
+static int
+overlay_write (uint64_t blknum, uint64_t nrblocks,
+               const uint8_t *block, int *err)
+{
+  uint64_t b;
+
+  /* Fast path for the file-only overlay: write the whole run. */
+  if (mem == NULL) {
+    if (full_pwrite (fd, block, blksize * nrblocks, blknum * blksize) == -1) {
+      *err = errno;
+      nbdkit_error ("pwrite: %m");
+      return -1;
+    }
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    for (b = 0; b < nrblocks; ++b)
+      set_state (blknum + b, BLOCK_ALLOCATED);
+    return 0;
+  }
+
+  for (b = 0; b < nrblocks; ++b) {
+    enum bm_entry state;
+
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+      state = choose_store (blknum + b);
+    }
+
+    if (store_block (state, block + b * blksize,
+                     (blknum + b) * blksize, err) == -1)
+      return -1;
+
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    set_state (blknum + b, state);
+  }
+
+  return 0;
+}
+
 /* These are the block operations.  They always read or write whole
  * blocks of size ‘blksize’.
  */
@@ -289,21 +455,14 @@ blk_read_multiple (nbdkit_next *next,
                       "at offset %" PRIu64 " into the cache",
                       runblocks, offset);
 
-      if (full_pwrite (fd, block, blksize * runblocks, offset) == -1) {
-        *err = errno;
-        nbdkit_error ("pwrite: %m");
+      if (overlay_write (blknum, runblocks, block, err) == -1)
         return -1;
-      }
-      for (b = 0; b < runblocks; ++b)
-        bitmap_set_blk (&bm, blknum+b, BLOCK_ALLOCATED);
     }
   }
-  else if (state == BLOCK_ALLOCATED) { /* Read overlay. */
-    if (full_pread (fd, block, blksize * runblocks, offset) == -1) {
-      *err = errno;
-      nbdkit_error ("pread: %m");
+  else if (state == BLOCK_ALLOCATED || state == BLOCK_SPILLED) {
+    /* Read overlay. */
+    if (overlay_read (state, block, runblocks, offset, err) == -1)
       return -1;
-    }
   }
   else /* state == BLOCK_TRIMMED */ {
     memset (block, 0, blksize * runblocks);
@@ -321,6 +480,36 @@ blk_read_multiple (nbdkit_next *next,
                             cow_on_read, err);
 }
 
+int
+blk_read_overlay (uint64_t blknum, uint64_t nrblocks,
+                  uint8_t *block, int *err)
+{
+  enum bm_entry state;
+  uint64_t runblocks;
+
+  while (nrblocks > 0) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+      state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_ALLOCATED);
+      for (runblocks = 1; runblocks < nrblocks; ++runblocks) {
+        if (bitmap_get_blk (&bm, blknum + runblocks,
+                            BLOCK_NOT_ALLOCATED) != state)
+          break;
+      }
+    }
+    assert (state == BLOCK_ALLOCATED || state == BLOCK_SPILLED);
+
+    if (overlay_read (state, block, runblocks, blknum * blksize, err) == -1)
+      return -1;
+
+    blknum += runblocks;
+    nrblocks -= runblocks;
+    block += blksize * runblocks;
+  }
+
+  return 0;
+}
+
 int
 blk_read (nbdkit_next *next,
           uint64_t blknum, uint8_t *block, bool cow_on_read, int *err)
@@ -347,13 +536,15 @@ blk_cache (nbdkit_next *next,
     nbdkit_debug ("cow: blk_cache block %" PRIu64 " (offset %" PRIu64 ") is %s",
                   blknum, (uint64_t) offset, state_to_string (state));
 
-  if (state == BLOCK_ALLOCATED) {
+  if (state == BLOCK_ALLOCATED || state == BLOCK_SPILLED) {
 #if HAVE_POSIX_FADVISE
-    int r = posix_fadvise (fd, offset, blksize, POSIX_FADV_WILLNEED);
-    if (r) {
-      errno = r;
-      nbdkit_error ("posix_fadvise: %m");
-      return -1;
+    if (mem == NULL || state == BLOCK_SPILLED) {
+      int r = posix_fadvise (fd, offset, blksize, POSIX_FADV_WILLNEED);
+      if (r) {
+        errno = r;
+        nbdkit_error ("posix_fadvise: %m");
+        return -1;
+      }
     }
 #endif
     return 0;
@@ -374,12 +565,11 @@ blk_cache (nbdkit_next *next,
   memset (block + n, 0, tail);
 
   if (mode == BLK_CACHE_COW) {
-    if (full_pwrite (fd, block, blksize, offset) == -1) {
-      *err = errno;
-      nbdkit_error ("pwrite: %m");
+    enum bm_entry dest = choose_store (blknum);
+
+    if (store_block (dest, block, offset, err) == -1)
       return -1;
-    }
-    bitmap_set_blk (&bm, blknum, BLOCK_ALLOCATED);
+    set_state (blknum, dest);
   }
   return 0;
 }
@@ -393,16 +583,7 @@ blk_write (uint64_t blknum, const uint8_t *block, int *err)
     nbdkit_debug ("cow: blk_write block %" PRIu64 " (offset %" PRIu64 ")",
                   blknum, (uint64_t) offset);
 
-  if (full_pwrite (fd, block, blksize, offset) == -1) {
-    *err = errno;
-    nbdkit_error ("pwrite: %m");
-    return -1;
-  }
-
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  bitmap_set_blk (&bm, blknum, BLOCK_ALLOCATED);
-
-  return 0;
+  return overlay_write (blknum, 1, block, err);
 }
 
 int
@@ -417,8 +598,18 @@ blk_trim (uint64_t blknum, int *err)
   /* XXX As an optimization we could punch a whole in the overlay
    * here.  However it's not trivial since blksize is unrelated to the
    * overlay filesystem block size.
+   *
+   * For the in-memory overlay we can release the memory by zeroing
+   * the block (the allocators free zero pages).
    */
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  bitmap_set_blk (&bm, blknum, BLOCK_TRIMMED);
+  if (mem &&
+      bitmap_get_blk (&bm, blknum, BLOCK_NOT_ALLOCATED) == BLOCK_ALLOCATED) {
+    if (mem->f->zero (mem, blksize, offset) == -1) {
+      *err = errno;
+      return -1;
+    }
+  }
+  set_state (blknum, BLOCK_TRIMMED);
   return 0;
 }
@@ -58,6 +58,11 @@ extern int blk_read_multiple (nbdkit_next *next,
                               bool cow_on_read, int *err)
   __attribute__ ((__nonnull__ (1, 4, 6)));
 
+/* Read multiple blocks which must all be present in the overlay. */
+extern int blk_read_overlay (uint64_t blknum, uint64_t nrblocks,
+                             uint8_t *block, int *err)
+  __attribute__ ((__nonnull__ (3, 4)));
+
 /* Cache mode for blocks not already in overlay */
 enum cache_mode {
   BLK_CACHE_IGNORE,      /* Do nothing */
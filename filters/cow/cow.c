@@ -55,6 +55,7 @@
 
 #include "cow.h"
 #include "blk.h"
+#include "persist.h"
 
 /* Read-modify-write requests are serialized through this global lock.
  * This is only used for unaligned requests which should be
@@ -63,6 +64,8 @@
 static pthread_mutex_t rmw_lock = PTHREAD_MUTEX_INITIALIZER;
 
 unsigned blksize = 65536;       /* block size */
+const char *cow_allocator = "file"; /* overlay allocator */
+uint64_t cow_memory_limit = 0;  /* in-memory overlay limit, 0 = none */
 
 static bool cow_on_cache;
 
@@ -75,6 +78,19 @@ extern enum cor_mode {
 enum cor_mode cor_mode = COR_OFF;
 const char *cor_path;
 
+/* Saving, loading and committing the overlay. */
+static const char *load_file;           /* cow-load */
+static const char *save_file;           /* cow-save */
+static bool commit;                     /* cow-commit */
+static unsigned commit_threads = 4;     /* cow-commit-threads */
+static int cow_thread_model;
+
+/* The size of the overlay, or -1 if it has not been set yet.  This
+ * is protected by size_lock.
+ */
+static pthread_mutex_t size_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t overlay_size = -1;
+
 static void
 cow_unload (void)
 {
@@ -97,6 +113,42 @@ cow_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
     blksize = r;
     return 0;
   }
+  else if (strcmp (key, "cow-allocator") == 0) {
+    cow_allocator = value;
+    return 0;
+  }
+  else if (strcmp (key, "cow-memory-limit") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    cow_memory_limit = r;
+    return 0;
+  }
+  else if (strcmp (key, "cow-load") == 0) {
+    load_file = value;
+    return 0;
+  }
+  else if (strcmp (key, "cow-save") == 0) {
+    save_file = value;
+    return 0;
+  }
+  else if (strcmp (key, "cow-commit") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    commit = r;
+    return 0;
+  }
+  else if (strcmp (key, "cow-commit-threads") == 0) {
+    if (nbdkit_parse_unsigned ("cow-commit-threads", value,
+                               &commit_threads) == -1)
+      return -1;
+    if (commit_threads == 0) {
+      nbdkit_error ("cow-commit-threads must be at least 1");
+      return -1;
+    }
+    return 0;
+  }
   else if (strcmp (key, "cow-on-cache") == 0) {
     int r;
 
@@ -125,19 +177,79 @@ cow_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
 }
 
 #define cow_config_help \
+  "cow-allocator=file|sparse|...\n" \
+  "                         Where to store the overlay (default: file).\n" \
   "cow-block-size=<N>       Set COW block size.\n" \
+  "cow-commit=<BOOL>        Write the overlay to the plugin on exit.\n" \
+  "cow-commit-threads=<N>   Number of threads used to commit.\n" \
+  "cow-load=<FILENAME>      Load a saved overlay.\n" \
+  "cow-memory-limit=<SIZE>  Spill in-memory overlay to disk above SIZE.\n" \
   "cow-on-cache=<BOOL>      Copy cache (prefetch) requests to the overlay.\n" \
-  "cow-on-read=<BOOL>|/PATH Copy read requests to the overlay."
+  "cow-on-read=<BOOL>|/PATH Copy read requests to the overlay.\n" \
+  "cow-save=<FILENAME>      Save the overlay on exit."
 
 static int
 cow_get_ready (int thread_model)
 {
+  if (cow_memory_limit > 0 && strcmp (cow_allocator, "file") == 0) {
+    nbdkit_error ("cow-memory-limit can only be used with "
+                  "an in-memory cow-allocator");
+    return -1;
+  }
+
   if (blk_init () == -1)
     return -1;
 
+  cow_thread_model = thread_model;
   return 0;
 }
 
+/* Save and/or commit the overlay when nbdkit exits.  Errors cannot
+ * be returned from here, but any error reported during cleanup makes
+ * nbdkit exit with a non-zero status.
+ */
+static void
+cow_cleanup (nbdkit_backend *backend)
+{
+  int64_t size;
+  bool saved = false;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&size_lock);
+    size = overlay_size;
+  }
+
+  /* If no client ever connected there is nothing new to save (and
+   * the overlay from cow-load was never loaded).
+   */
+  if (save_file) {
+    if (size < 0)
+      nbdkit_debug ("cow: no clients connected, not saving the overlay");
+    else if (persist_save (save_file, size) == 0)
+      saved = true;
+    else
+      /* Carry on and try to commit, so the changes are not lost. */
+      nbdkit_error ("cow: the overlay could not be saved to %s",
+                    save_file);
+  }
+
+  if (commit) {
+    /* Don't violate the plugin's thread model when opening more than
+     * one context.
+     */
+    unsigned n =
+      cow_thread_model == NBDKIT_THREAD_MODEL_PARALLEL ? commit_threads : 1;
+    if (persist_commit (backend, n) == -1) {
+      if (saved)
+        nbdkit_error ("cow: the overlay could not be committed, "
+                      "it can be committed later from %s using cow-load",
+                      save_file);
+      else
+        nbdkit_error ("cow: the overlay could not be committed");
+    }
+  }
+}
+
 /* Decide if cow-on-read is currently on or off. */
 bool
 cow_on_read (void)
@@ -175,13 +287,32 @@ cow_get_size (nbdkit_next *next,
 
   nbdkit_debug ("cow: underlying file size: %" PRIi64, size);
 
-  r = blk_set_size (size);
+  r = cow_set_size (size);
   if (r == -1)
     return -1;
 
   return size;
 }
 
+/* Set the size of the overlay.  The first time this is called the
+ * saved overlay (if any) is loaded.
+ */
+int
+cow_set_size (uint64_t size)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&size_lock);
+  bool first = overlay_size == -1;
+
+  if (blk_set_size (size) == -1)
+    return -1;
+
+  if (first && load_file && persist_load (load_file, size) == -1)
+    return -1;
+
+  overlay_size = size;
+  return 0;
+}
+
 /* Block size constraints. */
 static int
 cow_block_size (nbdkit_next *next, void *handle,
@@ -781,6 +912,7 @@ static struct nbdkit_filter filter = {
   .config            = cow_config,
   .config_help       = cow_config_help,
   .get_ready         = cow_get_ready,
+  .cleanup           = cow_cleanup,
   .prepare           = cow_prepare,
   .get_size          = cow_get_size,
   .block_size        = cow_block_size,
@@ -36,4 +36,17 @@
 /* Size of a block in the cache. */
 extern unsigned blksize;
 
+/* Overlay allocator (cow-allocator), "file" or an allocator type. */
+extern const char *cow_allocator;
+
+/* Maximum size of the in-memory overlay before spilling to the
+ * temporary file (cow-memory-limit), or 0 for no limit.
+ */
+extern uint64_t cow_memory_limit;
+
+/* Set the size of the overlay, loading the saved overlay (cow-load)
+ * the first time this is called.
+ */
+extern int cow_set_size (uint64_t size);
+
 #endif /* NBDKIT_COW_H */
@@ -0,0 +1,509 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Saving, loading and committing the overlay.
+ *
+ * The saved overlay file (cow-save, cow-load) has this format:
+ *
+ *   struct persist_header           (big endian, see below)
+ *   bitmap                          (2 bits per block)
+ *   data blocks                     (blksize bytes each)
+ *
+ * The bitmap uses the same layout as common/bitmap with these
+ * values:
+ *
+ *   00 = not present in the overlay
+ *   01 = present, a data block follows
+ *   11 = trimmed
+ *
+ * Only present blocks are stored, in order of increasing block
+ * number, so the file is roughly the size of the changes.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "bitmap.h"
+#include "byte-swapping.h"
+#include "cleanup.h"
+#include "minmax.h"
+#include "rounding.h"
+
+#include "cow.h"
+#include "blk.h"
+#include "persist.h"
+
+#define PERSIST_MAGIC "NBDKIT-COW-SAVE1"
+
+struct persist_header {
+  char magic[16];               /* PERSIST_MAGIC, not NUL-terminated */
+  uint32_t blksize;             /* cow-block-size */
+  uint32_t reserved;            /* must be zero */
+  uint64_t size;                /* virtual size of the disk */
+  uint64_t bitmap_size;         /* size of the bitmap in bytes */
+} __attribute__ ((__packed__));
+
+enum persist_entry {
+  PERSIST_NOT_PRESENT = 0,
+  PERSIST_DATA = 1,
+  PERSIST_TRIMMED = 3,
+};
+
+/* Largest run of blocks read, written or committed in one go. */
+#define MAX_RUN (32 * 1024 * 1024)
+
+static uint64_t
+max_run_blocks (void)
+{
+  return MAX (MAX_RUN / blksize, 1);
+}
+
+int
+persist_load (const char *filename, uint64_t size)
+{
+  FILE *fp;
+  struct persist_header h;
+  struct bitmap pbm;
+  CLEANUP_FREE uint8_t *block = NULL;
+  uint64_t blknum, loaded = 0;
+  int err, r = -1;
+
+  bitmap_init (&pbm, blksize, 2);
+
+  fp = fopen (filename, "r");
+  if (fp == NULL) {
+    nbdkit_error ("cow-load: %s: %m", filename);
+    return -1;
+  }
+
+  if (fread (&h, sizeof h, 1, fp) != 1 ||
+      memcmp (h.magic, PERSIST_MAGIC, sizeof h.magic) != 0) {
+    nbdkit_error ("cow-load: %s: not a saved cow filter overlay", filename);
+    goto out;
+  }
+  if (be32toh (h.blksize) != blksize) {
+    nbdkit_error ("cow-load: %s: overlay was saved with "
+                  "cow-block-size=%" PRIu32 " but the current block size "
+                  "is %u", filename, be32toh (h.blksize), blksize);
+    goto out;
+  }
+  if (be64toh (h.size) != size) {
+    nbdkit_error ("cow-load: %s: overlay was saved from a disk of size "
+                  "%" PRIu64 " but the underlying disk has size %" PRIu64,
+                  filename, be64toh (h.size), size);
+    goto out;
+  }
+
+  if (bitmap_resize (&pbm, size) == -1)
+    goto out;
+  if (be64toh (h.bitmap_size) != pbm.size ||
+      fread (pbm.bitmap, 1, pbm.size, fp) != pbm.size) {
+    nbdkit_error ("cow-load: %s: overlay file is truncated or corrupt",
+                  filename);
+    goto out;
+  }
+
+  block = malloc (blksize);
+  if (block == NULL) {
+    nbdkit_error ("malloc: %m");
+    goto out;
+  }
+
+  bitmap_for (&pbm, blknum) {
+    switch (bitmap_get_blk (&pbm, blknum, PERSIST_NOT_PRESENT)) {
+    case PERSIST_NOT_PRESENT:
+      break;
+    case PERSIST_DATA:
+      if (fread (block, blksize, 1, fp) != 1) {
+        nbdkit_error ("cow-load: %s: overlay file is truncated", filename);
+        goto out;
+      }
+      if (blk_write (blknum, block, &err) == -1)
+        goto out;
+      loaded++;
+      break;
+    case PERSIST_TRIMMED:
+      if (blk_trim (blknum, &err) == -1)
+        goto out;
+      break;
+    default:
+      nbdkit_error ("cow-load: %s: invalid entry in bitmap", filename);
+      goto out;
+    }
+  }
+
+  nbdkit_debug ("cow: loaded %" PRIu64 " blocks from %s", loaded, filename);
+  r = 0;
+
+ out:
+  bitmap_free (&pbm);
+  fclose (fp);
+  return r;
+}
+
+/* Write the run of present blocks to the saved overlay file. */
+static int
+save_data (FILE *fp, uint8_t *buf, uint64_t blknum, uint64_t nrblocks)
+{
+  int err;
+
+  if (blk_read_overlay (blknum, nrblocks, buf, &err) == -1)
+    return -1;
+  if (fwrite (buf, blksize, nrblocks, fp) != nrblocks) {
+    nbdkit_error ("cow-save: fwrite: %m");
+    return -1;
+  }
+  return 0;
+}
+
+int
+persist_save (const char *filename, uint64_t size)
+{
+  CLEANUP_FREE char *tmpfile = NULL;
+  CLEANUP_FREE uint8_t *buf = NULL;
+  FILE *fp;
+  struct persist_header h;
+  struct bitmap pbm;
+  uint64_t blknum, run_start = 0, run_len = 0, saved = 0;
+  bool present, trimmed;
+  int r = -1;
+
+  bitmap_init (&pbm, blksize, 2);
+  if (bitmap_resize (&pbm, size) == -1)
+    return -1;
+
+  /* Take a snapshot of the block states. */
+  bitmap_for (&pbm, blknum) {
+    blk_status (blknum, &present, &trimmed);
+    if (trimmed)
+      bitmap_set_blk (&pbm, blknum, PERSIST_TRIMMED);
+    else if (present)
+      bitmap_set_blk (&pbm, blknum, PERSIST_DATA);
+  }
+
+  buf = malloc (max_run_blocks () * blksize);
+  if (buf == NULL) {
+    nbdkit_error ("malloc: %m");
+    goto out;
+  }
+
+  /* Write to a temporary file and rename it into place, so we never
+   * leave a partially written overlay behind.
+   */
+  if (asprintf (&tmpfile, "%s.tmp", filename) == -1) {
+    nbdkit_error ("asprintf: %m");
+    goto out;
+  }
+  fp = fopen (tmpfile, "w");
+  if (fp == NULL) {
+    nbdkit_error ("cow-save: %s: %m", tmpfile);
+    goto out;
+  }
+
+  memcpy (h.magic, PERSIST_MAGIC, sizeof h.magic);
+  h.blksize = htobe32 (blksize);
+  h.reserved = 0;
+  h.size = htobe64 (size);
+  h.bitmap_size = htobe64 (pbm.size);
+  if (fwrite (&h, sizeof h, 1, fp) != 1 ||
+      fwrite (pbm.bitmap, 1, pbm.size, fp) != pbm.size) {
+    nbdkit_error ("cow-save: fwrite: %m");
+    goto err;
+  }
+
+  /* Write the data blocks, coalescing adjacent blocks. */
+  bitmap_for (&pbm, blknum) {
+    if (bitmap_get_blk (&pbm, blknum, PERSIST_NOT_PRESENT) == PERSIST_DATA) {
+      if (run_len == 0)
+        run_start = blknum;
+      run_len++;
+      saved++;
+      if (run_len < max_run_blocks ())
+        continue;
+    }
+    if (run_len > 0) {
+      if (save_data (fp, buf, run_start, run_len) == -1)
+        goto err;
+      run_len = 0;
+    }
+  }
+  if (run_len > 0 && save_data (fp, buf, run_start, run_len) == -1)
+    goto err;
+
+  if (fflush (fp) == EOF || fsync (fileno (fp)) == -1) {
+    nbdkit_error ("cow-save: %s: %m", tmpfile);
+    goto err;
+  }
+  if (fclose (fp) == EOF) {
+    nbdkit_error ("cow-save: %s: %m", tmpfile);
+    unlink (tmpfile);
+    goto out;
+  }
+  if (rename (tmpfile, filename) == -1) {
+    nbdkit_error ("cow-save: rename: %s: %m", filename);
+    unlink (tmpfile);
+    goto out;
+  }
+
+  nbdkit_debug ("cow: saved %" PRIu64 " blocks to %s", saved, filename);
+  r = 0;
+  goto out;
+
+ err:
+  fclose (fp);
+  unlink (tmpfile);
+ out:
+  bitmap_free (&pbm);
+  return r;
+}
+
+/* State shared between the commit threads. */
+struct commit_state {
+  pthread_mutex_t lock;
+  uint64_t size;                /* virtual size of the disk */
+  uint64_t nrblocks;            /* number of blocks */
+  uint64_t next_blknum;         /* next block to consider */
+  bool error;                   /* set if any thread fails */
+};
+
+struct commit_thread {
+  pthread_t thread;
+  struct commit_state *cs;
+  nbdkit_next *next;
+};
+
+/* Find the next run of present blocks which all have the same state
+ * and claim it for the calling thread.  Returns false when there is
+ * no more work to do.
+ */
+static bool
+get_next_run (struct commit_state *cs,
+              uint64_t *blknum, uint64_t *nrblocks, bool *trimmed)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cs->lock);
+  bool present, t;
+  uint64_t n;
+
+  for (;;) {
+    if (cs->error || cs->next_blknum >= cs->nrblocks)
+      return false;
+    blk_status (cs->next_blknum, &present, trimmed);
+    if (present)
+      break;
+    cs->next_blknum++;
+  }
+
+  *blknum = cs->next_blknum;
+  for (n = 1; n < max_run_blocks () && *blknum + n < cs->nrblocks; ++n) {
+    blk_status (*blknum + n, &present, &t);
+    if (!present || t != *trimmed)
+      break;
+  }
+  *nrblocks = n;
+  cs->next_blknum += n;
+  return true;
+}
+
+static void *
+commit_thread (void *vp)
+{
+  struct commit_thread *ct = vp;
+  struct commit_state *cs = ct->cs;
+  nbdkit_next *next = ct->next;
+  CLEANUP_FREE uint8_t *buf = NULL;
+  uint32_t minimum, preferred, maximum;
+  uint64_t blknum, nrblocks;
+  bool trimmed;
+  int can_zero, err;
+
+  buf = malloc (max_run_blocks () * blksize);
+  if (buf == NULL) {
+    nbdkit_error ("malloc: %m");
+    goto err;
+  }
+  can_zero = next->can_zero (next);
+  if (can_zero == -1 ||
+      next->block_size (next, &minimum, &preferred, &maximum) == -1)
+    goto err;
+  if (maximum == 0 || maximum > MAX_RUN)
+    maximum = MAX_RUN;
+
+  while (get_next_run (cs, &blknum, &nrblocks, &trimmed)) {
+    uint64_t offset = blknum * blksize;
+    uint64_t count = MIN (nrblocks * blksize, cs->size - offset);
+    uint8_t *p = buf;
+
+    if (trimmed) {
+      if (can_zero == NBDKIT_ZERO_NONE)
+        memset (buf, 0, count);
+    }
+    else {
+      if (blk_read_overlay (blknum, nrblocks, buf, &err) == -1)
+        goto err;
+    }
+
+    while (count > 0) {
+      uint32_t n = MIN (count, maximum);
+
+      if (trimmed && can_zero != NBDKIT_ZERO_NONE) {
+        if (next->zero (next, n, offset, NBDKIT_FLAG_MAY_TRIM, &err) == -1)
+          goto err;
+      }
+      else {
+        if (next->pwrite (next, p, n, offset, 0, &err) == -1)
+          goto err;
+      }
+      p += n;
+      offset += n;
+      count -= n;
+    }
+  }
+
+  return NULL;
+
+ err:
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cs->lock);
+    cs->error = true;
+  }
+  return NULL;
+}
+
+int
+persist_commit (nbdkit_backend *backend, unsigned nr_threads)
+{
+  struct commit_state cs = { .lock = PTHREAD_MUTEX_INITIALIZER };
+  CLEANUP_FREE struct commit_thread *threads = NULL;
+  unsigned i, nr_opened = 0, nr_started = 0;
+  int64_t size;
+  int r, err;
+
+  assert (nr_threads > 0);
+  threads = calloc (nr_threads, sizeof *threads);
+  if (threads == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+
+  /* Open writable contexts into the plugin.  These are shared
+   * contexts because there may be no client connection.  nbdkit
+   * requires that the size and write flag are fetched on each context
+   * before writing to it.
+   */
+  for (i = 0; i < nr_threads; ++i) {
+    nbdkit_next *next = nbdkit_next_context_open (backend, 0, "", 1);
+    if (next == NULL)
+      goto out;
+    if (next->prepare (next) == -1) {
+      nbdkit_next_context_close (next);
+      goto out;
+    }
+    threads[i].cs = &cs;
+    threads[i].next = next;
+    nr_opened++;
+
+    r = next->can_write (next);
+    if (r == -1)
+      goto out;
+    if (r == 0) {
+      nbdkit_error ("cow-commit: the underlying plugin is not writable");
+      goto out;
+    }
+    size = next->get_size (next);
+    if (size == -1)
+      goto out;
+  }
+
+  /* If no client connected, the saved overlay may not have been
+   * loaded yet.
+   */
+  if (cow_set_size (size) == -1)
+    goto out;
+
+  cs.size = size;
+  cs.nrblocks = DIV_ROUND_UP (size, blksize);
+
+  nbdkit_debug ("cow: committing overlay to the plugin using %u threads",
+                nr_threads);
+
+  for (i = 0; i < nr_threads; ++i) {
+    err = pthread_create (&threads[i].thread, NULL,
+                          commit_thread, &threads[i]);
+    if (err) {
+      errno = err;
+      nbdkit_error ("pthread_create: %m");
+      cs.error = true;
+      break;
+    }
+    nr_started++;
+  }
+  for (i = 0; i < nr_started; ++i)
+    pthread_join (threads[i].thread, NULL);
+
+  /* Flush each context so the commit is persistent. */
+  if (!cs.error) {
+    for (i = 0; i < nr_opened; ++i) {
+      nbdkit_next *next = threads[i].next;
+
+      r = next->can_flush (next);
+      if (r == -1 || (r > 0 && next->flush (next, 0, &err) == -1)) {
+        cs.error = true;
+        break;
+      }
+    }
+  }
+
+ out:
+  for (i = 0; i < nr_opened; ++i) {
+    threads[i].next->finalize (threads[i].next);
+    nbdkit_next_context_close (threads[i].next);
+  }
+  if (nr_opened < nr_threads || nr_started < nr_threads || cs.error) {
+    nbdkit_error ("cow-commit: failed to commit the overlay");
+    return -1;
+  }
+  nbdkit_debug ("cow: overlay committed");
+  return 0;
+}
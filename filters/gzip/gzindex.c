@@ -0,0 +1,643 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Random access index for gzip files.  See gzindex.h.
+ *
+ * The saved index file (gzip-index) has this format:
+ *
+ *   struct index_header             (big endian, see below)
+ *   struct index_point              (repeated nr_points times)
+ *     window                        (GZ_WINDOW_SIZE bytes)
+ *
+ * The compressed size and gzip trailer are used to check that the
+ * index matches the compressed file.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include <nbdkit-filter.h>
+
+#include "byte-swapping.h"
+#include "cleanup.h"
+#include "minmax.h"
+#include "utils.h"
+
+#include "gzindex.h"
+
+#define INDEX_MAGIC "NBDKIT-GZIP-IDX1"
+
+struct index_header {
+  char magic[16];               /* INDEX_MAGIC, not NUL-terminated */
+  uint64_t compressed_size;
+  uint64_t size;
+  uint8_t trailer[8];
+  uint64_t nr_points;
+} __attribute__ ((__packed__));
+
+struct index_point {
+  uint64_t out;
+  uint64_t in;
+  uint32_t bits;
+  uint32_t reserved;            /* must be zero */
+} __attribute__ ((__packed__));
+
+/* Largest read from the plugin.  A generous size is more efficient
+ * with some plugins (esp. curl).
+ */
+#define READ_SIZE (4 * 1024 * 1024)
+
+/* The maximum compression ratio of deflate is about 1032:1.  This is
+ * used to check that the spans in a loaded index are plausible, so a
+ * corrupt index cannot make us allocate huge buffers.
+ */
+#define MAX_DEFLATE_RATIO 1032
+
+/* Convert a zlib error (always negative) to an nbdkit error message,
+ * and return errno correctly.
+ */
+static void
+zerror (const char *op, const z_stream *strm, int zerr)
+{
+  if (zerr == Z_MEM_ERROR) {
+    errno = ENOMEM;
+    nbdkit_error ("gzip: %s: %m", op);
+  }
+  else {
+    errno = EIO;
+    if (strm->msg)
+      nbdkit_error ("gzip: %s: %s", op, strm->msg);
+    else
+      nbdkit_error ("gzip: %s: unknown error: %d", op, zerr);
+  }
+}
+
+void
+gzindex_free (gzindex *idx)
+{
+  if (idx) {
+    if (idx->fd >= 0)
+      close (idx->fd);
+    access_points_reset (&idx->points);
+    free (idx);
+  }
+}
+
+/* Create the unlinked temporary file which holds the windows while
+ * building the index.
+ */
+static int
+create_window_file (void)
+{
+  const char *tmpdir;
+  CLEANUP_FREE char *template = NULL;
+  int fd;
+
+  tmpdir = getenv ("TMPDIR");
+  if (!tmpdir)
+    tmpdir = LARGE_TMPDIR;
+
+  if (asprintf (&template, "%s/gzipXXXXXX", tmpdir) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+#ifdef HAVE_MKOSTEMP
+  fd = mkostemp (template, O_CLOEXEC);
+#else
+  fd = mkstemp (template);
+  if (fd >= 0) {
+    fd = set_cloexec (fd);
+    if (fd < 0) {
+      int e = errno;
+      unlink (template);
+      errno = e;
+    }
+  }
+#endif
+  if (fd == -1) {
+    nbdkit_error ("mkostemp: %s: %m", tmpdir);
+    return -1;
+  }
+  unlink (template);
+  return fd;
+}
+
+/* Add an access point, saving the window to the window file.  The
+ * window buffer is circular and 'left' bytes at the end were not
+ * written yet.  'saved' is a scratch buffer of GZ_WINDOW_SIZE bytes.
+ */
+static int
+add_point (gzindex *idx, int bits, uint64_t in, uint64_t out,
+           unsigned left, const unsigned char *window,
+           unsigned char *saved)
+{
+  struct access_point p = { .out = out, .in = in, .bits = bits };
+
+  if (left)
+    memcpy (saved, window + GZ_WINDOW_SIZE - left, left);
+  if (left < GZ_WINDOW_SIZE)
+    memcpy (saved + left, window, GZ_WINDOW_SIZE - left);
+
+  p.window = (uint64_t) idx->points.len * GZ_WINDOW_SIZE;
+  if (full_pwrite (idx->fd, saved, GZ_WINDOW_SIZE, p.window) == -1) {
+    nbdkit_error ("gzip: writing temporary file: %m");
+    return -1;
+  }
+
+  if (access_points_append (&idx->points, p) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  return 0;
+}
+
+gzindex *
+gzindex_build (nbdkit_next *next, uint64_t span)
+{
+  gzindex *idx;
+  z_stream strm;
+  int zerr, err;
+  int64_t r;
+  uint64_t pos = 0, totin = 0, totout = 0, last = 0;
+  CLEANUP_FREE char *in_block = NULL;
+  CLEANUP_FREE unsigned char *window = NULL;
+  CLEANUP_FREE unsigned char *saved = NULL;
+
+  idx = calloc (1, sizeof *idx);
+  if (idx == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  idx->fd = create_window_file ();
+  if (idx->fd == -1)
+    goto err;
+
+  r = next->get_size (next);
+  if (r == -1)
+    goto err;
+  idx->compressed_size = r;
+
+  in_block = malloc (READ_SIZE);
+  /* Calloc so uninitialized memory is never saved in the index file. */
+  window = calloc (1, GZ_WINDOW_SIZE);
+  saved = malloc (GZ_WINDOW_SIZE);
+  if (in_block == NULL || window == NULL || saved == NULL) {
+    nbdkit_error ("malloc: %m");
+    goto err;
+  }
+
+  /* For use of inflateInit2 on gzip streams see:
+   * https://stackoverflow.com/a/1838702
+   */
+  memset (&strm, 0, sizeof strm);
+  zerr = inflateInit2 (&strm, 16+MAX_WBITS);
+  if (zerr != Z_OK) {
+    zerror ("inflateInit2", &strm, zerr);
+    goto err;
+  }
+
+  /* Uncompress the whole plugin.  This is REQUIRED in order to
+   * implement gzip_get_size.  See: https://stackoverflow.com/a/9213826
+   *
+   * Inflate with Z_BLOCK so it stops at each deflate block boundary,
+   * where we can add an access point.  The output goes to the
+   * circular window buffer and is otherwise discarded.
+   */
+  strm.avail_out = 0;
+  do {
+    /* Do we need to read more from the plugin? */
+    if (strm.avail_in == 0 && pos < idx->compressed_size) {
+      size_t n = MIN (READ_SIZE, idx->compressed_size - pos);
+
+      if (next->pread (next, in_block, n, pos, 0, &err) == -1) {
+        errno = err;
+        goto err_inflate;
+      }
+      pos += n;
+      strm.next_in = (void *) in_block;
+      strm.avail_in = n;
+    }
+    if (strm.avail_out == 0) {
+      strm.next_out = window;
+      strm.avail_out = GZ_WINDOW_SIZE;
+    }
+
+    totin += strm.avail_in;
+    totout += strm.avail_out;
+    zerr = inflate (&strm, Z_BLOCK);
+    totin -= strm.avail_in;
+    totout -= strm.avail_out;
+    if (zerr == Z_NEED_DICT)
+      zerr = Z_DATA_ERROR;
+    if (zerr == Z_BUF_ERROR && strm.avail_in == 0 &&
+        pos >= idx->compressed_size) {
+      nbdkit_error ("gzip: unexpected end of compressed data");
+      goto err_inflate;
+    }
+    if (zerr < 0 && zerr != Z_BUF_ERROR) {
+      zerror ("inflate", &strm, zerr);
+      goto err_inflate;
+    }
+
+    /* At the end of a deflate block (but not the last one), add an
+     * access point if we have moved far enough since the last one.
+     */
+    if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+        (totout == 0 || totout - last >= span)) {
+      if (add_point (idx, strm.data_type & 7, totin, totout,
+                     strm.avail_out, window, saved) == -1)
+        goto err_inflate;
+      last = totout;
+    }
+  } while (zerr != Z_STREAM_END);
+
+  inflateEnd (&strm);
+
+  idx->size = totout;
+  if (idx->compressed_size < sizeof idx->trailer ||
+      next->pread (next, idx->trailer, sizeof idx->trailer,
+                   idx->compressed_size - sizeof idx->trailer,
+                   0, &err) == -1)
+    goto err;
+
+  nbdkit_debug ("gzip: uncompressed size: %" PRIu64 ", "
+                "%zu access points", idx->size, idx->points.len);
+  return idx;
+
+ err_inflate:
+  inflateEnd (&strm);
+ err:
+  gzindex_free (idx);
+  return NULL;
+}
+
+/* Check that the access point read from the index file is
+ * consistent with the previous one (or is a valid first point), so
+ * that spans are never empty or implausibly large.
+ */
+static bool
+check_point (const gzindex *idx, const struct access_point *p)
+{
+  const struct access_point *prev;
+
+  if (p->in > idx->compressed_size || p->out > idx->size)
+    return false;
+  if (idx->points.len == 0)
+    return p->out == 0;
+  prev = &idx->points.ptr[idx->points.len-1];
+  return p->out > prev->out && p->in > prev->in &&
+    (p->out - prev->out) / MAX_DEFLATE_RATIO <= p->in - prev->in;
+}
+
+int
+gzindex_load (const char *filename, nbdkit_next *next, gzindex **ret)
+{
+  int fd;
+  struct stat statbuf;
+  struct index_header h;
+  struct index_point ip;
+  uint8_t trailer[8];
+  gzindex *idx = NULL;
+  int64_t compressed_size;
+  uint64_t i, nr_points, offset;
+  uint32_t bits;
+  const struct access_point *last;
+  int err, r = -1;
+
+  *ret = NULL;
+
+  compressed_size = next->get_size (next);
+  if (compressed_size == -1)
+    return -1;
+  if (compressed_size < sizeof trailer) {
+    nbdkit_error ("gzip: not a gzip file: file too short");
+    return -1;
+  }
+  if (next->pread (next, trailer, sizeof trailer,
+                   compressed_size - sizeof trailer, 0, &err) == -1)
+    return -1;
+
+  fd = open (filename, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    if (errno == ENOENT) {
+      nbdkit_debug ("gzip: index %s does not exist, creating it", filename);
+      return 0;
+    }
+    nbdkit_error ("gzip-index: %s: %m", filename);
+    return -1;
+  }
+  if (fstat (fd, &statbuf) == -1) {
+    nbdkit_error ("gzip-index: fstat: %s: %m", filename);
+    goto out;
+  }
+
+  if (full_pread (fd, &h, sizeof h, 0) == -1 ||
+      memcmp (h.magic, INDEX_MAGIC, sizeof h.magic) != 0) {
+    nbdkit_error ("gzip-index: %s: not a gzip filter index", filename);
+    goto out;
+  }
+  if (be64toh (h.compressed_size) != compressed_size ||
+      memcmp (h.trailer, trailer, sizeof trailer) != 0) {
+    nbdkit_debug ("gzip: index %s does not match the compressed file, "
+                  "recreating it", filename);
+    r = 0;
+    goto out;
+  }
+
+  idx = calloc (1, sizeof *idx);
+  if (idx == NULL) {
+    nbdkit_error ("calloc: %m");
+    goto out;
+  }
+  idx->fd = fd;
+  idx->compressed_size = compressed_size;
+  idx->size = be64toh (h.size);
+  memcpy (idx->trailer, trailer, sizeof trailer);
+
+  /* The windows are read from the file when needed, so we only have
+   * to check that the file is the expected size.
+   */
+  nr_points = be64toh (h.nr_points);
+  if (nr_points == 0 ||
+      nr_points > (statbuf.st_size - sizeof h) /
+                  (sizeof ip + GZ_WINDOW_SIZE) ||
+      statbuf.st_size != sizeof h + nr_points * (sizeof ip + GZ_WINDOW_SIZE))
+    goto corrupt;
+  if (access_points_reserve (&idx->points, nr_points) == -1) {
+    nbdkit_error ("realloc: %m");
+    goto out;
+  }
+  offset = sizeof h;
+  for (i = 0; i < nr_points; ++i) {
+    struct access_point p;
+
+    if (full_pread (fd, &ip, sizeof ip, offset) == -1)
+      goto corrupt;
+    bits = be32toh (ip.bits);
+    if (bits > 7 || ip.reserved != 0)
+      goto corrupt;
+    p.out = be64toh (ip.out);
+    p.in = be64toh (ip.in);
+    p.bits = bits;
+    p.window = offset + sizeof ip;
+    if (!check_point (idx, &p))
+      goto corrupt;
+    access_points_append (&idx->points, p); /* cannot fail, reserved above */
+    offset += sizeof ip + GZ_WINDOW_SIZE;
+  }
+  last = &idx->points.ptr[nr_points-1];
+  if ((idx->size - last->out) / MAX_DEFLATE_RATIO >
+      idx->compressed_size - last->in)
+    goto corrupt;
+
+  nbdkit_debug ("gzip: loaded index %s: uncompressed size: %" PRIu64 ", "
+                "%zu access points", filename, idx->size, idx->points.len);
+  *ret = idx;
+  return 1;
+
+ corrupt:
+  nbdkit_error ("gzip-index: %s: index file is truncated or corrupt",
+                filename);
+ out:
+  if (idx)
+    gzindex_free (idx);         /* closes fd */
+  else
+    close (fd);
+  return r;
+}
+
+int
+gzindex_save (const gzindex *idx, const char *filename)
+{
+  CLEANUP_FREE char *tmpname = NULL;
+  FILE *fp;
+  struct index_header h;
+  struct index_point ip;
+  size_t i;
+  CLEANUP_FREE unsigned char *window = NULL;
+
+  window = malloc (GZ_WINDOW_SIZE);
+  if (window == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+
+  /* Write to a temporary file and rename it, so a partially written
+   * index is never left behind.
+   */
+  if (asprintf (&tmpname, "%s.tmp", filename) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+  fp = fopen (tmpname, "w");
+  if (fp == NULL) {
+    nbdkit_error ("gzip-index: %s: %m", tmpname);
+    return -1;
+  }
+
+  memcpy (h.magic, INDEX_MAGIC, sizeof h.magic);
+  h.compressed_size = htobe64 (idx->compressed_size);
+  h.size = htobe64 (idx->size);
+  memcpy (h.trailer, idx->trailer, sizeof h.trailer);
+  h.nr_points = htobe64 (idx->points.len);
+  if (fwrite (&h, sizeof h, 1, fp) != 1)
+    goto err;
+
+  for (i = 0; i < idx->points.len; ++i) {
+    const struct access_point *p = &idx->points.ptr[i];
+
+    ip.out = htobe64 (p->out);
+    ip.in = htobe64 (p->in);
+    ip.bits = htobe32 (p->bits);
+    ip.reserved = 0;
+    if (full_pread (idx->fd, window, GZ_WINDOW_SIZE, p->window) == -1 ||
+        fwrite (&ip, sizeof ip, 1, fp) != 1 ||
+        fwrite (window, GZ_WINDOW_SIZE, 1, fp) != 1)
+      goto err;
+  }
+
+  if (fclose (fp) == EOF) {
+    fp = NULL;
+    goto err;
+  }
+  if (rename (tmpname, filename) == -1) {
+    nbdkit_error ("gzip-index: rename: %s: %m", filename);
+    unlink (tmpname);
+    return -1;
+  }
+
+  nbdkit_debug ("gzip: saved index to %s", filename);
+  return 0;
+
+ err:
+  nbdkit_error ("gzip-index: %s: %m", tmpname);
+  if (fp)
+    fclose (fp);
+  unlink (tmpname);
+  return -1;
+}
+
+size_t
+gzindex_find (const gzindex *idx, uint64_t offset)
+{
+  size_t lo = 0, hi = idx->points.len;
+
+  /* Find the last access point at or before offset. */
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (idx->points.ptr[mid].out <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+uint64_t
+gzindex_span_size (const gzindex *idx, size_t i)
+{
+  if (i+1 < idx->points.len)
+    return idx->points.ptr[i+1].out - idx->points.ptr[i].out;
+  else
+    return idx->size - idx->points.ptr[i].out;
+}
+
+int
+gzindex_read_span (const gzindex *idx, nbdkit_next *next,
+                   size_t i, char *buf, int *err)
+{
+  const struct access_point *p = &idx->points.ptr[i];
+  z_stream strm;
+  int zerr;
+  uint64_t pos, end;
+  CLEANUP_FREE char *in_block = NULL;
+  CLEANUP_FREE unsigned char *window = NULL;
+  size_t in_size;
+
+  /* The compressed data for this span ends at the next access point
+   * (plus the partial byte), or the end of the file.
+   */
+  pos = p->in - (p->bits ? 1 : 0);
+  if (i+1 < idx->points.len)
+    end = MIN (idx->points.ptr[i+1].in + 1, idx->compressed_size);
+  else
+    end = idx->compressed_size;
+  in_size = MIN (READ_SIZE, end - pos);
+  in_block = malloc (in_size);
+  window = malloc (GZ_WINDOW_SIZE);
+  if (in_block == NULL || window == NULL) {
+    *err = errno;
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  if (full_pread (idx->fd, window, GZ_WINDOW_SIZE, p->window) == -1) {
+    *err = errno;
+    nbdkit_error ("gzip: reading index window: %m");
+    return -1;
+  }
+
+  /* Access points are in the raw deflate data. */
+  memset (&strm, 0, sizeof strm);
+  zerr = inflateInit2 (&strm, -MAX_WBITS);
+  if (zerr != Z_OK) {
+    zerror ("inflateInit2", &strm, zerr);
+    *err = errno;
+    return -1;
+  }
+
+  if (p->bits) {
+    unsigned char ch;
+
+    if (next->pread (next, &ch, 1, pos, 0, err) == -1)
+      goto err;
+    pos++;
+    inflatePrime (&strm, p->bits, ch >> (8 - p->bits));
+  }
+  if (p->out > 0) {
+    const size_t len = MIN (p->out, GZ_WINDOW_SIZE);
+
+    inflateSetDictionary (&strm, window + GZ_WINDOW_SIZE - len, len);
+  }
+
+  strm.next_out = (void *) buf;
+  strm.avail_out = gzindex_span_size (idx, i);
+  while (strm.avail_out > 0) {
+    if (strm.avail_in == 0) {
+      size_t n = MIN (in_size, end - pos);
+
+      if (n == 0) {
+        nbdkit_error ("gzip: unexpected end of compressed data");
+        *err = EIO;
+        goto err;
+      }
+      if (next->pread (next, in_block, n, pos, 0, err) == -1)
+        goto err;
+      pos += n;
+      strm.next_in = (void *) in_block;
+      strm.avail_in = n;
+    }
+
+    zerr = inflate (&strm, Z_NO_FLUSH);
+    if (zerr == Z_NEED_DICT)
+      zerr = Z_DATA_ERROR;
+    if (zerr < 0 && zerr != Z_BUF_ERROR) {
+      zerror ("inflate", &strm, zerr);
+      *err = errno;
+      goto err;
+    }
+    if (zerr == Z_STREAM_END && strm.avail_out > 0) {
+      nbdkit_error ("gzip: unexpected end of deflate stream");
+      *err = EIO;
+      goto err;
+    }
+  }
+
+  inflateEnd (&strm);
+  return 0;
+
+ err:
+  inflateEnd (&strm);
+  return -1;
+}
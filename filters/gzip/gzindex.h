@@ -0,0 +1,101 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Random access index for gzip files.
+ *
+ * This is based on the technique used in zran.c in the zlib sources:
+ * while uncompressing the whole file once we record "access points"
+ * roughly every span bytes of output.  Each access point saves the
+ * position in the compressed and uncompressed data and the 32K
+ * window of uncompressed data preceding it, which is all the state
+ * that inflate needs to restart at that point.
+ *
+ * The windows are not kept in memory.  They are stored in a file
+ * (the saved index, or an unlinked temporary file) and only read
+ * when a span is uncompressed.
+ */
+
+#ifndef NBDKIT_GZINDEX_H
+#define NBDKIT_GZINDEX_H
+
+#include <stdint.h>
+
+#include <nbdkit-filter.h>
+
+#include "vector.h"
+
+/* Size of the deflate window. */
+#define GZ_WINDOW_SIZE 32768
+
+struct access_point {
+  uint64_t out;                 /* Offset in the uncompressed data. */
+  uint64_t in;                  /* Offset in the compressed data. */
+  int bits;                     /* Bits from the byte before 'in', or 0. */
+  uint64_t window;              /* Offset in fd of the preceding
+                                   GZ_WINDOW_SIZE bytes. */
+};
+DEFINE_VECTOR_TYPE (access_points, struct access_point);
+
+typedef struct gzindex {
+  uint64_t compressed_size;
+  uint64_t size;                /* Uncompressed size. */
+  uint8_t trailer[8];           /* gzip trailer (CRC32 and ISIZE). */
+  access_points points;
+  int fd;                       /* File containing the windows. */
+} gzindex;
+
+/* Build the index by uncompressing the whole plugin once. */
+extern gzindex *gzindex_build (nbdkit_next *next, uint64_t span);
+
+/* Load an index previously saved by gzindex_save.  Returns 1 if
+ * loaded, 0 if the file does not exist or does not match the plugin
+ * (so it should be rebuilt), or -1 on error.
+ */
+extern int gzindex_load (const char *filename, nbdkit_next *next,
+                         gzindex **ret);
+
+/* Save the index to a file. */
+extern int gzindex_save (const gzindex *idx, const char *filename);
+
+extern void gzindex_free (gzindex *idx);
+
+/* Return the access point index of the span containing 'offset'. */
+extern size_t gzindex_find (const gzindex *idx, uint64_t offset);
+
+/* Return the uncompressed size of span i. */
+extern uint64_t gzindex_span_size (const gzindex *idx, size_t i);
+
+/* Uncompress span i into buf, which must be gzindex_span_size bytes. */
+extern int gzindex_read_span (const gzindex *idx, nbdkit_next *next,
+                              size_t i, char *buf, int *err);
+
+#endif /* NBDKIT_GZINDEX_H */
@@ -35,39 +35,85 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
-#include <fcntl.h>
 #include <errno.h>
+#include <assert.h>
 #include <pthread.h>
 
-#include <zlib.h>
-
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
-#include "pread.h"
 #include "minmax.h"
 
-/* The first thread to call gzip_prepare has to uncompress the whole
- * plugin to the temporary file.  This lock prevents concurrent
- * access.
+#include "gzindex.h"
+
+/* Distance between access points in the uncompressed data. */
+static uint64_t span = 4 * 1024 * 1024;
+
+/* Index file (gzip-index parameter), or NULL. */
+static const char *index_file = NULL;
+
+/* The first thread to call gzip_prepare has to build (or load) the
+ * index.  This lock prevents concurrent access.
  */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Temporary file storing the uncompressed data. */
-static int fd = -1;
+/* The index, shared by all connections. */
+static gzindex *idx = NULL;
 
-/* Size of compressed and uncompressed data. */
-static int64_t compressed_size = -1, size = -1;
+/* Cache of recently uncompressed spans, so that sequential reads do
+ * not uncompress the same span repeatedly.
+ */
+#define NR_CACHED_SPANS 16
+
+struct cached_span {
+  size_t i;                     /* Access point number. */
+  char *data;                   /* NULL if this slot is free. */
+  uint64_t last_used;
+};
+static struct cached_span cache[NR_CACHED_SPANS];
+static uint64_t cache_clock;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void
 gzip_unload (void)
 {
-  if (fd >= 0)
-    close (fd);
+  size_t i;
+
+  for (i = 0; i < NR_CACHED_SPANS; ++i)
+    free (cache[i].data);
+  gzindex_free (idx);
 }
 
+static int
+gzip_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
+             const char *key, const char *value)
+{
+  if (strcmp (key, "gzip-span") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    if (r < GZ_WINDOW_SIZE || r > 1024 * 1024 * 1024) {
+      nbdkit_error ("gzip-span must be between 32K and 1G");
+      return -1;
+    }
+    span = r;
+    return 0;
+  }
+  else if (strcmp (key, "gzip-index") == 0) {
+    index_file = value;
+    return 0;
+  }
+  else
+    return next (nxdata, key, value);
+}
+
+#define gzip_config_help \
+  "gzip-span=<SIZE>     Distance between access points (default: 4M).\n" \
+  "gzip-index=<FILE>    Load or save the index in FILE."
+
 static int
 gzip_thread_model (void)
 {
@@ -85,181 +131,35 @@ gzip_open (nbdkit_next_open *next, nbdkit_context *nxdata,
   return NBDKIT_HANDLE_NOT_NEEDED;
 }
 
-/* Convert a zlib error (always negative) to an nbdkit error message,
- * and return errno correctly.
- */
-static void
-zerror (const char *op, const z_stream *strm, int zerr)
-{
-  if (zerr == Z_MEM_ERROR) {
-    errno = ENOMEM;
-    nbdkit_error ("gzip: %s: %m", op);
-  }
-  else {
-    errno = EIO;
-    if (strm->msg)
-      nbdkit_error ("gzip: %s: %s", op, strm->msg);
-    else
-      nbdkit_error ("gzip: %s: unknown error: %d", op, zerr);
-  }
-}
-
-/* Write a whole buffer to the temporary file or fail. */
-static int
-xwrite (const void *buf, size_t count)
-{
-  ssize_t r;
-
-  while (count > 0) {
-    r = write (fd, buf, count);
-    if (r == -1) {
-      nbdkit_error ("write: %m");
-      return -1;
-    }
-    buf += r;
-    count -= r;
-  }
-
-  return 0;
-}
-
-/* The first thread to call gzip_prepare uncompresses the whole plugin. */
+/* The first thread to call gzip_prepare loads or builds the index. */
 static int
-do_uncompress (nbdkit_next *next)
+gzip_prepare (nbdkit_next *next, void *handle,
+              int readonly)
 {
-  z_stream strm;
-  int zerr;
-  const char *tmpdir;
-  size_t len;
-  char *template;
-  CLEANUP_FREE char *in_block = NULL, *out_block = NULL;
-
-  /* Choose a generous block size here because it's more efficient
-   * with some plugins (esp. curl).  XXX This should really be
-   * configurable.
-   */
-  const size_t block_size = 4 * 1024 * 1024;
-
-  assert (size == -1);
-
-  /* Get the size of the underlying plugin. */
-  compressed_size = next->get_size (next);
-  if (compressed_size == -1)
-    return -1;
-
-  /* Create the temporary file. */
-  tmpdir = getenv ("TMPDIR");
-  if (!tmpdir)
-    tmpdir = LARGE_TMPDIR;
-
-  len = strlen (tmpdir) + 8;
-  template = alloca (len);
-  snprintf (template, len, "%s/XXXXXX", tmpdir);
-
-#ifdef HAVE_MKOSTEMP
-  fd = mkostemp (template, O_CLOEXEC);
-#else
-  /* This is only invoked serially with the lock held, so this is safe. */
-  fd = mkstemp (template);
-#ifndef WIN32
-  if (fd >= 0) {
-    fd = set_cloexec (fd);
-    if (fd < 0) {
-      int e = errno;
-      unlink (template);
-      errno = e;
-    }
-  }
-#endif /* WIN32 */
-#endif /* !HAVE_MKOSTEMP */
-  if (fd == -1) {
-    nbdkit_error ("mkostemp: %s: %m", tmpdir);
-    return -1;
-  }
-
-  unlink (template);
-
-  /* Uncompress the whole plugin.  This is REQUIRED in order to
-   * implement gzip_get_size.  See: https://stackoverflow.com/a/9213826
-   *
-   * For use of inflateInit2 on gzip streams see:
-   * https://stackoverflow.com/a/1838702
-   */
-  memset (&strm, 0, sizeof strm);
-  zerr = inflateInit2 (&strm, 16+MAX_WBITS);
-  if (zerr != Z_OK) {
-    zerror ("inflateInit2", &strm, zerr);
-    return -1;
-  }
-
-  in_block = malloc (block_size);
-  if (!in_block) {
-    nbdkit_error ("malloc: %m");
-    return -1;
-  }
-  out_block = malloc (block_size);
-  if (!out_block) {
-    nbdkit_error ("malloc: %m");
-    return -1;
-  }
-
-  for (;;) {
-    /* Do we need to read more from the plugin? */
-    if (strm.avail_in == 0 && strm.total_in < compressed_size) {
-      size_t n = MIN (block_size, compressed_size - strm.total_in);
-      int err = 0;
-
-      if (next->pread (next, in_block, (uint32_t)n, strm.total_in, 0,
-                       &err) == -1) {
-        errno = err;
-        return -1;
-      }
-
-      strm.next_in = (void *) in_block;
-      strm.avail_in = n;
-    }
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  int r;
 
-    /* Inflate the next chunk of input. */
-    strm.next_out = (void *) out_block;
-    strm.avail_out = block_size;
-    zerr = inflate (&strm, Z_SYNC_FLUSH);
-    if (zerr < 0) {
-      zerror ("inflate", &strm, zerr);
-      return -1;
-    }
+  if (idx)
+    return 0;
 
-    /* Write the output to the file. */
-    if (xwrite (out_block, (char *) strm.next_out - out_block) == -1)
+  if (index_file) {
+    r = gzindex_load (index_file, next, &idx);
+    if (r == -1)
       return -1;
-
-    if (zerr == Z_STREAM_END)
-      break;
+    if (r == 1)
+      return 0;
   }
 
-  /* Set the size to the total uncompressed size. */
-  size = strm.total_out;
-  nbdkit_debug ("gzip: uncompressed size: %" PRIi64, size);
+  idx = gzindex_build (next, span);
+  if (idx == NULL)
+    return -1;
 
-  zerr = inflateEnd (&strm);
-  if (zerr != Z_OK) {
-    zerror ("inflateEnd", &strm, zerr);
+  if (index_file && gzindex_save (idx, index_file) == -1)
     return -1;
-  }
 
   return 0;
 }
 
-static int
-gzip_prepare (nbdkit_next *next, void *handle,
-              int readonly)
-{
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-
-  if (size >= 0)
-    return 0;
-  return do_uncompress (next);
-}
-
 /* Whatever the plugin says, this filter makes it read-only. */
 static int
 gzip_can_write (nbdkit_next *next,
@@ -317,44 +217,105 @@ gzip_get_size (nbdkit_next *next,
   int64_t t;
 
   /* This must be true because gzip_prepare must have been called. */
-  assert (size >= 0);
+  assert (idx != NULL);
 
   /* Check the plugin size didn't change underneath us. */
   t = next->get_size (next);
   if (t == -1)
     return -1;
-  if (t != compressed_size) {
+  if (t != idx->compressed_size) {
     nbdkit_error ("plugin size changed unexpectedly: "
                   "you must restart nbdkit so the gzip filter "
-                  "can uncompress the data again");
+                  "can index the data again");
     return -1;
   }
 
-  return size;
+  return idx->size;
+}
+
+/* Copy from span i to buf if it is in the cache. */
+static bool
+read_cached_span (size_t i, char *buf, uint32_t n, uint64_t offset)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cache_lock);
+  size_t j;
+
+  for (j = 0; j < NR_CACHED_SPANS; ++j) {
+    if (cache[j].data && cache[j].i == i) {
+      memcpy (buf, &cache[j].data[offset], n);
+      cache[j].last_used = ++cache_clock;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Add span i to the cache, replacing the least recently used entry.
+ * This takes ownership of data.
+ */
+static void
+add_cached_span (size_t i, char *data)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cache_lock);
+  size_t j, lru = 0;
+
+  for (j = 0; j < NR_CACHED_SPANS; ++j) {
+    if (cache[j].data && cache[j].i == i) {
+      /* Another thread uncompressed it at the same time. */
+      free (data);
+      return;
+    }
+    if (cache[j].last_used < cache[lru].last_used)
+      lru = j;
+  }
+
+  free (cache[lru].data);
+  cache[lru].i = i;
+  cache[lru].data = data;
+  cache[lru].last_used = ++cache_clock;
 }
 
-/* Read data from the temporary file. */
+/* Read data.  At most one span is uncompressed for each span
+ * overlapped by the request.
+ */
 static int
 gzip_pread (nbdkit_next *next,
             void *handle, void *buf, uint32_t count, uint64_t offset,
             uint32_t flags, int *err)
 {
+  size_t i;
+  uint64_t start, len;
+  uint32_t n;
+  char *data;
+
   /* This must be true because gzip_prepare must have been called. */
-  assert (fd >= 0);
+  assert (idx != NULL);
 
   while (count > 0) {
-    ssize_t r = pread (fd, buf, count, offset);
-    if (r == -1) {
-      nbdkit_error ("pread: %m");
-      return -1;
-    }
-    if (r == 0) {
-      nbdkit_error ("pread: unexpected end of file");
-      return -1;
+    i = gzindex_find (idx, offset);
+    start = idx->points.ptr[i].out;
+    len = gzindex_span_size (idx, i);
+    assert (start <= offset && offset < start + len);
+    n = MIN (count, start + len - offset);
+
+    if (!read_cached_span (i, buf, n, offset - start)) {
+      data = malloc (len);
+      if (data == NULL) {
+        *err = errno;
+        nbdkit_error ("malloc: %m");
+        return -1;
+      }
+      if (gzindex_read_span (idx, next, i, data, err) == -1) {
+        free (data);
+        return -1;
+      }
+      memcpy (buf, &data[offset - start], n);
+      add_cached_span (i, data);
     }
-    buf += r;
-    count -= r;
-    offset += r;
+
+    buf += n;
+    count -= n;
+    offset += n;
   }
 
   return 0;
@@ -364,6 +325,8 @@ static struct nbdkit_filter filter = {
   .name               = "gzip",
   .longname           = "nbdkit gzip filter",
   .unload             = gzip_unload,
+  .config             = gzip_config,
+  .config_help        = gzip_config_help,
   .thread_model       = gzip_thread_model,
   .open               = gzip_open,
   .prepare            = gzip_prepare,
@@ -34,11 +34,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
 #include <limits.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include <gnutls/crypto.h>
 
@@ -49,7 +52,9 @@
 #include "byte-swapping.h"
 #include "cleanup.h"
 #include "isaligned.h"
+#include "minmax.h"
 #include "rounding.h"
+#include "vector.h"
 
 /* LUKSv1 constants. */
 #define LUKS_MAGIC { 'L', 'U', 'K', 'S', 0xBA, 0xBE }
@@ -890,30 +895,44 @@ create_cipher (struct luks_data *h)
   return cipher;
 }
 
-/* Perform decryption of a block of data in memory. */
-int
-do_decrypt (struct luks_data *h, gnutls_cipher_hd_t cipher,
-            uint64_t sector, uint8_t *buf, size_t nr_sectors)
+/* Largest IV used by any supported cipher. */
+#define MAX_IV_LEN 16
+
+/* Perform decryption or encryption of a block of data in memory.
+ *
+ * Each sector has its own IV, so GnuTLS must be called once per
+ * sector, but we avoid any other per-sector overhead.
+ */
+static int
+do_crypt (struct luks_data *h, gnutls_cipher_hd_t cipher, bool encrypt,
+          uint64_t sector, uint8_t *buf, size_t nr_sectors)
 {
   int r;
   const size_t ivlen = cipher_alg_iv_len (h->cipher_alg, h->cipher_mode);
-  CLEANUP_FREE uint8_t *iv;
+  uint8_t iv[MAX_IV_LEN];
 
-  iv = malloc (ivlen);
-  if (!iv) {
-    nbdkit_error ("malloc: %m");
-    return -1;
-  }
+  assert (ivlen <= sizeof iv);
 
   while (nr_sectors) {
     calculate_iv (h->ivgen_alg, iv, ivlen, sector);
     gnutls_cipher_set_iv (cipher, iv, ivlen);
-    r = gnutls_cipher_decrypt2 (cipher,
-                                buf, LUKS_SECTOR_SIZE, /* ciphertext */
-                                buf, LUKS_SECTOR_SIZE  /* plaintext */);
-    if (r != 0) {
-      nbdkit_error ("gnutls_cipher_decrypt2: %s", gnutls_strerror (r));
-      return -1;
+    if (encrypt) {
+      r = gnutls_cipher_encrypt2 (cipher,
+                                  buf, LUKS_SECTOR_SIZE, /* plaintext */
+                                  buf, LUKS_SECTOR_SIZE  /* ciphertext */);
+      if (r != 0) {
+        nbdkit_error ("gnutls_cipher_encrypt2: %s", gnutls_strerror (r));
+        return -1;
+      }
+    }
+    else {
+      r = gnutls_cipher_decrypt2 (cipher,
+                                  buf, LUKS_SECTOR_SIZE, /* ciphertext */
+                                  buf, LUKS_SECTOR_SIZE  /* plaintext */);
+      if (r != 0) {
+        nbdkit_error ("gnutls_cipher_decrypt2: %s", gnutls_strerror (r));
+        return -1;
+      }
     }
 
     buf += LUKS_SECTOR_SIZE;
@@ -924,36 +943,204 @@ do_decrypt (struct luks_data *h, gnutls_cipher_hd_t cipher,
   return 0;
 }
 
-/* Perform encryption of a block of data in memory. */
+int
+do_decrypt (struct luks_data *h, gnutls_cipher_hd_t cipher,
+            uint64_t sector, uint8_t *buf, size_t nr_sectors)
+{
+  return do_crypt (h, cipher, false, sector, buf, nr_sectors);
+}
+
 int
 do_encrypt (struct luks_data *h, gnutls_cipher_hd_t cipher,
             uint64_t sector, uint8_t *buf, size_t nr_sectors)
 {
+  return do_crypt (h, cipher, true, sector, buf, nr_sectors);
+}
+
+/* Pool of crypto worker threads.
+ *
+ * Large requests are split into chunks.  The calling thread processes
+ * the first chunk itself and queues the rest for the workers.  GnuTLS
+ * cipher handles cannot be shared between threads so each job
+ * creates its own from the master key.
+ */
+#define MIN_CHUNK_SECTORS (256 * 1024 / LUKS_SECTOR_SIZE)
+
+struct crypto_batch {
+  unsigned remaining;           /* Number of jobs not yet finished. */
+  int r;                        /* Set to -1 if any job failed. */
+  pthread_cond_t cond;          /* Signalled when remaining reaches 0. */
+};
+
+struct crypto_job {
+  struct luks_data *h;
+  bool encrypt;
+  uint64_t sector;
+  uint8_t *buf;
+  size_t nr_sectors;
+  struct crypto_batch *batch;
+};
+
+DEFINE_VECTOR_TYPE (crypto_job_queue, struct crypto_job);
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static crypto_job_queue jobs = empty_vector;
+static bool pool_stop;
+static pthread_t *threads;
+static size_t nr_threads;
+
+static void *
+crypto_worker (void *vp)
+{
+  struct crypto_job job;
+  gnutls_cipher_hd_t cipher;
   int r;
-  const size_t ivlen = cipher_alg_iv_len (h->cipher_alg, h->cipher_mode);
-  CLEANUP_FREE uint8_t *iv;
 
-  iv = malloc (ivlen);
-  if (!iv) {
-    nbdkit_error ("malloc: %m");
+  for (;;) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+      while (!pool_stop && jobs.len == 0)
+        pthread_cond_wait (&pool_cond, &pool_lock);
+      if (pool_stop)
+        return NULL;
+      job = jobs.ptr[0];
+      crypto_job_queue_remove (&jobs, 0);
+    }
+
+    cipher = create_cipher (job.h);
+    if (cipher) {
+      r = do_crypt (job.h, cipher, job.encrypt,
+                    job.sector, job.buf, job.nr_sectors);
+      gnutls_cipher_deinit (cipher);
+    }
+    else
+      r = -1;
+
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+    if (r == -1)
+      job.batch->r = -1;
+    if (--job.batch->remaining == 0)
+      pthread_cond_signal (&job.batch->cond);
+  }
+}
+
+int
+start_crypto_threads (unsigned n)
+{
+  size_t i;
+  int err;
+
+  assert (threads == NULL);
+
+  if (n == 0)
+    return 0;
+
+  threads = calloc (n, sizeof (pthread_t));
+  if (threads == NULL) {
+    nbdkit_error ("calloc: %m");
     return -1;
   }
 
-  while (nr_sectors) {
-    calculate_iv (h->ivgen_alg, iv, ivlen, sector);
-    gnutls_cipher_set_iv (cipher, iv, ivlen);
-    r = gnutls_cipher_encrypt2 (cipher,
-                                buf, LUKS_SECTOR_SIZE, /* plaintext */
-                                buf, LUKS_SECTOR_SIZE  /* ciphertext */);
-    if (r != 0) {
-      nbdkit_error ("gnutls_cipher_decrypt2: %s", gnutls_strerror (r));
+  for (i = 0; i < n; ++i) {
+    err = pthread_create (&threads[i], NULL, crypto_worker, NULL);
+    if (err != 0) {
+      errno = err;
+      nbdkit_error ("pthread_create: %m");
+      stop_crypto_threads ();
       return -1;
     }
-
-    buf += LUKS_SECTOR_SIZE;
-    nr_sectors--;
-    sector++;
+    nr_threads++;
   }
 
+  nbdkit_debug ("LUKS started %zu crypto worker threads", nr_threads);
   return 0;
 }
+
+void
+stop_crypto_threads (void)
+{
+  size_t i;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+    pool_stop = true;
+    pthread_cond_broadcast (&pool_cond);
+  }
+
+  for (i = 0; i < nr_threads; ++i)
+    pthread_join (threads[i], NULL);
+  free (threads);
+  threads = NULL;
+  nr_threads = 0;
+  crypto_job_queue_reset (&jobs);
+}
+
+static int
+parallel_crypt (struct luks_data *h, gnutls_cipher_hd_t cipher,
+                bool encrypt,
+                uint64_t sector, uint8_t *buf, size_t nr_sectors)
+{
+  struct crypto_batch batch = { .cond = PTHREAD_COND_INITIALIZER };
+  size_t nr_chunks, chunk, queued, i;
+  int r;
+
+  if (nr_threads == 0 || nr_sectors < 2 * MIN_CHUNK_SECTORS)
+    return do_crypt (h, cipher, encrypt, sector, buf, nr_sectors);
+
+  nr_chunks = MIN (nr_threads + 1, nr_sectors / MIN_CHUNK_SECTORS);
+  chunk = DIV_ROUND_UP (nr_sectors, nr_chunks);
+
+  /* Queue all except the first chunk.  If we run out of memory then
+   * whatever could not be queued is done by this thread below.
+   */
+  queued = chunk;
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+    for (i = chunk; i < nr_sectors; i += chunk) {
+      const struct crypto_job job = {
+        .h = h, .encrypt = encrypt,
+        .sector = sector + i,
+        .buf = buf + i * LUKS_SECTOR_SIZE,
+        .nr_sectors = MIN (chunk, nr_sectors - i),
+        .batch = &batch,
+      };
+      if (crypto_job_queue_append (&jobs, job) == -1)
+        break;
+      batch.remaining++;
+      queued += job.nr_sectors;
+    }
+    pthread_cond_broadcast (&pool_cond);
+  }
+
+  r = do_crypt (h, cipher, encrypt, sector, buf, chunk);
+  if (r == 0 && queued < nr_sectors)
+    r = do_crypt (h, cipher, encrypt, sector + queued,
+                  buf + queued * LUKS_SECTOR_SIZE, nr_sectors - queued);
+
+  /* Even on error we must wait, since the jobs refer to batch and buf. */
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+    while (batch.remaining > 0)
+      pthread_cond_wait (&batch.cond, &pool_lock);
+  }
+  pthread_cond_destroy (&batch.cond);
+
+  if (batch.r == -1)
+    r = -1;
+  return r;
+}
+
+int
+parallel_decrypt (struct luks_data *h, gnutls_cipher_hd_t cipher,
+                  uint64_t sector, uint8_t *buf, size_t nr_sectors)
+{
+  return parallel_crypt (h, cipher, false, sector, buf, nr_sectors);
+}
+
+int
+parallel_encrypt (struct luks_data *h, gnutls_cipher_hd_t cipher,
+                  uint64_t sector, uint8_t *buf, size_t nr_sectors)
+{
+  return parallel_crypt (h, cipher, true, sector, buf, nr_sectors);
+}
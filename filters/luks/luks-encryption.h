@@ -75,4 +75,23 @@ extern int do_decrypt (struct luks_data *h, gnutls_cipher_hd_t cipher,
 extern int do_encrypt (struct luks_data *h, gnutls_cipher_hd_t cipher,
                        uint64_t sector, uint8_t *buf, size_t nr_sectors);
 
+/* Start or stop the pool of crypto worker threads.  'n' is the
+ * number of extra threads, 0 means no pool.
+ */
+extern int start_crypto_threads (unsigned n);
+extern void stop_crypto_threads (void);
+
+/* As above, but large buffers are split into chunks which are
+ * processed in parallel by the calling thread (using 'cipher') and
+ * the crypto worker threads (which create their own cipher handles
+ * from the master key).  This can only be used for the payload, not
+ * the keyslots.
+ */
+extern int parallel_decrypt (struct luks_data *h, gnutls_cipher_hd_t cipher,
+                             uint64_t sector, uint8_t *buf,
+                             size_t nr_sectors);
+extern int parallel_encrypt (struct luks_data *h, gnutls_cipher_hd_t cipher,
+                             uint64_t sector, uint8_t *buf,
+                             size_t nr_sectors);
+
 #endif /* NBDKIT_LUKS_ENCRYPTION_H */
@@ -40,6 +40,7 @@
 #include <limits.h>
 #include <assert.h>
 #include <pthread.h>
+#include <unistd.h>
 
 #include <gnutls/crypto.h>
 
@@ -50,12 +51,20 @@
 #include "cleanup.h"
 #include "isaligned.h"
 #include "minmax.h"
+#include "rounding.h"
 
 static char *passphrase = NULL;
 
+/* Number of threads which may work on a single large request,
+ * including the calling thread.  0 means use the default.
+ */
+static unsigned luks_threads = 0;
+
 static void
 luks_unload (void)
 {
+  stop_crypto_threads ();
+
   /* XXX We should really store the passphrase (and master key)
    * in mlock-ed memory.
    */
@@ -80,6 +89,15 @@ luks_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
       return -1;
     return 0;
   }
+  else if (strcmp (key, "luks-threads") == 0) {
+    if (nbdkit_parse_unsigned ("luks-threads", value, &luks_threads) == -1)
+      return -1;
+    if (luks_threads == 0) {
+      nbdkit_error ("luks-threads cannot be 0");
+      return -1;
+    }
+    return 0;
+  }
 
   return next (nxdata, key, value);
 }
@@ -91,11 +109,25 @@ luks_config_complete (nbdkit_next_config_complete *next, nbdkit_backend *nxdata)
     nbdkit_error ("LUKS \"passphrase\" parameter is missing");
     return -1;
   }
+
+  if (luks_threads == 0) {
+    long n = sysconf (_SC_NPROCESSORS_ONLN);
+    luks_threads = n >= 1 ? MIN (n, 8) : 1;
+  }
+
   return next (nxdata);
 }
 
 #define luks_config_help \
-  "passphrase=<SECRET>      Secret passphrase."
+  "passphrase=<SECRET>      Secret passphrase.\n" \
+  "luks-threads=<N>         Threads used to decrypt large requests."
+
+/* The crypto worker threads must be started after nbdkit forks. */
+static int
+luks_after_fork (nbdkit_backend *nxdata)
+{
+  return start_crypto_threads (luks_threads - 1);
+}
 
 /* Per-connection handle. */
 struct handle {
@@ -283,19 +315,24 @@ luks_pread (nbdkit_next *next, void *handle,
     sectnum++;
   }
 
-  /* Aligned body */
-  while (count >= LUKS_SECTOR_SIZE) {
-    if (next->pread (next, buf, LUKS_SECTOR_SIZE,
+  /* Aligned body.  This is read in a single request and decrypted
+   * in place, in parallel if it is large enough.
+   */
+  if (count >= LUKS_SECTOR_SIZE) {
+    const uint32_t n = ROUND_DOWN (count, LUKS_SECTOR_SIZE);
+
+    if (next->pread (next, buf, n,
                      sectnum * LUKS_SECTOR_SIZE + payload_offset,
                      flags, err) == -1)
       goto err;
 
-    if (do_decrypt (h->h, cipher, sectnum, buf, 1) == -1)
+    if (parallel_decrypt (h->h, cipher, sectnum, buf,
+                          n / LUKS_SECTOR_SIZE) == -1)
       goto err;
 
-    buf += LUKS_SECTOR_SIZE;
-    count -= LUKS_SECTOR_SIZE;
-    sectnum++;
+    buf += n;
+    count -= n;
+    sectnum += n / LUKS_SECTOR_SIZE;
   }
 
   /* Unaligned tail */
@@ -317,7 +354,7 @@ luks_pread (nbdkit_next *next, void *handle,
 
  err:
   gnutls_cipher_deinit (cipher);
-  goto err;
+  return -1;
 }
 
 /* Lock preventing read-modify-write cycles from overlapping. */
@@ -332,6 +369,7 @@ luks_pwrite (nbdkit_next *next, void *handle,
   struct handle *h = handle;
   const uint64_t payload_offset = get_payload_offset (h->h) * LUKS_SECTOR_SIZE;
   CLEANUP_FREE uint8_t *sector = NULL;
+  CLEANUP_FREE uint8_t *bounce = NULL;
   uint64_t sectnum, sectoffs;
   gnutls_cipher_hd_t cipher;
 
@@ -365,6 +403,9 @@ luks_pwrite (nbdkit_next *next, void *handle,
                      flags, err) == -1)
       goto err;
 
+    if (do_decrypt (h->h, cipher, sectnum, sector, 1) == -1)
+      goto err;
+
     memcpy (&sector[sectoffs], buf, n);
 
     if (do_encrypt (h->h, cipher, sectnum, sector, 1) == -1)
@@ -380,21 +421,32 @@ luks_pwrite (nbdkit_next *next, void *handle,
     sectnum++;
   }
 
-  /* Aligned body */
-  while (count >= LUKS_SECTOR_SIZE) {
-    memcpy (sector, buf, LUKS_SECTOR_SIZE);
+  /* Aligned body.  The caller's buffer is read-only so this is
+   * encrypted into a bounce buffer and written in a single request.
+   */
+  if (count >= LUKS_SECTOR_SIZE) {
+    const uint32_t n = ROUND_DOWN (count, LUKS_SECTOR_SIZE);
 
-    if (do_encrypt (h->h, cipher, sectnum, sector, 1) == -1)
+    bounce = malloc (n);
+    if (bounce == NULL) {
+      *err = errno;
+      nbdkit_error ("malloc: %m");
       goto err;
+    }
+    memcpy (bounce, buf, n);
 
-    if (next->pwrite (next, sector, LUKS_SECTOR_SIZE,
+    if (parallel_encrypt (h->h, cipher, sectnum, bounce,
+                          n / LUKS_SECTOR_SIZE) == -1)
+      goto err;
+
+    if (next->pwrite (next, bounce, n,
                       sectnum * LUKS_SECTOR_SIZE + payload_offset,
                       flags, err) == -1)
       goto err;
 
-    buf += LUKS_SECTOR_SIZE;
-    count -= LUKS_SECTOR_SIZE;
-    sectnum++;
+    buf += n;
+    count -= n;
+    sectnum += n / LUKS_SECTOR_SIZE;
   }
 
   /* Unaligned tail */
@@ -406,6 +458,9 @@ luks_pwrite (nbdkit_next *next, void *handle,
                      flags, err) == -1)
       goto err;
 
+    if (do_decrypt (h->h, cipher, sectnum, sector, 1) == -1)
+      goto err;
+
     memcpy (sector, buf, count);
 
     if (do_encrypt (h->h, cipher, sectnum, sector, 1) == -1)
@@ -429,6 +484,7 @@ static struct nbdkit_filter filter = {
   .name               = "luks",
   .longname           = "nbdkit luks filter",
   .unload             = luks_unload,
+  .after_fork         = luks_after_fork,
   .thread_model       = luks_thread_model,
   .config             = luks_config,
   .config_complete    = luks_config_complete,
@@ -71,6 +71,14 @@ readahead_thread (void *vp)
        * client, and readahead is only advisory.
        */
       cmd.next->cache (cmd.next, cmd.count, cmd.offset, 0, NULL);
+      break;
+
+    case CMD_PREFETCH:
+      /* Read the data into our own buffer, using the separate
+       * context opened for this purpose.
+       */
+      buffer_prefetch (cmd.buffer, cmd.next, cmd.offset, cmd.count);
+      break;
     }
   }
 }
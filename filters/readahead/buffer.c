@@ -0,0 +1,278 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* When the plugin cannot prefetch data itself (it does not support
+ * NBDKIT_CACHE_NATIVE) or does not use the PARALLEL thread model,
+ * the background thread instead reads data ahead into this bounded
+ * buffer, using its own plugin context, and subsequent reads are
+ * served from here.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "readahead.h"
+
+#include "cleanup.h"
+#include "minmax.h"
+
+void
+buffer_init (struct ra_buffer *b, uint64_t limit)
+{
+  pthread_mutex_init (&b->lock, NULL);
+  pthread_cond_init (&b->cond, NULL);
+  b->blocks = (prefetched_list) empty_vector;
+  b->used = 0;
+  b->limit = limit;
+  b->generation = 0;
+  b->pending = (pending_list) empty_vector;
+  b->writes = (pending_list) empty_vector;
+  b->hits = b->misses = 0;
+}
+
+static void
+free_prefetched (struct prefetched p)
+{
+  free (p.data);
+}
+
+void
+buffer_free (struct ra_buffer *b)
+{
+  prefetched_list_iter (&b->blocks, free_prefetched);
+  prefetched_list_reset (&b->blocks);
+  pending_list_reset (&b->pending);
+  pending_list_reset (&b->writes);
+  pthread_cond_destroy (&b->cond);
+  pthread_mutex_destroy (&b->lock);
+}
+
+int
+buffer_queue (struct ra_buffer *b, uint64_t offset, uint32_t count)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&b->lock);
+  const struct pending p = { .offset = offset, .end = offset + count };
+
+  return pending_list_append (&b->pending, p);
+}
+
+/* Remove one matching range from the list. */
+static void
+remove_range (pending_list *list, uint64_t offset, uint32_t count)
+{
+  size_t i;
+
+  for (i = 0; i < list->len; ++i) {
+    if (list->ptr[i].offset == offset &&
+        list->ptr[i].end == offset + count) {
+      pending_list_remove (list, i);
+      break;
+    }
+  }
+}
+
+/* Does any range in the list overlap [offset, end)? */
+static bool
+overlaps (const pending_list *list, uint64_t offset, uint64_t end)
+{
+  size_t i;
+
+  for (i = 0; i < list->len; ++i) {
+    if (offset < list->ptr[i].end && end > list->ptr[i].offset)
+      return true;
+  }
+  return false;
+}
+
+/* Must be called with the lock held. */
+static void
+remove_pending (struct ra_buffer *b, uint64_t offset, uint32_t count)
+{
+  remove_range (&b->pending, offset, count);
+  pthread_cond_broadcast (&b->cond);
+}
+
+void
+buffer_unqueue (struct ra_buffer *b, uint64_t offset, uint32_t count)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&b->lock);
+  remove_pending (b, offset, count);
+}
+
+void
+buffer_prefetch (struct ra_buffer *b, nbdkit_next *next,
+                 uint64_t offset, uint32_t count)
+{
+  const uint32_t queued_count = count;
+  struct prefetched p = { .offset = offset };
+  uint64_t generation;
+  int r, err;
+
+  count = MIN (count, b->limit);
+  p.count = count;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&b->lock);
+    generation = b->generation;
+  }
+
+  /* Errors are ignored because readahead is only advisory.  The
+   * client will see the error when it reads the data itself.
+   */
+  p.data = malloc (count);
+  r = p.data ? next->pread (next, p.data, count, offset, 0, &err) : -1;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&b->lock);
+
+  /* Wake up any readers waiting for this data, whatever happens.
+   * They cannot run until we release the lock below, by which time
+   * the data is in the buffer.
+   */
+  remove_pending (b, offset, queued_count);
+
+  /* Drop the data if it failed, or may be older than a write which
+   * is still running or finished while we were reading it.
+   */
+  if (r == -1 || generation != b->generation ||
+      overlaps (&b->writes, offset, offset + count)) {
+    free (p.data);
+    return;
+  }
+
+  /* Evict the oldest data to make room. */
+  while (b->blocks.len > 0 && b->used + count > b->limit) {
+    b->used -= b->blocks.ptr[0].count;
+    free (b->blocks.ptr[0].data);
+    prefetched_list_remove (&b->blocks, 0);
+  }
+
+  if (prefetched_list_append (&b->blocks, p) == -1) {
+    free (p.data);
+    return;
+  }
+  b->used += count;
+}
+
+/* Find the buffered block containing offset, or NULL. */
+static const struct prefetched *
+find_block (const struct ra_buffer *b, uint64_t offset)
+{
+  size_t i;
+
+  /* Search newest first since that is most likely to match. */
+  for (i = b->blocks.len; i > 0; --i) {
+    const struct prefetched *p = &b->blocks.ptr[i-1];
+
+    if (offset >= p->offset && offset < p->offset + p->count)
+      return p;
+  }
+  return NULL;
+}
+
+bool
+buffer_read (struct ra_buffer *b, void *buf, uint32_t count, uint64_t offset)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&b->lock);
+  const uint64_t end = offset + count;
+  uint64_t pos;
+
+  /* If the data is about to be prefetched, wait for it rather than
+   * issuing a second request to the plugin.
+   */
+  while (overlaps (&b->pending, offset, end))
+    pthread_cond_wait (&b->cond, &b->lock);
+
+  /* Check the whole read is buffered before copying anything. */
+  for (pos = offset; pos < end; ) {
+    const struct prefetched *p = find_block (b, pos);
+
+    if (p == NULL) {
+      b->misses++;
+      return false;
+    }
+    pos = p->offset + p->count;
+  }
+
+  for (pos = offset; pos < end; ) {
+    const struct prefetched *p = find_block (b, pos);
+    uint64_t n = MIN (end, p->offset + p->count) - pos;
+
+    memcpy ((char *) buf + (pos - offset), p->data + (pos - p->offset), n);
+    pos += n;
+  }
+
+  b->hits++;
+  return true;
+}
+
+int
+buffer_invalidate (struct ra_buffer *b, uint32_t count, uint64_t offset)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&b->lock);
+  const struct pending w = { .offset = offset, .end = offset + count };
+  size_t i;
+
+  if (pending_list_append (&b->writes, w) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+
+  for (i = 0; i < b->blocks.len; ) {
+    struct prefetched *p = &b->blocks.ptr[i];
+
+    if (offset < p->offset + p->count && w.end > p->offset) {
+      b->used -= p->count;
+      free (p->data);
+      prefetched_list_remove (&b->blocks, i);
+    }
+    else
+      ++i;
+  }
+  return 0;
+}
+
+void
+buffer_write_done (struct ra_buffer *b, uint32_t count, uint64_t offset)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&b->lock);
+
+  remove_range (&b->writes, offset, count);
+  b->generation++;
+}
@@ -37,6 +37,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <pthread.h>
 
@@ -48,46 +49,158 @@
 #include "minmax.h"
 #include "vector.h"
 
-/* These could be made configurable in future. */
-#define READAHEAD_MIN 32768
-#define READAHEAD_MAX (4*1024*1024)
+/* Size of the readahead window (readahead-min, readahead-max). */
+static uint64_t readahead_min = 32768;
+static uint64_t readahead_max = 4*1024*1024;
 
-/* Size of the readahead window. */
-static pthread_mutex_t window_lock = PTHREAD_MUTEX_INITIALIZER;
-static uint64_t window = READAHEAD_MIN;
-static uint64_t last_offset = 0, last_readahead = 0;
+/* Number of sequential streams tracked per connection
+ * (readahead-streams).
+ */
+static unsigned nr_streams = 4;
+
+/* Size of the prefetch buffer used when the plugin cannot prefetch
+ * itself (readahead-buffer).
+ */
+static uint64_t buffer_size = 16*1024*1024;
 
 static int thread_model = -1; /* Thread model of the underlying plugin. */
 
+/* How prefetching is done for a connection (chosen in .prepare). */
+enum mode {
+  MODE_DISABLED,  /* The filter does nothing. */
+  MODE_CACHE,     /* Send .cache requests to the plugin. */
+  MODE_BUFFER,    /* Read into our own buffer using a separate context. */
+};
+
+/* A sequential stream of reads detected within a connection.  The
+ * range [last_end, ra_end) has been prefetched but not yet read.
+ */
+struct stream {
+  bool in_use;
+  uint64_t last_offset;         /* Offset of the last read. */
+  uint64_t last_end;            /* End of the last read. */
+  uint64_t ra_end;              /* End of the prefetched range. */
+  uint64_t window;              /* Current window size. */
+  uint64_t last_used;           /* For LRU replacement. */
+};
+
 /* Per-connection data. */
 struct readahead_handle {
   int can_cache;      /* Can the underlying plugin cache? */
+  enum mode mode;
   pthread_t thread;   /* The background thread, one per connection. */
   struct bgthread_ctrl ctrl;
+
+  /* Used by MODE_BUFFER only. */
+  nbdkit_backend *backend;      /* Backend, to open ra_next. */
+  const char *exportname;       /* Export name, to open ra_next. */
+  nbdkit_next *ra_next;         /* Context used by the background thread. */
+  struct ra_buffer buffer;      /* Prefetched data. */
+
+  pthread_mutex_t lock;         /* Protects the fields below. */
+  struct stream *streams;       /* Array of nr_streams streams. */
+  uint64_t clock;               /* Incremented on every read. */
+
+  /* Statistics, printed when the connection is closed. */
+  uint64_t reads, read_bytes;   /* Reads seen. */
+  uint64_t prefetches, prefetch_bytes; /* Prefetches issued. */
+  uint64_t hit_bytes;           /* Bytes read which had been prefetched. */
+  uint64_t wasted_bytes;        /* Bytes prefetched but never read. */
 };
 
-/* We have various requirements of the underlying filter(s) + plugin:
- * - They must support NBDKIT_CACHE_NATIVE (otherwise our requests
- *   would not do anything useful).
- * - They must use the PARALLEL thread model (otherwise we could
- *   violate their thread model).
+/* To use the plugin's own prefetching (MODE_CACHE) the underlying
+ * filter(s) + plugin must support NBDKIT_CACHE_NATIVE and use the
+ * PARALLEL thread model (otherwise we could violate their thread
+ * model).
+ *
+ * Otherwise we can prefetch into our own buffer (MODE_BUFFER) using
+ * a second plugin context, which only requires that requests on
+ * different contexts can run in parallel (SERIALIZE_REQUESTS).
  */
+static enum mode
+choose_mode (struct readahead_handle *h)
+{
+  if (h->can_cache == NBDKIT_CACHE_NATIVE &&
+      thread_model == NBDKIT_THREAD_MODEL_PARALLEL)
+    return MODE_CACHE;
+  if (thread_model >= NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS)
+    return MODE_BUFFER;
+  return MODE_DISABLED;
+}
+
 static bool
 filter_working (struct readahead_handle *h)
 {
-  return
-    h->can_cache == NBDKIT_CACHE_NATIVE &&
-    thread_model == NBDKIT_THREAD_MODEL_PARALLEL;
+  return h->mode != MODE_DISABLED;
 }
 
-static bool
-suggest_cache_filter (struct readahead_handle *h)
+static int
+readahead_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
+                  const char *key, const char *value)
+{
+  int64_t r;
+
+  if (strcmp (key, "readahead-min") == 0) {
+    r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    readahead_min = r;
+    return 0;
+  }
+  else if (strcmp (key, "readahead-max") == 0) {
+    r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    readahead_max = r;
+    return 0;
+  }
+  else if (strcmp (key, "readahead-buffer") == 0) {
+    r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    buffer_size = r;
+    return 0;
+  }
+  else if (strcmp (key, "readahead-streams") == 0) {
+    if (nbdkit_parse_unsigned ("readahead-streams", value, &nr_streams) == -1)
+      return -1;
+    return 0;
+  }
+  else
+    return next (nxdata, key, value);
+}
+
+static int
+readahead_config_complete (nbdkit_next_config_complete *next,
+                           nbdkit_backend *nxdata)
 {
-  return
-    h->can_cache != NBDKIT_CACHE_NATIVE &&
-    thread_model == NBDKIT_THREAD_MODEL_PARALLEL;
+  if (readahead_min == 0 || readahead_min > readahead_max) {
+    nbdkit_error ("readahead-min must be > 0 and <= readahead-max");
+    return -1;
+  }
+  /* Cache requests are limited to 32 bits. */
+  if (readahead_max > UINT32_MAX) {
+    nbdkit_error ("readahead-max must be < 4G");
+    return -1;
+  }
+  if (buffer_size < readahead_min) {
+    nbdkit_error ("readahead-buffer must be >= readahead-min");
+    return -1;
+  }
+  if (nr_streams == 0 || nr_streams > 64) {
+    nbdkit_error ("readahead-streams must be between 1 and 64");
+    return -1;
+  }
+
+  return next (nxdata);
 }
 
+#define readahead_config_help \
+  "readahead-buffer=<SIZE>  Prefetch buffer size if plugin cannot prefetch.\n" \
+  "readahead-min=<SIZE>     Minimum readahead window (default 32K).\n" \
+  "readahead-max=<SIZE>     Maximum readahead window (default 4M).\n" \
+  "readahead-streams=<N>    Sequential streams per connection (default 4)."
+
 /* We need to hook into .get_ready() so we can read the final thread
  * model (of the whole server).
  */
@@ -127,6 +240,28 @@ readahead_open (nbdkit_next_open *next, nbdkit_context *nxdata,
     return NULL;
   }
 
+  h->streams = calloc (nr_streams, sizeof (struct stream));
+  if (h->streams == NULL) {
+    nbdkit_error ("calloc: %m");
+    free (h);
+    return NULL;
+  }
+  h->mode = MODE_DISABLED;
+  h->backend = nbdkit_context_get_backend (nxdata);
+  h->exportname = nbdkit_strdup_intern (exportname);
+  if (h->exportname == NULL) {
+    free (h->streams);
+    free (h);
+    return NULL;
+  }
+  h->ra_next = NULL;
+  buffer_init (&h->buffer, buffer_size);
+  h->clock = 0;
+  h->reads = h->read_bytes = 0;
+  h->prefetches = h->prefetch_bytes = 0;
+  h->hit_bytes = h->wasted_bytes = 0;
+  pthread_mutex_init (&h->lock, NULL);
+
   h->ctrl.cmds = (command_queue) empty_vector;
   pthread_mutex_init (&h->ctrl.lock, NULL);
   pthread_cond_init (&h->ctrl.cond, NULL);
@@ -138,6 +273,9 @@ readahead_open (nbdkit_next_open *next, nbdkit_context *nxdata,
     nbdkit_error ("pthread_create: %m");
     pthread_cond_destroy (&h->ctrl.cond);
     pthread_mutex_destroy (&h->ctrl.lock);
+    pthread_mutex_destroy (&h->lock);
+    buffer_free (&h->buffer);
+    free (h->streams);
     free (h);
     return NULL;
   }
@@ -145,45 +283,192 @@ readahead_open (nbdkit_next_open *next, nbdkit_context *nxdata,
   return h;
 }
 
+static int
+readahead_prepare (nbdkit_next *next, void *handle, int readonly)
+{
+  struct readahead_handle *h = handle;
+
+  /* Call next->can_cache to read the underlying 'can_cache'. */
+  h->can_cache = next->can_cache (next);
+  if (h->can_cache == -1)
+    return -1;
+
+  h->mode = choose_mode (h);
+  switch (h->mode) {
+  case MODE_DISABLED:
+    nbdkit_error ("readahead: warning: underlying plugin serializes all "
+                  "requests, so the filter won't do anything");
+    /* This is an error, but that's just to ensure that the warning
+     * above is seen.  We don't need to return -1 here.
+     */
+    break;
+
+  case MODE_CACHE:
+    nbdkit_debug ("readahead: prefetching using the plugin cache method");
+    break;
+
+  case MODE_BUFFER:
+    /* Open a separate read-only context for the background thread so
+     * it never runs requests in parallel on the client's context.
+     * This is shared because the background thread is outside the
+     * client connection.
+     */
+    nbdkit_debug ("readahead: prefetching into a buffer of %" PRIu64 " bytes",
+                  buffer_size);
+    h->ra_next = nbdkit_next_context_open (h->backend, 1, h->exportname, 1);
+    if (h->ra_next == NULL)
+      return -1;
+    if (h->ra_next->prepare (h->ra_next) == -1 ||
+        h->ra_next->get_size (h->ra_next) == -1) {
+      h->ra_next->finalize (h->ra_next);
+      nbdkit_next_context_close (h->ra_next);
+      h->ra_next = NULL;
+      return -1;
+    }
+    break;
+  }
+
+  return 0;
+}
+
+/* Prefetched data which was never read. */
+static uint64_t
+unread_bytes (const struct stream *s)
+{
+  return s->in_use && s->ra_end > s->last_end ? s->ra_end - s->last_end : 0;
+}
+
 static void
 readahead_close (void *handle)
 {
   struct readahead_handle *h = handle;
   const struct command quit_cmd = { .type = CMD_QUIT };
+  unsigned i;
 
   send_command_to_background_thread (&h->ctrl, quit_cmd);
   pthread_join (h->thread, NULL);
+
+  if (h->ra_next) {
+    h->ra_next->finalize (h->ra_next);
+    nbdkit_next_context_close (h->ra_next);
+  }
+
+  for (i = 0; i < nr_streams; ++i)
+    h->wasted_bytes += unread_bytes (&h->streams[i]);
+  if (h->reads > 0)
+    nbdkit_debug ("readahead: reads: %" PRIu64 " (%" PRIu64 " bytes), "
+                  "prefetches: %" PRIu64 " (%" PRIu64 " bytes), "
+                  "hits: %" PRIu64 " bytes, wasted: %" PRIu64 " bytes",
+                  h->reads, h->read_bytes,
+                  h->prefetches, h->prefetch_bytes,
+                  h->hit_bytes, h->wasted_bytes);
+  if (h->mode == MODE_BUFFER)
+    nbdkit_debug ("readahead: reads served from buffer: %" PRIu64 ", "
+                  "not in buffer: %" PRIu64,
+                  h->buffer.hits, h->buffer.misses);
+
   pthread_cond_destroy (&h->ctrl.cond);
   pthread_mutex_destroy (&h->ctrl.lock);
+  pthread_mutex_destroy (&h->lock);
   command_queue_reset (&h->ctrl.cmds);
+  buffer_free (&h->buffer);
+  free (h->streams);
   free (h);
 }
 
+/* Other connections cannot see the data in our buffer, so we must
+ * not advertise multi-conn when using it.
+ */
 static int
-readahead_can_cache (nbdkit_next *next, void *handle)
+readahead_can_multi_conn (nbdkit_next *next, void *handle)
 {
   struct readahead_handle *h = handle;
-  int r;
 
-  /* Call next->can_cache to read the underlying 'can_cache'. */
-  r = next->can_cache (next);
-  if (r == -1)
-    return -1;
-  h->can_cache = r;
-
-  if (!filter_working (h)) {
-    nbdkit_error ("readahead: warning: underlying plugin does not support "
-                  "NBD_CMD_CACHE or PARALLEL thread model, so the filter "
-                  "won't do anything");
-    if (suggest_cache_filter (h))
-      nbdkit_error ("readahead: try adding --filter=cache "
-                    "after this filter");
-    /* This is an error, but that's just to ensure that the warning
-     * above is seen.  We don't need to return -1 here.
-     */
+  if (h->mode == MODE_BUFFER)
+    return 0;
+  return next->can_multi_conn (next);
+}
+
+/* Find the stream which this read continues.  A read continues a
+ * stream if it makes forward progress from the previous read and
+ * starts within (or just after) the prefetched range.  If several
+ * streams match choose the closest.  Returns NULL if there is no
+ * match.
+ */
+static struct stream *
+find_stream (struct readahead_handle *h, uint64_t offset)
+{
+  struct stream *best = NULL;
+  uint64_t best_dist = UINT64_MAX;
+  unsigned i;
+
+  for (i = 0; i < nr_streams; ++i) {
+    struct stream *s = &h->streams[i];
+    uint64_t limit, dist;
+
+    if (!s->in_use || offset < s->last_offset)
+      continue;
+    limit = MAX (s->ra_end, s->last_end + s->window);
+    if (offset > limit)
+      continue;
+    dist = offset >= s->last_end ? offset - s->last_end : s->last_end - offset;
+    if (dist < best_dist) {
+      best = s;
+      best_dist = dist;
+    }
   }
 
-  return r;
+  return best;
+}
+
+/* Start a new stream, replacing an unused or the least recently used
+ * stream.
+ */
+static struct stream *
+new_stream (struct readahead_handle *h, uint64_t offset)
+{
+  struct stream *s = &h->streams[0];
+  unsigned i;
+
+  for (i = 0; i < nr_streams; ++i) {
+    if (!h->streams[i].in_use) {
+      s = &h->streams[i];
+      break;
+    }
+    if (h->streams[i].last_used < s->last_used)
+      s = &h->streams[i];
+  }
+
+  h->wasted_bytes += unread_bytes (s);
+  s->in_use = true;
+  s->last_offset = s->last_end = s->ra_end = offset;
+  s->window = readahead_min;
+  return s;
+}
+
+/* If [*start, end) begins inside a range already prefetched by
+ * another stream, skip over that part.
+ */
+static void
+skip_prefetched (struct readahead_handle *h, const struct stream *self,
+                 uint64_t *start, uint64_t end)
+{
+  bool again;
+  unsigned i;
+
+  do {
+    again = false;
+    for (i = 0; i < nr_streams; ++i) {
+      const struct stream *s = &h->streams[i];
+
+      if (s == self || !s->in_use)
+        continue;
+      if (*start >= s->last_end && *start < s->ra_end && *start < end) {
+        *start = s->ra_end;
+        again = true;
+      }
+    }
+  } while (again);
 }
 
 /* Read data. */
@@ -203,49 +488,156 @@ readahead_pread (nbdkit_next *next,
 
     size = next->get_size (next);
     if (size >= 0) {
-      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&window_lock);
-
-      /* Generate the asynchronous (background) cache command for
-       * the readahead window.
-       */
-      ra_cmd.offset = offset + count;
-      if (ra_cmd.offset < size) {
-        ra_cmd.count = MIN (window, size - ra_cmd.offset);
-        ra_cmd.next = next; /* If .next is non-NULL, we'll send it below. */
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+      const uint64_t end = offset + count;
+      struct stream *s;
+      uint64_t ra_start, ra_end;
+
+      h->reads++;
+      h->read_bytes += count;
+
+      s = find_stream (h, offset);
+      if (s) {
+        /* Account for the part of this read which was prefetched. */
+        if (offset < s->ra_end && end > s->last_end)
+          h->hit_bytes += MIN (end, s->ra_end) - MAX (offset, s->last_end);
       }
+      else
+        s = new_stream (h, offset);
 
-      /* Should we change the window size?
-       * If the last readahead < current offset, double the window.
-       * If not, but we're still making forward progress, keep the window.
-       * If we're not making forward progress, reduce the window to minimum.
+      s->last_used = ++h->clock;
+      s->last_offset = offset;
+      s->last_end = MAX (s->last_end, end);
+
+      /* Only issue a new prefetch when less than half the window
+       * remains prefetched ahead of the reader.  This avoids issuing
+       * many small overlapping prefetches for small sequential reads.
+       * Each time the stream continues like this the window is
+       * doubled.
        */
-      if (last_readahead < offset)
-        window = MIN (window * 2, READAHEAD_MAX);
-      else if (last_offset < offset)
-        /* leave window unchanged */ ;
-      else
-        window = READAHEAD_MIN;
-      last_offset = offset;
-      last_readahead = ra_cmd.offset + ra_cmd.count;
+      if (s->ra_end < end || s->ra_end - end < s->window / 2) {
+        if (s->ra_end > offset)
+          s->window = MIN (s->window * 2, readahead_max);
+
+        ra_start = MAX (s->ra_end, end);
+        ra_end = MIN (end + s->window, size);
+        skip_prefetched (h, s, &ra_start, ra_end);
+        if (ra_start < ra_end) {
+          ra_cmd.offset = ra_start;
+          ra_cmd.count = ra_end - ra_start;
+          /* If .next is non-NULL, we'll send it below. */
+          if (h->mode == MODE_CACHE)
+            ra_cmd.next = next;
+          else {
+            ra_cmd.type = CMD_PREFETCH;
+            ra_cmd.next = h->ra_next;
+            ra_cmd.buffer = &h->buffer;
+          }
+          s->ra_end = ra_end;
+          h->prefetches++;
+          h->prefetch_bytes += ra_cmd.count;
+        }
+      }
     }
 
+    if (ra_cmd.type == CMD_PREFETCH &&
+        buffer_queue (&h->buffer, ra_cmd.offset, ra_cmd.count) == -1)
+      ra_cmd.next = NULL;
+
     if (ra_cmd.next &&
-        send_command_to_background_thread (&h->ctrl, ra_cmd) == -1)
+        send_command_to_background_thread (&h->ctrl, ra_cmd) == -1) {
+      if (ra_cmd.type == CMD_PREFETCH)
+        buffer_unqueue (&h->buffer, ra_cmd.offset, ra_cmd.count);
       return -1;
+    }
   }
 
+  /* Serve the read from the buffer if possible. */
+  if (h->mode == MODE_BUFFER && buffer_read (&h->buffer, buf, count, offset))
+    return 0;
+
   /* Issue the synchronous read. */
   return next->pread (next, buf, count, offset, flags, err);
 }
 
+/* Writes must invalidate any overlapping data in the buffer, both
+ * before and after the write (see buffer_invalidate).
+ */
+static int
+readahead_pwrite (nbdkit_next *next,
+                  void *handle, const void *buf, uint32_t count,
+                  uint64_t offset, uint32_t flags, int *err)
+{
+  struct readahead_handle *h = handle;
+  int r;
+
+  if (h->mode != MODE_BUFFER)
+    return next->pwrite (next, buf, count, offset, flags, err);
+
+  if (buffer_invalidate (&h->buffer, count, offset) == -1) {
+    *err = errno;
+    return -1;
+  }
+  r = next->pwrite (next, buf, count, offset, flags, err);
+  buffer_write_done (&h->buffer, count, offset);
+  return r;
+}
+
+static int
+readahead_zero (nbdkit_next *next,
+                void *handle, uint32_t count, uint64_t offset,
+                uint32_t flags, int *err)
+{
+  struct readahead_handle *h = handle;
+  int r;
+
+  if (h->mode != MODE_BUFFER)
+    return next->zero (next, count, offset, flags, err);
+
+  if (buffer_invalidate (&h->buffer, count, offset) == -1) {
+    *err = errno;
+    return -1;
+  }
+  r = next->zero (next, count, offset, flags, err);
+  buffer_write_done (&h->buffer, count, offset);
+  return r;
+}
+
+static int
+readahead_trim (nbdkit_next *next,
+                void *handle, uint32_t count, uint64_t offset,
+                uint32_t flags, int *err)
+{
+  struct readahead_handle *h = handle;
+  int r;
+
+  if (h->mode != MODE_BUFFER)
+    return next->trim (next, count, offset, flags, err);
+
+  if (buffer_invalidate (&h->buffer, count, offset) == -1) {
+    *err = errno;
+    return -1;
+  }
+  r = next->trim (next, count, offset, flags, err);
+  buffer_write_done (&h->buffer, count, offset);
+  return r;
+}
+
 static struct nbdkit_filter filter = {
   .name              = "readahead",
   .longname          = "nbdkit readahead filter",
+  .config            = readahead_config,
+  .config_complete   = readahead_config_complete,
+  .config_help       = readahead_config_help,
   .get_ready         = readahead_get_ready,
   .open              = readahead_open,
   .close             = readahead_close,
-  .can_cache         = readahead_can_cache,
+  .prepare           = readahead_prepare,
+  .can_multi_conn    = readahead_can_multi_conn,
   .pread             = readahead_pread,
+  .pwrite            = readahead_pwrite,
+  .zero              = readahead_zero,
+  .trim              = readahead_trim,
 };
 
 NBDKIT_REGISTER_FILTER (filter)
@@ -33,16 +33,82 @@
 #ifndef NBDKIT_READAHEAD_H
 #define NBDKIT_READAHEAD_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #include <nbdkit-filter.h>
 
 #include "vector.h"
 
+/* Buffer of prefetched data (see buffer.c).  This is used when the
+ * plugin cannot prefetch itself, or does not support the parallel
+ * thread model.
+ */
+struct prefetched {
+  uint64_t offset;
+  uint32_t count;
+  char *data;
+};
+DEFINE_VECTOR_TYPE (prefetched_list, struct prefetched);
+
+struct pending {
+  uint64_t offset, end;
+};
+DEFINE_VECTOR_TYPE (pending_list, struct pending);
+
+struct ra_buffer {
+  pthread_mutex_t lock;         /* Protects the fields below. */
+  pthread_cond_t cond;          /* Signalled when a prefetch finishes. */
+  prefetched_list blocks;       /* Prefetched data, oldest first. */
+  uint64_t used;                /* Total bytes in blocks. */
+  uint64_t limit;               /* Maximum bytes in blocks. */
+  uint64_t generation;          /* Incremented when a write finishes. */
+  pending_list pending;         /* Prefetches queued or in progress. */
+  pending_list writes;          /* Writes in progress. */
+
+  /* Statistics. */
+  uint64_t hits, misses;        /* Reads served from the buffer or not. */
+};
+
+extern void buffer_init (struct ra_buffer *b, uint64_t limit);
+extern void buffer_free (struct ra_buffer *b);
+
+/* Record that a prefetch is about to be queued, or was not queued
+ * after all.  Reads overlapping the prefetch will wait for it.
+ */
+extern int buffer_queue (struct ra_buffer *b,
+                         uint64_t offset, uint32_t count);
+extern void buffer_unqueue (struct ra_buffer *b,
+                            uint64_t offset, uint32_t count);
+
+/* Read data from the plugin into the buffer.  Called from the
+ * background thread after buffer_queue.
+ */
+extern void buffer_prefetch (struct ra_buffer *b, nbdkit_next *next,
+                             uint64_t offset, uint32_t count);
+
+/* Try to satisfy a read from the buffer.  Returns true if the whole
+ * read was served from the buffer.
+ */
+extern bool buffer_read (struct ra_buffer *b,
+                         void *buf, uint32_t count, uint64_t offset);
+
+/* Discard any buffered data overlapping a write which is about to
+ * start.  Until buffer_write_done is called, prefetches overlapping
+ * the write are not buffered, and any prefetch running when the
+ * write finishes is discarded, since it may have read the old data.
+ */
+extern int buffer_invalidate (struct ra_buffer *b,
+                              uint32_t count, uint64_t offset);
+extern void buffer_write_done (struct ra_buffer *b,
+                               uint32_t count, uint64_t offset);
+
 /* List of commands issued to the background thread. */
 struct command {
-  enum { CMD_QUIT, CMD_CACHE } type;
+  enum { CMD_QUIT, CMD_CACHE, CMD_PREFETCH } type;
   nbdkit_next *next;
+  struct ra_buffer *buffer;     /* Only used by CMD_PREFETCH. */
   uint64_t offset;
   uint32_t count;
 };
@@ -35,11 +35,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <lzma.h>
 
@@ -51,6 +53,9 @@
 
 static uint64_t maxblock = 512 * 1024 * 1024;
 static uint32_t maxdepth = 8;
+static uint64_t maxcache = 1024 * 1024 * 1024;
+static bool prefetch = false;
+static int thread_model = -1; /* Thread model of the layers below. */
 
 static int
 xz_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
@@ -72,13 +77,36 @@ xz_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
     }
     return 0;
   }
+  else if (strcmp (key, "xz-cache-size") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    maxcache = (uint64_t) r;
+    return 0;
+  }
+  else if (strcmp (key, "xz-prefetch") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    prefetch = r;
+    return 0;
+  }
   else
     return next (nxdata, key, value);
 }
 
 #define xz_config_help \
   "xz-max-block=<SIZE> (optional) Maximum block size allowed (default: 512M)\n"\
-  "xz-max-depth=<N>    (optional) Maximum blocks in cache (default: 4)\n"
+  "xz-max-depth=<N>    (optional) Maximum blocks in cache (default: 8)\n" \
+  "xz-cache-size=<SIZE> (optional) Maximum size of cache (default: 1G)\n" \
+  "xz-prefetch=true    (optional) Uncompress the next block in advance"
+
+static int
+xz_get_ready (int model)
+{
+  thread_model = model;
+  return 0;
+}
 
 /* The per-connection handle. */
 struct xz_handle {
@@ -86,6 +114,19 @@ struct xz_handle {
 
   /* Block cache. */
   blkcache *c;
+
+  /* Prefetch thread, if running.  The lock protects the fields
+   * following it.
+   */
+  bool running;
+  pthread_t thread;
+  nbdkit_next *next;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool stop;
+  bool prefetch_pending;
+  uint64_t prefetch_offset;
+  uint64_t last_number;         /* Block number of the last read. */
 };
 
 /* Create the per-connection handle. */
@@ -99,13 +140,13 @@ xz_open (nbdkit_next_open *next, nbdkit_context *nxdata,
   if (next (nxdata, 1, exportname) == -1)
     return NULL;
 
-  h = malloc (sizeof *h);
+  h = calloc (1, sizeof *h);
   if (h == NULL) {
-    nbdkit_error ("malloc: %m");
+    nbdkit_error ("calloc: %m");
     return NULL;
   }
 
-  h->c = new_blkcache (maxdepth);
+  h->c = new_blkcache (maxdepth, maxcache);
   if (!h->c) {
     free (h);
     return NULL;
@@ -114,6 +155,10 @@ xz_open (nbdkit_next_open *next, nbdkit_context *nxdata,
   /* Initialized in xz_prepare. */
   h->xz = NULL;
 
+  pthread_mutex_init (&h->lock, NULL);
+  pthread_cond_init (&h->cond, NULL);
+  h->last_number = UINT64_MAX;
+
   return h;
 }
 
@@ -125,13 +170,56 @@ xz_close (void *handle)
   blkcache_stats stats;
 
   blkcache_get_stats (h->c, &stats);
-  nbdkit_debug ("cache: hits = %zu, misses = %zu", stats.hits, stats.misses);
+  nbdkit_debug ("cache: hits = %zu, misses = %zu, evictions = %zu, "
+                "max used = %" PRIu64,
+                stats.hits, stats.misses, stats.evictions, stats.max_used);
 
   xzfile_close (h->xz);
   free_blkcache (h->c);
+  pthread_mutex_destroy (&h->lock);
+  pthread_cond_destroy (&h->cond);
   free (h);
 }
 
+/* The prefetch thread uncompresses the block following the most
+ * recent sequential read into the cache, so that it is (hopefully)
+ * ready by the time the client reads it.
+ */
+static void *
+prefetch_thread (void *vp)
+{
+  struct xz_handle *h = vp;
+  uint64_t offset, number, start, size;
+  block *b;
+  char *data;
+  int err;
+
+  for (;;) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+      while (!h->stop && !h->prefetch_pending)
+        pthread_cond_wait (&h->cond, &h->lock);
+      if (h->stop)
+        break;
+      offset = h->prefetch_offset;
+      h->prefetch_pending = false;
+    }
+
+    if (xzfile_locate_block (h->xz, offset, &number, &start, &size) == -1)
+      continue;
+    b = reserve_block (h->c, number, start, size);
+    if (b == NULL)              /* Already cached or being uncompressed. */
+      continue;
+
+    nbdkit_debug ("xz: prefetching block %" PRIu64, number);
+    data = xzfile_read_block (h->xz, h->next, 0, &err, offset, &start, &size);
+    fill_block (h->c, b, data);
+    put_block (h->c, b);
+  }
+
+  return NULL;
+}
+
 static int
 xz_prepare (nbdkit_next *next, void *handle,
             int readonly)
@@ -154,6 +242,48 @@ xz_prepare (nbdkit_next *next, void *handle,
     return -1;
   }
 
+  if (prefetch) {
+    int err;
+
+    /* The prefetch thread calls into the plugin in parallel with
+     * requests from the client.
+     */
+    if (thread_model != NBDKIT_THREAD_MODEL_PARALLEL) {
+      nbdkit_debug ("xz: underlying plugin does not support "
+                    "the PARALLEL thread model, not prefetching");
+      return 0;
+    }
+
+    h->next = next;
+    err = pthread_create (&h->thread, NULL, prefetch_thread, h);
+    if (err != 0) {
+      errno = err;
+      nbdkit_error ("pthread_create: %m");
+      return -1;
+    }
+    h->running = true;
+  }
+
+  return 0;
+}
+
+/* Finalize stops the prefetch thread if it is running. */
+static int
+xz_finalize (nbdkit_next *next, void *handle)
+{
+  struct xz_handle *h = handle;
+
+  if (!h->running)
+    return 0;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+    h->stop = true;
+    pthread_cond_signal (&h->cond);
+  }
+  pthread_join (h->thread, NULL);
+  h->running = false;
+
   return 0;
 }
 
@@ -220,49 +350,90 @@ xz_can_cache (nbdkit_next *next,
   return NBDKIT_CACHE_EMULATE;
 }
 
-/* Read data from the file. */
+/* If the client has moved sequentially from one block to the next,
+ * ask the prefetch thread to uncompress the block after.
+ */
+static void
+maybe_prefetch (struct xz_handle *h, uint64_t number, uint64_t next_offset)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+
+  if (number == h->last_number + 1 &&
+      next_offset < xzfile_get_size (h->xz)) {
+    h->prefetch_offset = next_offset;
+    h->prefetch_pending = true;
+    pthread_cond_signal (&h->cond);
+  }
+  h->last_number = number;
+}
+
+/* Read data from the file.
+ *
+ * This may be called in parallel.  Different blocks are uncompressed
+ * concurrently, while threads wanting the same block wait for the
+ * first one to uncompress it.
+ */
 static int
 xz_pread (nbdkit_next *next,
           void *handle, void *buf, uint32_t count, uint64_t offset,
           uint32_t flags, int *err)
 {
   struct xz_handle *h = handle;
+  block *b;
+  bool fill;
   char *data;
-  uint64_t start, size;
+  uint64_t number, start, size;
   uint32_t n;
 
-  /* Find the block in the cache. */
-  data = get_block (h->c, offset, &start, &size);
-  if (!data) {
-    /* Not in the cache.  We need to read the block from the xz file. */
-    data = xzfile_read_block (h->xz, next, flags, err,
-                              offset, &start, &size);
-    if (data == NULL)
-      return -1;
-    put_block (h->c, start, size, data);
-  }
-
   /* It's possible if the blocks are really small or oddly aligned or
-   * if the requests are large that we need to read the following
-   * block to satisfy the request.
+   * if the requests are large that we need to read several blocks to
+   * satisfy the request.
    */
-  n = count;
-  if (start + size - offset < n)
-    n = start + size - offset;
+  while (count > 0) {
+    if (xzfile_locate_block (h->xz, offset, &number, &start, &size) == -1) {
+      nbdkit_error ("cannot find offset %" PRIu64 " in the xz file", offset);
+      *err = EIO;
+      return -1;
+    }
 
-  memcpy (buf, &data[offset-start], n);
-  buf += n;
-  count -= n;
-  offset += n;
-  if (count > 0)
-    return xz_pread (next, h, buf, count, offset, flags, err);
+    /* Find the block in the cache. */
+    b = get_block (h->c, number, start, size, &fill);
+    if (b == NULL) {
+      *err = errno;
+      return -1;
+    }
+    if (fill) {
+      /* Not in the cache.  We need to read the block from the xz file. */
+      data = xzfile_read_block (h->xz, next, flags, err,
+                                offset, &start, &size);
+      fill_block (h->c, b, data);
+      if (data == NULL) {
+        put_block (h->c, b);
+        return -1;
+      }
+    }
+
+    if (h->running)
+      maybe_prefetch (h, number, start + size);
+
+    n = count;
+    if (start + size - offset < n)
+      n = start + size - offset;
+
+    memcpy (buf, &block_data (b)[offset-start], n);
+    put_block (h->c, b);
+
+    buf += n;
+    count -= n;
+    offset += n;
+  }
 
   return 0;
 }
 
 static int xz_thread_model (void)
 {
-  return NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS;
+  return NBDKIT_THREAD_MODEL_PARALLEL;
 }
 
 static struct nbdkit_filter filter = {
@@ -271,9 +442,11 @@ static struct nbdkit_filter filter = {
   .config             = xz_config,
   .config_help        = xz_config_help,
   .thread_model       = xz_thread_model,
+  .get_ready          = xz_get_ready,
   .open               = xz_open,
   .close              = xz_close,
   .prepare            = xz_prepare,
+  .finalize           = xz_finalize,
   .export_description = xz_export_description,
   .get_size           = xz_get_size,
   .can_write          = xz_can_write,
@@ -346,6 +346,22 @@ xzfile_get_size (xzfile *xz)
   return lzma_index_uncompressed_size (xz->idx);
 }
 
+int
+xzfile_locate_block (xzfile *xz, uint64_t offset,
+                     uint64_t *number, uint64_t *start, uint64_t *size)
+{
+  lzma_index_iter iter;
+
+  lzma_index_iter_init (&iter, xz->idx);
+  if (lzma_index_iter_locate (&iter, offset))
+    return -1;
+
+  *number = iter.block.number_in_file;
+  *start = iter.block.uncompressed_file_offset;
+  *size = iter.block.uncompressed_size;
+  return 0;
+}
+
 char *
 xzfile_read_block (xzfile *xz,
                    nbdkit_next *next,
@@ -51,6 +51,15 @@ extern uint64_t xzfile_max_uncompressed_block_size (xzfile *);
 /* Get the total uncompressed size of the file. */
 extern uint64_t xzfile_get_size (xzfile *);
 
+/* Find the xz file block that contains the byte at 'offset' in the
+ * uncompressed file.  The block number and the start offset & size
+ * of the block relative to the uncompressed file are returned.
+ * Returns -1 if the offset is beyond the end of the file.
+ */
+extern int xzfile_locate_block (xzfile *xz, uint64_t offset,
+                                uint64_t *number,
+                                uint64_t *start, uint64_t *size);
+
 /* Read the xz file block that contains the byte at 'offset' in the
  * uncompressed file.
  *
@@ -60,6 +69,8 @@ extern uint64_t xzfile_get_size (xzfile *);
  *
  * The start offset & size of the block relative to the uncompressed
  * file are returned in *start and *size.
+ *
+ * This may be called from multiple threads at the same time.
  */
 extern char *xzfile_read_block (xzfile *xz,
                                 nbdkit_next *next,
@@ -0,0 +1,423 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "zstdfile.h"
+#include "array-size.h"
+#include "blkcache.h"
+#include "cleanup.h"
+#include "minmax.h"
+
+static uint64_t maxframe = 512 * 1024 * 1024;
+static uint64_t maxcache = 1024 * 1024 * 1024;
+static unsigned nr_threads = 4;
+static int thread_model = -1; /* Thread model of the layers below. */
+
+/* Most frames uncompressed in parallel by a single request. */
+#define MAX_THREADS 64
+
+static int
+zstd_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
+             const char *key, const char *value)
+{
+  if (strcmp (key, "zstd-max-frame") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    maxframe = (uint64_t) r;
+    return 0;
+  }
+  else if (strcmp (key, "zstd-cache-size") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    maxcache = (uint64_t) r;
+    return 0;
+  }
+  else if (strcmp (key, "zstd-threads") == 0) {
+    if (nbdkit_parse_unsigned ("zstd-threads", value, &nr_threads) == -1)
+      return -1;
+    if (nr_threads == 0 || nr_threads > MAX_THREADS) {
+      nbdkit_error ("'zstd-threads' parameter must be between 1 and %d",
+                    MAX_THREADS);
+      return -1;
+    }
+    return 0;
+  }
+  else
+    return next (nxdata, key, value);
+}
+
+#define zstd_config_help \
+  "zstd-max-frame=<SIZE> (optional) Maximum frame size allowed (default: 512M)\n"\
+  "zstd-cache-size=<SIZE> (optional) Maximum size of cache (default: 1G)\n" \
+  "zstd-threads=<N>     (optional) Threads for large reads (default: 4)"
+
+static int
+zstd_get_ready (int model)
+{
+  thread_model = model;
+  return 0;
+}
+
+/* The per-connection handle. */
+struct zstd_handle {
+  zstdfile *zf;
+
+  /* Frame cache. */
+  blkcache *c;
+};
+
+/* Create the per-connection handle. */
+static void *
+zstd_open (nbdkit_next_open *next, nbdkit_context *nxdata,
+           int readonly, const char *exportname, int is_tls)
+{
+  struct zstd_handle *h;
+
+  /* Always pass readonly=1 to the underlying plugin. */
+  if (next (nxdata, 1, exportname) == -1)
+    return NULL;
+
+  h = malloc (sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+
+  /* The cache is bounded by size, not by the number of frames. */
+  h->c = new_blkcache (SIZE_MAX, maxcache);
+  if (!h->c) {
+    free (h);
+    return NULL;
+  }
+
+  /* Initialized in zstd_prepare. */
+  h->zf = NULL;
+
+  return h;
+}
+
+/* Free up the per-connection handle. */
+static void
+zstd_close (void *handle)
+{
+  struct zstd_handle *h = handle;
+  blkcache_stats stats;
+
+  blkcache_get_stats (h->c, &stats);
+  nbdkit_debug ("cache: hits = %zu, misses = %zu, evictions = %zu, "
+                "max used = %" PRIu64,
+                stats.hits, stats.misses, stats.evictions, stats.max_used);
+
+  zstdfile_close (h->zf);
+  free_blkcache (h->c);
+  free (h);
+}
+
+static int
+zstd_prepare (nbdkit_next *next, void *handle,
+              int readonly)
+{
+  struct zstd_handle *h = handle;
+
+  h->zf = zstdfile_open (next);
+  if (!h->zf)
+    return -1;
+
+  if (maxframe < zstdfile_max_uncompressed_frame_size (h->zf)) {
+    nbdkit_error ("zstd file largest frame is bigger than maxframe\n"
+                  "Either recompress the zstd file with smaller frames "
+                  "(see nbdkit-zstd-filter(1))\n"
+                  "or make maxframe parameter bigger.\n"
+                  "maxframe = %" PRIu64 " (bytes)\n"
+                  "largest frame in zstd file = %" PRIu64 " (bytes)",
+                  maxframe,
+                  zstdfile_max_uncompressed_frame_size (h->zf));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Description. */
+static const char *
+zstd_export_description (nbdkit_next *next,
+                         void *handle)
+{
+  const char *base = next->export_description (next);
+
+  if (!base)
+    return NULL;
+  return nbdkit_printf_intern ("expansion of zstd-compressed image: %s", base);
+}
+
+/* Get the file size. */
+static int64_t
+zstd_get_size (nbdkit_next *next, void *handle)
+{
+  struct zstd_handle *h = handle;
+
+  return zstdfile_get_size (h->zf);
+}
+
+/* See the comment in the xz filter. */
+static int
+zstd_can_write (nbdkit_next *next,
+                void *handle)
+{
+  return 0;
+}
+
+/* Whatever the plugin says, this filter is consistent across connections. */
+static int
+zstd_can_multi_conn (nbdkit_next *next,
+                     void *handle)
+{
+  return 1;
+}
+
+static int
+zstd_can_extents (nbdkit_next *next,
+                  void *handle)
+{
+  return 0;
+}
+
+/* We are already operating as a cache regardless of the plugin's
+ * underlying .can_cache, but it's easiest to just rely on nbdkit's
+ * behavior of calling .pread for caching.
+ */
+static int
+zstd_can_cache (nbdkit_next *next,
+                void *handle)
+{
+  return NBDKIT_CACHE_EMULATE;
+}
+
+/* Frames which a single request has reserved in the cache and must
+ * uncompress.
+ */
+struct job {
+  uint64_t number;
+  block *b;
+};
+
+struct jobs {
+  struct zstd_handle *h;
+  nbdkit_next *next;
+  struct job *jobs;
+  size_t nr_jobs;
+  pthread_mutex_t lock;
+  size_t next_job;              /* Protected by lock. */
+};
+
+/* Uncompress jobs until there are none left.  Errors are not
+ * reported here: the frame is left out of the cache and the read
+ * which follows will uncompress it again and report the error.
+ */
+static void *
+run_jobs (void *vp)
+{
+  struct jobs *jobs = vp;
+  struct job *job;
+  char *data;
+  int err;
+
+  for (;;) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&jobs->lock);
+      if (jobs->next_job >= jobs->nr_jobs)
+        break;
+      job = &jobs->jobs[jobs->next_job++];
+    }
+
+    data = zstdfile_read_frame (jobs->h->zf, jobs->next, job->number, &err);
+    fill_block (jobs->h->c, job->b, data);
+    put_block (jobs->h->c, job->b);
+  }
+
+  return NULL;
+}
+
+/* For a request which covers several frames that are not in the
+ * cache, uncompress them in parallel into the cache before the
+ * request copies them out.
+ */
+static void
+prefill_frames (nbdkit_next *next, struct zstd_handle *h,
+                uint64_t first, uint64_t last)
+{
+  struct job jobs_array[MAX_THREADS * 4];
+  struct jobs jobs = {
+    .h = h, .next = next, .jobs = jobs_array, .nr_jobs = 0,
+    .lock = PTHREAD_MUTEX_INITIALIZER, .next_job = 0,
+  };
+  pthread_t threads[MAX_THREADS];
+  size_t i, nr_started = 0;
+  uint64_t number, start, size;
+  int err;
+
+  /* reserve_block never waits, so this cannot deadlock with another
+   * request doing the same thing.
+   */
+  for (number = first;
+       number <= last && jobs.nr_jobs < ARRAY_SIZE (jobs_array);
+       ++number) {
+    block *b;
+
+    zstdfile_frame_extent (h->zf, number, &start, &size);
+    b = reserve_block (h->c, number, start, size);
+    if (b) {
+      jobs.jobs[jobs.nr_jobs].number = number;
+      jobs.jobs[jobs.nr_jobs].b = b;
+      jobs.nr_jobs++;
+    }
+  }
+  if (jobs.nr_jobs == 0)
+    return;
+
+  for (i = 0; i < MIN (nr_threads, jobs.nr_jobs) - 1; ++i) {
+    err = pthread_create (&threads[i], NULL, run_jobs, &jobs);
+    if (err != 0)
+      break;                    /* Not fatal, this thread does the rest. */
+    nr_started++;
+  }
+  run_jobs (&jobs);
+  for (i = 0; i < nr_started; ++i)
+    pthread_join (threads[i], NULL);
+  pthread_mutex_destroy (&jobs.lock);
+}
+
+/* Read data from the file. */
+static int
+zstd_pread (nbdkit_next *next,
+            void *handle, void *buf, uint32_t count, uint64_t offset,
+            uint32_t flags, int *err)
+{
+  struct zstd_handle *h = handle;
+  block *b;
+  bool fill;
+  char *data;
+  uint64_t number, last, start, size;
+  uint32_t n;
+
+  if (zstdfile_locate_frame (h->zf, offset, &number, &start, &size) == -1 ||
+      zstdfile_locate_frame (h->zf, offset + count - 1,
+                             &last, &start, &size) == -1) {
+    nbdkit_error ("cannot find offset %" PRIu64 " in the zstd file", offset);
+    *err = EIO;
+    return -1;
+  }
+
+  /* Uncompressing frames in parallel calls into the plugin from
+   * several threads, so only do it if the plugin allows it.
+   */
+  if (last > number && nr_threads > 1 &&
+      thread_model == NBDKIT_THREAD_MODEL_PARALLEL)
+    prefill_frames (next, h, number, last);
+
+  while (count > 0) {
+    if (zstdfile_locate_frame (h->zf, offset,
+                               &number, &start, &size) == -1) {
+      nbdkit_error ("cannot find offset %" PRIu64 " in the zstd file",
+                    offset);
+      *err = EIO;
+      return -1;
+    }
+
+    /* Find the frame in the cache. */
+    b = get_block (h->c, number, start, size, &fill);
+    if (b == NULL) {
+      *err = errno;
+      return -1;
+    }
+    if (fill) {
+      /* Not in the cache.  We need to read the frame from the file. */
+      data = zstdfile_read_frame (h->zf, next, number, err);
+      fill_block (h->c, b, data);
+      if (data == NULL) {
+        put_block (h->c, b);
+        return -1;
+      }
+    }
+
+    n = MIN (count, start + size - offset);
+    memcpy (buf, &block_data (b)[offset-start], n);
+    put_block (h->c, b);
+
+    buf += n;
+    count -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+
+static int
+zstd_thread_model (void)
+{
+  return NBDKIT_THREAD_MODEL_PARALLEL;
+}
+
+static struct nbdkit_filter filter = {
+  .name               = "zstd",
+  .longname           = "nbdkit zstd filter",
+  .config             = zstd_config,
+  .config_help        = zstd_config_help,
+  .thread_model       = zstd_thread_model,
+  .get_ready          = zstd_get_ready,
+  .open               = zstd_open,
+  .close              = zstd_close,
+  .prepare            = zstd_prepare,
+  .export_description = zstd_export_description,
+  .get_size           = zstd_get_size,
+  .can_write          = zstd_can_write,
+  .can_extents        = zstd_can_extents,
+  .can_cache          = zstd_can_cache,
+  .can_multi_conn     = zstd_can_multi_conn,
+  .pread              = zstd_pread,
+};
+
+NBDKIT_REGISTER_FILTER (filter)
@@ -0,0 +1,332 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Parse the zstd seekable format.
+ *
+ * A seekable zstd file is a series of independent zstd frames
+ * followed by a skippable frame containing the seek table:
+ *
+ *   Skippable_Magic_Number          4 bytes LE, 0x184D2A5E
+ *   Frame_Size                      4 bytes LE
+ *   Seek_Table_Entries              Number_Of_Frames entries of
+ *     Compressed_Size               4 bytes LE
+ *     Decompressed_Size             4 bytes LE
+ *     [Checksum]                    4 bytes LE, if Checksum_Flag
+ *   Number_Of_Frames                4 bytes LE
+ *   Seek_Table_Descriptor           1 byte
+ *   Seekable_Magic_Number           4 bytes LE, 0x8F92EAB1
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include <nbdkit-filter.h>
+
+#include <zstd.h>
+
+#include "byte-swapping.h"
+#include "cleanup.h"
+#include "minmax.h"
+#include "vector.h"
+
+#include "zstdfile.h"
+
+#define SKIPPABLE_MAGIC 0x184D2A5E
+#define SEEKABLE_MAGIC  0x8F92EAB1
+#define FOOTER_SIZE     9
+#define SKIPPABLE_HEADER_SIZE 8
+#define CHECKSUM_FLAG   0x80
+#define RESERVED_BITS   0x7c
+
+/* Largest read from the plugin. */
+#define READ_SIZE (4 * 1024 * 1024)
+
+struct frame {
+  uint64_t compressed_offset;
+  uint64_t uncompressed_offset;
+  uint32_t compressed_size;
+  uint32_t uncompressed_size;
+};
+DEFINE_VECTOR_TYPE (frames, struct frame);
+
+struct zstdfile {
+  frames frames;
+  uint64_t size;
+  uint64_t max_uncompressed_frame_size;
+};
+
+static uint32_t
+get_le32 (const uint8_t *p)
+{
+  uint32_t v;
+
+  memcpy (&v, p, sizeof v);
+  return le32toh (v);
+}
+
+zstdfile *
+zstdfile_open (nbdkit_next *next)
+{
+  zstdfile *zf;
+  int64_t file_size;
+  uint8_t footer[FOOTER_SIZE];
+  uint8_t header[SKIPPABLE_HEADER_SIZE];
+  CLEANUP_FREE uint8_t *table = NULL;
+  uint32_t nr_frames, i;
+  uint8_t descriptor;
+  size_t entry_size;
+  uint64_t table_size, coffs = 0, uoffs = 0;
+  int err;
+
+  zf = calloc (1, sizeof *zf);
+  if (zf == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
+  file_size = next->get_size (next);
+  if (file_size == -1)
+    goto err;
+  if (file_size < SKIPPABLE_HEADER_SIZE + FOOTER_SIZE) {
+    nbdkit_error ("zstd: file too short");
+    goto err;
+  }
+
+  /* Read the seek table footer. */
+  if (next->pread (next, footer, FOOTER_SIZE, file_size - FOOTER_SIZE,
+                   0, &err) == -1) {
+    nbdkit_error ("zstd: could not read seek table footer: error %d", err);
+    goto err;
+  }
+  if (get_le32 (&footer[5]) != SEEKABLE_MAGIC) {
+    nbdkit_error ("zstd: not a seekable zstd file "
+                  "(see nbdkit-zstd-filter(1))");
+    goto err;
+  }
+  nr_frames = get_le32 (&footer[0]);
+  descriptor = footer[4];
+  if (descriptor & RESERVED_BITS) {
+    nbdkit_error ("zstd: seek table descriptor has reserved bits set");
+    goto err;
+  }
+  entry_size = descriptor & CHECKSUM_FLAG ? 12 : 8;
+
+  /* Read the whole seek table including the skippable frame header. */
+  table_size = (uint64_t) nr_frames * entry_size;
+  if (table_size + SKIPPABLE_HEADER_SIZE + FOOTER_SIZE > file_size) {
+    nbdkit_error ("zstd: seek table is larger than the file");
+    goto err;
+  }
+  if (next->pread (next, header, SKIPPABLE_HEADER_SIZE,
+                   file_size - FOOTER_SIZE - table_size -
+                   SKIPPABLE_HEADER_SIZE, 0, &err) == -1) {
+    nbdkit_error ("zstd: could not read seek table: error %d", err);
+    goto err;
+  }
+  if (get_le32 (&header[0]) != SKIPPABLE_MAGIC ||
+      get_le32 (&header[4]) != table_size + FOOTER_SIZE) {
+    nbdkit_error ("zstd: seek table frame header is corrupt");
+    goto err;
+  }
+  table = malloc (table_size ? table_size : 1);
+  if (table == NULL) {
+    nbdkit_error ("malloc: %m");
+    goto err;
+  }
+  if (table_size > 0 &&
+      next->pread (next, table, table_size,
+                   file_size - FOOTER_SIZE - table_size, 0, &err) == -1) {
+    nbdkit_error ("zstd: could not read seek table: error %d", err);
+    goto err;
+  }
+
+  if (frames_reserve (&zf->frames, nr_frames) == -1) {
+    nbdkit_error ("realloc: %m");
+    goto err;
+  }
+  for (i = 0; i < nr_frames; ++i) {
+    struct frame f = {
+      .compressed_offset = coffs,
+      .uncompressed_offset = uoffs,
+      .compressed_size = get_le32 (&table[i * entry_size]),
+      .uncompressed_size = get_le32 (&table[i * entry_size + 4]),
+    };
+
+    coffs += f.compressed_size;
+    uoffs += f.uncompressed_size;
+    if (f.uncompressed_size > zf->max_uncompressed_frame_size)
+      zf->max_uncompressed_frame_size = f.uncompressed_size;
+    frames_append (&zf->frames, f); /* cannot fail, reserved above */
+  }
+
+  /* The frames should exactly fill the file up to the seek table. */
+  if (coffs != file_size - FOOTER_SIZE - table_size - SKIPPABLE_HEADER_SIZE) {
+    nbdkit_error ("zstd: seek table does not match the file size");
+    goto err;
+  }
+  zf->size = uoffs;
+
+  nbdkit_debug ("zstd: size %" PRIu64 " bytes (%.1fM)",
+                zf->size, zf->size / 1024.0 / 1024.0);
+  nbdkit_debug ("zstd: %zu frames", zf->frames.len);
+  nbdkit_debug ("zstd: maximum uncompressed frame size %" PRIu64
+                " bytes (%.1fM)",
+                zf->max_uncompressed_frame_size,
+                zf->max_uncompressed_frame_size / 1024.0 / 1024.0);
+
+  return zf;
+
+ err:
+  zstdfile_close (zf);
+  return NULL;
+}
+
+void
+zstdfile_close (zstdfile *zf)
+{
+  if (zf) {
+    frames_reset (&zf->frames);
+    free (zf);
+  }
+}
+
+size_t
+zstdfile_nr_frames (zstdfile *zf)
+{
+  return zf->frames.len;
+}
+
+uint64_t
+zstdfile_max_uncompressed_frame_size (zstdfile *zf)
+{
+  return zf->max_uncompressed_frame_size;
+}
+
+uint64_t
+zstdfile_get_size (zstdfile *zf)
+{
+  return zf->size;
+}
+
+int
+zstdfile_locate_frame (zstdfile *zf, uint64_t offset,
+                       uint64_t *number, uint64_t *start, uint64_t *size)
+{
+  size_t lo = 0, hi = zf->frames.len;
+
+  if (offset >= zf->size)
+    return -1;
+
+  /* Find the last frame starting at or before offset.  This skips
+   * empty frames because the following frame starts at the same
+   * offset.
+   */
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (zf->frames.ptr[mid].uncompressed_offset <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  *number = lo;
+  *start = zf->frames.ptr[lo].uncompressed_offset;
+  *size = zf->frames.ptr[lo].uncompressed_size;
+  return 0;
+}
+
+void
+zstdfile_frame_extent (zstdfile *zf, uint64_t number,
+                       uint64_t *start, uint64_t *size)
+{
+  *start = zf->frames.ptr[number].uncompressed_offset;
+  *size = zf->frames.ptr[number].uncompressed_size;
+}
+
+char *
+zstdfile_read_frame (zstdfile *zf, nbdkit_next *next,
+                     uint64_t number, int *err)
+{
+  const struct frame *f = &zf->frames.ptr[number];
+  CLEANUP_FREE char *in = NULL;
+  char *data;
+  uint32_t n, offs;
+  size_t r;
+
+  in = malloc (MAX (f->compressed_size, 1));
+  data = malloc (MAX (f->uncompressed_size, 1));
+  if (in == NULL || data == NULL) {
+    *err = errno;
+    nbdkit_error ("malloc: %m\n"
+                  "NOTE: If this error occurs, you need to recompress your "
+                  "zstd files with a smaller frame size.");
+    free (data);
+    return NULL;
+  }
+
+  for (offs = 0; offs < f->compressed_size; offs += n) {
+    n = MIN (READ_SIZE, f->compressed_size - offs);
+    if (next->pread (next, &in[offs], n, f->compressed_offset + offs,
+                     0, err) == -1) {
+      nbdkit_error ("zstd: read: error %d", *err);
+      free (data);
+      return NULL;
+    }
+  }
+
+  r = ZSTD_decompress (data, f->uncompressed_size, in, f->compressed_size);
+  if (ZSTD_isError (r)) {
+    nbdkit_error ("zstd: frame %" PRIu64 ": %s",
+                  number, ZSTD_getErrorName (r));
+    *err = EIO;
+    free (data);
+    return NULL;
+  }
+  if (r != f->uncompressed_size) {
+    nbdkit_error ("zstd: frame %" PRIu64 ": uncompressed size %zu does not "
+                  "match the seek table (%" PRIu32 ")",
+                  number, r, f->uncompressed_size);
+    *err = EIO;
+    free (data);
+    return NULL;
+  }
+
+  return data;
+}
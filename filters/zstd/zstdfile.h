@@ -0,0 +1,83 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Parse the zstd seekable format, see:
+ * https://github.com/facebook/zstd/blob/dev/contrib/seekable_format/zstd_seekable_compression_format.md
+ */
+
+#ifndef NBDKIT_ZSTDFILE_H
+#define NBDKIT_ZSTDFILE_H
+
+#include <nbdkit-filter.h>
+
+typedef struct zstdfile zstdfile;
+
+/* Open the seekable zstd file and read the seek table. */
+extern zstdfile *zstdfile_open (nbdkit_next *next);
+
+/* Close the file and free up all resources. */
+extern void zstdfile_close (zstdfile *);
+
+/* Get the number of frames. */
+extern size_t zstdfile_nr_frames (zstdfile *);
+
+/* Get (uncompressed) size of the largest frame in the file. */
+extern uint64_t zstdfile_max_uncompressed_frame_size (zstdfile *);
+
+/* Get the total uncompressed size of the file. */
+extern uint64_t zstdfile_get_size (zstdfile *);
+
+/* Find the frame that contains the byte at 'offset' in the
+ * uncompressed file.  The frame number and the start offset & size
+ * of the frame relative to the uncompressed file are returned.
+ * Returns -1 if the offset is beyond the end of the file.
+ */
+extern int zstdfile_locate_frame (zstdfile *zf, uint64_t offset,
+                                  uint64_t *number,
+                                  uint64_t *start, uint64_t *size);
+
+/* Get the start offset & size of frame 'number' relative to the
+ * uncompressed file.
+ */
+extern void zstdfile_frame_extent (zstdfile *zf, uint64_t number,
+                                   uint64_t *start, uint64_t *size);
+
+/* Read and uncompress frame 'number'.  The uncompressed frame is
+ * returned, which the caller must free.  NULL is returned if there
+ * was an error.
+ *
+ * This may be called from multiple threads at the same time.
+ */
+extern char *zstdfile_read_frame (zstdfile *zf, nbdkit_next *next,
+                                  uint64_t number, int *err);
+
+#endif /* NBDKIT_ZSTDFILE_H */
@@ -30,24 +30,16 @@
  * SUCH DAMAGE.
  */
 
-#ifndef NBDKIT_BLKCACHE_H
-#define NBDKIT_BLKCACHE_H
+#ifndef NBDKIT_VERSION_H
+#define NBDKIT_VERSION_H
 
-typedef struct blkcache blkcache;
+#if !defined (NBDKIT_PLUGIN_H) && !defined (NBDKIT_FILTER_H)
+#error this header file should not be directly included
+#endif
 
-typedef struct blkcache_stats {
-  size_t hits;
-  size_t misses;
-} blkcache_stats;
+#define NBDKIT_VERSION_MAJOR 1
+#define NBDKIT_VERSION_MINOR 33
+#define NBDKIT_VERSION_MICRO 11
+#define NBDKIT_VERSION_STRING "1.33.11"
 
-extern blkcache *new_blkcache (size_t maxdepth);
-extern void free_blkcache (blkcache *) __attribute__ ((__nonnull__ (1)));
-extern char *get_block (blkcache *, uint64_t offset,
-                        uint64_t *start, uint64_t *size)
-  __attribute__ ((__nonnull__ (1, 3, 4)));
-extern int put_block (blkcache *, uint64_t start, uint64_t size, char *data)
-  __attribute__ ((__nonnull__ (1, 4)));
-extern void blkcache_get_stats (blkcache *, blkcache_stats *ret)
-  __attribute__ ((__nonnull__ (1, 2)));
-
-#endif /* NBDKIT_XZFILE_H */
+#endif /* NBDKIT_VERSION_H */
@@ -34,7 +34,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include <blkio.h>
 
@@ -42,15 +48,24 @@
 #include <nbdkit-plugin.h>
 
 #include "array-size.h"
+#include "cleanup.h"
 #include "const-string-vector.h"
+#include "rounding.h"
 #include "vector.h"
 
 #define MAX_BOUNCE_BUFFER (64 * 1024 * 1024)
 
-/* libblkio could do parallel, but we would need to reimplement this
- * plugin to use the libblkio event model.
+/* The bounce buffer of each queue is divided into slots so that
+ * several requests can be in flight on the queue.  Requests larger
+ * than a slot use several adjacent slots.
  */
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+#define BOUNCE_SLOTS 16
+#define BOUNCE_SLOT_SIZE (MAX_BOUNCE_BUFFER / BOUNCE_SLOTS)
+
+/* Requests are submitted to libblkio queues without waiting, and a
+ * completion thread per queue reaps them (see "event model" below).
+ */
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 struct property {
   const char *name;
@@ -163,11 +178,210 @@ bio_config_complete (void)
   "PROPERTY=VALUE             Set arbitrary libblkio property.\n" \
   "get=PROPERTY               Print property name after connection."
 
+/* The libblkio event model.
+ *
+ * libblkio queues are not thread safe, so each queue (there are
+ * num-queues of them, default 1) has a lock which is held while
+ * requests are added to it and while completions are reaped from it.
+ * nbdkit worker threads are spread across the queues round robin.  A
+ * worker thread enqueues its request, submits it without waiting
+ * (blkioq_do_io with max_completions = 0), and then sleeps on the
+ * queue condition.  Each queue has a completion thread which polls
+ * the queue's completion fd, reaps all available completions, marks
+ * the corresponding requests done and wakes the waiters.  This keeps
+ * as many requests in flight as there are nbdkit threads.
+ */
+struct request {
+  bool done;                    /* set by the completion thread */
+  int ret;                      /* blkio_completion.ret */
+};
+
+struct queue {
+  struct blkioq *q;
+  int completion_fd;
+  int stop_fd;                  /* becomes readable when closing */
+  pthread_t thread;             /* completion thread */
+
+  /* The lock protects q and all the fields below. */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;          /* broadcast when requests complete */
+  bool broken;                  /* reaping failed, fail all requests */
+
+  /* Bounce buffer if the driver needs memory regions, and the
+   * bitmap of the slots of it which are in use.
+   */
+  struct blkio_mem_region mem_region;
+  uint32_t busy_slots;
+};
+
 struct handle {
   struct blkio *b;
-  struct blkio_mem_region mem_region;
+  int stop_fds[2];              /* pipe used to stop completion threads */
+  struct queue *queues;
+  size_t nr_queues;             /* number of queues initialized */
+  size_t nr_threads;            /* number of completion threads running */
+  _Atomic size_t next_queue;    /* for round robin */
 };
 
+/* Completion thread, one per queue. */
+static void *
+completion_thread (void *vp)
+{
+  struct queue *q = vp;
+  struct blkio_completion completions[64];
+  uint64_t v;
+  int n;
+
+  for (;;) {
+    struct pollfd fds[2] = {
+      [0].fd = q->completion_fd,
+      [0].events = POLLIN,
+      [1].fd = q->stop_fd,
+      [1].events = POLLIN,
+    };
+
+    if (poll (fds, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      nbdkit_error ("poll: %m");
+      break;
+    }
+    if (fds[1].revents)
+      return NULL;
+
+    /* Reset the completion fd before reaping so that we cannot miss
+     * the notification for a completion which arrives while we are
+     * reaping.
+     */
+    if (read (q->completion_fd, &v, sizeof v) == -1 && errno != EAGAIN) {
+      nbdkit_error ("read: completion fd: %m");
+      break;
+    }
+
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&q->lock);
+    do {
+      int i;
+
+      n = blkioq_do_io (q->q, completions, 0, ARRAY_SIZE (completions),
+                        NULL);
+      if (n < 0) {
+        nbdkit_error ("blkioq_do_io: %s", blkio_get_error_msg ());
+        q->broken = true;
+        pthread_cond_broadcast (&q->cond);
+        return NULL;
+      }
+      for (i = 0; i < n; ++i) {
+        struct request *req = completions[i].user_data;
+
+        req->ret = completions[i].ret;
+        req->done = true;
+      }
+      if (n > 0)
+        pthread_cond_broadcast (&q->cond);
+    } while (n == ARRAY_SIZE (completions));
+  }
+
+  /* Fail any waiters rather than leaving them hanging. */
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&q->lock);
+  q->broken = true;
+  pthread_cond_broadcast (&q->cond);
+  return NULL;
+}
+
+/* Submit the requests added to the queue and wait for req to
+ * complete.  Must be called with q->lock held.
+ */
+static int
+submit_and_wait (struct queue *q, struct request *req, const char *what)
+{
+  int r;
+
+  r = blkioq_do_io (q->q, NULL, 0, 0, NULL);
+  if (r < 0) {
+    nbdkit_error ("blkioq_do_io: %s", blkio_get_error_msg ());
+    return -1;
+  }
+
+  while (!req->done && !q->broken)
+    pthread_cond_wait (&q->cond, &q->lock);
+  if (!req->done) {
+    nbdkit_error ("%s: queue failed", what);
+    return -1;
+  }
+  if (req->ret != 0) {
+    nbdkit_error ("blkioq_do_io: unexpected %s completion.ret %d != 0",
+                  what, req->ret);
+    return -1;
+  }
+  return 0;
+}
+
+/* Pick the queue for the next request. */
+static struct queue *
+get_queue (struct handle *h)
+{
+  return &h->queues[h->next_queue++ % h->nr_queues];
+}
+
+/* Acquire enough adjacent slots of the queue's bounce buffer for
+ * count bytes, waiting if they are all in use, and release them.
+ * The slots are returned in *slots.  Must be called with q->lock
+ * held.
+ */
+static void *
+get_mem_region (struct queue *q, uint32_t count, uint32_t *slots)
+{
+  const unsigned n = count > 0 ? DIV_ROUND_UP (count, BOUNCE_SLOT_SIZE) : 1;
+  const uint32_t mask = (UINT32_C (1) << n) - 1;
+  unsigned i;
+
+  for (;;) {
+    for (i = 0; i + n <= BOUNCE_SLOTS; ++i) {
+      if ((q->busy_slots & (mask << i)) == 0) {
+        *slots = mask << i;
+        q->busy_slots |= *slots;
+        return (char *) q->mem_region.addr + i * BOUNCE_SLOT_SIZE;
+      }
+    }
+    pthread_cond_wait (&q->cond, &q->lock);
+  }
+}
+
+static void
+put_mem_region (struct queue *q, uint32_t slots)
+{
+  q->busy_slots &= ~slots;
+  pthread_cond_broadcast (&q->cond);
+}
+
+/* Stop the completion threads and free the handle. */
+static void
+free_handle (struct handle *h)
+{
+  size_t i;
+  char c = 0;
+
+  if (h->nr_threads > 0 && write (h->stop_fds[1], &c, 1) == -1)
+    nbdkit_debug ("write: stop pipe: %m");
+  for (i = 0; i < h->nr_threads; ++i) {
+    if ((errno = pthread_join (h->queues[i].thread, NULL)) != 0)
+      nbdkit_debug ("pthread_join: %m");
+  }
+  for (i = 0; i < h->nr_queues; ++i) {
+    pthread_mutex_destroy (&h->queues[i].lock);
+    pthread_cond_destroy (&h->queues[i].cond);
+  }
+  if (h->stop_fds[0] >= 0)
+    close (h->stop_fds[0]);
+  if (h->stop_fds[1] >= 0)
+    close (h->stop_fds[1]);
+  /* This also frees the memory regions. */
+  if (h->b)
+    blkio_destroy (&h->b);
+  free (h->queues);
+  free (h);
+}
+
 /* Create the per-connection handle. */
 static void *
 bio_open (int readonly)
@@ -176,12 +390,14 @@ bio_open (int readonly)
   int r;
   size_t i;
   bool b;
+  int num_queues;
 
   h = calloc (1, sizeof *h);
   if (h == NULL) {
     nbdkit_error ("calloc: %m");
     return NULL;
   }
+  h->stop_fds[0] = h->stop_fds[1] = -1;
 
   r = blkio_create (driver, &h->b);
   if (r < 0) {
@@ -266,27 +482,84 @@ bio_open (int readonly)
     free (value);
   }
 
-  /* If memory regions are required, allocate them using the
-   * convenience functions.  Note we allocate one buffer per handle.
-   * It is attached to the handle so blkio_destroy will remove it.
-   */
   r = blkio_get_bool (h->b, "needs-mem-regions", &b);
   if (r < 0) {
     nbdkit_error ("error reading 'needs-mem-regions' property: %s",
                   blkio_get_error_msg ());
     goto error;
   }
-  if (b) {
+  if (b)
     nbdkit_debug ("driver %s requires a bounce buffer", driver);
 
-    r = blkio_alloc_mem_region (h->b, &h->mem_region, MAX_BOUNCE_BUFFER);
-    if (r < 0) {
-      nbdkit_error ("blkio_alloc_mem_region: %s", blkio_get_error_msg ());
+  /* Set up the queues (see "event model" above). */
+  r = blkio_get_int (h->b, "num-queues", &num_queues);
+  if (r < 0) {
+    nbdkit_error ("error reading 'num-queues' property: %s",
+                  blkio_get_error_msg ());
+    goto error;
+  }
+  if (num_queues < 1) {
+    nbdkit_error ("num-queues must be >= 1");
+    goto error;
+  }
+  nbdkit_debug ("using %d queue(s)", num_queues);
+
+  if (pipe (h->stop_fds) == -1) {
+    nbdkit_error ("pipe: %m");
+    goto error;
+  }
+
+  h->queues = calloc (num_queues, sizeof h->queues[0]);
+  if (h->queues == NULL) {
+    nbdkit_error ("calloc: %m");
+    goto error;
+  }
+  for (; h->nr_queues < (size_t) num_queues; ++h->nr_queues) {
+    struct queue *q = &h->queues[h->nr_queues];
+
+    q->q = blkio_get_queue (h->b, h->nr_queues);
+    if (q->q == NULL) {
+      nbdkit_error ("blkio_get_queue: %zu: %s",
+                    h->nr_queues, blkio_get_error_msg ());
       goto error;
     }
-    r = blkio_map_mem_region (h->b, &h->mem_region);
-    if (r < 0) {
-      nbdkit_error ("blkio_map_mem_region: %s", blkio_get_error_msg ());
+    blkioq_set_completion_fd_enabled (q->q, true);
+    q->completion_fd = blkioq_get_completion_fd (q->q);
+    if (q->completion_fd < 0) {
+      nbdkit_error ("blkioq_get_completion_fd: "
+                    "driver %s does not support completion fds", driver);
+      goto error;
+    }
+    q->stop_fd = h->stop_fds[0];
+
+    /* If memory regions are required, allocate them using the
+     * convenience functions.  Note we allocate one buffer per queue.
+     * It is attached to the handle so blkio_destroy will remove it.
+     */
+    if (b) {
+      r = blkio_alloc_mem_region (h->b, &q->mem_region, MAX_BOUNCE_BUFFER);
+      if (r < 0) {
+        nbdkit_error ("blkio_alloc_mem_region: %s", blkio_get_error_msg ());
+        goto error;
+      }
+      r = blkio_map_mem_region (h->b, &q->mem_region);
+      if (r < 0) {
+        nbdkit_error ("blkio_map_mem_region: %s", blkio_get_error_msg ());
+        goto error;
+      }
+    }
+
+    pthread_mutex_init (&q->lock, NULL);
+    pthread_cond_init (&q->cond, NULL);
+  }
+
+  /* Start the completion threads. */
+  for (; h->nr_threads < h->nr_queues; ++h->nr_threads) {
+    struct queue *q = &h->queues[h->nr_threads];
+
+    errno = pthread_create (&q->thread, NULL, completion_thread, q);
+    if (errno != 0) {
+      nbdkit_error ("pthread_create: %m");
       goto error;
     }
   }
@@ -294,9 +567,7 @@ bio_open (int readonly)
   return h;
 
  error:
-  if (h->b)
-    blkio_destroy (&h->b);
-  free (h);
+  free_handle (h);
   return NULL;
 }
 
@@ -304,10 +575,7 @@ bio_open (int readonly)
 static void
 bio_close (void *handle)
 {
-  struct handle *h = handle;
-
-  blkio_destroy (&h->b);
-  free (h);
+  free_handle (handle);
 }
 
 /* Get the device size. */
@@ -384,30 +652,28 @@ bio_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
            uint32_t flags)
 {
   struct handle *h = handle;
+  struct queue *q = get_queue (h);
+  struct request req = { .done = false };
+  void *bounce = NULL;
+  uint32_t slots;
   int r;
-  struct blkioq *q = blkio_get_queue (h->b, 0);
-  struct blkio_completion completion;
 
-  if (h->mem_region.addr && count > MAX_BOUNCE_BUFFER) {
+  if (q->mem_region.addr && count > MAX_BOUNCE_BUFFER) {
     nbdkit_error ("request too large for bounce buffer");
     return -1;
   }
 
-  blkioq_read (q, offset, h->mem_region.addr ? : buf, count, NULL, 0);
-  r = blkioq_do_io (q, &completion, 1, 1, NULL);
-  if (r != 1) {
-    nbdkit_error ("blkioq_do_io: %s", blkio_get_error_msg ());
-    return -1;
-  }
-  if (completion.ret != 0) {
-    nbdkit_error ("blkioq_do_io: unexpected read completion.ret %d != 0",
-                  completion.ret);
-    return -1;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&q->lock);
+  if (q->mem_region.addr)
+    bounce = get_mem_region (q, count, &slots);
+  blkioq_read (q->q, offset, bounce ? : buf, count, &req, 0);
+  r = submit_and_wait (q, &req, "read");
+  if (bounce) {
+    if (r == 0)
+      memcpy (buf, bounce, count);
+    put_mem_region (q, slots);
   }
-  if (h->mem_region.addr)
-    memcpy (buf, h->mem_region.addr, count);
-
-  return 0;
+  return r;
 }
 
 /* Write data to the device. */
@@ -417,33 +683,31 @@ bio_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
 {
   const bool fua = flags & NBDKIT_FLAG_FUA;
   struct handle *h = handle;
-  int r;
-  struct blkioq *q = blkio_get_queue (h->b, 0);
-  struct blkio_completion completion;
+  struct queue *q = get_queue (h);
+  struct request req = { .done = false };
   uint32_t bio_flags;
+  void *bounce = NULL;
+  uint32_t slots;
+  int r;
 
-  if (h->mem_region.addr && count > MAX_BOUNCE_BUFFER) {
+  if (q->mem_region.addr && count > MAX_BOUNCE_BUFFER) {
     nbdkit_error ("request too large for bounce buffer");
     return -1;
   }
 
   bio_flags = 0;
   if (fua) bio_flags |= BLKIO_REQ_FUA;
-  if (h->mem_region.addr)
-    memcpy (h->mem_region.addr, buf, count);
-  blkioq_write (q, offset, h->mem_region.addr ? : buf, count, NULL, bio_flags);
-  r = blkioq_do_io (q, &completion, 1, 1, NULL);
-  if (r != 1) {
-    nbdkit_error ("blkioq_do_io: %s", blkio_get_error_msg ());
-    return -1;
-  }
-  if (completion.ret != 0) {
-    nbdkit_error ("blkioq_do_io: unexpected write completion.ret %d != 0",
-                  completion.ret);
-    return -1;
-  }
 
-  return 0;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&q->lock);
+  if (q->mem_region.addr) {
+    bounce = get_mem_region (q, count, &slots);
+    memcpy (bounce, buf, count);
+  }
+  blkioq_write (q->q, offset, bounce ? : buf, count, &req, bio_flags);
+  r = submit_and_wait (q, &req, "write");
+  if (bounce)
+    put_mem_region (q, slots);
+  return r;
 }
 
 /* Flush. */
@@ -451,23 +715,12 @@ static int
 bio_flush (void *handle, uint32_t flags)
 {
   struct handle *h = handle;
-  int r;
-  struct blkioq *q = blkio_get_queue (h->b, 0);
-  struct blkio_completion completion;
-
-  blkioq_flush (q, NULL, 0);
-  r = blkioq_do_io (q, &completion, 1, 1, NULL);
-  if (r != 1) {
-    nbdkit_error ("blkioq_do_io: %s", blkio_get_error_msg ());
-    return -1;
-  }
-  if (completion.ret != 0) {
-    nbdkit_error ("blkioq_do_io: unexpected flush completion.ret %d != 0",
-                  completion.ret);
-    return -1;
-  }
+  struct queue *q = get_queue (h);
+  struct request req = { .done = false };
 
-  return 0;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&q->lock);
+  blkioq_flush (q->q, &req, 0);
+  return submit_and_wait (q, &req, "flush");
 }
 
 /* Write zeroes. */
@@ -477,29 +730,17 @@ bio_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   const bool fua = flags & NBDKIT_FLAG_FUA;
   const bool may_trim = flags & NBDKIT_FLAG_MAY_TRIM;
   struct handle *h = handle;
-  int r;
-  struct blkioq *q = blkio_get_queue (h->b, 0);
-  struct blkio_completion completion;
+  struct queue *q = get_queue (h);
+  struct request req = { .done = false };
   uint32_t bio_flags;
 
   bio_flags = 0;
   if (fua) bio_flags |= BLKIO_REQ_FUA;
   if (!may_trim) bio_flags |= BLKIO_REQ_NO_UNMAP;
   /* XXX Could support forcing fast zeroes too. */
-  blkioq_write_zeroes (q, offset, count, NULL, bio_flags);
-  r = blkioq_do_io (q, &completion, 1, 1, NULL);
-  if (r != 1) {
-    nbdkit_error ("blkioq_do_io: %s", blkio_get_error_msg ());
-    return -1;
-  }
-  if (completion.ret != 0) {
-    nbdkit_error ("blkioq_do_io: "
-                  "unexpected write zeroes completion.ret %d != 0",
-                  completion.ret);
-    return -1;
-  }
-
-  return 0;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&q->lock);
+  blkioq_write_zeroes (q->q, offset, count, &req, bio_flags);
+  return submit_and_wait (q, &req, "write zeroes");
 }
 
 /* Discard. */
@@ -508,26 +749,15 @@ bio_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   const bool fua = flags & NBDKIT_FLAG_FUA;
   struct handle *h = handle;
-  int r;
-  struct blkioq *q = blkio_get_queue (h->b, 0);
-  struct blkio_completion completion;
+  struct queue *q = get_queue (h);
+  struct request req = { .done = false };
   uint32_t bio_flags;
 
   bio_flags = 0;
   if (fua) bio_flags |= BLKIO_REQ_FUA;
-  blkioq_discard (q, offset, count, NULL, bio_flags);
-  r = blkioq_do_io (q, &completion, 1, 1, NULL);
-  if (r != 1) {
-    nbdkit_error ("blkioq_do_io: %s", blkio_get_error_msg ());
-    return -1;
-  }
-  if (completion.ret != 0) {
-    nbdkit_error ("blkioq_do_io: unexpected discard completion.ret %d != 0",
-                  completion.ret);
-    return -1;
-  }
-
-  return 0;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&q->lock);
+  blkioq_discard (q->q, offset, count, &req, bio_flags);
+  return submit_and_wait (q, &req, "discard");
 }
 
 static struct nbdkit_plugin plugin = {
@@ -0,0 +1,248 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Request coalescing and block cache.
+ *
+ * When fetch-size is set, reads are rounded out to whole blocks of
+ * fetch_size bytes, and blocks are kept in an in-memory cache shared
+ * by all connections.  Runs of adjacent blocks which are missing from
+ * the cache are fetched with a single range request.  If another
+ * thread is already fetching a block we wait for it instead of
+ * sending a second request, so overlapping concurrent reads only
+ * cause one request.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <assert.h>
+
+#include <curl/curl.h>
+
+#include <nbdkit-plugin.h>
+
+#include "blkcache.h"
+#include "minmax.h"
+
+#include "curldefs.h"
+
+/* Use '-D curl.cache=1' to debug the block cache. */
+NBDKIT_DLL_PUBLIC int curl_debug_cache = 0;
+
+/* Maximum number of blocks touched by a single read. */
+#define MAX_RUN 64
+
+static blkcache *cache;
+
+int
+coalesce_init (void)
+{
+  cache = new_blkcache (SIZE_MAX, cache_size);
+  if (cache == NULL)
+    return -1;
+  return 0;
+}
+
+void
+coalesce_free (void)
+{
+  blkcache_stats stats;
+
+  if (cache == NULL)
+    return;
+
+  blkcache_get_stats (cache, &stats);
+  nbdkit_debug ("curl block cache: hits: %zu misses: %zu evictions: %zu "
+                "max used: %" PRIu64,
+                stats.hits, stats.misses, stats.evictions, stats.max_used);
+
+  free_blkcache (cache);
+  cache = NULL;
+}
+
+/* Fetch the run of placeholders run[0..n-1], which are adjacent
+ * blocks, with a single range request, and fill them.  On error the
+ * placeholders are marked as failed.  In all cases the caller still
+ * holds its references to the blocks.
+ */
+static int
+fetch_run (struct curl_handle *ch, block **run, size_t n)
+{
+  uint64_t start = block_start (run[0]);
+  uint64_t end = block_start (run[n-1]) + block_size (run[n-1]);
+  char *datas[MAX_RUN];
+  char *buf = NULL;
+  size_t i;
+  int r = -1;
+
+  if (curl_debug_cache)
+    nbdkit_debug ("cache: fetching %zu block(s) at %" PRIu64 "-%" PRIu64,
+                  n, start, end);
+
+  for (i = 0; i < n; ++i)
+    datas[i] = NULL;
+  for (i = 0; i < n; ++i) {
+    datas[i] = malloc (block_size (run[i]));
+    if (datas[i] == NULL) {
+      nbdkit_error ("malloc: %m");
+      goto out;
+    }
+  }
+
+  /* Avoid the extra copy in the common case of a single block. */
+  if (n == 1)
+    buf = datas[0];
+  else {
+    buf = malloc (end - start);
+    if (buf == NULL) {
+      nbdkit_error ("malloc: %m");
+      goto out;
+    }
+  }
+
+  if (fetch_range (ch, buf, end - start, start) == -1)
+    goto out;
+
+  if (n > 1) {
+    for (i = 0; i < n; ++i)
+      memcpy (datas[i], &buf[block_start (run[i]) - start],
+              block_size (run[i]));
+  }
+  r = 0;
+
+ out:
+  if (n > 1)
+    free (buf);
+  for (i = 0; i < n; ++i) {
+    if (r == -1) {
+      free (datas[i]);
+      datas[i] = NULL;
+    }
+    fill_block (cache, run[i], datas[i]);
+  }
+  return r;
+}
+
+/* Copy the part of block b which overlaps the read into buf, and
+ * drop our reference.
+ */
+static void
+copy_block (block *b, char *buf, uint32_t count, uint64_t offset)
+{
+  uint64_t start = MAX (block_start (b), offset);
+  uint64_t end = MIN (block_start (b) + block_size (b), offset + count);
+
+  memcpy (&buf[start - offset], &block_data (b)[start - block_start (b)],
+          end - start);
+  put_block (cache, b);
+}
+
+/* Fetch the current run of placeholders (if any) and copy it into
+ * the caller's buffer.
+ */
+static int
+flush_run (struct curl_handle *ch, block **run, size_t *n,
+           char *buf, uint32_t count, uint64_t offset)
+{
+  size_t i;
+  int r;
+
+  if (*n == 0)
+    return 0;
+
+  r = fetch_run (ch, run, *n);
+  for (i = 0; i < *n; ++i) {
+    if (r == 0)
+      copy_block (run[i], buf, count, offset);
+    else
+      put_block (cache, run[i]);
+  }
+  *n = 0;
+  return r;
+}
+
+int
+coalesce_pread (struct curl_handle *ch, char *buf, uint32_t count,
+                uint64_t offset)
+{
+  const uint64_t exportsize = ch->exportsize;
+  block *run[MAX_RUN];
+  size_t n = 0;
+  uint64_t number, first, last;
+
+  assert (count > 0);
+  assert (offset + count <= exportsize);
+
+  first = offset / fetch_size;
+  last = (offset + count - 1) / fetch_size;
+
+  for (number = first; number <= last; ++number) {
+    const uint64_t start = number * fetch_size;
+    const uint64_t size = MIN (fetch_size, exportsize - start);
+    block *b;
+    bool fill;
+
+    /* If no one has this block, add it to the current run. */
+    b = reserve_block (cache, number, start, size);
+    if (b != NULL) {
+      run[n++] = b;
+      if (n == MAX_RUN &&
+          flush_run (ch, run, &n, buf, count, offset) == -1)
+        return -1;
+      continue;
+    }
+
+    /* The block is cached or another thread is fetching it.  Send
+     * our own run first so we never hold placeholders while waiting
+     * for another thread.
+     */
+    if (flush_run (ch, run, &n, buf, count, offset) == -1)
+      return -1;
+
+    b = get_block (cache, number, start, size, &fill);
+    if (b == NULL)
+      return -1;
+    if (fill) {
+      /* It was evicted or the other thread failed. */
+      run[n++] = b;
+      continue;
+    }
+    copy_block (b, buf, count, offset);
+  }
+
+  return flush_run (ch, run, &n, buf, count, offset);
+}
@@ -49,12 +49,14 @@
 #include <nbdkit-plugin.h>
 
 #include "cleanup.h"
+#include "minmax.h"
 
 #include "curldefs.h"
 
 /* Plugin configuration. */
 const char *url = NULL;         /* required */
 
+uint64_t cache_size = 64 * 1024 * 1024;
 const char *cainfo = NULL;
 const char *capath = NULL;
 unsigned connections = 4;
@@ -63,11 +65,13 @@ const char *cookiefile = NULL;
 const char *cookiejar = NULL;
 const char *cookie_script = NULL;
 unsigned cookie_script_renew = 0;
+uint32_t fetch_size = 0;
 bool followlocation = true;
 struct curl_slist *headers = NULL;
 const char *header_script = NULL;
 unsigned header_script_renew = 0;
 long http_version = CURL_HTTP_VERSION_NONE;
+bool multiplex = true;
 char *password = NULL;
 #ifndef HAVE_CURLOPT_PROTOCOLS_STR
 long protocols = CURLPROTO_ALL;
@@ -77,9 +81,11 @@ const char *protocols = NULL;
 const char *proxy = NULL;
 char *proxy_password = NULL;
 const char *proxy_user = NULL;
+uint32_t split_size = 4 * 1024 * 1024;
 bool sslverify = true;
 const char *ssl_cipher_list = NULL;
 long ssl_version = CURL_SSLVERSION_DEFAULT;
+unsigned streams = 16;
 const char *tls13_ciphers = NULL;
 bool tcp_keepalive = false;
 bool tcp_nodelay = true;
@@ -106,6 +112,8 @@ curl_load (void)
 static void
 curl_unload (void)
 {
+  worker_stop ();
+  coalesce_free ();
   free (cookie);
   if (headers)
     curl_slist_free_all (headers);
@@ -204,6 +212,13 @@ curl_config (const char *key, const char *value)
     cainfo = value;
   }
 
+  else if (strcmp (key, "cache-size") == 0) {
+    int64_t v = nbdkit_parse_size (value);
+    if (v == -1)
+      return -1;
+    cache_size = v;
+  }
+
   else if (strcmp (key, "capath") == 0) {
     capath =  value;
   }
@@ -256,6 +271,17 @@ curl_config (const char *key, const char *value)
       return -1;
   }
 
+  else if (strcmp (key, "fetch-size") == 0) {
+    int64_t v = nbdkit_parse_size (value);
+    if (v == -1)
+      return -1;
+    if (v > MAX_FETCH_SIZE) {
+      nbdkit_error ("fetch-size is too large");
+      return -1;
+    }
+    fetch_size = v;
+  }
+
   else if (strcmp (key, "followlocation") == 0) {
     r = nbdkit_parse_bool (value);
     if (r == -1)
@@ -314,6 +340,13 @@ curl_config (const char *key, const char *value)
     }
   }
 
+  else if (strcmp (key, "multiplex") == 0) {
+    r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    multiplex = r;
+  }
+
   else if (strcmp (key, "password") == 0) {
     free (password);
     if (nbdkit_read_password (value, &password) == -1)
@@ -342,6 +375,17 @@ curl_config (const char *key, const char *value)
   else if (strcmp (key, "proxy-user") == 0)
     proxy_user = value;
 
+  else if (strcmp (key, "split-size") == 0) {
+    int64_t v = nbdkit_parse_size (value);
+    if (v == -1)
+      return -1;
+    if (v > UINT32_MAX) {
+      nbdkit_error ("split-size is too large");
+      return -1;
+    }
+    split_size = v;
+  }
+
   else if (strcmp (key, "sslverify") == 0) {
     r = nbdkit_parse_bool (value);
     if (r == -1)
@@ -395,6 +439,15 @@ curl_config (const char *key, const char *value)
   else if (strcmp (key, "ssl-cipher-list") == 0)
     ssl_cipher_list = value;
 
+  else if (strcmp (key, "streams") == 0) {
+    if (nbdkit_parse_unsigned ("streams", value, &streams) == -1)
+      return -1;
+    if (streams == 0) {
+      nbdkit_error ("streams parameter must not be 0");
+      return -1;
+    }
+  }
+
   else if (strcmp (key, "tls13-ciphers") == 0)
     tls13_ciphers = value;
 
@@ -477,10 +530,14 @@ curl_config_complete (void)
     return -1;
   }
 
+  if (fetch_size > 0 && coalesce_init () == -1)
+    return -1;
+
   return 0;
 }
 
 #define curl_config_help \
+  "cache-size=<SIZE>          Size of the block cache (with fetch-size).\n" \
   "cainfo=<CAINFO>            Path to Certificate Authority file.\n" \
   "capath=<CAPATH>            Path to directory with CA certificates.\n" \
   "connections=<N>            Number of libcurl connections to use.\n" \
@@ -490,19 +547,23 @@ curl_config_complete (void)
   "cookiejar=<FILENAME>       Read and write cookies to jar.\n" \
   "cookie-script=<SCRIPT>     Script to set HTTP/HTTPS cookies.\n" \
   "cookie-script-renew=<SECS> Time to renew HTTP/HTTPS cookies.\n" \
+  "fetch-size=<SIZE>          Coalesce and cache reads in blocks of SIZE.\n" \
   "followlocation=false       Do not follow redirects.\n" \
   "header=<HEADER>            Set HTTP/HTTPS header.\n" \
   "header-script=<SCRIPT>     Script to set HTTP/HTTPS headers.\n" \
   "header-script-renew=<SECS> Time to renew HTTP/HTTPS headers.\n" \
   "http-version=none|...      Force a particular HTTP protocol.\n" \
+  "multiplex=false            Do not multiplex requests over HTTP/2.\n" \
   "password=<PASSWORD>        The password for the user account.\n" \
   "protocols=PROTO,PROTO,..   Limit protocols allowed.\n" \
   "proxy=<PROXY>              Set proxy URL.\n" \
   "proxy-password=<PASSWORD>  The proxy password.\n" \
   "proxy-user=<USER>          The proxy user.\n" \
+  "split-size=<SIZE>          Split larger reads into parallel requests.\n" \
   "sslverify=false            Do not verify SSL certificate of remote host.\n" \
   "ssl-cipher-list=C1:C2:..   Specify TLS/SSL cipher suites to be used.\n" \
   "ssl-version=<VERSION>      Specify preferred TLS/SSL version.\n" \
+  "streams=<N>                Requests per HTTP/2 connection (default 16).\n" \
   "tcp-keepalive=true         Enable TCP keepalives.\n" \
   "tcp-nodelay=false          Disable Nagle’s algorithm.\n" \
   "timeout=<TIMEOUT>          Set the timeout for requests (seconds).\n" \
@@ -519,6 +580,13 @@ curl_config_complete (void)
                   curl_easy_strerror ((r)), (ch)->errbuf);      \
   } while (0)
 
+/* Start the background worker thread. */
+static int
+curl_after_fork (void)
+{
+  return worker_start ();
+}
+
 /* Create the per-connection handle. */
 static void *
 curl_open (int readonly)
@@ -544,12 +612,21 @@ curl_close (void *handle)
   free (h);
 }
 
-/* This plugin could support the parallel thread model.  It currently
- * uses serialize_requests because parallel has the unfortunate effect
- * of pessimising common workloads.  See:
+#ifdef HAVE_CURL_MULTI_WAKEUP
+/* All requests are run by the worker thread (see worker.c) over at
+ * most 'connections' connections to the server, with up to 'streams'
+ * requests multiplexed over each connection when the server supports
+ * HTTP/2, so the parallel thread model no longer opens a new
+ * connection for each concurrent request.
+ */
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+#else
+/* With old libcurl we cannot use the worker thread, and parallel has
+ * the unfortunate effect of pessimising common workloads.  See:
  * https://listman.redhat.com/archives/libguestfs/2023-February/030618.html
  */
 #define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+#endif
 
 /* Calls get_handle() ... put_handle() to get a handle for the length
  * of the current scope.
@@ -577,6 +654,15 @@ curl_get_size (void *handle)
   return ch->exportsize;
 }
 
+/* Writes are not possible when using the block cache, since we do
+ * not invalidate cached blocks.
+ */
+static int
+curl_can_write (void *handle)
+{
+  return fetch_size == 0;
+}
+
 /* Multi-conn is safe for read-only connections, but HTTP does not
  * have any concept of flushing so we cannot use it for read-write
  * connections.
@@ -589,17 +675,13 @@ curl_can_multi_conn (void *handle)
   return !! h->readonly;
 }
 
-/* Read data from the remote server. */
+/* Set up a handle to read a range from the remote server. */
 static int
-curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+setup_pread (struct curl_handle *ch, char *buf, uint32_t count,
+             uint64_t offset)
 {
-  CURLcode r;
   char range[128];
 
-  GET_HANDLE_FOR_CURRENT_SCOPE (ch);
-  if (ch == NULL)
-    return -1;
-
   /* Run the scripts if necessary and set headers in the handle. */
   if (do_scripts (ch) == -1) return -1;
 
@@ -616,23 +698,92 @@ curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
             offset, offset + count);
   curl_easy_setopt (ch->c, CURLOPT_RANGE, range);
 
-  /* The assumption here is that curl will look after timeouts. */
-  r = curl_easy_perform (ch->c);
-  if (r != CURLE_OK) {
-    display_curl_error (ch, r, "pread: curl_easy_perform");
-    return -1;
-  }
+  return 0;
+}
 
-  /* Could use curl_easy_getinfo here to obtain further information
-   * about the connection.
-   */
+/* Maximum number of pieces a read is split into at the same time. */
+#define MAX_SPLIT 64
 
-  /* As far as I understand the cURL API, this should never happen. */
-  assert (ch->write_count == 0);
+/* Read a range from the remote server using handle ch.
+ *
+ * Reads larger than split_size are split into several range requests
+ * which run in parallel, using whatever extra handles are free in
+ * the pool.  If no other handles are free then we read the rest in a
+ * single request.
+ */
+int
+fetch_range (struct curl_handle *ch, char *p, uint32_t count,
+             uint64_t offset)
+{
+  struct curl_handle *chs[MAX_SPLIT];
+  size_t i, n, submitted;
+  uint32_t len;
+  CURLcode r;
+  int ret = 0;
+
+  while (count > 0) {
+    /* Never wait for extra handles, since other threads may be
+     * holding some handles while waiting for more.
+     */
+    chs[0] = ch;
+    n = 1;
+    if (split_size > 0) {
+      while (n < MAX_SPLIT && (uint64_t) n * split_size < count &&
+             (chs[n] = try_get_handle ()) != NULL)
+        n++;
+    }
+
+    for (submitted = 0; submitted < n; ++submitted) {
+      len = n == 1 ? count : MIN (split_size, count);
+      if (setup_pread (chs[submitted], p, len, offset) == -1) {
+        ret = -1;
+        break;
+      }
+      /* The assumption here is that curl will look after timeouts. */
+      submit_request (chs[submitted]);
+      p += len;
+      count -= len;
+      offset += len;
+    }
+
+    for (i = 0; i < submitted; ++i) {
+      r = wait_request (chs[i]);
+      if (r != CURLE_OK) {
+        display_curl_error (chs[i], r, "pread");
+        ret = -1;
+      }
+      else {
+        /* As far as I understand the cURL API, this should never
+         * happen.
+         */
+        assert (chs[i]->write_count == 0);
+      }
+    }
+
+    for (i = 1; i < n; ++i)
+      put_handle (chs[i]);
+
+    if (ret == -1)
+      return -1;
+  }
 
   return 0;
 }
 
+/* Read data from the remote server. */
+static int
+curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+{
+  GET_HANDLE_FOR_CURRENT_SCOPE (ch);
+  if (ch == NULL)
+    return -1;
+
+  if (fetch_size > 0)
+    return coalesce_pread (ch, buf, count, offset);
+  else
+    return fetch_range (ch, buf, count, offset);
+}
+
 /* Write data to the remote server. */
 static int
 curl_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
@@ -661,9 +812,9 @@ curl_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
   curl_easy_setopt (ch->c, CURLOPT_RANGE, range);
 
   /* The assumption here is that curl will look after timeouts. */
-  r = curl_easy_perform (ch->c);
+  r = perform_request (ch);
   if (r != CURLE_OK) {
-    display_curl_error (ch, r, "pwrite: curl_easy_perform");
+    display_curl_error (ch, r, "pwrite");
     return -1;
   }
 
@@ -682,6 +833,7 @@ static struct nbdkit_plugin plugin = {
   .version           = PACKAGE_VERSION,
   .load              = curl_load,
   .unload            = curl_unload,
+  .after_fork        = curl_after_fork,
   .config            = curl_config,
   .config_complete   = curl_config_complete,
   .config_help       = curl_config_help,
@@ -689,6 +841,7 @@ static struct nbdkit_plugin plugin = {
   .open              = curl_open,
   .close             = curl_close,
   .get_size          = curl_get_size,
+  .can_write         = curl_can_write,
   .can_multi_conn    = curl_can_multi_conn,
   .pread             = curl_pread,
   .pwrite            = curl_pwrite,
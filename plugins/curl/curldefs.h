@@ -44,10 +44,14 @@
 #if CURL_AT_LEAST_VERSION (7, 55, 0)
 #define HAVE_CURLINFO_CONTENT_LENGTH_DOWNLOAD_T
 #endif
+#if CURL_AT_LEAST_VERSION (7, 68, 0)
+#define HAVE_CURL_MULTI_WAKEUP
+#endif
 #endif
 
 extern const char *url;
 
+extern uint64_t cache_size;
 extern const char *cainfo;
 extern const char *capath;
 extern unsigned connections;
@@ -56,11 +60,13 @@ extern const char *cookiefile;
 extern const char *cookiejar;
 extern const char *cookie_script;
 extern unsigned cookie_script_renew;
+extern uint32_t fetch_size;
 extern bool followlocation;
 extern struct curl_slist *headers;
 extern const char *header_script;
 extern unsigned header_script_renew;
 extern long http_version;
+extern bool multiplex;
 extern char *password;
 #ifndef HAVE_CURLOPT_PROTOCOLS_STR
 extern long protocols;
@@ -70,9 +76,11 @@ extern const char *protocols;
 extern const char *proxy;
 extern char *proxy_password;
 extern const char *proxy_user;
+extern uint32_t split_size;
 extern bool sslverify;
 extern const char *ssl_cipher_list;
 extern long ssl_version;
+extern unsigned streams;
 extern const char *tls13_ciphers;
 extern bool tcp_keepalive;
 extern bool tcp_nodelay;
@@ -83,6 +91,11 @@ extern const char *user_agent;
 
 extern int curl_debug_verbose;
 
+/* Maximum fetch-size.  A read touching up to 64 blocks is fetched in
+ * one range request, so this keeps requests below 4GB.
+ */
+#define MAX_FETCH_SIZE (32 * 1024 * 1024)
+
 /* The per-connection handle. */
 struct handle {
   int readonly;
@@ -117,13 +130,35 @@ struct curl_handle {
 
   /* Used by scripts.c */
   struct curl_slist *headers_copy;
+
+  /* Used by worker.c.  These are protected by the worker lock. */
+  bool done;
+  CURLcode status;
 };
 
 /* pool.c */
 extern struct curl_handle *get_handle (void);
+extern struct curl_handle *try_get_handle (void);
 extern void put_handle (struct curl_handle *ch);
 extern void free_all_handles (void);
 
+/* curl.c */
+extern int fetch_range (struct curl_handle *ch, char *buf, uint32_t count,
+                        uint64_t offset);
+
+/* coalesce.c */
+extern int coalesce_init (void);
+extern void coalesce_free (void);
+extern int coalesce_pread (struct curl_handle *ch, char *buf, uint32_t count,
+                           uint64_t offset);
+
+/* worker.c */
+extern int worker_start (void);
+extern void worker_stop (void);
+extern void submit_request (struct curl_handle *ch);
+extern CURLcode wait_request (struct curl_handle *ch);
+extern CURLcode perform_request (struct curl_handle *ch);
+
 /* scripts.c */
 extern int do_scripts (struct curl_handle *ch);
 extern void scripts_unload (void);
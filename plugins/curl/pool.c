@@ -82,7 +82,7 @@ static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* List of curl handles.  This is allocated dynamically as more
  * handles are requested.  Currently it does not shrink.  It may grow
- * up to 'connections' in length.
+ * up to max_handles () in length.
  */
 DEFINE_VECTOR_TYPE (curl_handle_list, struct curl_handle *);
 static curl_handle_list curl_handles = empty_vector;
@@ -93,6 +93,23 @@ static curl_handle_list curl_handles = empty_vector;
 static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 static size_t in_use = 0, waiting = 0;
 
+/* Each handle is one request in flight.  When requests are
+ * multiplexed over HTTP/2 each connection can carry up to 'streams'
+ * requests at the same time, otherwise each request needs its own
+ * connection.  (If the server turns out not to support HTTP/2 then
+ * the extra requests are queued by libcurl until a connection is
+ * free.)
+ */
+static size_t
+max_handles (void)
+{
+#ifdef HAVE_CURL_MULTI_WAKEUP
+  if (multiplex)
+    return (size_t) connections * streams;
+#endif
+  return connections;
+}
+
 /* Close and free all handles in the pool. */
 void
 free_all_handles (void)
@@ -111,9 +128,12 @@ free_all_handles (void)
 /* Get a handle from the pool.
  *
  * It is owned exclusively by the caller until they call put_handle.
+ *
+ * If wait is false and all handles are in use, return NULL instead
+ * of waiting for another thread to call put_handle.
  */
-struct curl_handle *
-get_handle (void)
+static struct curl_handle *
+get_handle_common (bool wait)
 {
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   size_t i;
@@ -132,8 +152,8 @@ get_handle (void)
     }
   }
 
-  /* If more connections are allowed, then allocate a new handle. */
-  if (curl_handles.len < connections) {
+  /* If more requests are allowed, then allocate a new handle. */
+  if (curl_handles.len < max_handles ()) {
     ch = allocate_handle ();
     if (ch == NULL)
       return NULL;
@@ -149,18 +169,36 @@ get_handle (void)
     return ch;
   }
 
-  /* Otherwise we have run out of connections so we must wait until
+  /* Otherwise we have run out of handles so we must wait until
    * another thread calls put_handle.
    */
-  assert (in_use == connections);
+  assert (in_use == max_handles ());
+  if (!wait)
+    return NULL;
   waiting++;
-  while (in_use == connections)
+  while (in_use == max_handles ())
     pthread_cond_wait (&cond, &lock);
   waiting--;
 
   goto again;
 }
 
+struct curl_handle *
+get_handle (void)
+{
+  return get_handle_common (true);
+}
+
+/* Like get_handle, but returns NULL if all handles are in use.  This
+ * is used to get extra handles for a split request without risking
+ * deadlock against other threads doing the same.
+ */
+struct curl_handle *
+try_get_handle (void)
+{
+  return get_handle_common (false);
+}
+
 /* Return the handle to the pool. */
 void
 put_handle (struct curl_handle *ch)
@@ -0,0 +1,298 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Background worker thread.
+ *
+ * When libcurl is new enough, all requests are run by a single
+ * background thread using the curl multi interface.  A thread which
+ * wants to make a request sets up the easy handle, calls
+ * submit_request() to pass it to the worker thread, and then calls
+ * wait_request() to wait for it to finish.  Several requests can be
+ * in flight at the same time, and if the server supports HTTP/2 they
+ * are multiplexed as separate streams over the same connection.
+ *
+ * With older libcurl (before 7.68, which added curl_multi_wakeup)
+ * submit_request() simply runs the request synchronously using
+ * curl_easy_perform.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+#include "vector.h"
+
+#include "curldefs.h"
+
+/* Use '-D curl.worker=1' to debug the worker thread. */
+NBDKIT_DLL_PUBLIC int curl_debug_worker = 0;
+
+#ifdef HAVE_CURL_MULTI_WAKEUP
+
+/* This lock protects the queue and the done/status fields of every
+ * curl handle.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Broadcast whenever a request finishes. */
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/* Requests submitted but not yet added to the multi handle. */
+DEFINE_VECTOR_TYPE (request_queue, struct curl_handle *);
+static request_queue queue = empty_vector;
+
+static CURLM *multi;
+static pthread_t thread;
+static bool running;            /* Worker thread was started. */
+static bool stop;               /* Worker thread should exit. */
+
+static void
+complete_request (struct curl_handle *ch, CURLcode r)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+  if (curl_debug_worker)
+    nbdkit_debug ("worker: request on handle %zu finished: %s",
+                  ch->i, curl_easy_strerror (r));
+
+  ch->status = r;
+  ch->done = true;
+  pthread_cond_broadcast (&cond);
+}
+
+static void *
+worker_thread (void *vp)
+{
+  for (;;) {
+    CURLMcode mc;
+    CURLMsg *msg;
+    int running_handles, msgs_left, numfds;
+    size_t i;
+
+    /* Add any newly submitted requests to the multi handle. */
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+      if (stop)
+        break;
+
+      for (i = 0; i < queue.len; ++i) {
+        struct curl_handle *ch = queue.ptr[i];
+
+        mc = curl_multi_add_handle (multi, ch->c);
+        if (mc != CURLM_OK) {
+          nbdkit_error ("curl_multi_add_handle: %s",
+                        curl_multi_strerror (mc));
+          ch->status = CURLE_FAILED_INIT;
+          ch->done = true;
+          pthread_cond_broadcast (&cond);
+        }
+      }
+      queue.len = 0;
+    }
+
+    mc = curl_multi_perform (multi, &running_handles);
+    if (mc != CURLM_OK)
+      nbdkit_debug ("curl_multi_perform: %s", curl_multi_strerror (mc));
+
+    /* Check for completed requests. */
+    while ((msg = curl_multi_info_read (multi, &msgs_left)) != NULL) {
+      if (msg->msg == CURLMSG_DONE) {
+        CURL *c = msg->easy_handle;
+        CURLcode r = msg->data.result;
+        char *p;
+
+        /* msg is invalid after we remove the easy handle. */
+        curl_easy_getinfo (c, CURLINFO_PRIVATE, &p);
+        curl_multi_remove_handle (multi, c);
+        complete_request ((struct curl_handle *) p, r);
+      }
+    }
+
+    /* Wait for activity on any connection, or for curl_multi_wakeup
+     * to be called by submit_request or worker_stop.
+     */
+    mc = curl_multi_poll (multi, NULL, 0, 1000, &numfds);
+    if (mc != CURLM_OK)
+      nbdkit_debug ("curl_multi_poll: %s", curl_multi_strerror (mc));
+  }
+
+  return NULL;
+}
+
+/* Start the worker thread.  This is called from .after_fork because
+ * threads created before nbdkit forks into the background would be
+ * lost.
+ */
+int
+worker_start (void)
+{
+  int err;
+
+  multi = curl_multi_init ();
+  if (multi == NULL) {
+    nbdkit_error ("curl_multi_init: failed");
+    return -1;
+  }
+
+  /* Allow up to 'streams' requests to be multiplexed over each HTTP/2
+   * connection, and never open more than 'connections' connections
+   * to one host.  The number of requests in flight is limited by the
+   * size of the handle pool (see pool.c).
+   */
+  curl_multi_setopt (multi, CURLMOPT_PIPELINING,
+                     multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+  curl_multi_setopt (multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) connections);
+  curl_multi_setopt (multi, CURLMOPT_MAX_CONCURRENT_STREAMS, (long) streams);
+
+  err = pthread_create (&thread, NULL, worker_thread, NULL);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    curl_multi_cleanup (multi);
+    multi = NULL;
+    return -1;
+  }
+  running = true;
+  return 0;
+}
+
+/* Stop the worker thread.  There must be no requests in flight. */
+void
+worker_stop (void)
+{
+  if (running) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+      stop = true;
+    }
+    curl_multi_wakeup (multi);
+    pthread_join (thread, NULL);
+    running = false;
+  }
+  if (multi) {
+    curl_multi_cleanup (multi);
+    multi = NULL;
+  }
+  request_queue_reset (&queue);
+}
+
+/* Pass a request to the worker thread.  The handle must have been
+ * set up completely before calling this, and the caller must not
+ * touch it again until wait_request returns.
+ */
+void
+submit_request (struct curl_handle *ch)
+{
+  curl_easy_setopt (ch->c, CURLOPT_PRIVATE, (char *) ch);
+
+  /* When multiplexing, prefer waiting for an existing connection to
+   * confirm that it can multiplex over opening a new connection.
+   */
+  if (multiplex)
+    curl_easy_setopt (ch->c, CURLOPT_PIPEWAIT, 1L);
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+    ch->done = false;
+    if (request_queue_append (&queue, ch) == -1) {
+      nbdkit_error ("realloc: %m");
+      ch->status = CURLE_OUT_OF_MEMORY;
+      ch->done = true;
+      return;
+    }
+  }
+
+  curl_multi_wakeup (multi);
+}
+
+/* Wait for a submitted request to finish and return its status. */
+CURLcode
+wait_request (struct curl_handle *ch)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+  while (!ch->done)
+    pthread_cond_wait (&cond, &lock);
+  return ch->status;
+}
+
+#else /* !HAVE_CURL_MULTI_WAKEUP */
+
+int
+worker_start (void)
+{
+  return 0;
+}
+
+void
+worker_stop (void)
+{
+  /* nothing */
+}
+
+void
+submit_request (struct curl_handle *ch)
+{
+  ch->status = curl_easy_perform (ch->c);
+  ch->done = true;
+}
+
+CURLcode
+wait_request (struct curl_handle *ch)
+{
+  assert (ch->done);
+  return ch->status;
+}
+
+#endif /* !HAVE_CURL_MULTI_WAKEUP */
+
+/* Run a single request and wait for it to finish. */
+CURLcode
+perform_request (struct curl_handle *ch)
+{
+  submit_request (ch);
+  return wait_request (ch);
+}
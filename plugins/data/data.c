@@ -51,6 +51,7 @@
 
 #include "data.h"
 #include "format.h"
+#include "lazy.h"
 
 /* Data (raw|base64|data) parameter. */
 static enum { NOT_SEEN, RAW, BASE64, DATA } data_seen = NOT_SEEN;
@@ -61,8 +62,11 @@ static const char *data_param;
  */
 static int64_t size = -1;
 
-/* Allocator. */
+/* Allocator.  This is wrapped in a store which also holds the
+ * lazily evaluated parts of the data parameter (see lazy.c).
+ */
 static struct allocator *a;
+static struct lazy *l;
 const char *allocator_type = "sparse";
 
 /* Debug directory operations (-D data.dir=1). */
@@ -77,8 +81,8 @@ static param_list params;
 static void
 data_unload (void)
 {
-  if (a)
-    a->f->free (a);
+  lazy_free (l);
+  lazy_free_all ();
 }
 
 /* Parse the base64 parameter. */
@@ -200,6 +204,9 @@ data_get_ready (void)
   a = create_allocator (allocator_type, data_debug_dir);
   if (a == NULL)
     return -1;
+  l = lazy_create (a);
+  if (l == NULL)
+    return -1;
 
   switch (data_seen) {
   case RAW:
@@ -214,7 +221,7 @@ data_get_ready (void)
     break;
 
   case DATA:
-    if (read_data_format (data_param, a, &data_size) == -1)
+    if (read_data_format (data_param, l, &data_size) == -1)
       return -1;
     break;
 
@@ -310,7 +317,7 @@ data_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
             uint32_t flags)
 {
   assert (!flags);
-  return a->f->read (a, buf, count, offset);
+  return lazy_read (l, buf, count, offset);
 }
 
 /* Write data. */
@@ -320,7 +327,7 @@ data_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
 {
   /* Flushing, and thus FUA flag, is a no-op */
   assert ((flags & ~NBDKIT_FLAG_FUA) == 0);
-  return a->f->write (a, buf, count, offset);
+  return lazy_write (l, buf, count, offset);
 }
 
 /* Zero. */
@@ -331,7 +338,7 @@ data_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
    * a->f->zero generally beats writes, so FAST_ZERO is a no-op. */
   assert ((flags & ~(NBDKIT_FLAG_FUA | NBDKIT_FLAG_MAY_TRIM |
                      NBDKIT_FLAG_FAST_ZERO)) == 0);
-  return a->f->zero (a, count, offset);
+  return lazy_zero (l, count, offset);
 }
 
 /* Trim (same as zero). */
@@ -340,7 +347,7 @@ data_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   /* Flushing, and thus FUA flag, is a no-op */
   assert ((flags & ~NBDKIT_FLAG_FUA) == 0);
-  return a->f->zero (a, count, offset);
+  return lazy_zero (l, count, offset);
 }
 
 /* Nothing is persistent, so flush is trivially supported */
@@ -355,7 +362,7 @@ static int
 data_extents (void *handle, uint32_t count, uint64_t offset,
               uint32_t flags, struct nbdkit_extents *extents)
 {
-  return a->f->extents (a, count, offset, extents);
+  return lazy_extents (l, count, offset, extents);
 }
 
 static struct nbdkit_plugin plugin = {
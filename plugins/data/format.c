@@ -60,6 +60,7 @@
 
 #include "data.h"
 #include "format.h"
+#include "lazy.h"
 
 /* To print the AST, use -D data.AST=1 */
 NBDKIT_DLL_PUBLIC int data_debug_AST = 0;
@@ -424,11 +425,11 @@ static int parser (int level, const char *value, size_t *start, size_t len,
                    node_id *root_rtn);
 static int optimize_ast (node_id root, node_id *root_rtn);
 static int evaluate (const dict_t *dict, node_id root,
-                     struct allocator *a,
+                     struct lazy *l,
                      uint64_t *offset, uint64_t *size);
 
 int
-read_data_format (const char *value, struct allocator *a, uint64_t *size_rtn)
+read_data_format (const char *value, struct lazy *l, uint64_t *size_rtn)
 {
   size_t i = 0;
   node_id root;
@@ -452,8 +453,8 @@ read_data_format (const char *value, struct allocator *a, uint64_t *size_rtn)
     nbdkit_debug ("END AST");
   }
 
-  /* Evaluate the expression into the allocator. */
-  r = evaluate (NULL, root, a, &offset, size_rtn);
+  /* Evaluate the expression into the lazy store. */
+  r = evaluate (NULL, root, l, &offset, size_rtn);
 
  out:
   free_expr_table ();
@@ -1563,23 +1564,23 @@ exprs_can_combine (expr_t e0, expr_t e1, node_id *id_rtn)
   exit (EXIT_FAILURE);
 }
 
-static int store_file (struct allocator *a,
+static int store_file (struct lazy *l,
                        const char *filename, uint64_t *offset);
-static int store_file_slice (struct allocator *a,
+static int store_file_slice (struct lazy *l,
                              const char *filename,
                              uint64_t skip, int64_t end, uint64_t *offset);
-static int store_script (struct allocator *a,
+static int store_script (struct lazy *l,
                          const char *script, uint64_t *offset);
-static int store_script_len (struct allocator *a,
+static int store_script_len (struct lazy *l,
                              const char *script,
                              int64_t len, uint64_t *offset);
 
 /* This is the evaluator.  It takes the root (node_id) of the parsed
- * abstract syntax tree and evaulates it into the allocator.
+ * abstract syntax tree and evaulates it into the lazy store.
  */
 static int
 evaluate (const dict_t *dict, node_id root,
-          struct allocator *a, uint64_t *offset, uint64_t *size)
+          struct lazy *l, uint64_t *offset, uint64_t *size)
 {
   /* 'd' is the local dictionary for this function.  Assignments are
    * added to the dictionary in this scope and passed to nested
@@ -1587,7 +1588,7 @@ evaluate (const dict_t *dict, node_id root,
    * exit(1).
    */
   dict_t *d = (dict_t *) dict;
-  size_t i, j;
+  size_t i;
   node_ids list;
 
   /* Extract the list from the current node.  If the current node is
@@ -1609,7 +1610,7 @@ evaluate (const dict_t *dict, node_id root,
 
     case EXPR_BYTE:
       /* Store the byte. */
-      if (a->f->write (a, &e.b, 1, *offset) == -1)
+      if (lazy_write (l, &e.b, 1, *offset) == -1)
         return -1;
       (*offset)++;
       break;
@@ -1635,24 +1636,24 @@ evaluate (const dict_t *dict, node_id root,
       break;
 
     case EXPR_FILE:
-      if (store_file (a, e.filename, offset) == -1)
+      if (store_file (l, e.filename, offset) == -1)
         return -1;
       break;
 
     case EXPR_SCRIPT:
-      if (store_script (a, e.script, offset) == -1)
+      if (store_script (l, e.script, offset) == -1)
         return -1;
       break;
 
     case EXPR_STRING:
       /* Copy the string into the allocator. */
-      if (a->f->write (a, e.string.ptr, e.string.len, *offset) == -1)
+      if (lazy_write (l, e.string.ptr, e.string.len, *offset) == -1)
         return -1;
       *offset += e.string.len;
       break;
 
     case EXPR_FILL:
-      if (a->f->fill (a, e.fl.b, e.fl.n, *offset) == -1)
+      if (lazy_fill (l, e.fl.b, e.fl.n, *offset) == -1)
         return -1;
       *offset += e.fl.n;
       break;
@@ -1672,7 +1673,7 @@ evaluate (const dict_t *dict, node_id root,
     }
 
     case EXPR_NAME: {
-      CLEANUP_FREE_ALLOCATOR struct allocator *a2 = NULL;
+      CLEANUP_FREE_LAZY struct lazy *l2 = NULL;
       uint64_t offset2 = 0, size2 = 0;
       dict_t *t;
 
@@ -1686,18 +1687,18 @@ evaluate (const dict_t *dict, node_id root,
       }
 
       /* Evaluate and then substitute the expression. */
-      a2 = create_allocator ("sparse", false);
-      if (a2 == NULL) {
+      l2 = lazy_create (create_allocator ("sparse", false));
+      if (l2 == NULL) {
         nbdkit_error ("malloc: %m");
         return -1;
       }
       /* NB: We pass the environment at the time that the assignment was
        * made (t->next) not the current environment.  This is deliberate.
        */
-      if (evaluate (t->next, t->id, a2, &offset2, &size2) == -1)
+      if (evaluate (t->next, t->id, l2, &offset2, &size2) == -1)
         return -1;
 
-      if (a->f->blit (a2, a, size2, 0, *offset) == -1)
+      if (lazy_blit (l2, l, size2, 0, *offset) == -1)
         return -1;
       *offset += size2;
       break;
@@ -1715,7 +1716,7 @@ evaluate (const dict_t *dict, node_id root,
        * infinite loop.
        */
       if (e.t == EXPR_SLICE && get_node (e.sl.id).t == EXPR_FILE) {
-        if (store_file_slice (a, get_node (e.sl.id).filename,
+        if (store_file_slice (l, get_node (e.sl.id).filename,
                               e.sl.n, e.sl.m, offset) == -1)
           return -1;
       }
@@ -1725,7 +1726,7 @@ evaluate (const dict_t *dict, node_id root,
        */
       else if (e.t == EXPR_SLICE && e.sl.n == 0 &&
                get_node (e.sl.id).t == EXPR_SCRIPT) {
-        if (store_script_len (a, get_node (e.sl.id).script, e.sl.m,
+        if (store_script_len (l, get_node (e.sl.id).script, e.sl.m,
                               offset) == -1)
           return -1;
       }
@@ -1736,7 +1737,7 @@ evaluate (const dict_t *dict, node_id root,
          * Nesting creates a new context where there is a new allocator
          * and the offset is reset to 0.
          */
-        CLEANUP_FREE_ALLOCATOR struct allocator *a2 = NULL;
+        CLEANUP_FREE_LAZY struct lazy *l2 = NULL;
         uint64_t offset2 = 0, size2 = 0, m;
         node_id id;
 
@@ -1747,27 +1748,28 @@ evaluate (const dict_t *dict, node_id root,
         default: abort ();
         }
 
-        a2 = create_allocator ("sparse", false);
-        if (a2 == NULL) {
+        l2 = lazy_create (create_allocator ("sparse", false));
+        if (l2 == NULL) {
           nbdkit_error ("malloc: %m");
           return -1;
         }
-        if (evaluate (d, id, a2, &offset2, &size2) == -1)
+        if (evaluate (d, id, l2, &offset2, &size2) == -1)
           return -1;
 
         switch (e.t) {
         case EXPR_LIST:
-          if (a->f->blit (a2, a, size2, 0, *offset) == -1)
+          if (lazy_blit (l2, l, size2, 0, *offset) == -1)
             return -1;
           *offset += size2;
           break;
         case EXPR_REPEAT:
-          /* Duplicate the allocator a2 N times. */
-          for (j = 0; j < e.r.n; ++j) {
-            if (a->f->blit (a2, a, size2, 0, *offset) == -1)
-              return -1;
-            *offset += size2;
+          /* Repeat l2 N times.  This takes ownership of l2. */
+          if (lazy_repeat (l, l2, size2, e.r.n, *offset) == -1) {
+            l2 = NULL;
+            return -1;
           }
+          l2 = NULL;
+          *offset += size2 * e.r.n;
           break;
         case EXPR_SLICE:
           /* Slice [N:M] */
@@ -1779,7 +1781,7 @@ evaluate (const dict_t *dict, node_id root,
             return -1;
           }
           /* Take a slice from the allocator. */
-          if (a->f->blit (a2, a, m-e.sl.n, e.sl.n, *offset) == -1)
+          if (lazy_blit (l2, l, m-e.sl.n, e.sl.n, *offset) == -1)
             return -1;
           *offset += m-e.sl.n;
           break;
@@ -1805,15 +1807,22 @@ evaluate (const dict_t *dict, node_id root,
   return 0;
 }
 
-/* Store file at current offset in the allocator, updating the offset. */
+/* Store file at current offset in the allocator, updating the offset.
+ * Large regular files are read on demand instead.
+ */
 static int
-store_file (struct allocator *a,
+store_file (struct lazy *l,
             const char *filename, uint64_t *offset)
 {
   FILE *fp;
   char buf[BUFSIZ];
   size_t n;
 
+  switch (lazy_file (l, filename, 0, -1, offset)) {
+  case -1: return -1;
+  case 1: return 0;
+  }
+
   fp = fopen (filename, "r");
   if (fp == NULL) {
     nbdkit_error ("%s: %m", filename);
@@ -1823,7 +1832,7 @@ store_file (struct allocator *a,
   while (!feof (fp)) {
     n = fread (buf, 1, BUFSIZ, fp);
     if (n > 0) {
-      if (a->f->write (a, buf, n, *offset) == -1) {
+      if (lazy_write (l, buf, n, *offset) == -1) {
         fclose (fp);
         return -1;
       }
@@ -1846,7 +1855,7 @@ store_file (struct allocator *a,
 
 /* <FILE[N:M] */
 static int
-store_file_slice (struct allocator *a,
+store_file_slice (struct lazy *l,
                   const char *filename,
                   uint64_t skip, int64_t end, uint64_t *offset)
 {
@@ -1863,6 +1872,11 @@ store_file_slice (struct allocator *a,
   if (end >= 0)
     len = end - skip;
 
+  switch (lazy_file (l, filename, skip, end, offset)) {
+  case -1: return -1;
+  case 1: return 0;
+  }
+
   fp = fopen (filename, "r");
   if (fp == NULL) {
     nbdkit_error ("%s: %m", filename);
@@ -1877,7 +1891,7 @@ store_file_slice (struct allocator *a,
   while (!feof (fp) && (end == -1 || len > 0)) {
     n = fread (buf, 1, end == -1 ? BUFSIZ : MIN (len, BUFSIZ), fp);
     if (n > 0) {
-      if (a->f->write (a, buf, n, *offset) == -1) {
+      if (lazy_write (l, buf, n, *offset) == -1) {
         fclose (fp);
         return -1;
       }
@@ -1903,7 +1917,7 @@ store_file_slice (struct allocator *a,
 
 /* Run the script and store the output in the allocator from offset. */
 static int
-store_script (struct allocator *a,
+store_script (struct lazy *l,
               const char *script, uint64_t *offset)
 {
   FILE *pp;
@@ -1919,7 +1933,7 @@ store_script (struct allocator *a,
   while (!feof (pp)) {
     n = fread (buf, 1, BUFSIZ, pp);
     if (n > 0) {
-      if (a->f->write (a, buf, n, *offset) == -1) {
+      if (lazy_write (l, buf, n, *offset) == -1) {
         pclose (pp);
         return -1;
       }
@@ -1944,7 +1958,7 @@ store_script (struct allocator *a,
  * allocator from offset.
  */
 static int
-store_script_len (struct allocator *a,
+store_script_len (struct lazy *l,
                   const char *script,
                   int64_t len, uint64_t *offset)
 {
@@ -1964,7 +1978,7 @@ store_script_len (struct allocator *a,
   while (!feof (pp) && len > 0) {
     n = fread (buf, 1, MIN (len, BUFSIZ), pp);
     if (n > 0) {
-      if (a->f->write (a, buf, n, *offset) == -1) {
+      if (lazy_write (l, buf, n, *offset) == -1) {
         pclose (pp);
         return -1;
       }
@@ -1996,14 +2010,14 @@ store_script_len (struct allocator *a,
 #else /* WIN32 */
 
 static int
-store_script (struct allocator *a,
+store_script (struct lazy *l,
               const char *script, uint64_t *offset)
 {
   NOT_IMPLEMENTED_ON_WINDOWS ("<(SCRIPT)");
 }
 
 static int
-store_script_len (struct allocator *a,
+store_script_len (struct lazy *l,
                   const char *script,
                   int64_t len, uint64_t *offset)
 {
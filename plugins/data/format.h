@@ -33,12 +33,12 @@
 #ifndef NBDKIT_DATA_FORMAT_H
 #define NBDKIT_DATA_FORMAT_H
 
-#include "allocator.h"
+#include "lazy.h"
 
 /* Parses the data parameter as described in the man page
  * under "DATA FORMAT".
  */
 extern int read_data_format (const char *value,
-                             struct allocator *a, uint64_t *size);
+                             struct lazy *l, uint64_t *size);
 
 #endif /* NBDKIT_DATA_FORMAT_H */
@@ -0,0 +1,639 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define NBDKIT_API_VERSION 2
+#include <nbdkit-plugin.h>
+
+#include "allocator.h"
+#include "checked-overflow.h"
+#include "cleanup.h"
+#include "minmax.h"
+#include "pread.h"
+#include "rounding.h"
+#include "vector.h"
+#include "windows-compat.h"
+
+#include "lazy.h"
+
+/* Repeats, fills and files smaller than this are stored in the
+ * allocator as before.
+ */
+#define LAZY_MIN_SIZE (1024 * 1024)
+
+/* Patterns up to this size are flattened into a tile containing at
+ * least TILE_MIN_SIZE bytes, so that reading a repeated short
+ * pattern is a few memcpys.  Larger patterns are read from the
+ * nested store.
+ */
+#define TILE_MAX_PERIOD (1024 * 1024)
+#define TILE_MIN_SIZE (64 * 1024)
+
+/* The repeated pattern used by a REGION_REPEAT.  Patterns are shared
+ * by all regions split or copied from the original one, and are
+ * freed by lazy_free_all.
+ */
+struct pattern {
+  uint64_t period;
+  char *tile;                   /* If not NULL, tile_len bytes. */
+  uint64_t tile_len;
+  struct lazy *src;             /* Else read the pattern from here. */
+};
+DEFINE_VECTOR_TYPE (pattern_list, struct pattern *);
+static pattern_list patterns;
+
+/* A file used by a REGION_FILE, shared in the same way. */
+struct file {
+  char *filename;
+  int fd;
+};
+DEFINE_VECTOR_TYPE (file_list, struct file *);
+static file_list files;
+
+enum region_type {
+  REGION_FILL,                  /* c - same byte repeated */
+  REGION_REPEAT,                /* r.p, r.phase - repeated pattern */
+  REGION_FILE,                  /* f.f, f.skip - slice of a file */
+};
+
+struct region {
+  uint64_t offset;              /* Position and length in the store. */
+  uint64_t len;
+  enum region_type t;
+  union {
+    char c;
+    struct {
+      struct pattern *p;
+      uint64_t phase;           /* Offset in pattern of the first byte. */
+    } r;
+    struct {
+      struct file *f;
+      uint64_t skip;            /* Offset in file of the first byte. */
+    } f;
+  };
+};
+DEFINE_VECTOR_TYPE (region_list, struct region);
+
+struct lazy {
+  struct allocator *a;
+
+  /* Regions are sorted by offset and do not overlap.  New regions
+   * are only added during configuration.  After that writes only
+   * remove regions, which lets us skip the write lock once there are
+   * none left.
+   */
+  pthread_rwlock_t lock;
+  region_list regions;
+};
+
+struct lazy *
+lazy_create (struct allocator *a)
+{
+  struct lazy *l;
+
+  if (a == NULL)
+    return NULL;
+
+  l = calloc (1, sizeof *l);
+  if (l == NULL) {
+    nbdkit_error ("calloc: %m");
+    a->f->free (a);
+    return NULL;
+  }
+  l->a = a;
+  pthread_rwlock_init (&l->lock, NULL);
+  return l;
+}
+
+void
+lazy_free (struct lazy *l)
+{
+  if (l) {
+    l->a->f->free (l->a);
+    region_list_reset (&l->regions);
+    pthread_rwlock_destroy (&l->lock);
+    free (l);
+  }
+}
+
+void
+cleanup_free_lazy (struct lazy **lp)
+{
+  lazy_free (*lp);
+}
+
+void
+lazy_free_all (void)
+{
+  size_t i;
+
+  for (i = 0; i < patterns.len; ++i) {
+    free (patterns.ptr[i]->tile);
+    lazy_free (patterns.ptr[i]->src);
+    free (patterns.ptr[i]);
+  }
+  pattern_list_reset (&patterns);
+
+  for (i = 0; i < files.len; ++i) {
+    close (files.ptr[i]->fd);
+    free (files.ptr[i]->filename);
+    free (files.ptr[i]);
+  }
+  file_list_reset (&files);
+}
+
+static uint64_t
+region_end (const struct region *r)
+{
+  return r->offset + r->len;
+}
+
+/* Return the index of the first region which ends after offset. */
+static size_t
+find_region (const region_list *regions, uint64_t offset)
+{
+  size_t lo = 0, hi = regions->len, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (region_end (&regions->ptr[mid]) <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Drop the first n bytes of a region. */
+static void
+advance_region (struct region *r, uint64_t n)
+{
+  assert (n <= r->len);
+  r->offset += n;
+  r->len -= n;
+
+  switch (r->t) {
+  case REGION_FILL:
+    break;
+  case REGION_REPEAT:
+    r->r.phase = (r->r.phase + n % r->r.p->period) % r->r.p->period;
+    break;
+  case REGION_FILE:
+    r->f.skip += n;
+    break;
+  }
+}
+
+/* Remove [offset, offset+count-1] from the regions.  Must be called
+ * with the write lock held.
+ */
+static int
+punch (struct lazy *l, uint64_t count, uint64_t offset)
+{
+  const uint64_t end = offset + count;
+  size_t i = find_region (&l->regions, offset);
+  struct region *r, right;
+
+  while (i < l->regions.len && l->regions.ptr[i].offset < end) {
+    r = &l->regions.ptr[i];
+    if (r->offset < offset) {
+      if (region_end (r) > end) {
+        /* Punching a hole in the middle splits the region. */
+        right = *r;
+        advance_region (&right, end - r->offset);
+        r->len = offset - r->offset;
+        if (region_list_insert (&l->regions, right, i+1) == -1) {
+          nbdkit_error ("realloc: %m");
+          return -1;
+        }
+        return 0;
+      }
+      r->len = offset - r->offset;
+      i++;
+    }
+    else if (region_end (r) > end) {
+      advance_region (r, end - r->offset);
+      return 0;
+    }
+    else
+      region_list_remove (&l->regions, i);
+  }
+
+  return 0;
+}
+
+/* Add a region, replacing anything it overlaps.  Must be called with
+ * the write lock held.
+ */
+static int
+insert_region (struct lazy *l, struct region r)
+{
+  if (r.len == 0)
+    return 0;
+
+  if (punch (l, r.len, r.offset) == -1)
+    return -1;
+  if (region_list_insert (&l->regions, r,
+                          find_region (&l->regions, r.offset)) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  return 0;
+}
+
+static int
+read_pattern (const struct pattern *p, char *buf, uint64_t n, uint64_t pos)
+{
+  uint64_t m;
+
+  pos %= p->period;
+  while (n > 0) {
+    if (p->tile) {
+      /* The tile is a whole number of periods, so we can copy up to
+       * its end and then start again at the beginning.
+       */
+      m = MIN (n, p->tile_len - pos);
+      memcpy (buf, &p->tile[pos], m);
+    }
+    else {
+      m = MIN (n, p->period - pos);
+      if (lazy_read (p->src, buf, m, pos) == -1)
+        return -1;
+    }
+    buf += m;
+    n -= m;
+    pos = 0;
+  }
+  return 0;
+}
+
+static int
+read_file (const struct file *f, char *buf, uint64_t n, uint64_t pos)
+{
+  ssize_t r;
+
+  while (n > 0) {
+    r = pread (f->fd, buf, n, pos);
+    if (r == -1) {
+      nbdkit_error ("pread: %s: %m", f->filename);
+      return -1;
+    }
+    if (r == 0) {
+      nbdkit_error ("%s: file is shorter than when nbdkit started",
+                    f->filename);
+      errno = EIO;
+      return -1;
+    }
+    buf += r;
+    n -= r;
+    pos += r;
+  }
+  return 0;
+}
+
+static int
+read_region (const struct region *r, char *buf, uint64_t n, uint64_t delta)
+{
+  switch (r->t) {
+  case REGION_FILL:
+    memset (buf, r->c, n);
+    return 0;
+  case REGION_REPEAT:
+    return read_pattern (r->r.p, buf, n,
+                         r->r.phase + delta % r->r.p->period);
+  case REGION_FILE:
+    return read_file (r->f.f, buf, n, r->f.skip + delta);
+  }
+  abort ();
+}
+
+int
+lazy_read (struct lazy *l, void *buf, uint64_t count, uint64_t offset)
+{
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&l->lock);
+  const region_list *regions = &l->regions;
+  size_t i = find_region (regions, offset);
+  char *p = buf;
+  uint64_t n;
+
+  while (count > 0) {
+    if (i < regions->len && regions->ptr[i].offset <= offset) {
+      n = MIN (count, region_end (&regions->ptr[i]) - offset);
+      if (read_region (&regions->ptr[i], p, n,
+                       offset - regions->ptr[i].offset) == -1)
+        return -1;
+      i++;
+    }
+    else {
+      n = count;
+      if (i < regions->len)
+        n = MIN (n, regions->ptr[i].offset - offset);
+      if (l->a->f->read (l->a, p, n, offset) == -1)
+        return -1;
+    }
+    p += n;
+    count -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+
+/* Returns true if there are no regions, in which case operations
+ * can go straight to the allocator.
+ */
+static bool
+no_regions (struct lazy *l)
+{
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&l->lock);
+  return l->regions.len == 0;
+}
+
+int
+lazy_write (struct lazy *l, const void *buf, uint64_t count, uint64_t offset)
+{
+  if (no_regions (l))
+    return l->a->f->write (l->a, buf, count, offset);
+
+  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&l->lock);
+  if (punch (l, count, offset) == -1)
+    return -1;
+  return l->a->f->write (l->a, buf, count, offset);
+}
+
+int
+lazy_fill (struct lazy *l, char c, uint64_t count, uint64_t offset)
+{
+  /* Filling with zero is cheap for all allocators. */
+  if (c != 0 && count >= LAZY_MIN_SIZE) {
+    const struct region r =
+      { .offset = offset, .len = count, .t = REGION_FILL, .c = c };
+    ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&l->lock);
+    return insert_region (l, r);
+  }
+
+  if (no_regions (l))
+    return l->a->f->fill (l->a, c, count, offset);
+
+  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&l->lock);
+  if (punch (l, count, offset) == -1)
+    return -1;
+  return l->a->f->fill (l->a, c, count, offset);
+}
+
+int
+lazy_zero (struct lazy *l, uint64_t count, uint64_t offset)
+{
+  if (no_regions (l))
+    return l->a->f->zero (l->a, count, offset);
+
+  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&l->lock);
+  if (punch (l, count, offset) == -1)
+    return -1;
+  return l->a->f->zero (l->a, count, offset);
+}
+
+/* This is only used while evaluating the data parameter, when l1 is
+ * no longer changing.
+ */
+int
+lazy_blit (struct lazy *l1, struct lazy *l2,
+           uint64_t count, uint64_t offset1, uint64_t offset2)
+{
+  assert (l1 != l2);
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&l1->lock);
+  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&l2->lock);
+  const region_list *regions = &l1->regions;
+  size_t i = find_region (regions, offset1);
+  const uint64_t end = offset1 + count;
+  uint64_t pos, n;
+  struct region r;
+
+  if (punch (l2, count, offset2) == -1)
+    return -1;
+
+  /* Copy the source regions, and the allocator in between them. */
+  for (pos = offset1; pos < end; pos += n) {
+    if (i < regions->len && regions->ptr[i].offset <= pos) {
+      n = MIN (end, region_end (&regions->ptr[i])) - pos;
+      r = regions->ptr[i];
+      advance_region (&r, pos - r.offset);
+      r.offset = offset2 + (pos - offset1);
+      r.len = n;
+      if (insert_region (l2, r) == -1)
+        return -1;
+      i++;
+    }
+    else {
+      n = end - pos;
+      if (i < regions->len)
+        n = MIN (n, regions->ptr[i].offset - pos);
+      if (l2->a->f->blit (l1->a, l2->a, n, pos,
+                          offset2 + (pos - offset1)) == -1)
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+int
+lazy_repeat (struct lazy *l, struct lazy *pattern,
+             uint64_t size, uint64_t n, uint64_t offset)
+{
+  CLEANUP_FREE_LAZY struct lazy *src = pattern;
+  struct pattern *p;
+  struct region r;
+  uint64_t total, i, k;
+
+  if (size == 0 || n == 0)
+    return 0;
+  if (MUL_OVERFLOW (size, n, &total) ||
+      ADD_OVERFLOW (offset, total, &i)) {
+    nbdkit_error ("data parameter: repeated expression is too large");
+    return -1;
+  }
+
+  /* Small repeats are copied into the allocator. */
+  if (n == 1 || (total < LAZY_MIN_SIZE && src->regions.len == 0)) {
+    for (i = 0; i < n; ++i) {
+      if (lazy_blit (src, l, size, 0, offset + i*size) == -1)
+        return -1;
+    }
+    return 0;
+  }
+
+  p = calloc (1, sizeof *p);
+  if (p == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  if (pattern_list_append (&patterns, p) == -1) {
+    nbdkit_error ("realloc: %m");
+    free (p);
+    return -1;
+  }
+  p->period = size;
+
+  if (size <= TILE_MAX_PERIOD) {
+    k = DIV_ROUND_UP (TILE_MIN_SIZE, size);
+    p->tile_len = size * k;
+    p->tile = malloc (p->tile_len);
+    if (p->tile == NULL) {
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+    if (lazy_read (src, p->tile, size, 0) == -1)
+      return -1;
+    for (i = 1; i < k; ++i)
+      memcpy (&p->tile[i*size], p->tile, size);
+  }
+  else {
+    p->src = src;
+    src = NULL;
+  }
+
+  r = (struct region) {
+    .offset = offset, .len = total,
+    .t = REGION_REPEAT, .r = { .p = p, .phase = 0 },
+  };
+  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&l->lock);
+  return insert_region (l, r);
+}
+
+int
+lazy_file (struct lazy *l, const char *filename,
+           uint64_t skip, int64_t end, uint64_t *offset)
+{
+  struct stat statbuf;
+  struct file *f;
+  struct region r;
+  uint64_t len = 0;
+  int fd;
+
+  /* Leave invalid slices and errors to the caller to report. */
+  if (end < -1 || (end >= 0 && skip > end))
+    return 0;
+  fd = open (filename, O_RDONLY|O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+  if (fstat (fd, &statbuf) == -1 || !S_ISREG (statbuf.st_mode)) {
+    /* Devices, pipes etc. may not be seekable or may return
+     * different data each time they are read, so must be read once.
+     */
+    close (fd);
+    return 0;
+  }
+
+  if (skip < statbuf.st_size) {
+    len = statbuf.st_size - skip;
+    if (end >= 0)
+      len = MIN (len, end - skip);
+  }
+  if (len < LAZY_MIN_SIZE) {
+    close (fd);
+    return 0;
+  }
+
+  f = malloc (sizeof *f);
+  if (f == NULL) {
+    nbdkit_error ("malloc: %m");
+    close (fd);
+    return -1;
+  }
+  f->fd = fd;
+  f->filename = strdup (filename);
+  if (f->filename == NULL || file_list_append (&files, f) == -1) {
+    nbdkit_error ("strdup: %m");
+    free (f->filename);
+    free (f);
+    close (fd);
+    return -1;
+  }
+
+  r = (struct region) {
+    .offset = *offset, .len = len,
+    .t = REGION_FILE, .f = { .f = f, .skip = skip },
+  };
+  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&l->lock);
+  if (insert_region (l, r) == -1)
+    return -1;
+  *offset += len;
+  return 1;
+}
+
+int
+lazy_extents (struct lazy *l, uint64_t count, uint64_t offset,
+              struct nbdkit_extents *extents)
+{
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&l->lock);
+  const region_list *regions = &l->regions;
+  size_t i = find_region (regions, offset);
+  const uint64_t end = offset + count;
+  uint64_t n;
+
+  while (offset < end) {
+    if (i < regions->len && regions->ptr[i].offset <= offset) {
+      n = MIN (end, region_end (&regions->ptr[i])) - offset;
+      i++;
+    }
+    else if (i < regions->len && regions->ptr[i].offset < end) {
+      /* The allocator may return extents which run past the start
+       * of the next region, so we cannot ask it about gaps between
+       * regions.  Reporting data is always safe.
+       */
+      n = regions->ptr[i].offset - offset;
+    }
+    else
+      return l->a->f->extents (l->a, end - offset, offset, extents);
+
+    if (nbdkit_add_extent (extents, offset, n, 0) == -1)
+      return -1;
+    offset += n;
+  }
+
+  return 0;
+}
@@ -0,0 +1,98 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_DATA_LAZY_H
+#define NBDKIT_DATA_LAZY_H
+
+#include <stdint.h>
+
+#include "allocator.h"
+
+struct nbdkit_extents;
+
+/* A lazy store is an allocator with a list of lazily evaluated
+ * regions layered on top.  Regions describe large repeats, fills and
+ * file slices which are only resolved when the data is read, so the
+ * memory used is proportional to the size of the expression, not to
+ * the size of the data it describes.  Regions always take precedence
+ * over the allocator underneath.  Writing to a range removes any
+ * regions covering it and writes to the allocator.
+ *
+ * All functions do their own locking.
+ */
+struct lazy;
+
+/* Create a lazy store over the allocator @a.  The store takes
+ * ownership of the allocator.  On error, calls nbdkit_error and
+ * returns NULL.
+ */
+extern struct lazy *lazy_create (struct allocator *a);
+extern void lazy_free (struct lazy *l);
+
+#define CLEANUP_FREE_LAZY __attribute__ ((cleanup (cleanup_free_lazy)))
+extern void cleanup_free_lazy (struct lazy **lp);
+
+/* Free the patterns and files shared between regions.  Call this on
+ * unload after freeing all stores.
+ */
+extern void lazy_free_all (void);
+
+/* These work like the allocator functions of the same name. */
+extern int lazy_read (struct lazy *l, void *buf,
+                      uint64_t count, uint64_t offset);
+extern int lazy_write (struct lazy *l, const void *buf,
+                       uint64_t count, uint64_t offset);
+extern int lazy_fill (struct lazy *l, char c,
+                      uint64_t count, uint64_t offset);
+extern int lazy_zero (struct lazy *l, uint64_t count, uint64_t offset);
+extern int lazy_blit (struct lazy *l1, struct lazy *l2,
+                      uint64_t count, uint64_t offset1, uint64_t offset2);
+extern int lazy_extents (struct lazy *l, uint64_t count, uint64_t offset,
+                         struct nbdkit_extents *extents);
+
+/* Store @n copies of the first @size bytes of @pattern at @offset.
+ * The store takes ownership of @pattern (even on error), which must
+ * not be modified afterwards.
+ */
+extern int lazy_repeat (struct lazy *l, struct lazy *pattern,
+                        uint64_t size, uint64_t n, uint64_t offset);
+
+/* Store the content of @filename from @skip to @end (or to the end
+ * of the file if @end == -1) at *@offset, updating *@offset.  Only
+ * large regular files are stored lazily.  Returns 1 if the file was
+ * stored, 0 if the caller should read the file instead, or -1 on
+ * error.
+ */
+extern int lazy_file (struct lazy *l, const char *filename,
+                      uint64_t skip, int64_t end, uint64_t *offset);
+
+#endif /* NBDKIT_DATA_LAZY_H */
@@ -0,0 +1 @@
+./../sh/call.c
\ No newline at end of file
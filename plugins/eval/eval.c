@@ -69,6 +69,7 @@ static const char *known_methods[] = {
   "close",
   "config",
   "config_complete",
+  "coprocess",
   "default_export",
   "dump_plugin",
   "export_description",
@@ -234,6 +235,8 @@ eval_unload (void)
   const char *method = "unload";
   const char *script = get_script (method);
 
+  call_stop_coprocess ();
+
   /* Run the unload method.  Ignore all errors. */
   if (script) {
     const char *args[] = { script, method, NULL };
@@ -0,0 +1 @@
+./../sh/methods.c
\ No newline at end of file
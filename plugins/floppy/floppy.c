@@ -34,12 +34,17 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <nbdkit-plugin.h>
 
+#include "cleanup.h"
+#include "fdcache.h"
+#include "minmax.h"
 #include "regions.h"
 
 #include "virtual-floppy.h"
@@ -56,6 +61,21 @@ static uint64_t size = 0;
 /* Virtual floppy. */
 static struct virtual_floppy floppy;
 
+/* Maximum number of host files kept open. */
+#define MAX_OPEN_FILES 64
+
+/* When a read finishes at the end of a file, this much of the next
+ * file is read ahead.
+ */
+#define READAHEAD_SIZE (128 * 1024)
+
+/* Open host files, shared by all connections.  These are closed
+ * when the last connection closes.
+ */
+static fdcache *fds;
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned connections;
+
 static void
 floppy_load (void)
 {
@@ -66,6 +86,8 @@ static void
 floppy_unload (void)
 {
   free (dir);
+  if (fds)
+    free_fdcache (fds);
   free_virtual_floppy (&floppy);
 }
 
@@ -121,15 +143,32 @@ floppy_config_complete (void)
 static int
 floppy_get_ready (void)
 {
-  return create_virtual_floppy (dir, label, size, &floppy);
+  if (create_virtual_floppy (dir, label, size, &floppy) == -1)
+    return -1;
+
+  fds = new_fdcache (MAX_OPEN_FILES);
+  if (fds == NULL)
+    return -1;
+
+  return 0;
 }
 
 static void *
 floppy_open (int readonly)
 {
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&connections_lock);
+  connections++;
   return NBDKIT_HANDLE_NOT_NEEDED;
 }
 
+static void
+floppy_close (void *handle)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&connections_lock);
+  if (--connections == 0)
+    fdcache_flush (fds);
+}
+
 #define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the file size. */
@@ -158,13 +197,12 @@ floppy_can_cache (void *handle)
 static int
 floppy_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
-  while (count > 0) {
-    const struct region *region = find_region (&floppy.regions, offset);
-    size_t i, len;
-    const char *host_path;
-    int fd;
-    ssize_t r;
+  const struct region *region = find_region (&floppy.regions, offset);
+  const struct region *last = &floppy.regions.ptr[floppy.regions.len-1];
+  bool read_file = false;
+  size_t i, len;
 
+  while (count > 0) {
     /* Length to end of region. */
     len = region->end - offset + 1;
     if (len > count)
@@ -174,25 +212,10 @@ floppy_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
     case region_file:
       i = region->u.i;
       assert (i < floppy.files.len);
-      host_path = floppy.files.ptr[i].host_path;
-      fd = open (host_path, O_RDONLY|O_CLOEXEC);
-      if (fd == -1) {
-        nbdkit_error ("open: %s: %m", host_path);
-        return -1;
-      }
-      r = pread (fd, buf, len, offset - region->start);
-      if (r == -1) {
-        nbdkit_error ("pread: %s: %m", host_path);
-        close (fd);
-        return -1;
-      }
-      if (r == 0) {
-        nbdkit_error ("pread: %s: unexpected end of file", host_path);
-        close (fd);
+      if (fdcache_pread (fds, i, floppy.files.ptr[i].host_path,
+                         buf, len, offset - region->start) == -1)
         return -1;
-      }
-      close (fd);
-      len = r;
+      read_file = true;
       break;
 
     case region_data:
@@ -207,6 +230,27 @@ floppy_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
     count -= len;
     buf += len;
     offset += len;
+
+    /* Regions are contiguous, so a read spanning several regions
+     * (eg. the end of one file and the start of the next) moves to
+     * the next region without looking it up again.
+     */
+    if (count > 0)
+      region++;
+  }
+
+  /* If the read finished at the end of a file, the client is probably
+   * reading files in order, so start reading the next file.
+   */
+  if (read_file &&
+      (region->type == region_zero || offset == region->end + 1)) {
+    for (++region; region <= last && region->type == region_zero; ++region)
+      ;
+    if (region <= last && region->type == region_file) {
+      i = region->u.i;
+      fdcache_readahead (fds, i, floppy.files.ptr[i].host_path,
+                         MIN (region->len, READAHEAD_SIZE), 0);
+    }
   }
 
   return 0;
@@ -224,6 +268,7 @@ static struct nbdkit_plugin plugin = {
   .magic_config_key  = "dir",
   .get_ready         = floppy_get_ready,
   .open              = floppy_open,
+  .close             = floppy_close,
   .get_size          = floppy_get_size,
   .can_multi_conn    = floppy_can_multi_conn,
   .can_cache         = floppy_can_cache,
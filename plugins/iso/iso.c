@@ -34,31 +34,70 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include <nbdkit-plugin.h>
 
 #include "cleanup.h"
+#include "fdcache.h"
+#include "minmax.h"
+#include "regions.h"
 #include "string-vector.h"
 #include "utils.h"
 
+#include "virtual-iso.h"
+
 /* List of directories parsed from the command line. */
 static string_vector dirs = empty_vector;
 
 /* xorriso or genisoimage or mkisofs program, picked at compile time,
  * but can be overridden at run time.
  */
+#ifdef ISOPROG
 static const char *isoprog = ISOPROG;
+#else
+static const char *isoprog = NULL;
+#endif
 
 /* Extra parameters for isoprog. */
 static const char *params = NULL;
 
-/* The temporary ISO. */
+/* Volume label (native mode only). */
+static const char *label = "CDROM";
+
+/* If prog or params is set, run the external program to make a
+ * temporary ISO.  Otherwise the ISO is built in memory.
+ */
+static bool use_isoprog = false;
+
+/* The temporary ISO (external program only). */
 static int fd = -1;
 
+/* Virtual ISO (native mode). */
+static struct virtual_iso iso;
+
+/* Maximum number of host files kept open (native mode). */
+#define MAX_OPEN_FILES 64
+
+/* When a read finishes at the end of a file, this much of the next
+ * file is read ahead.
+ */
+#define READAHEAD_SIZE (128 * 1024)
+
+/* Open host files, shared by all connections.  These are closed
+ * when the last connection closes.
+ */
+static fdcache *fds;
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned connections;
+
 /* Construct the temporary ISO. */
 static int
 make_iso (void)
@@ -125,10 +164,19 @@ make_iso (void)
   return 0;
 }
 
+static void
+iso_load (void)
+{
+  init_virtual_iso (&iso);
+}
+
 static void
 iso_unload (void)
 {
   string_vector_empty (&dirs);
+  if (fds)
+    free_fdcache (fds);
+  free_virtual_iso (&iso);
 
   if (fd >= 0)
     close (fd);
@@ -150,11 +198,16 @@ iso_config (const char *key, const char *value)
       return -1;
     }
   }
+  else if (strcmp (key, "label") == 0) {
+    label = value;
+  }
   else if (strcmp (key, "params") == 0) {
     params = value;
+    use_isoprog = true;
   }
   else if (strcmp (key, "prog") == 0) {
     isoprog = value;
+    use_isoprog = true;
   }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
@@ -173,32 +226,63 @@ iso_config_complete (void)
     return -1;
   }
 
+  if (use_isoprog && isoprog == NULL) {
+    nbdkit_error ("no ISO program was found at compile time, "
+                  "use the prog=<ISOPROG> parameter");
+    return -1;
+  }
+
   return 0;
 }
 
 #define iso_config_help \
   "dir=<DIRECTORY>     (required) The directory to serve.\n" \
+  "label=<LABEL>                  The volume label.\n" \
   "params='<PARAMS>'              Extra parameters to pass.\n" \
   "prog=<ISOPROG>                 The program used to make ISOs." \
 
 static void
 iso_dump_plugin (void)
 {
+#ifdef ISOPROG
   printf ("iso_prog=%s\n", ISOPROG);
+#endif
+  printf ("iso_native=yes\n");
 }
 
 static int
 iso_get_ready (void)
 {
-  return make_iso ();
+  if (use_isoprog)
+    return make_iso ();
+
+  if (create_virtual_iso ((const char **) dirs.ptr, dirs.len, label,
+                          &iso) == -1)
+    return -1;
+
+  fds = new_fdcache (MAX_OPEN_FILES);
+  if (fds == NULL)
+    return -1;
+
+  return 0;
 }
 
 static void *
 iso_open (int readonly)
 {
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&connections_lock);
+  connections++;
   return NBDKIT_HANDLE_NOT_NEEDED;
 }
 
+static void
+iso_close (void *handle)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&connections_lock);
+  if (--connections == 0 && fds)
+    fdcache_flush (fds);
+}
+
 #define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the file size. */
@@ -207,6 +291,9 @@ iso_get_size (void *handle)
 {
   struct stat statbuf;
 
+  if (!use_isoprog)
+    return virtual_size (&iso.regions);
+
   if (fstat (fd, &statbuf) == -1) {
     nbdkit_error ("fstat: %m");
     return -1;
@@ -229,10 +316,77 @@ iso_can_cache (void *handle)
   return NBDKIT_CACHE_EMULATE;
 }
 
+/* Read data from the virtual ISO.  File contents are read from the
+ * host files.
+ */
+static int
+pread_virtual_iso (void *buf, uint32_t count, uint64_t offset)
+{
+  const struct region *region = find_region (&iso.regions, offset);
+  const struct region *last = &iso.regions.ptr[iso.regions.len-1];
+  bool read_file = false;
+  size_t i, len;
+
+  while (count > 0) {
+    /* Length to end of region. */
+    len = region->end - offset + 1;
+    if (len > count)
+      len = count;
+
+    switch (region->type) {
+    case region_file:
+      i = region->u.i;
+      assert (i < iso.files.len);
+      if (fdcache_pread (fds, i, iso.files.ptr[i].host_path,
+                         buf, len, offset - region->start) == -1)
+        return -1;
+      read_file = true;
+      break;
+
+    case region_data:
+      memcpy (buf, &region->u.data[offset - region->start], len);
+      break;
+
+    case region_zero:
+      memset (buf, 0, len);
+      break;
+    }
+
+    count -= len;
+    buf += len;
+    offset += len;
+
+    /* Regions are contiguous, so move to the next region without
+     * looking it up again.
+     */
+    if (count > 0)
+      region++;
+  }
+
+  /* If the read finished at the end of a file, the client is probably
+   * reading files in order, so start reading the next file.
+   */
+  if (read_file &&
+      (region->type == region_zero || offset == region->end + 1)) {
+    for (++region; region <= last && region->type == region_zero; ++region)
+      ;
+    if (region <= last && region->type == region_file) {
+      i = region->u.i;
+      fdcache_readahead (fds, i, iso.files.ptr[i].host_path,
+                         MIN (region->len, READAHEAD_SIZE), 0);
+    }
+  }
+
+  return 0;
+}
+
 /* Read data from the file. */
 static int
 iso_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
+  if (!use_isoprog)
+    return pread_virtual_iso (buf, count, offset);
+
   while (count > 0) {
     ssize_t r = pread (fd, buf, count, offset);
     if (r == -1) {
@@ -255,6 +409,7 @@ static struct nbdkit_plugin plugin = {
   .name              = "iso",
   .longname          = "nbdkit iso plugin",
   .version           = PACKAGE_VERSION,
+  .load              = iso_load,
   .unload            = iso_unload,
   .config            = iso_config,
   .config_complete   = iso_config_complete,
@@ -263,6 +418,7 @@ static struct nbdkit_plugin plugin = {
   .dump_plugin       = iso_dump_plugin,
   .get_ready         = iso_get_ready,
   .open              = iso_open,
+  .close             = iso_close,
   .get_size          = iso_get_size,
   .can_multi_conn    = iso_can_multi_conn,
   .can_cache         = iso_can_cache,
@@ -0,0 +1,1306 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <nbdkit-plugin.h>
+
+#include "byte-swapping.h"
+#include "cleanup.h"
+#include "minmax.h"
+#include "nbdkit-string.h"
+#include "regions.h"
+#include "rounding.h"
+
+#include "virtual-iso.h"
+
+#define APPLICATION_ID "NBDKIT"
+
+/* The first 16 sectors of the ISO are the unused system area. */
+#define SYSTEM_AREA_SECTORS 16
+
+/* Longest directory record. */
+#define MAX_RECORD_LEN 255
+
+/* Rock Ridge extension reference (RRIP 1.10). */
+#define RRIP_ID "RRIP_1991A"
+#define RRIP_DESCRIPTION \
+  "THE ROCK RIDGE INTERCHANGE PROTOCOL PROVIDES SUPPORT FOR " \
+  "POSIX FILE SYSTEM SEMANTICS"
+
+/* A child of a directory, used when sorting. */
+struct child {
+  const string *id;             /* Identifier in the tree being sorted. */
+  bool is_dir;
+  size_t i;                     /* Index in iso->dirs or iso->files. */
+};
+
+static int visit (const char *dir, size_t di, struct virtual_iso *iso);
+static int visit_subdirectory (const char *path, const char *name, const struct stat *statbuf, size_t di, struct virtual_iso *iso);
+static int visit_file (const char *path, const char *name, const struct stat *statbuf, size_t di, struct virtual_iso *iso);
+static int make_ids (size_t di, enum iso_tree t, struct virtual_iso *iso);
+static int make_order (enum iso_tree t, struct virtual_iso *iso);
+static int layout (struct virtual_iso *iso);
+static int create_path_tables (enum iso_tree t, struct virtual_iso *iso);
+static int create_directory (size_t di, enum iso_tree t, struct virtual_iso *iso);
+static void create_volume_descriptor (enum iso_tree t, const char *label, uint32_t nr_sectors, struct virtual_iso *iso);
+static int create_regions (struct virtual_iso *iso);
+
+void
+init_virtual_iso (struct virtual_iso *iso)
+{
+  memset (iso, 0, sizeof *iso);
+  init_regions (&iso->regions);
+
+  /* Assert that the on disk struct sizes are correct. */
+  assert (sizeof (struct iso_dir_record) == 33);
+  assert (sizeof (struct iso_volume_descriptor) == ISO_SECTOR_SIZE);
+}
+
+int
+create_virtual_iso (const char **dirs, size_t nr_dirs, const char *label,
+                    struct virtual_iso *iso)
+{
+  struct iso_dir root;
+  enum iso_tree t;
+  size_t i;
+
+  /* The root directory always exists, even if dirs is empty. */
+  memset (&root, 0, sizeof root);
+  if (nr_dirs > 0 && stat (dirs[0], &root.statbuf) == -1) {
+    nbdkit_error ("stat: %s: %m", dirs[0]);
+    return -1;
+  }
+  if (iso_dirs_append (&iso->dirs, root) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+
+  /* Multiple directories are merged. */
+  for (i = 0; i < nr_dirs; ++i) {
+    if (visit (dirs[i], 0, iso) == -1)
+      return -1;
+  }
+
+  nbdkit_debug ("iso: %zu directories and %zu files",
+                iso->dirs.len, iso->files.len);
+
+  for (t = 0; t < ISO_NR_TREES; ++t) {
+    for (i = 0; i < iso->dirs.len; ++i) {
+      if (make_ids (i, t, iso) == -1)
+        return -1;
+    }
+    if (make_order (t, iso) == -1)
+      return -1;
+  }
+
+  /* Decide where everything goes. */
+  if (layout (iso) == -1)
+    return -1;
+
+  /* Now that we know the location of everything, create the path
+   * tables and directories.
+   */
+  iso_bytes_reset (&iso->continuation);
+  for (t = 0; t < ISO_NR_TREES; ++t) {
+    if (create_path_tables (t, iso) == -1)
+      return -1;
+    for (i = 0; i < iso->dirs.len; ++i) {
+      const uint32_t size = iso->dirs.ptr[i].size[t];
+
+      if (create_directory (i, t, iso) == -1)
+        return -1;
+      assert (iso->dirs.ptr[i].records[t].len == size);
+    }
+    create_volume_descriptor (t, label,
+                              le32toh (iso->vd[t].volume_space_size.le),
+                              iso);
+  }
+
+  /* Volume descriptor set terminator. */
+  iso->terminator[0] = 255;
+  memcpy (&iso->terminator[1], "CD001", 5);
+  iso->terminator[6] = 1;
+
+  return create_regions (iso);
+}
+
+void
+free_virtual_iso (struct virtual_iso *iso)
+{
+  size_t i;
+  enum iso_tree t;
+
+  free_regions (&iso->regions);
+
+  for (t = 0; t < ISO_NR_TREES; ++t) {
+    free (iso->l_path_table[t].ptr);
+    free (iso->m_path_table[t].ptr);
+    free (iso->order[t].ptr);
+  }
+  free (iso->continuation.ptr);
+
+  for (i = 0; i < iso->files.len; ++i) {
+    free (iso->files.ptr[i].name);
+    free (iso->files.ptr[i].host_path);
+    for (t = 0; t < ISO_NR_TREES; ++t)
+      free (iso->files.ptr[i].id[t].ptr);
+  }
+  free (iso->files.ptr);
+
+  for (i = 0; i < iso->dirs.len; ++i) {
+    free (iso->dirs.ptr[i].name);
+    free (iso->dirs.ptr[i].subdirs.ptr);
+    free (iso->dirs.ptr[i].fileidxs.ptr);
+    for (t = 0; t < ISO_NR_TREES; ++t) {
+      free (iso->dirs.ptr[i].id[t].ptr);
+      free (iso->dirs.ptr[i].records[t].ptr);
+    }
+  }
+  free (iso->dirs.ptr);
+}
+
+/* Visit files and directories in the host directory, adding them to
+ * the ISO directory iso->dirs[di].
+ */
+static int
+visit (const char *dir, size_t di, struct virtual_iso *iso)
+{
+  DIR *DIR;
+  struct dirent *d;
+  struct stat statbuf;
+
+  DIR = opendir (dir);
+  if (DIR == NULL) {
+    nbdkit_error ("opendir: %s: %m", dir);
+    return -1;
+  }
+
+  while (errno = 0, (d = readdir (DIR)) != NULL) {
+    CLEANUP_FREE char *path = NULL;
+
+    if (strcmp (d->d_name, ".") == 0 ||
+        strcmp (d->d_name, "..") == 0)
+      continue;
+
+    if (asprintf (&path, "%s/%s", dir, d->d_name) == -1) {
+      nbdkit_error ("asprintf: %m");
+      goto error;
+    }
+    if (lstat (path, &statbuf) == -1) {
+      nbdkit_error ("stat: %s: %m", path);
+      goto error;
+    }
+
+    /* Directory. */
+    if (S_ISDIR (statbuf.st_mode)) {
+      if (visit_subdirectory (path, d->d_name, &statbuf, di, iso) == -1)
+        goto error;
+    }
+    /* Regular file. */
+    else if (S_ISREG (statbuf.st_mode)) {
+      if (visit_file (path, d->d_name, &statbuf, di, iso) == -1)
+        goto error;
+    }
+    /* else ALL other file types are ignored - see documentation. */
+  }
+
+  /* Did readdir fail? */
+  if (errno != 0) {
+    nbdkit_error ("readdir: %s: %m", dir);
+    goto error;
+  }
+
+  if (closedir (DIR) == -1) {
+    nbdkit_error ("closedir: %s: %m", dir);
+    return -1;
+  }
+  return 0;
+
+ error:
+  closedir (DIR);
+  return -1;
+}
+
+/* Return true if directory di already contains a file called name. */
+static bool
+has_file (size_t di, const char *name, const struct virtual_iso *iso)
+{
+  const struct iso_dir *dir = &iso->dirs.ptr[di];
+  size_t i;
+
+  for (i = 0; i < dir->fileidxs.len; ++i) {
+    if (strcmp (iso->files.ptr[dir->fileidxs.ptr[i]].name, name) == 0)
+      return true;
+  }
+  return false;
+}
+
+/* Return the index of the subdirectory of di called name, or 0 if
+ * there is none (0 is the root which cannot be a subdirectory).
+ */
+static size_t
+find_subdirectory (size_t di, const char *name, const struct virtual_iso *iso)
+{
+  const struct iso_dir *dir = &iso->dirs.ptr[di];
+  size_t i;
+
+  for (i = 0; i < dir->subdirs.len; ++i) {
+    if (strcmp (iso->dirs.ptr[dir->subdirs.ptr[i]].name, name) == 0)
+      return dir->subdirs.ptr[i];
+  }
+  return 0;
+}
+
+/* This is called to visit a subdirectory in a directory.  If the ISO
+ * directory already has a subdirectory with the same name (because
+ * of an earlier dir parameter) the contents are merged.
+ */
+static int
+visit_subdirectory (const char *path, const char *name,
+                    const struct stat *statbuf, size_t di,
+                    struct virtual_iso *iso)
+{
+  struct iso_dir new_dir;
+  size_t sdi;
+
+  sdi = find_subdirectory (di, name, iso);
+  if (sdi > 0)
+    return visit (path, sdi, iso);
+
+  if (has_file (di, name, iso)) {
+    nbdkit_error ("%s: cannot merge a directory with a file of the "
+                  "same name", path);
+    return -1;
+  }
+
+  memset (&new_dir, 0, sizeof new_dir);
+  new_dir.pdi = di;
+  new_dir.statbuf = *statbuf;
+  new_dir.name = strdup (name);
+  if (new_dir.name == NULL) {
+    nbdkit_error ("strdup: %m");
+    return -1;
+  }
+  sdi = iso->dirs.len;
+  if (iso_dirs_append (&iso->dirs, new_dir) == -1) {
+    nbdkit_error ("realloc: %m");
+    free (new_dir.name);
+    return -1;
+  }
+
+  /* Add to the list of subdirs in the parent directory (di). */
+  if (iso_idxs_append (&iso->dirs.ptr[di].subdirs, sdi) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+
+  return visit (path, sdi, iso);
+}
+
+/* This is called to visit a file in a directory.  It adds the file
+ * to the global list of files, and to the list of files in the
+ * parent directory.
+ */
+static int
+visit_file (const char *path, const char *name,
+            const struct stat *statbuf, size_t di,
+            struct virtual_iso *iso)
+{
+  struct iso_file new_file;
+  size_t fi;
+
+  if (has_file (di, name, iso) || find_subdirectory (di, name, iso) > 0) {
+    nbdkit_error ("%s: a file or directory with the same name was "
+                  "found in another directory", path);
+    return -1;
+  }
+
+  memset (&new_file, 0, sizeof new_file);
+  new_file.name = strdup (name);
+  new_file.host_path = strdup (path);
+  if (new_file.name == NULL || new_file.host_path == NULL) {
+    nbdkit_error ("strdup: %m");
+    free (new_file.name);
+    free (new_file.host_path);
+    return -1;
+  }
+  new_file.statbuf = *statbuf;
+  fi = iso->files.len;
+  if (iso_files_append (&iso->files, new_file) == -1) {
+    nbdkit_error ("realloc: %m");
+    free (new_file.name);
+    free (new_file.host_path);
+    return -1;
+  }
+
+  /* Add to the list of files in the parent directory (di). */
+  if (iso_idxs_append (&iso->dirs.ptr[di].fileidxs, fi) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Map a character to an ISO 9660 d-character. */
+static char
+d_char (char c)
+{
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 'A';
+  if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_')
+    return c;
+  return '_';
+}
+
+/* Make the identifier used in the primary tree.  This uses upper
+ * case d-characters and ISO 9660 level 2 lengths (up to 30
+ * characters plus the version for files, 31 for directories).  If
+ * n > 0 then a suffix is added to make the identifier unique.
+ */
+static int
+make_primary_id (const char *name, bool is_dir, unsigned n, string *id)
+{
+  const char *dot = is_dir ? NULL : strrchr (name, '.');
+  char suffix[16] = "";
+  size_t base_len, ext_len, max, i;
+
+  if (dot == name)
+    dot = NULL;
+  base_len = dot ? dot - name : strlen (name);
+  ext_len = dot ? MIN (strlen (dot+1), 8) : 0;
+  if (n > 0)
+    snprintf (suffix, sizeof suffix, "~%u", n);
+  max = is_dir ? 31 : 30 - 1 - ext_len;
+  base_len = MIN (base_len, max - strlen (suffix));
+
+  string_reset (id);
+  for (i = 0; i < base_len; ++i) {
+    /* Skip UTF-8 continuation bytes so each character becomes a
+     * single '_'.
+     */
+    if ((name[i] & 0xc0) == 0x80)
+      continue;
+    if (string_append (id, d_char (name[i])) == -1)
+      goto err;
+  }
+  for (i = 0; i < strlen (suffix); ++i) {
+    if (string_append (id, suffix[i]) == -1)
+      goto err;
+  }
+  if (!is_dir) {
+    if (string_append (id, '.') == -1)
+      goto err;
+    for (i = 0; i < ext_len; ++i) {
+      if (string_append (id, d_char (dot[1+i])) == -1)
+        goto err;
+    }
+    if (string_append (id, ';') == -1 || string_append (id, '1') == -1)
+      goto err;
+  }
+  return 0;
+
+ err:
+  nbdkit_error ("realloc: %m");
+  return -1;
+}
+
+/* Decode the next UTF-8 character, returning a UCS-2 character.
+ * Invalid sequences and characters outside the Basic Multilingual
+ * Plane are replaced by '_'.
+ */
+static uint16_t
+next_ucs2 (const char **sp)
+{
+  const unsigned char *s = (const unsigned char *) *sp;
+  uint32_t c;
+  size_t n, i;
+
+  if (s[0] < 0x80) { c = s[0]; n = 0; }
+  else if ((s[0] & 0xe0) == 0xc0) { c = s[0] & 0x1f; n = 1; }
+  else if ((s[0] & 0xf0) == 0xe0) { c = s[0] & 0x0f; n = 2; }
+  else if ((s[0] & 0xf8) == 0xf0) { c = s[0] & 0x07; n = 3; }
+  else { *sp += 1; return '_'; }
+
+  for (i = 1; i <= n; ++i) {
+    if ((s[i] & 0xc0) != 0x80) {
+      *sp += i;
+      return '_';
+    }
+    c = (c << 6) | (s[i] & 0x3f);
+  }
+  *sp += n+1;
+
+  if (c > 0xffff || (c >= 0xd800 && c <= 0xdfff))
+    return '_';
+  /* Characters not allowed in Joliet identifiers. */
+  if (c < 0x20 || c == '*' || c == '/' || c == ':' || c == ';' ||
+      c == '?' || c == '\\')
+    return '_';
+  return c;
+}
+
+static int
+append_ucs2 (string *id, uint16_t c)
+{
+  if (string_append (id, c >> 8) == -1 ||
+      string_append (id, c & 0xff) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  return 0;
+}
+
+/* Make the identifier used in the Joliet tree.  This is the name in
+ * UCS-2 (big endian), up to 64 characters including the version for
+ * files.  If n > 0 then a suffix is added to make the identifier
+ * unique.
+ */
+static int
+make_joliet_id (const char *name, bool is_dir, unsigned n, string *id)
+{
+  uint16_t chars[256];
+  char suffix[16] = "";
+  size_t len = 0, base_len, ext_len = 0, max, i;
+  const char *p = name;
+
+  while (*p && len < sizeof chars / sizeof chars[0])
+    chars[len++] = next_ucs2 (&p);
+
+  /* Keep a short extension when truncating files. */
+  base_len = len;
+  if (!is_dir) {
+    for (i = len; i > 1; --i) {
+      if (chars[i-1] == '.') {
+        if (len - (i-1) <= 16) {
+          base_len = i-1;
+          ext_len = len - base_len;
+        }
+        break;
+      }
+    }
+  }
+  if (n > 0)
+    snprintf (suffix, sizeof suffix, "~%u", n);
+  max = (is_dir ? 64 : 62) - ext_len - strlen (suffix);
+  base_len = MIN (base_len, max);
+
+  string_reset (id);
+  for (i = 0; i < base_len; ++i) {
+    if (append_ucs2 (id, chars[i]) == -1)
+      return -1;
+  }
+  for (i = 0; i < strlen (suffix); ++i) {
+    if (append_ucs2 (id, suffix[i]) == -1)
+      return -1;
+  }
+  for (i = 0; i < ext_len; ++i) {
+    if (append_ucs2 (id, chars[len-ext_len+i]) == -1)
+      return -1;
+  }
+  if (!is_dir) {
+    if (append_ucs2 (id, ';') == -1 || append_ucs2 (id, '1') == -1)
+      return -1;
+  }
+  return 0;
+}
+
+static int
+make_id (enum iso_tree t, const char *name, bool is_dir, unsigned n,
+         string *id)
+{
+  switch (t) {
+  case ISO_PRIMARY: return make_primary_id (name, is_dir, n, id);
+  case ISO_JOLIET: return make_joliet_id (name, is_dir, n, id);
+  default: abort ();
+  }
+}
+
+static int
+compare_ids (const string *id1, const string *id2)
+{
+  int r = memcmp (id1->ptr, id2->ptr, MIN (id1->len, id2->len));
+
+  if (r != 0)
+    return r;
+  return id1->len < id2->len ? -1 : id1->len > id2->len ? 1 : 0;
+}
+
+static int
+compare_children (const void *c1, const void *c2)
+{
+  return compare_ids (((const struct child *) c1)->id,
+                      ((const struct child *) c2)->id);
+}
+
+/* Return the children of directory di sorted by their identifier in
+ * tree t.  The caller must free the array.
+ */
+static struct child *
+sorted_children (size_t di, enum iso_tree t, const struct virtual_iso *iso,
+                 size_t *nr)
+{
+  const struct iso_dir *dir = &iso->dirs.ptr[di];
+  struct child *children;
+  size_t i;
+
+  *nr = dir->subdirs.len + dir->fileidxs.len;
+  children = malloc ((*nr + 1) * sizeof *children);
+  if (children == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+  for (i = 0; i < dir->subdirs.len; ++i) {
+    children[i].i = dir->subdirs.ptr[i];
+    children[i].is_dir = true;
+    children[i].id = &iso->dirs.ptr[children[i].i].id[t];
+  }
+  for (i = 0; i < dir->fileidxs.len; ++i) {
+    children[dir->subdirs.len + i].i = dir->fileidxs.ptr[i];
+    children[dir->subdirs.len + i].is_dir = false;
+    children[dir->subdirs.len + i].id =
+      &iso->files.ptr[dir->fileidxs.ptr[i]].id[t];
+  }
+  qsort (children, *nr, sizeof *children, compare_children);
+  return children;
+}
+
+/* Make the identifiers in tree t of the children of directory di.
+ * Because names are mapped and truncated they might not be unique,
+ * so add suffixes until they are.
+ */
+static int
+make_ids (size_t di, enum iso_tree t, struct virtual_iso *iso)
+{
+  const struct iso_dir *dir = &iso->dirs.ptr[di];
+  CLEANUP_FREE struct child *children = NULL;
+  size_t nr, i;
+  unsigned n = 0;
+  bool changed;
+
+  for (i = 0; i < dir->subdirs.len; ++i) {
+    struct iso_dir *sub = &iso->dirs.ptr[dir->subdirs.ptr[i]];
+    if (make_id (t, sub->name, true, 0, &sub->id[t]) == -1)
+      return -1;
+  }
+  for (i = 0; i < dir->fileidxs.len; ++i) {
+    struct iso_file *file = &iso->files.ptr[dir->fileidxs.ptr[i]];
+    if (make_id (t, file->name, false, 0, &file->id[t]) == -1)
+      return -1;
+  }
+
+  do {
+    free (children);
+    children = sorted_children (di, t, iso, &nr);
+    if (children == NULL)
+      return -1;
+    changed = false;
+    for (i = 1; i < nr; ++i) {
+      if (compare_ids (children[i-1].id, children[i].id) == 0) {
+        const char *name =
+          children[i].is_dir ?
+          iso->dirs.ptr[children[i].i].name :
+          iso->files.ptr[children[i].i].name;
+        if (make_id (t, name, children[i].is_dir, ++n,
+                     (string *) children[i].id) == -1)
+          return -1;
+        changed = true;
+      }
+    }
+  } while (changed);
+
+  return 0;
+}
+
+/* Put the directories of tree t into path table order, which is by
+ * level, then by parent, then by identifier, and number them.
+ */
+static int
+make_order (enum iso_tree t, struct virtual_iso *iso)
+{
+  size_t k, i, nr;
+
+  iso_idxs_reset (&iso->order[t]);
+  if (iso_idxs_append (&iso->order[t], 0) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+
+  for (k = 0; k < iso->order[t].len; ++k) {
+    const size_t di = iso->order[t].ptr[k];
+    CLEANUP_FREE struct child *children = sorted_children (di, t, iso, &nr);
+
+    if (children == NULL)
+      return -1;
+    if (k >= 0xffff) {
+      nbdkit_error ("too many directories for the ISO 9660 path table");
+      return -1;
+    }
+    iso->dirs.ptr[di].number[t] = k+1;
+
+    for (i = 0; i < nr; ++i) {
+      if (children[i].is_dir &&
+          iso_idxs_append (&iso->order[t], children[i].i) == -1) {
+        nbdkit_error ("realloc: %m");
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static int
+append_bytes (iso_bytes *v, const void *data, size_t len)
+{
+  if (v->cap - v->len < len &&
+      iso_bytes_reserve (v, len - (v->cap - v->len)) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  if (data)
+    memcpy (&v->ptr[v->len], data, len);
+  else
+    memset (&v->ptr[v->len], 0, len);
+  v->len += len;
+  return 0;
+}
+
+/* Pad with zeroes to the end of the current sector. */
+static int
+pad_to_sector (iso_bytes *v)
+{
+  return append_bytes (v, NULL, ROUND_UP (v->len, ISO_SECTOR_SIZE) - v->len);
+}
+
+/* Decide where everything goes on disk.  To do this we have to
+ * create the path tables and directories once to find out their
+ * sizes, which do not depend on the locations of anything.
+ */
+static int
+layout (struct virtual_iso *iso)
+{
+  uint64_t sector;
+  enum iso_tree t;
+  size_t i;
+
+  iso_bytes_reset (&iso->continuation);
+  for (t = 0; t < ISO_NR_TREES; ++t) {
+    if (create_path_tables (t, iso) == -1)
+      return -1;
+    for (i = 0; i < iso->dirs.len; ++i) {
+      if (create_directory (i, t, iso) == -1)
+        return -1;
+      if (iso->dirs.ptr[i].records[t].len > UINT32_MAX) {
+        nbdkit_error ("directory is too large");
+        return -1;
+      }
+      iso->dirs.ptr[i].size[t] = iso->dirs.ptr[i].records[t].len;
+    }
+  }
+
+  /* Volume descriptors, then the terminator. */
+  sector = SYSTEM_AREA_SECTORS + ISO_NR_TREES + 1;
+
+  for (t = 0; t < ISO_NR_TREES; ++t) {
+    sector += 2 * DIV_ROUND_UP (iso->l_path_table[t].len, ISO_SECTOR_SIZE);
+  }
+
+  /* Primary directories, the Rock Ridge continuation area, then the
+   * Joliet directories.
+   */
+  for (t = 0; t < ISO_NR_TREES; ++t) {
+    for (i = 0; i < iso->order[t].len; ++i) {
+      struct iso_dir *dir = &iso->dirs.ptr[iso->order[t].ptr[i]];
+
+      dir->extent[t] = sector;
+      sector += dir->size[t] / ISO_SECTOR_SIZE;
+    }
+    if (t == ISO_PRIMARY) {
+      iso->continuation_extent = sector;
+      sector += DIV_ROUND_UP (iso->continuation.len, ISO_SECTOR_SIZE);
+    }
+  }
+
+  /* File data. */
+  for (i = 0; i < iso->files.len; ++i) {
+    struct iso_file *file = &iso->files.ptr[i];
+
+    if (file->statbuf.st_size > 0) {
+      file->extent = sector;
+      sector += DIV_ROUND_UP (file->statbuf.st_size, ISO_SECTOR_SIZE);
+    }
+    else
+      file->extent = 0;
+  }
+
+  if (sector > UINT32_MAX) {
+    nbdkit_error ("disk image is too large for the ISO 9660 format");
+    return -1;
+  }
+
+  for (t = 0; t < ISO_NR_TREES; ++t)
+    create_volume_descriptor (t, NULL, sector, iso);
+
+  nbdkit_debug ("iso: %" PRIu64 " sectors", sector);
+  return 0;
+}
+
+/* Create the L (little endian) and M (big endian) path tables. */
+static int
+create_path_tables (enum iso_tree t, struct virtual_iso *iso)
+{
+  iso_bytes *l = &iso->l_path_table[t], *m = &iso->m_path_table[t];
+  size_t k;
+
+  iso_bytes_reset (l);
+  iso_bytes_reset (m);
+
+  for (k = 0; k < iso->order[t].len; ++k) {
+    const struct iso_dir *dir = &iso->dirs.ptr[iso->order[t].ptr[k]];
+    const struct iso_dir *parent = &iso->dirs.ptr[dir->pdi];
+    const uint8_t root_id = 0;
+    const void *id = k == 0 ? &root_id : (const void *) dir->id[t].ptr;
+    const uint8_t id_len = k == 0 ? 1 : dir->id[t].len;
+    uint8_t header[2];
+    uint32_t extent;
+    uint16_t pnum;
+
+    header[0] = id_len;
+    header[1] = 0;
+    if (append_bytes (l, header, 2) == -1 ||
+        append_bytes (m, header, 2) == -1)
+      return -1;
+    extent = htole32 (dir->extent[t]);
+    pnum = htole16 (parent->number[t]);
+    if (append_bytes (l, &extent, 4) == -1 ||
+        append_bytes (l, &pnum, 2) == -1 ||
+        append_bytes (l, id, id_len) == -1)
+      return -1;
+    extent = htobe32 (dir->extent[t]);
+    pnum = htobe16 (parent->number[t]);
+    if (append_bytes (m, &extent, 4) == -1 ||
+        append_bytes (m, &pnum, 2) == -1 ||
+        append_bytes (m, id, id_len) == -1)
+      return -1;
+    if (id_len & 1) {
+      if (append_bytes (l, NULL, 1) == -1 ||
+          append_bytes (m, NULL, 1) == -1)
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void
+set_both16 (struct iso_both16 *f, uint16_t v)
+{
+  f->le = htole16 (v);
+  f->be = htobe16 (v);
+}
+
+static void
+set_both32 (struct iso_both32 *f, uint32_t v)
+{
+  f->le = htole32 (v);
+  f->be = htobe32 (v);
+}
+
+/* Set the 7 byte date and time used in directory records (UTC). */
+static void
+set_record_date (uint8_t *date, time_t t)
+{
+  struct tm tm;
+
+  memset (date, 0, 7);
+  if (gmtime_r (&t, &tm) == NULL || tm.tm_year < 0 || tm.tm_year > 255)
+    return;
+  date[0] = tm.tm_year;
+  date[1] = tm.tm_mon + 1;
+  date[2] = tm.tm_mday;
+  date[3] = tm.tm_hour;
+  date[4] = tm.tm_min;
+  date[5] = tm.tm_sec;
+}
+
+/* Set the 17 byte date and time used in volume descriptors (UTC). */
+static void
+set_volume_date (uint8_t *date, time_t t)
+{
+  struct tm tm;
+  char s[32];
+
+  memset (date, '0', 16);
+  date[16] = 0;
+  if (t == 0 || gmtime_r (&t, &tm) == NULL ||
+      tm.tm_year < 0 || tm.tm_year > 8099)
+    return;
+  snprintf (s, sizeof s, "%04d%02d%02d%02d%02d%02d00",
+            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+            tm.tm_hour, tm.tm_min, tm.tm_sec);
+  memcpy (date, s, 16);
+}
+
+static void
+put_both32 (uint8_t *p, uint32_t v)
+{
+  struct iso_both32 f;
+
+  set_both32 (&f, v);
+  memcpy (p, &f, sizeof f);
+}
+
+/* Create the Rock Ridge System Use entries for a directory record in
+ * the primary tree.  If name is not NULL, it is stored in NM entries,
+ * either directly in the record or (if the name is too long to fit)
+ * in the continuation area.
+ */
+static int
+rock_ridge (const struct stat *statbuf, uint32_t nlink, const char *name,
+            bool root, size_t record_len, struct virtual_iso *iso,
+            uint8_t *su, size_t *su_len)
+{
+  const size_t id_len = strlen (RRIP_ID), des_len = strlen (RRIP_DESCRIPTION);
+  size_t len = 0, name_len, n, ce_len, ce_offset = 0;
+  uint8_t nm[MAX_RECORD_LEN + 16];
+
+  if (root) {
+    /* SP must be the first entry of the root directory "." record. */
+    const uint8_t sp[7] = { 'S', 'P', 7, 1, 0xbe, 0xef, 0 };
+    memcpy (&su[len], sp, sizeof sp);
+    len += sizeof sp;
+  }
+
+  su[len+0] = 'P';
+  su[len+1] = 'X';
+  su[len+2] = 36;
+  su[len+3] = 1;
+  put_both32 (&su[len+4], statbuf->st_mode);
+  put_both32 (&su[len+12], nlink);
+  put_both32 (&su[len+20], statbuf->st_uid);
+  put_both32 (&su[len+28], statbuf->st_gid);
+  len += 36;
+
+  if (root) {
+    su[len+0] = 'E';
+    su[len+1] = 'R';
+    su[len+2] = 8 + id_len + des_len;
+    su[len+3] = 1;
+    su[len+4] = id_len;
+    su[len+5] = des_len;
+    su[len+6] = 0;              /* length of source */
+    su[len+7] = 1;              /* extension version */
+    memcpy (&su[len+8], RRIP_ID, id_len);
+    memcpy (&su[len+8+id_len], RRIP_DESCRIPTION, des_len);
+    len += 8 + id_len + des_len;
+  }
+
+  if (name) {
+    name_len = strlen (name);
+
+    if (record_len + len + 5 + name_len < MAX_RECORD_LEN) {
+      su[len+0] = 'N';
+      su[len+1] = 'M';
+      su[len+2] = 5 + name_len;
+      su[len+3] = 1;
+      su[len+4] = 0;
+      memcpy (&su[len+5], name, name_len);
+      len += 5 + name_len;
+    }
+    else {
+      /* Put the name into one or more NM entries in the continuation
+       * area, which must not cross a sector boundary.
+       */
+      ce_len = 0;
+      while (name_len > 0) {
+        n = MIN (name_len, MAX_RECORD_LEN - 5);
+        nm[0] = 'N';
+        nm[1] = 'M';
+        nm[2] = 5 + n;
+        nm[3] = 1;
+        nm[4] = n < name_len ? 1 : 0; /* CONTINUE flag */
+        if (ce_len == 0) {
+          ce_offset = iso->continuation.len;
+          if (ce_offset / ISO_SECTOR_SIZE !=
+              (ce_offset + 2 * (MAX_RECORD_LEN + 5)) / ISO_SECTOR_SIZE) {
+            if (pad_to_sector (&iso->continuation) == -1)
+              return -1;
+            ce_offset = iso->continuation.len;
+          }
+        }
+        if (append_bytes (&iso->continuation, nm, 5) == -1 ||
+            append_bytes (&iso->continuation, name, n) == -1)
+          return -1;
+        ce_len += 5 + n;
+        name += n;
+        name_len -= n;
+      }
+
+      su[len+0] = 'C';
+      su[len+1] = 'E';
+      su[len+2] = 28;
+      su[len+3] = 1;
+      put_both32 (&su[len+4],
+                  iso->continuation_extent + ce_offset / ISO_SECTOR_SIZE);
+      put_both32 (&su[len+12], ce_offset % ISO_SECTOR_SIZE);
+      put_both32 (&su[len+20], ce_len);
+      len += 28;
+    }
+  }
+
+  /* The System Use field must have an even length. */
+  if (len & 1)
+    su[len++] = 0;
+
+  *su_len = len;
+  return 0;
+}
+
+/* Append a directory record.  Records may not cross a sector
+ * boundary, so if necessary pad to the next sector first.
+ */
+static int
+append_record (iso_bytes *out, enum iso_tree t,
+               const void *id, size_t id_len,
+               uint32_t extent, uint32_t size, uint8_t flags,
+               const struct stat *statbuf, uint32_t nlink,
+               const char *rr_name, bool root, struct virtual_iso *iso)
+{
+  struct iso_dir_record r;
+  uint8_t su[MAX_RECORD_LEN];
+  size_t len, su_len = 0;
+
+  /* The identifier is padded to make the length even. */
+  len = sizeof r + id_len + (id_len & 1 ? 0 : 1);
+
+  if (t == ISO_PRIMARY) {
+    if (rock_ridge (statbuf, nlink, rr_name, root, len, iso,
+                    su, &su_len) == -1)
+      return -1;
+  }
+  assert (len + su_len <= MAX_RECORD_LEN);
+
+  memset (&r, 0, sizeof r);
+  r.len = len + su_len;
+  set_both32 (&r.extent, extent);
+  set_both32 (&r.size, size);
+  set_record_date (r.date, statbuf->st_mtime);
+  r.flags = flags;
+  set_both16 (&r.volume_seq, 1);
+  r.id_len = id_len;
+
+  if (out->len / ISO_SECTOR_SIZE != (out->len + r.len) / ISO_SECTOR_SIZE &&
+      (out->len + r.len) % ISO_SECTOR_SIZE != 0) {
+    if (pad_to_sector (out) == -1)
+      return -1;
+  }
+
+  if (append_bytes (out, &r, sizeof r) == -1 ||
+      append_bytes (out, id, id_len) == -1 ||
+      append_bytes (out, NULL, len - sizeof r - id_len) == -1 ||
+      append_bytes (out, su, su_len) == -1)
+    return -1;
+  return 0;
+}
+
+/* Create the directory records for directory di in tree t. */
+static int
+create_directory (size_t di, enum iso_tree t, struct virtual_iso *iso)
+{
+  struct iso_dir *dir = &iso->dirs.ptr[di];
+  const struct iso_dir *parent = &iso->dirs.ptr[dir->pdi];
+  iso_bytes *out = &dir->records[t];
+  CLEANUP_FREE struct child *children = NULL;
+  const uint8_t dot = 0, dotdot = 1;
+  size_t nr, i;
+  uint64_t size, offset;
+
+  iso_bytes_reset (out);
+
+  if (append_record (out, t, &dot, 1, dir->extent[t], dir->size[t],
+                     ISO_FLAG_DIRECTORY, &dir->statbuf,
+                     2 + dir->subdirs.len, NULL, di == 0, iso) == -1 ||
+      append_record (out, t, &dotdot, 1, parent->extent[t], parent->size[t],
+                     ISO_FLAG_DIRECTORY, &parent->statbuf,
+                     2 + parent->subdirs.len, NULL, false, iso) == -1)
+    return -1;
+
+  children = sorted_children (di, t, iso, &nr);
+  if (children == NULL)
+    return -1;
+
+  for (i = 0; i < nr; ++i) {
+    const string *id = children[i].id;
+
+    if (children[i].is_dir) {
+      const struct iso_dir *sub = &iso->dirs.ptr[children[i].i];
+
+      if (append_record (out, t, id->ptr, id->len,
+                         sub->extent[t], sub->size[t], ISO_FLAG_DIRECTORY,
+                         &sub->statbuf, 2 + sub->subdirs.len,
+                         sub->name, false, iso) == -1)
+        return -1;
+    }
+    else {
+      const struct iso_file *file = &iso->files.ptr[children[i].i];
+
+      /* Files larger than ISO_MAX_EXTENT are split into several
+       * extents, each with its own directory record.
+       */
+      offset = 0;
+      do {
+        size = MIN (file->statbuf.st_size - offset, ISO_MAX_EXTENT);
+        if (append_record (out, t, id->ptr, id->len,
+                           file->extent + offset / ISO_SECTOR_SIZE, size,
+                           offset + size < file->statbuf.st_size ?
+                           ISO_FLAG_MULTI_EXTENT : 0,
+                           &file->statbuf, 1, file->name, false, iso) == -1)
+          return -1;
+        offset += size;
+      } while (offset < file->statbuf.st_size);
+    }
+  }
+
+  return pad_to_sector (out);
+}
+
+/* Copy a string into a volume descriptor field, padding with spaces.
+ * For Joliet the field is UCS-2.
+ */
+static void
+set_vd_string (enum iso_tree t, uint8_t *field, size_t len, const char *str)
+{
+  size_t i;
+
+  if (t == ISO_PRIMARY) {
+    memset (field, ' ', len);
+    for (i = 0; str && str[i] && i < len; ++i)
+      field[i] = str[i];
+  }
+  else {
+    for (i = 0; i + 1 < len; i += 2) {
+      field[i] = 0;
+      field[i+1] = ' ';
+    }
+    if (len & 1)
+      field[len-1] = 0;
+    for (i = 0; str && *str && 2*i + 1 < len; ++i) {
+      const uint16_t c = next_ucs2 (&str);
+      field[2*i] = c >> 8;
+      field[2*i+1] = c & 0xff;
+    }
+  }
+}
+
+/* Create the volume descriptor for tree t.  This is called once
+ * during layout with label == NULL just to record the sizes, and
+ * again later when everything is known.
+ */
+static void
+create_volume_descriptor (enum iso_tree t, const char *label,
+                          uint32_t nr_sectors, struct virtual_iso *iso)
+{
+  struct iso_volume_descriptor *vd = &iso->vd[t];
+  const struct iso_dir *root = &iso->dirs.ptr[0];
+  const time_t now = time (NULL);
+  uint32_t sector;
+  enum iso_tree t2;
+  char label_d[33];
+  size_t i;
+
+  memset (vd, 0, sizeof *vd);
+  vd->type = t == ISO_PRIMARY ? 1 : 2;
+  memcpy (vd->id, "CD001", 5);
+  vd->version = 1;
+
+  set_vd_string (t, vd->system_id, sizeof vd->system_id, NULL);
+  if (t == ISO_PRIMARY && label) {
+    for (i = 0; label[i] && i < sizeof label_d - 1; ++i)
+      label_d[i] = d_char (label[i]);
+    label_d[i] = '\0';
+    set_vd_string (t, vd->volume_id, sizeof vd->volume_id, label_d);
+  }
+  else
+    set_vd_string (t, vd->volume_id, sizeof vd->volume_id, label);
+  set_both32 (&vd->volume_space_size, nr_sectors);
+  if (t == ISO_JOLIET)
+    memcpy (vd->escape_sequences, "%/E", 3); /* UCS-2 level 3 */
+  set_both16 (&vd->volume_set_size, 1);
+  set_both16 (&vd->volume_seq, 1);
+  set_both16 (&vd->block_size, ISO_SECTOR_SIZE);
+
+  /* Path tables follow the volume descriptors. */
+  sector = SYSTEM_AREA_SECTORS + ISO_NR_TREES + 1;
+  for (t2 = 0; t2 < t; ++t2)
+    sector += 2 * DIV_ROUND_UP (iso->l_path_table[t2].len, ISO_SECTOR_SIZE);
+  set_both32 (&vd->path_table_size, iso->l_path_table[t].len);
+  vd->l_path_table = htole32 (sector);
+  vd->m_path_table =
+    htobe32 (sector + DIV_ROUND_UP (iso->l_path_table[t].len,
+                                    ISO_SECTOR_SIZE));
+
+  vd->root.len = sizeof vd->root + 1;
+  set_both32 (&vd->root.extent, root->extent[t]);
+  set_both32 (&vd->root.size, root->size[t]);
+  set_record_date (vd->root.date, root->statbuf.st_mtime);
+  vd->root.flags = ISO_FLAG_DIRECTORY;
+  set_both16 (&vd->root.volume_seq, 1);
+  vd->root.id_len = 1;
+  vd->root_id = 0;
+
+  set_vd_string (t, vd->volume_set_id, sizeof vd->volume_set_id, NULL);
+  set_vd_string (t, vd->publisher_id, sizeof vd->publisher_id, NULL);
+  set_vd_string (t, vd->preparer_id, sizeof vd->preparer_id, NULL);
+  set_vd_string (t, vd->application_id, sizeof vd->application_id,
+                 APPLICATION_ID);
+  set_vd_string (t, vd->copyright_file_id, sizeof vd->copyright_file_id,
+                 NULL);
+  set_vd_string (t, vd->abstract_file_id, sizeof vd->abstract_file_id,
+                 NULL);
+  set_vd_string (t, vd->biblio_file_id, sizeof vd->biblio_file_id, NULL);
+  set_volume_date (vd->creation_date, now);
+  set_volume_date (vd->modification_date, now);
+  set_volume_date (vd->expiration_date, 0);
+  set_volume_date (vd->effective_date, 0);
+  vd->file_structure_version = 1;
+}
+
+static int
+create_regions (struct virtual_iso *iso)
+{
+  enum iso_tree t;
+  size_t i;
+
+  /* System area. */
+  if (append_region_len (&iso->regions, "system area",
+                         SYSTEM_AREA_SECTORS * ISO_SECTOR_SIZE, 0, 0,
+                         region_zero) == -1)
+    return -1;
+
+  /* Volume descriptors. */
+  for (t = 0; t < ISO_NR_TREES; ++t) {
+    if (append_region_len (&iso->regions,
+                           t == ISO_PRIMARY ?
+                           "primary volume descriptor" :
+                           "Joliet volume descriptor",
+                           ISO_SECTOR_SIZE, 0, 0,
+                           region_data, (void *) &iso->vd[t]) == -1)
+      return -1;
+  }
+  if (append_region_len (&iso->regions, "volume descriptor set terminator",
+                         ISO_SECTOR_SIZE, 0, 0,
+                         region_data, (void *) iso->terminator) == -1)
+    return -1;
+
+  /* Path tables. */
+  for (t = 0; t < ISO_NR_TREES; ++t) {
+    assert (virtual_size (&iso->regions) ==
+            (uint64_t) le32toh (iso->vd[t].l_path_table) * ISO_SECTOR_SIZE);
+    if (append_region_len (&iso->regions, "L path table",
+                           iso->l_path_table[t].len, 0, ISO_SECTOR_SIZE,
+                           region_data,
+                           (void *) iso->l_path_table[t].ptr) == -1)
+      return -1;
+    assert (virtual_size (&iso->regions) ==
+            (uint64_t) be32toh (iso->vd[t].m_path_table) * ISO_SECTOR_SIZE);
+    if (append_region_len (&iso->regions, "M path table",
+                           iso->m_path_table[t].len, 0, ISO_SECTOR_SIZE,
+                           region_data,
+                           (void *) iso->m_path_table[t].ptr) == -1)
+      return -1;
+  }
+
+  /* Directories, in path table order. */
+  for (t = 0; t < ISO_NR_TREES; ++t) {
+    for (i = 0; i < iso->order[t].len; ++i) {
+      const struct iso_dir *dir = &iso->dirs.ptr[iso->order[t].ptr[i]];
+
+      assert (virtual_size (&iso->regions) ==
+              (uint64_t) dir->extent[t] * ISO_SECTOR_SIZE);
+      if (append_region_len (&iso->regions,
+                             i == 0 ? "root directory" : dir->name,
+                             dir->records[t].len, 0, 0,
+                             region_data,
+                             (void *) dir->records[t].ptr) == -1)
+        return -1;
+    }
+
+    if (t == ISO_PRIMARY && iso->continuation.len > 0) {
+      assert (virtual_size (&iso->regions) ==
+              (uint64_t) iso->continuation_extent * ISO_SECTOR_SIZE);
+      if (append_region_len (&iso->regions, "Rock Ridge continuation area",
+                             iso->continuation.len, 0, ISO_SECTOR_SIZE,
+                             region_data,
+                             (void *) iso->continuation.ptr) == -1)
+        return -1;
+    }
+  }
+
+  /* Add all files.  These are read from the host files on demand. */
+  for (i = 0; i < iso->files.len; ++i) {
+    const struct iso_file *file = &iso->files.ptr[i];
+
+    /* Empty files do not occupy any sectors. */
+    if (file->statbuf.st_size == 0)
+      continue;
+
+    assert (virtual_size (&iso->regions) ==
+            (uint64_t) file->extent * ISO_SECTOR_SIZE);
+    if (append_region_len (&iso->regions, file->name,
+                           file->statbuf.st_size, 0, ISO_SECTOR_SIZE,
+                           region_file, i) == -1)
+      return -1;
+  }
+
+  nbdkit_debug ("iso: %zu regions, "
+                "total disk size %" PRIi64,
+                nr_regions (&iso->regions),
+                virtual_size (&iso->regions));
+
+  return 0;
+}
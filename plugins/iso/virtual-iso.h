@@ -0,0 +1,197 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_VIRTUAL_ISO_H
+#define NBDKIT_VIRTUAL_ISO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "nbdkit-string.h"
+#include "regions.h"
+#include "vector.h"
+
+/* This constructs an ISO 9660 image with Rock Ridge (RRIP 1.10) and
+ * Joliet extensions.  Only the directory structure is held in
+ * memory.  File contents are read from the host files on demand.
+ */
+
+#define ISO_SECTOR_SIZE 2048
+
+/* Largest extent.  Larger files are stored in multiple extents. */
+#define ISO_MAX_EXTENT (UINT32_MAX & ~(ISO_SECTOR_SIZE-1))
+
+/* The ISO contains two directory trees: the primary tree, which uses
+ * ISO 9660 names plus Rock Ridge for POSIX names and permissions, and
+ * the Joliet tree, which uses UCS-2 names.  They share file data.
+ */
+enum iso_tree { ISO_PRIMARY = 0, ISO_JOLIET = 1, ISO_NR_TREES = 2 };
+
+DEFINE_VECTOR_TYPE (iso_idxs, size_t);
+DEFINE_VECTOR_TYPE (iso_bytes, uint8_t);
+
+/* Both-endian fields are recorded little endian, then big endian. */
+struct iso_both16 { uint16_t le, be; } __attribute__ ((packed));
+struct iso_both32 { uint32_t le, be; } __attribute__ ((packed));
+
+/* Directory record, not including the file identifier and system use
+ * area which follow.
+ */
+struct iso_dir_record {
+  uint8_t len;                  /* Length of this record. */
+  uint8_t ext_attr_len;         /* Always 0. */
+  struct iso_both32 extent;     /* 0x02 - first sector */
+  struct iso_both32 size;       /* 0x0A - data length in bytes */
+  uint8_t date[7];              /* 0x12 - recording date and time */
+  uint8_t flags;                /* 0x19 */
+#define ISO_FLAG_DIRECTORY    0x02
+#define ISO_FLAG_MULTI_EXTENT 0x80
+  uint8_t file_unit_size;       /* 0x1A - always 0 */
+  uint8_t interleave_gap;       /* 0x1B - always 0 */
+  struct iso_both16 volume_seq; /* 0x1C - always 1 */
+  uint8_t id_len;               /* 0x20 - length of file identifier */
+} __attribute__ ((packed));
+
+/* Primary and supplementary (Joliet) volume descriptor. */
+struct iso_volume_descriptor {
+  uint8_t type;                 /* 1 = primary, 2 = supplementary */
+  uint8_t id[5];                /* "CD001" */
+  uint8_t version;              /* 1 */
+  uint8_t flags;                /* 0 */
+  uint8_t system_id[32];        /* 0x008 */
+  uint8_t volume_id[32];        /* 0x028 */
+  uint8_t unused[8];            /* 0x048 */
+  struct iso_both32 volume_space_size; /* 0x050 - in sectors */
+  uint8_t escape_sequences[32]; /* 0x058 - "%/E" for Joliet */
+  struct iso_both16 volume_set_size;   /* 0x078 */
+  struct iso_both16 volume_seq;        /* 0x07C */
+  struct iso_both16 block_size;        /* 0x080 */
+  struct iso_both32 path_table_size;   /* 0x084 */
+  uint32_t l_path_table;        /* 0x08C - little endian */
+  uint32_t opt_l_path_table;    /* 0x090 */
+  uint32_t m_path_table;        /* 0x094 - big endian */
+  uint32_t opt_m_path_table;    /* 0x098 */
+  struct iso_dir_record root;   /* 0x09C */
+  uint8_t root_id;              /* 0x0BD - root identifier (0) */
+  uint8_t volume_set_id[128];   /* 0x0BE */
+  uint8_t publisher_id[128];    /* 0x13E */
+  uint8_t preparer_id[128];     /* 0x1BE */
+  uint8_t application_id[128];  /* 0x23E */
+  uint8_t copyright_file_id[37]; /* 0x2BE */
+  uint8_t abstract_file_id[37]; /* 0x2E3 */
+  uint8_t biblio_file_id[37];   /* 0x308 */
+  uint8_t creation_date[17];    /* 0x32D */
+  uint8_t modification_date[17]; /* 0x33E */
+  uint8_t expiration_date[17];  /* 0x34F */
+  uint8_t effective_date[17];   /* 0x360 */
+  uint8_t file_structure_version; /* 0x371 - 1 */
+  uint8_t unused2;
+  uint8_t application_use[512]; /* 0x373 */
+  uint8_t unused3[653];         /* 0x573 */
+} __attribute__ ((packed));
+
+struct iso_file {
+  char *name;                   /* Filename. */
+  char *host_path;              /* Path of file on the host. */
+  struct stat statbuf;          /* stat(2) information, including size. */
+  string id[ISO_NR_TREES];      /* File identifier in each tree. */
+  uint32_t extent;              /* First sector containing this file. */
+};
+
+DEFINE_VECTOR_TYPE (iso_files, struct iso_file);
+
+struct iso_dir {
+  size_t pdi;                   /* Link to parent directory (for root, 0). */
+  char *name;                   /* Directory name (for root, NULL). */
+  struct stat statbuf;          /* stat(2) information. */
+  string id[ISO_NR_TREES];      /* Directory identifier in each tree. */
+
+  /* Indexes of subdirectories in the iso->dirs array, and of files
+   * in the iso->files array.
+   */
+  iso_idxs subdirs;
+  iso_idxs fileidxs;
+
+  /* Directory number in the path table, first sector, size in bytes
+   * and on disk directory records, for each tree.
+   */
+  uint32_t number[ISO_NR_TREES];
+  uint32_t extent[ISO_NR_TREES];
+  uint32_t size[ISO_NR_TREES];
+  iso_bytes records[ISO_NR_TREES];
+};
+
+DEFINE_VECTOR_TYPE (iso_dirs, struct iso_dir);
+
+struct virtual_iso {
+  /* Virtual disk layout. */
+  struct regions regions;
+
+  /* Volume descriptors.  [0] is the primary volume descriptor, [1] is
+   * the Joliet supplementary volume descriptor.  The volume
+   * descriptor set terminator follows.
+   */
+  struct iso_volume_descriptor vd[ISO_NR_TREES];
+  uint8_t terminator[ISO_SECTOR_SIZE];
+
+  /* Path tables for each tree (little endian and big endian). */
+  iso_bytes l_path_table[ISO_NR_TREES];
+  iso_bytes m_path_table[ISO_NR_TREES];
+
+  /* Rock Ridge continuation area, for names which do not fit in the
+   * directory record.
+   */
+  iso_bytes continuation;
+  uint32_t continuation_extent;
+
+  /* All regular files found. */
+  iso_files files;
+
+  /* Directories.  dirs[0] == root directory. */
+  iso_dirs dirs;
+
+  /* Directories in path table order for each tree (which is also the
+   * order they are placed on disk).
+   */
+  iso_idxs order[ISO_NR_TREES];
+};
+
+extern void init_virtual_iso (struct virtual_iso *iso)
+  __attribute__ ((__nonnull__ (1)));
+extern int create_virtual_iso (const char **dirs, size_t nr_dirs,
+                               const char *label, struct virtual_iso *iso)
+  __attribute__ ((__nonnull__ (1, 3, 4)));
+extern void free_virtual_iso (struct virtual_iso *iso)
+  __attribute__ ((__nonnull__ (1)));
+
+#endif /* NBDKIT_VIRTUAL_ISO_H */
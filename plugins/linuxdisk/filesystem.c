@@ -61,6 +61,17 @@ create_filesystem (struct virtual_disk *disk)
   CLEANUP_FREE char *filename = NULL;
   int fd = -1;
 
+  /* In virtual mode the filesystem is constructed in memory and the
+   * size is computed exactly, so none of the below is needed.
+   */
+  if (virtual_fs) {
+    if (create_virtual_ext4 (dir, label, size, size_add_estimate,
+                             &disk->ext4) == -1)
+      return -1;
+    disk->filesystem_size = virtual_size (&disk->ext4.regions);
+    return 0;
+  }
+
   /* Estimate the filesystem size and compute the final virtual size
    * of the disk.  We only need to do this if the user didn't specify
    * the exact size on the command line.
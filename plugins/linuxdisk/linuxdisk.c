@@ -39,22 +39,26 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 
 #define NBDKIT_API_VERSION 2
 
 #include <nbdkit-plugin.h>
 
+#include "cleanup.h"
+#include "fdcache.h"
 #include "random.h"
 #include "regions.h"
 
 #include "virtual-disk.h"
 
-/* Directory, label, type, size parameters. */
+/* Directory, label, type, size, virtual parameters. */
 const char *dir;
 const char *label;
-const char *type = "ext2";
+const char *type;        /* default is set in .config_complete */
 int64_t size;
 bool size_add_estimate;  /* if size=+SIZE was used */
+bool virtual_fs;         /* if virtual=true */
 
 /* Virtual disk. */
 static struct virtual_disk disk;
@@ -62,6 +66,12 @@ static struct virtual_disk disk;
 /* Used to create a random GUID for the partition. */
 struct random_state random_state;
 
+/* In virtual mode, host files are kept open (in disk.ext4.fds) until
+ * the last connection closes.
+ */
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned connections;
+
 static void
 linuxdisk_load (void)
 {
@@ -113,6 +123,12 @@ linuxdisk_config (const char *key, const char *value)
     if (size == -1)
       return -1;
   }
+  else if (strcmp (key, "virtual") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    virtual_fs = r;
+  }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -130,6 +146,13 @@ linuxdisk_config_complete (void)
     return -1;
   }
 
+  if (type == NULL)
+    type = virtual_fs ? "ext4" : "ext2";
+  else if (virtual_fs && strcmp (type, "ext4") != 0) {
+    nbdkit_error ("virtual=true can only create type=ext4 filesystems");
+    return -1;
+  }
+
   return 0;
 }
 
@@ -137,7 +160,8 @@ linuxdisk_config_complete (void)
   "dir=<DIRECTORY>  (required) The directory to serve.\n" \
   "label=<LABEL>               The filesystem label.\n" \
   "type=ext2|ext3|ext4         The filesystem type.\n" \
-  "size=[+]<SIZE>              The virtual filesystem size."
+  "size=[+]<SIZE>              The virtual filesystem size.\n" \
+  "virtual=true                Create ext4 in memory without mke2fs."
 
 static int
 linuxdisk_get_ready (void)
@@ -148,9 +172,19 @@ linuxdisk_get_ready (void)
 static void *
 linuxdisk_open (int readonly)
 {
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&connections_lock);
+  connections++;
   return NBDKIT_HANDLE_NOT_NEEDED;
 }
 
+static void
+linuxdisk_close (void *handle)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&connections_lock);
+  if (--connections == 0 && disk.ext4.fds)
+    fdcache_flush (disk.ext4.fds);
+}
+
 #define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the file size. */
@@ -193,8 +227,15 @@ linuxdisk_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
     switch (region->type) {
     case region_file:
       /* We don't use region->u.i since there is only one backing
-       * file, and we have that open already (in ‘disk.fd’).
+       * file, and we have that open already (in ‘disk.fd’), or it
+       * is the virtual filesystem.
        */
+      if (virtual_fs) {
+        if (pread_virtual_ext4 (&disk.ext4, buf, len,
+                                offset - region->start) == -1)
+          return -1;
+        break;
+      }
       r = pread (disk.fd, buf, len, offset - region->start);
       if (r == -1) {
         nbdkit_error ("pread: %m");
@@ -236,6 +277,7 @@ static struct nbdkit_plugin plugin = {
   .magic_config_key  = "dir",
   .get_ready         = linuxdisk_get_ready,
   .open              = linuxdisk_open,
+  .close             = linuxdisk_close,
   .get_size          = linuxdisk_get_size,
   .can_multi_conn    = linuxdisk_can_multi_conn,
   .can_cache         = linuxdisk_can_cache,
@@ -56,6 +56,7 @@ init_virtual_disk (struct virtual_disk *disk)
   disk->fd = -1;
 
   init_regions (&disk->regions);
+  init_virtual_ext4 (&disk->ext4);
 }
 
 int
@@ -114,6 +115,7 @@ free_virtual_disk (struct virtual_disk *disk)
   free (disk->secondary_header);
   if (disk->fd >= 0)
     close (disk->fd);
+  free_virtual_ext4 (&disk->ext4);
 }
 
 /* Lay out the final disk. */
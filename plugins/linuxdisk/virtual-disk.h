@@ -38,11 +38,14 @@
 
 #include "regions.h"
 
+#include "virtual-ext4.h"
+
 extern const char *dir;
 extern const char *label;
 extern const char *type;
 extern int64_t size;
 extern bool size_add_estimate;
+extern bool virtual_fs;
 
 extern struct random_state random_state;
 
@@ -70,8 +73,13 @@ struct virtual_disk {
   /* Unique partition GUID. */
   char guid[16];
 
-  /* File descriptor of the temporary file containing the filesystem. */
+  /* File descriptor of the temporary file containing the filesystem,
+   * or -1 if using the virtual filesystem below.
+   */
   int fd;
+
+  /* Virtual ext4 filesystem (only if virtual=true). */
+  struct virtual_ext4 ext4;
 };
 
 /* virtual-disk.c */
@@ -0,0 +1,1200 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <nbdkit-plugin.h>
+
+#include "byte-swapping.h"
+#include "cleanup.h"
+#include "fdcache.h"
+#include "minmax.h"
+#include "random.h"
+#include "regions.h"
+#include "rounding.h"
+
+#include "virtual-disk.h"
+#include "virtual-ext4.h"
+
+/* Maximum number of host files kept open. */
+#define MAX_OPEN_FILES 64
+
+/* When a read finishes at the end of a file, this much of the next
+ * file is read ahead.
+ */
+#define READAHEAD_SIZE (128 * 1024)
+
+/* Number of extent entries in a tree block, and in the inode. */
+#define EXTENTS_PER_BLOCK \
+  ((EXT4_BLOCK_SIZE - sizeof (struct ext4_extent_header)) / \
+   sizeof (struct ext4_extent))
+#define EXTENTS_IN_INODE 4
+
+/* Symbolic links shorter than this are stored in the inode. */
+#define FAST_SYMLINK_MAX 60
+
+/* Directories with more links than this have link count 1. */
+#define EXT4_LINK_MAX 65000
+
+/* Inode numbers are allocated in order, so the layout of inodes is
+ * described by these.
+ */
+struct layout {
+  uint64_t nr_blocks;           /* Size of the filesystem in blocks. */
+  uint32_t nr_groups;
+  uint32_t inodes_per_group;
+  uint32_t inode_table_blocks;  /* Per group. */
+  uint32_t used_inodes;         /* Including reserved inodes 1-10. */
+  uint64_t gdt_blocks;
+  uint64_t block_bitmaps;       /* First block of each area. */
+  uint64_t inode_bitmaps;
+  uint64_t inode_tables;
+  uint64_t metadata;
+  uint64_t data;
+  uint64_t used_blocks;         /* Blocks [0, used_blocks) are used. */
+};
+
+static int visit (const char *path, size_t di, struct virtual_ext4 *fs);
+static int find_hard_links (struct virtual_ext4 *fs);
+static int assign_inodes (struct virtual_ext4 *fs);
+static uint64_t directory_blocks (const struct virtual_ext4 *fs, size_t di,
+                                  uint8_t *out);
+static uint64_t extent_tree_blocks (uint64_t nr_blocks);
+static int compute_layout (struct virtual_ext4 *fs, int64_t fs_size,
+                           bool size_add, struct layout *l);
+static int create_metadata (struct virtual_ext4 *fs, const struct layout *l);
+static int create_inode_table (struct virtual_ext4 *fs,
+                               const struct layout *l);
+static int create_bitmaps (struct virtual_ext4 *fs, const struct layout *l,
+                           uint8_t **block_bitmaps, uint8_t **inode_bitmaps);
+static int create_superblock (struct virtual_ext4 *fs, const char *fs_label,
+                              const struct layout *l);
+static int create_regions (struct virtual_ext4 *fs, const struct layout *l,
+                           uint8_t **block_bitmaps, uint8_t **inode_bitmaps);
+
+void
+init_virtual_ext4 (struct virtual_ext4 *fs)
+{
+  memset (fs, 0, sizeof *fs);
+  init_regions (&fs->regions);
+
+  /* Assert that the on disk struct sizes are correct. */
+  assert (sizeof (struct ext4_super_block) == 1024);
+  assert (offsetof (struct ext4_super_block, s_log_groups_per_flex) == 0x174);
+  assert (sizeof (struct ext4_group_desc) == 32);
+  assert (sizeof (struct ext4_inode) == EXT4_INODE_SIZE);
+  assert (offsetof (struct ext4_inode, i_extra_isize) == 0x80);
+  assert (sizeof (struct ext4_extent_header) == 12);
+  assert (sizeof (struct ext4_extent) == 12);
+  assert (sizeof (struct ext4_extent_idx) == 12);
+}
+
+/* Iterate over the nodes which own an inode, in inode order (root
+ * first).
+ */
+static inline size_t
+inode_node (const struct virtual_ext4 *fs, size_t k)
+{
+  return k == 0 ? 0 : fs->inodes.ptr[k-1];
+}
+#define nr_inode_nodes(fs) ((fs)->inodes.len + 1)
+
+/* Regular files, directories and long symlinks have data blocks
+ * described by an extent tree.
+ */
+static bool
+has_extents (const struct ext4_node *node)
+{
+  return S_ISREG (node->statbuf.st_mode) || S_ISDIR (node->statbuf.st_mode) ||
+    (S_ISLNK (node->statbuf.st_mode) &&
+     strlen (node->target) >= FAST_SYMLINK_MAX);
+}
+
+int
+create_virtual_ext4 (const char *dirname, const char *fs_label,
+                     int64_t fs_size, bool size_add,
+                     struct virtual_ext4 *fs)
+{
+  struct ext4_node root, lost_found;
+  struct layout l;
+  CLEANUP_FREE uint8_t **block_bitmaps = NULL, **inode_bitmaps = NULL;
+  size_t k;
+
+  memset (&root, 0, sizeof root);
+  if (stat (dirname, &root.statbuf) == -1) {
+    nbdkit_error ("stat: %s: %m", dirname);
+    return -1;
+  }
+  if (!S_ISDIR (root.statbuf.st_mode)) {
+    nbdkit_error ("%s: not a directory", dirname);
+    return -1;
+  }
+
+  /* lost+found is required by e2fsck.  It is the first non-reserved
+   * inode, as created by mke2fs.
+   */
+  memset (&lost_found, 0, sizeof lost_found);
+  lost_found.name = strdup ("lost+found");
+  if (lost_found.name == NULL) {
+    nbdkit_error ("strdup: %m");
+    return -1;
+  }
+  lost_found.statbuf.st_mode = S_IFDIR | 0700;
+  lost_found.statbuf.st_mtime = lost_found.statbuf.st_ctime =
+    lost_found.statbuf.st_atime = time (NULL);
+  lost_found.link = 1;
+
+  if (ext4_nodes_append (&fs->nodes, root) == -1 ||
+      ext4_nodes_append (&fs->nodes, lost_found) == -1 ||
+      ext4_idxs_append (&fs->nodes.ptr[0].children, 1) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+
+  if (visit (dirname, 0, fs) == -1)
+    return -1;
+  if (find_hard_links (fs) == -1)
+    return -1;
+  if (assign_inodes (fs) == -1)
+    return -1;
+
+  /* Work out the size of the data of every inode. */
+  for (k = 0; k < nr_inode_nodes (fs); ++k) {
+    struct ext4_node *node = &fs->nodes.ptr[inode_node (fs, k)];
+
+    if (S_ISREG (node->statbuf.st_mode))
+      node->nr_blocks = DIV_ROUND_UP (node->statbuf.st_size, EXT4_BLOCK_SIZE);
+    else if (S_ISDIR (node->statbuf.st_mode))
+      node->nr_blocks = directory_blocks (fs, inode_node (fs, k), NULL);
+    else if (has_extents (node))
+      node->nr_blocks = 1;
+    if (has_extents (node))
+      node->nr_tree_blocks = extent_tree_blocks (node->nr_blocks);
+  }
+
+  if (compute_layout (fs, fs_size, size_add, &l) == -1)
+    return -1;
+
+  block_bitmaps = calloc (l.nr_groups, sizeof (uint8_t *));
+  inode_bitmaps = calloc (l.nr_groups, sizeof (uint8_t *));
+  if (block_bitmaps == NULL || inode_bitmaps == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+
+  if (create_metadata (fs, &l) == -1 ||
+      create_inode_table (fs, &l) == -1 ||
+      create_bitmaps (fs, &l, block_bitmaps, inode_bitmaps) == -1 ||
+      create_superblock (fs, fs_label, &l) == -1 ||
+      create_regions (fs, &l, block_bitmaps, inode_bitmaps) == -1)
+    return -1;
+
+  fs->fds = new_fdcache (MAX_OPEN_FILES);
+  if (fs->fds == NULL)
+    return -1;
+
+  return 0;
+}
+
+void
+free_virtual_ext4 (struct virtual_ext4 *fs)
+{
+  size_t i;
+
+  if (fs->fds)
+    free_fdcache (fs->fds);
+  free_regions (&fs->regions);
+
+  for (i = 0; i < fs->nodes.len; ++i) {
+    free (fs->nodes.ptr[i].name);
+    free (fs->nodes.ptr[i].host_path);
+    free (fs->nodes.ptr[i].target);
+    free (fs->nodes.ptr[i].children.ptr);
+  }
+  free (fs->nodes.ptr);
+  free (fs->inodes.ptr);
+
+  free (fs->block0);
+  free (fs->gdt);
+  free (fs->ones);
+  free (fs->zeroes);
+  free (fs->inode_padding);
+  for (i = 0; i < fs->bitmaps.len; ++i)
+    free (fs->bitmaps.ptr[i]);
+  free (fs->bitmaps.ptr);
+  free (fs->inode_table.ptr);
+  free (fs->metadata.ptr);
+}
+
+/* Visit the host directory, adding its contents to directory node di. */
+static int
+visit (const char *path, size_t di, struct virtual_ext4 *fs)
+{
+  DIR *DIR;
+  struct dirent *d;
+
+  DIR = opendir (path);
+  if (DIR == NULL) {
+    nbdkit_error ("opendir: %s: %m", path);
+    return -1;
+  }
+
+  while (errno = 0, (d = readdir (DIR)) != NULL) {
+    struct ext4_node node;
+    size_t i;
+
+    if (strcmp (d->d_name, ".") == 0 ||
+        strcmp (d->d_name, "..") == 0)
+      continue;
+
+    /* lost+found is created by us. */
+    if (di == 0 && strcmp (d->d_name, "lost+found") == 0)
+      continue;
+
+    memset (&node, 0, sizeof node);
+    node.parent = di;
+    node.link = i = fs->nodes.len;
+    node.name = strdup (d->d_name);
+    if (node.name == NULL) {
+      nbdkit_error ("strdup: %m");
+      goto error;
+    }
+    if (asprintf (&node.host_path, "%s/%s", path, d->d_name) == -1) {
+      nbdkit_error ("asprintf: %m");
+      free (node.name);
+      goto error;
+    }
+    if (strlen (node.name) > 255) {
+      nbdkit_error ("%s: name is too long for ext4", node.host_path);
+      goto error_node;
+    }
+    if (lstat (node.host_path, &node.statbuf) == -1) {
+      nbdkit_error ("stat: %s: %m", node.host_path);
+      goto error_node;
+    }
+
+    if (S_ISLNK (node.statbuf.st_mode)) {
+      node.target = calloc (1, EXT4_BLOCK_SIZE);
+      if (node.target == NULL) {
+        nbdkit_error ("calloc: %m");
+        goto error_node;
+      }
+      if (readlink (node.host_path, node.target, EXT4_BLOCK_SIZE-1) == -1) {
+        nbdkit_error ("readlink: %s: %m", node.host_path);
+        goto error_node;
+      }
+      node.statbuf.st_size = strlen (node.target);
+    }
+    else if (!S_ISREG (node.statbuf.st_mode) &&
+             !S_ISDIR (node.statbuf.st_mode) &&
+             !S_ISCHR (node.statbuf.st_mode) &&
+             !S_ISBLK (node.statbuf.st_mode) &&
+             !S_ISFIFO (node.statbuf.st_mode) &&
+             !S_ISSOCK (node.statbuf.st_mode)) {
+      nbdkit_debug ("%s: ignoring file of unknown type", node.host_path);
+      free (node.name);
+      free (node.host_path);
+      continue;
+    }
+
+    if (ext4_nodes_append (&fs->nodes, node) == -1) {
+      nbdkit_error ("realloc: %m");
+      goto error_node;
+    }
+    if (ext4_idxs_append (&fs->nodes.ptr[di].children, i) == -1) {
+      nbdkit_error ("realloc: %m");
+      goto error;
+    }
+
+    if (S_ISDIR (node.statbuf.st_mode)) {
+      if (visit (fs->nodes.ptr[i].host_path, i, fs) == -1)
+        goto error;
+    }
+    continue;
+
+  error_node:
+    free (node.name);
+    free (node.host_path);
+    free (node.target);
+    goto error;
+  }
+
+  /* Did readdir fail? */
+  if (errno != 0) {
+    nbdkit_error ("readdir: %s: %m", path);
+    goto error;
+  }
+
+  if (closedir (DIR) == -1) {
+    nbdkit_error ("closedir: %s: %m", path);
+    return -1;
+  }
+  return 0;
+
+ error:
+  closedir (DIR);
+  return -1;
+}
+
+/* Host files with more than one link inside the directory share an
+ * inode.
+ */
+struct host_inode {
+  dev_t dev;
+  ino_t ino;
+  size_t i;
+};
+
+static int
+compare_host_inodes (const void *p1, const void *p2)
+{
+  const struct host_inode *h1 = p1, *h2 = p2;
+
+  if (h1->dev != h2->dev)
+    return h1->dev < h2->dev ? -1 : 1;
+  if (h1->ino != h2->ino)
+    return h1->ino < h2->ino ? -1 : 1;
+  return h1->i < h2->i ? -1 : h1->i > h2->i ? 1 : 0;
+}
+
+static int
+find_hard_links (struct virtual_ext4 *fs)
+{
+  CLEANUP_FREE struct host_inode *h = NULL;
+  size_t i, n = 0, j;
+
+  h = malloc (fs->nodes.len * sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  for (i = 2; i < fs->nodes.len; ++i) {
+    const struct stat *st = &fs->nodes.ptr[i].statbuf;
+
+    if (!S_ISDIR (st->st_mode) && st->st_nlink > 1) {
+      h[n].dev = st->st_dev;
+      h[n].ino = st->st_ino;
+      h[n].i = i;
+      n++;
+    }
+  }
+
+  qsort (h, n, sizeof *h, compare_host_inodes);
+  for (j = 1; j < n; ++j) {
+    if (h[j].dev == h[j-1].dev && h[j].ino == h[j-1].ino)
+      fs->nodes.ptr[h[j].i].link = fs->nodes.ptr[h[j-1].i].link;
+  }
+
+  return 0;
+}
+
+/* Allocate inode numbers and work out link counts. */
+static int
+assign_inodes (struct virtual_ext4 *fs)
+{
+  size_t i, j;
+
+  fs->nodes.ptr[0].ino = EXT4_ROOT_INO;
+  for (i = 1; i < fs->nodes.len; ++i) {
+    struct ext4_node *node = &fs->nodes.ptr[i];
+
+    if (node->link == i) {
+      if (EXT4_FIRST_INO + fs->inodes.len == UINT32_MAX) {
+        nbdkit_error ("too many files for ext4");
+        return -1;
+      }
+      node->ino = EXT4_FIRST_INO + fs->inodes.len;
+      if (ext4_idxs_append (&fs->inodes, i) == -1) {
+        nbdkit_error ("realloc: %m");
+        return -1;
+      }
+    }
+    else
+      node->ino = fs->nodes.ptr[node->link].ino;
+  }
+
+  for (i = 0; i < fs->nodes.len; ++i) {
+    struct ext4_node *node = &fs->nodes.ptr[i];
+
+    if (S_ISDIR (node->statbuf.st_mode)) {
+      node->nlink = 2;
+      for (j = 0; j < node->children.len; ++j) {
+        if (S_ISDIR (fs->nodes.ptr[node->children.ptr[j]].statbuf.st_mode))
+          node->nlink++;
+      }
+      if (node->nlink > EXT4_LINK_MAX)
+        node->nlink = 1;
+    }
+    else
+      fs->nodes.ptr[node->link].nlink++;
+  }
+
+  return 0;
+}
+
+static uint8_t
+file_type (mode_t mode)
+{
+  if (S_ISREG (mode)) return 1;
+  if (S_ISDIR (mode)) return 2;
+  if (S_ISCHR (mode)) return 3;
+  if (S_ISBLK (mode)) return 4;
+  if (S_ISFIFO (mode)) return 5;
+  if (S_ISSOCK (mode)) return 6;
+  if (S_ISLNK (mode)) return 7;
+  return 0;
+}
+
+/* Append a directory entry.  *pos is the offset of the next entry
+ * and *last is the offset of the previous entry, whose record length
+ * is extended if the new entry does not fit in the current block.
+ */
+static void
+append_dir_entry (uint8_t *out, uint64_t *pos, uint64_t *last,
+                  uint32_t ino, const char *name, uint8_t ftype)
+{
+  struct ext4_dir_entry e;
+  const size_t name_len = strlen (name);
+  const size_t rec_len = ROUND_UP (sizeof e + name_len, 4);
+  const uint64_t block_end = ROUND_UP (*pos + 1, EXT4_BLOCK_SIZE);
+
+  if (*pos + rec_len > block_end) {
+    if (out) {
+      struct ext4_dir_entry *prev = (struct ext4_dir_entry *) &out[*last];
+      prev->rec_len = htole16 (block_end - *last);
+    }
+    *pos = block_end;
+  }
+
+  if (out) {
+    e.inode = htole32 (ino);
+    e.rec_len = htole16 (rec_len);
+    e.name_len = name_len;
+    e.file_type = ftype;
+    memcpy (&out[*pos], &e, sizeof e);
+    memcpy (&out[*pos + sizeof e], name, name_len);
+  }
+  *last = *pos;
+  *pos += rec_len;
+}
+
+/* Create the contents of directory di in out, and return the number
+ * of blocks.  If out is NULL, this only returns the number of blocks.
+ */
+static uint64_t
+directory_blocks (const struct virtual_ext4 *fs, size_t di, uint8_t *out)
+{
+  const struct ext4_node *node = &fs->nodes.ptr[di];
+  uint64_t pos = 0, last = 0, nr_blocks;
+  size_t j;
+
+  append_dir_entry (out, &pos, &last, node->ino, ".", 2);
+  append_dir_entry (out, &pos, &last, fs->nodes.ptr[node->parent].ino, "..", 2);
+  for (j = 0; j < node->children.len; ++j) {
+    const struct ext4_node *child = &fs->nodes.ptr[node->children.ptr[j]];
+
+    append_dir_entry (out, &pos, &last, child->ino, child->name,
+                      file_type (child->statbuf.st_mode));
+  }
+
+  /* The last entry extends to the end of the block. */
+  nr_blocks = DIV_ROUND_UP (pos, EXT4_BLOCK_SIZE);
+  if (out) {
+    struct ext4_dir_entry *prev = (struct ext4_dir_entry *) &out[last];
+    prev->rec_len = htole16 (nr_blocks * EXT4_BLOCK_SIZE - last);
+  }
+  return nr_blocks;
+}
+
+/* Number of extent tree blocks needed for nr_blocks contiguous
+ * blocks, which need one extent per EXT4_MAX_EXTENT_LEN blocks.
+ */
+static uint64_t
+extent_tree_blocks (uint64_t nr_blocks)
+{
+  uint64_t n = DIV_ROUND_UP (nr_blocks, EXT4_MAX_EXTENT_LEN), ret = 0;
+
+  while (n > EXTENTS_IN_INODE) {
+    n = DIV_ROUND_UP (n, EXTENTS_PER_BLOCK);
+    ret += n;
+  }
+  return ret;
+}
+
+/* Write one node of an extent tree containing entries first ..
+ * first+n-1 at the given depth.  Entry c at depth 0 is the extent
+ * for logical blocks c*span ..  At higher depths entry c points to
+ * tree block child_base + c.
+ */
+static void
+write_extent_node (uint8_t *out, const struct ext4_node *node,
+                   unsigned depth, unsigned max, uint64_t first,
+                   unsigned n, uint64_t span, uint64_t child_base)
+{
+  struct ext4_extent_header h;
+  unsigned k;
+
+  h.eh_magic = htole16 (EXT4_EXTENT_MAGIC);
+  h.eh_entries = htole16 (n);
+  h.eh_max = htole16 (max);
+  h.eh_depth = htole16 (depth);
+  h.eh_generation = 0;
+  memcpy (out, &h, sizeof h);
+  out += sizeof h;
+
+  for (k = 0; k < n; ++k) {
+    const uint64_t c = first + k;
+
+    if (depth == 0) {
+      const uint64_t start = node->block + c * span;
+      struct ext4_extent e;
+
+      e.ee_block = htole32 (c * span);
+      e.ee_len = htole16 (MIN (span, node->nr_blocks - c * span));
+      e.ee_start_hi = htole16 (start >> 32);
+      e.ee_start_lo = htole32 (start & 0xffffffff);
+      memcpy (out, &e, sizeof e);
+      out += sizeof e;
+    }
+    else {
+      const uint64_t leaf = child_base + c;
+      struct ext4_extent_idx ei;
+
+      ei.ei_block = htole32 (c * span);
+      ei.ei_leaf_lo = htole32 (leaf & 0xffffffff);
+      ei.ei_leaf_hi = htole16 (leaf >> 32);
+      ei.ei_unused = 0;
+      memcpy (out, &ei, sizeof ei);
+      out += sizeof ei;
+    }
+  }
+}
+
+/* Write the extent tree of a node into i_block and (for large files)
+ * the tree blocks, which must have been allocated at
+ * node->tree_block.
+ */
+static void
+write_extent_tree (const struct ext4_node *node, uint8_t *i_block,
+                   uint8_t *tree)
+{
+  uint64_t n = DIV_ROUND_UP (node->nr_blocks, EXT4_MAX_EXTENT_LEN);
+  uint64_t span = EXT4_MAX_EXTENT_LEN;
+  uint64_t base = node->tree_block, child_base = 0, b, nr;
+  unsigned depth = 0;
+
+  while (n > EXTENTS_IN_INODE) {
+    nr = DIV_ROUND_UP (n, EXTENTS_PER_BLOCK);
+    for (b = 0; b < nr; ++b) {
+      write_extent_node (tree, node, depth, EXTENTS_PER_BLOCK,
+                         b * EXTENTS_PER_BLOCK,
+                         MIN (EXTENTS_PER_BLOCK, n - b * EXTENTS_PER_BLOCK),
+                         span, child_base);
+      tree += EXT4_BLOCK_SIZE;
+    }
+    child_base = base;
+    base += nr;
+    span *= EXTENTS_PER_BLOCK;
+    n = nr;
+    depth++;
+  }
+  assert (base == node->tree_block + node->nr_tree_blocks);
+
+  write_extent_node (i_block, node, depth, EXTENTS_IN_INODE,
+                     0, n, span, child_base);
+}
+
+static int
+compute_layout (struct virtual_ext4 *fs, int64_t fs_size, bool size_add,
+                struct layout *l)
+{
+  uint64_t metadata = 0, data = 0, overhead, need;
+  size_t k;
+
+  for (k = 0; k < nr_inode_nodes (fs); ++k) {
+    const struct ext4_node *node = &fs->nodes.ptr[inode_node (fs, k)];
+
+    metadata += node->nr_tree_blocks;
+    if (S_ISREG (node->statbuf.st_mode))
+      data += node->nr_blocks;
+    else
+      metadata += node->nr_blocks;
+  }
+
+  memset (l, 0, sizeof *l);
+  l->used_inodes = EXT4_FIRST_INO - 1 + fs->inodes.len;
+  l->nr_groups = 1;
+
+  /* The number of groups depends on the size of the metadata, which
+   * depends on the number of groups, so iterate until it is stable.
+   */
+  for (;;) {
+    l->nr_groups = MAX (l->nr_groups,
+                        DIV_ROUND_UP (l->used_inodes, EXT4_BLOCKS_PER_GROUP));
+    l->inodes_per_group = ROUND_UP (DIV_ROUND_UP (l->used_inodes,
+                                                  l->nr_groups),
+                                    EXT4_BLOCK_SIZE / EXT4_INODE_SIZE);
+    l->inode_table_blocks =
+      l->inodes_per_group / (EXT4_BLOCK_SIZE / EXT4_INODE_SIZE);
+    l->gdt_blocks = DIV_ROUND_UP ((uint64_t) l->nr_groups *
+                                  sizeof (struct ext4_group_desc),
+                                  EXT4_BLOCK_SIZE);
+    overhead = 1 + l->gdt_blocks + 2 * (uint64_t) l->nr_groups +
+      (uint64_t) l->nr_groups * l->inode_table_blocks;
+    l->used_blocks = overhead + metadata + data;
+
+    if (size_add)
+      l->nr_blocks = l->used_blocks + DIV_ROUND_UP (fs_size, EXT4_BLOCK_SIZE);
+    else
+      l->nr_blocks = MAX (l->used_blocks, fs_size / EXT4_BLOCK_SIZE);
+
+    if (l->nr_blocks > UINT32_MAX) {
+      nbdkit_error ("filesystem is too large for ext4 without "
+                    "the 64bit feature");
+      return -1;
+    }
+    need = DIV_ROUND_UP (l->nr_blocks, EXT4_BLOCKS_PER_GROUP);
+    if (need <= l->nr_groups)
+      break;
+    l->nr_groups = need;
+  }
+
+  if (!size_add && fs_size > 0 &&
+      fs_size / EXT4_BLOCK_SIZE < l->used_blocks) {
+    nbdkit_error ("size is too small: the filesystem needs at least "
+                  "%" PRIu64 " bytes", l->used_blocks * EXT4_BLOCK_SIZE);
+    return -1;
+  }
+
+  /* The last group must not be empty. */
+  l->nr_blocks = MAX (l->nr_blocks,
+                      (uint64_t) (l->nr_groups - 1) * EXT4_BLOCKS_PER_GROUP
+                      + 1);
+
+  l->block_bitmaps = 1 + l->gdt_blocks;
+  l->inode_bitmaps = l->block_bitmaps + l->nr_groups;
+  l->inode_tables = l->inode_bitmaps + l->nr_groups;
+  l->metadata = l->inode_tables +
+    (uint64_t) l->nr_groups * l->inode_table_blocks;
+  l->data = l->metadata + metadata;
+  assert (l->data + data == l->used_blocks);
+
+  nbdkit_debug ("ext4: %zu inodes, %" PRIu64 " blocks, %" PRIu32 " groups, "
+                "%" PRIu64 " metadata blocks, %" PRIu64 " data blocks",
+                fs->inodes.len + 1, l->nr_blocks, l->nr_groups,
+                l->data, data);
+  return 0;
+}
+
+/* Allocate blocks and create directories, extent trees and long
+ * symbolic links.
+ */
+static int
+create_metadata (struct virtual_ext4 *fs, const struct layout *l)
+{
+  uint64_t meta = l->metadata, data = l->data, nr;
+  size_t k;
+
+  /* Allocate blocks. */
+  for (k = 0; k < nr_inode_nodes (fs); ++k) {
+    struct ext4_node *node = &fs->nodes.ptr[inode_node (fs, k)];
+
+    if (S_ISREG (node->statbuf.st_mode)) {
+      node->block = data;
+      data += node->nr_blocks;
+    }
+    else {
+      node->block = meta;
+      meta += node->nr_blocks;
+    }
+    node->tree_block = meta;
+    meta += node->nr_tree_blocks;
+  }
+  assert (meta == l->data);
+  assert (data == l->used_blocks);
+
+  nr = (l->data - l->metadata) * EXT4_BLOCK_SIZE;
+  if (ext4_bytes_reserve (&fs->metadata, nr) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  memset (fs->metadata.ptr, 0, nr);
+  fs->metadata.len = nr;
+
+#define METADATA(block) \
+  (&fs->metadata.ptr[((block) - l->metadata) * EXT4_BLOCK_SIZE])
+
+  for (k = 0; k < nr_inode_nodes (fs); ++k) {
+    const size_t i = inode_node (fs, k);
+    struct ext4_node *node = &fs->nodes.ptr[i];
+
+    if (S_ISDIR (node->statbuf.st_mode)) {
+      nr = directory_blocks (fs, i, METADATA (node->block));
+      assert (nr == node->nr_blocks);
+    }
+    else if (S_ISLNK (node->statbuf.st_mode) && node->nr_blocks > 0)
+      memcpy (METADATA (node->block), node->target, strlen (node->target));
+  }
+  return 0;
+}
+
+/* Inode times are stored as the low 32 bits of the seconds, and an
+ * extra field containing the nanoseconds and the epoch bits.
+ */
+static uint32_t
+inode_time (const struct timespec *ts)
+{
+  return htole32 ((uint64_t) ts->tv_sec & 0xffffffff);
+}
+
+static uint32_t
+inode_time_extra (const struct timespec *ts)
+{
+  const int64_t sec = ts->tv_sec;
+
+  return htole32 (((uint32_t) ts->tv_nsec << 2) |
+                  (((sec - (int32_t) sec) >> 32) & 3));
+}
+
+static int
+create_inode_table (struct virtual_ext4 *fs, const struct layout *l)
+{
+  const size_t nr = (size_t) l->used_inodes * EXT4_INODE_SIZE;
+  size_t k;
+
+  if (ext4_bytes_reserve (&fs->inode_table, nr) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  memset (fs->inode_table.ptr, 0, nr);
+  fs->inode_table.len = nr;
+
+  for (k = 0; k < nr_inode_nodes (fs); ++k) {
+    const struct ext4_node *node = &fs->nodes.ptr[inode_node (fs, k)];
+    struct ext4_inode *inode =
+      (struct ext4_inode *)
+      &fs->inode_table.ptr[(node->ino - 1) * EXT4_INODE_SIZE];
+    uint8_t *i_block =
+      (uint8_t *) inode + offsetof (struct ext4_inode, i_block);
+    const struct stat *st = &node->statbuf;
+    const mode_t mode = st->st_mode;
+    uint64_t i_size, blocks;
+
+    inode->i_mode = htole16 (mode);
+    inode->i_uid = htole16 (st->st_uid & 0xffff);
+    inode->i_uid_high = htole16 (st->st_uid >> 16);
+    inode->i_gid = htole16 (st->st_gid & 0xffff);
+    inode->i_gid_high = htole16 (st->st_gid >> 16);
+    inode->i_links_count = htole16 (node->nlink);
+    inode->i_extra_isize =
+      htole16 (offsetof (struct ext4_inode, i_unused) -
+               offsetof (struct ext4_inode, i_extra_isize));
+    inode->i_atime = inode_time (&st->st_atim);
+    inode->i_atime_extra = inode_time_extra (&st->st_atim);
+    inode->i_ctime = inode_time (&st->st_ctim);
+    inode->i_ctime_extra = inode_time_extra (&st->st_ctim);
+    inode->i_mtime = inode_time (&st->st_mtim);
+    inode->i_mtime_extra = inode_time_extra (&st->st_mtim);
+    inode->i_crtime = inode->i_mtime;
+    inode->i_crtime_extra = inode->i_mtime_extra;
+
+    if (S_ISREG (mode) || S_ISLNK (mode))
+      i_size = st->st_size;
+    else if (S_ISDIR (mode))
+      i_size = node->nr_blocks * EXT4_BLOCK_SIZE;
+    else
+      i_size = 0;
+    inode->i_size_lo = htole32 (i_size & 0xffffffff);
+    inode->i_size_high = htole32 (i_size >> 32);
+
+    blocks = (node->nr_blocks + node->nr_tree_blocks) * (EXT4_BLOCK_SIZE / 512);
+    inode->i_blocks_lo = htole32 (blocks & 0xffffffff);
+    inode->i_blocks_high = htole16 (blocks >> 32);
+
+    if (has_extents (node)) {
+      inode->i_flags = htole32 (EXT4_EXTENTS_FL);
+      write_extent_tree (node, i_block,
+                         node->nr_tree_blocks > 0 ?
+                         METADATA (node->tree_block) : NULL);
+    }
+    else if (S_ISLNK (mode))
+      memcpy (i_block, node->target, strlen (node->target));
+    else if (S_ISCHR (mode) || S_ISBLK (mode)) {
+      const unsigned ma = major (st->st_rdev), mi = minor (st->st_rdev);
+
+      if (ma < 256 && mi < 256)
+        inode->i_block[0] = htole32 (ma << 8 | mi);
+      else
+        inode->i_block[1] =
+          htole32 ((mi & 0xff) | (ma << 8) | ((mi & ~0xff) << 12));
+    }
+  }
+
+  return 0;
+}
+
+/* Set bits [from, to) in a bitmap block. */
+static void
+set_bits (uint8_t *bitmap, uint64_t from, uint64_t to)
+{
+  for (; from < to && (from & 7) != 0; ++from)
+    bitmap[from >> 3] |= 1 << (from & 7);
+  for (; from + 8 <= to; from += 8)
+    bitmap[from >> 3] = 0xff;
+  for (; from < to; ++from)
+    bitmap[from >> 3] |= 1 << (from & 7);
+}
+
+static uint8_t *
+new_bitmap (struct virtual_ext4 *fs)
+{
+  uint8_t *bitmap = calloc (1, EXT4_BLOCK_SIZE);
+
+  if (bitmap == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  if (ext4_buffers_append (&fs->bitmaps, bitmap) == -1) {
+    nbdkit_error ("realloc: %m");
+    free (bitmap);
+    return NULL;
+  }
+  return bitmap;
+}
+
+/* Create the block and inode bitmaps and the group descriptors.
+ * Blocks [0, used_blocks) and inodes [1, used_inodes] are used.  In
+ * the last group, bits for blocks past the end of the filesystem are
+ * set, and in every group bits past inodes_per_group are set.
+ */
+static int
+create_bitmaps (struct virtual_ext4 *fs, const struct layout *l,
+                uint8_t **block_bitmaps, uint8_t **inode_bitmaps)
+{
+  const uint64_t bpg = EXT4_BLOCKS_PER_GROUP, ipg = l->inodes_per_group;
+  struct ext4_group_desc *gd;
+  uint64_t g, start, end;
+  size_t k;
+
+  fs->ones = malloc (EXT4_BLOCK_SIZE);
+  fs->zeroes = calloc (1, EXT4_BLOCK_SIZE);
+  fs->inode_padding = calloc (1, EXT4_BLOCK_SIZE);
+  fs->gdt = calloc (l->gdt_blocks, EXT4_BLOCK_SIZE);
+  if (fs->ones == NULL || fs->zeroes == NULL ||
+      fs->inode_padding == NULL || fs->gdt == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  memset (fs->ones, 0xff, EXT4_BLOCK_SIZE);
+  set_bits (fs->inode_padding, ipg, bpg);
+  gd = (struct ext4_group_desc *) fs->gdt;
+
+  for (g = 0; g < l->nr_groups; ++g) {
+    /* Block bitmap. */
+    start = g * bpg;
+    end = start + bpg;
+    if (end <= l->used_blocks)
+      block_bitmaps[g] = fs->ones;
+    else if (start >= l->used_blocks && end <= l->nr_blocks)
+      block_bitmaps[g] = fs->zeroes;
+    else {
+      block_bitmaps[g] = new_bitmap (fs);
+      if (block_bitmaps[g] == NULL)
+        return -1;
+      if (l->used_blocks > start)
+        set_bits (block_bitmaps[g], 0, l->used_blocks - start);
+      if (l->nr_blocks < end)
+        set_bits (block_bitmaps[g], l->nr_blocks - start, bpg);
+    }
+    end = MIN (end, l->nr_blocks);
+    gd[g].bg_free_blocks_count_lo =
+      htole16 (end - MIN (end, MAX (start, l->used_blocks)));
+
+    /* Inode bitmap. */
+    start = g * ipg;
+    end = start + ipg;
+    if (end <= l->used_inodes)
+      inode_bitmaps[g] = fs->ones;
+    else if (start >= l->used_inodes)
+      inode_bitmaps[g] = fs->inode_padding;
+    else {
+      inode_bitmaps[g] = new_bitmap (fs);
+      if (inode_bitmaps[g] == NULL)
+        return -1;
+      set_bits (inode_bitmaps[g], 0, l->used_inodes - start);
+      set_bits (inode_bitmaps[g], ipg, bpg);
+    }
+    gd[g].bg_free_inodes_count_lo =
+      htole16 (end - MAX (start, MIN (end, l->used_inodes)));
+
+    gd[g].bg_block_bitmap_lo = htole32 (l->block_bitmaps + g);
+    gd[g].bg_inode_bitmap_lo = htole32 (l->inode_bitmaps + g);
+    gd[g].bg_inode_table_lo = htole32 (l->inode_tables +
+                                       g * l->inode_table_blocks);
+  }
+
+  /* Count directories in each group. */
+  for (k = 0; k < nr_inode_nodes (fs); ++k) {
+    const struct ext4_node *node = &fs->nodes.ptr[inode_node (fs, k)];
+
+    if (S_ISDIR (node->statbuf.st_mode)) {
+      g = (node->ino - 1) / ipg;
+      gd[g].bg_used_dirs_count_lo =
+        htole16 (le16toh (gd[g].bg_used_dirs_count_lo) + 1);
+    }
+  }
+
+  return 0;
+}
+
+static int
+create_superblock (struct virtual_ext4 *fs, const char *fs_label,
+                   const struct layout *l)
+{
+  struct ext4_super_block *sb;
+  const uint32_t now = time (NULL);
+  size_t i;
+
+  fs->block0 = calloc (1, EXT4_BLOCK_SIZE);
+  if (fs->block0 == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  sb = (struct ext4_super_block *) &fs->block0[1024];
+
+  sb->s_inodes_count = htole32 (l->nr_groups * l->inodes_per_group);
+  sb->s_blocks_count_lo = htole32 (l->nr_blocks);
+  sb->s_free_blocks_count_lo = htole32 (l->nr_blocks - l->used_blocks);
+  sb->s_free_inodes_count =
+    htole32 (l->nr_groups * l->inodes_per_group - l->used_inodes);
+  sb->s_first_data_block = 0;
+  sb->s_log_block_size = htole32 (2); /* 1024 << 2 == 4096 */
+  sb->s_log_cluster_size = htole32 (2);
+  sb->s_blocks_per_group = htole32 (EXT4_BLOCKS_PER_GROUP);
+  sb->s_clusters_per_group = htole32 (EXT4_BLOCKS_PER_GROUP);
+  sb->s_inodes_per_group = htole32 (l->inodes_per_group);
+  sb->s_wtime = htole32 (now);
+  sb->s_max_mnt_count = htole16 (0xffff);
+  sb->s_magic = htole16 (EXT4_SUPER_MAGIC);
+  sb->s_state = htole16 (1);    /* cleanly unmounted */
+  sb->s_errors = htole16 (1);   /* continue */
+  sb->s_lastcheck = htole32 (now);
+  sb->s_rev_level = htole32 (1);
+  sb->s_first_ino = htole32 (EXT4_FIRST_INO);
+  sb->s_inode_size = htole16 (EXT4_INODE_SIZE);
+  sb->s_feature_compat = htole32 (EXT4_FEATURE_COMPAT_SPARSE_SUPER2);
+  sb->s_feature_incompat = htole32 (EXT4_FEATURE_INCOMPAT_FILETYPE |
+                                    EXT4_FEATURE_INCOMPAT_EXTENTS |
+                                    EXT4_FEATURE_INCOMPAT_FLEX_BG);
+  sb->s_feature_ro_compat = htole32 (EXT4_FEATURE_RO_COMPAT_LARGE_FILE |
+                                     EXT4_FEATURE_RO_COMPAT_HUGE_FILE |
+                                     EXT4_FEATURE_RO_COMPAT_DIR_NLINK |
+                                     EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE);
+  for (i = 0; i < sizeof sb->s_uuid; ++i)
+    sb->s_uuid[i] = xrandom (&random_state) & 0xff;
+  sb->s_uuid[6] = (sb->s_uuid[6] & 0x0f) | 0x40; /* version 4 */
+  sb->s_uuid[8] = (sb->s_uuid[8] & 0x3f) | 0x80; /* variant */
+  /* The label is not necessarily NUL-terminated. */
+  if (fs_label)
+    memcpy (sb->s_volume_name, fs_label,
+            MIN (strlen (fs_label), sizeof sb->s_volume_name));
+  for (i = 0; i < 4; ++i)
+    sb->s_hash_seed[i] = htole32 (xrandom (&random_state));
+  sb->s_def_hash_version = 1;   /* half MD4 */
+  sb->s_mkfs_time = htole32 (now);
+  sb->s_min_extra_isize = sb->s_want_extra_isize =
+    htole16 (offsetof (struct ext4_inode, i_unused) -
+             offsetof (struct ext4_inode, i_extra_isize));
+  sb->s_flags =
+    htole32 ((char) -1 < 0 ? EXT4_FLAGS_SIGNED_HASH : EXT4_FLAGS_UNSIGNED_HASH);
+  sb->s_log_groups_per_flex = 4;
+  /* sparse_super2 with no backup superblocks. */
+  sb->s_backup_bgs[0] = sb->s_backup_bgs[1] = 0;
+
+  return 0;
+}
+
+static int
+create_regions (struct virtual_ext4 *fs, const struct layout *l,
+                uint8_t **block_bitmaps, uint8_t **inode_bitmaps)
+{
+  uint64_t g, len;
+  size_t k;
+
+  if (append_region_len (&fs->regions, "superblock",
+                         EXT4_BLOCK_SIZE, 0, 0,
+                         region_data, (void *) fs->block0) == -1)
+    return -1;
+  if (append_region_len (&fs->regions, "group descriptors",
+                         l->gdt_blocks * EXT4_BLOCK_SIZE, 0, 0,
+                         region_data, (void *) fs->gdt) == -1)
+    return -1;
+
+  assert (virtual_size (&fs->regions) == l->block_bitmaps * EXT4_BLOCK_SIZE);
+  for (g = 0; g < l->nr_groups; ++g) {
+    if (append_region_len (&fs->regions, "block bitmap",
+                           EXT4_BLOCK_SIZE, 0, 0,
+                           region_data, (void *) block_bitmaps[g]) == -1)
+      return -1;
+  }
+  for (g = 0; g < l->nr_groups; ++g) {
+    if (append_region_len (&fs->regions, "inode bitmap",
+                           EXT4_BLOCK_SIZE, 0, 0,
+                           region_data, (void *) inode_bitmaps[g]) == -1)
+      return -1;
+  }
+
+  assert (virtual_size (&fs->regions) == l->inode_tables * EXT4_BLOCK_SIZE);
+  if (append_region_len (&fs->regions, "inode table",
+                         fs->inode_table.len, 0, 0,
+                         region_data, (void *) fs->inode_table.ptr) == -1)
+    return -1;
+  len = l->metadata * EXT4_BLOCK_SIZE - virtual_size (&fs->regions);
+  if (len > 0 &&
+      append_region_len (&fs->regions, "unused inodes", len, 0, 0,
+                         region_zero) == -1)
+    return -1;
+
+  if (fs->metadata.len > 0 &&
+      append_region_len (&fs->regions, "directories and extents",
+                         fs->metadata.len, 0, 0,
+                         region_data, (void *) fs->metadata.ptr) == -1)
+    return -1;
+
+  /* Add all regular files.  These are read from the host files on
+   * demand.
+   */
+  assert (virtual_size (&fs->regions) == l->data * EXT4_BLOCK_SIZE);
+  for (k = 0; k < nr_inode_nodes (fs); ++k) {
+    const size_t i = inode_node (fs, k);
+    const struct ext4_node *node = &fs->nodes.ptr[i];
+
+    if (!S_ISREG (node->statbuf.st_mode) || node->statbuf.st_size == 0)
+      continue;
+
+    assert (virtual_size (&fs->regions) == node->block * EXT4_BLOCK_SIZE);
+    if (append_region_len (&fs->regions, node->name,
+                           node->statbuf.st_size, 0, EXT4_BLOCK_SIZE,
+                           region_file, i) == -1)
+      return -1;
+  }
+
+  assert (virtual_size (&fs->regions) == l->used_blocks * EXT4_BLOCK_SIZE);
+  len = (l->nr_blocks - l->used_blocks) * EXT4_BLOCK_SIZE;
+  if (len > 0 &&
+      append_region_len (&fs->regions, "free space", len, 0, 0,
+                         region_zero) == -1)
+    return -1;
+
+  nbdkit_debug ("ext4: %zu regions, total filesystem size %" PRIi64,
+                nr_regions (&fs->regions), virtual_size (&fs->regions));
+  return 0;
+}
+
+/* Read from the virtual filesystem. */
+int
+pread_virtual_ext4 (struct virtual_ext4 *fs,
+                    void *buf, uint32_t count, uint64_t offset)
+{
+  const struct region *region = find_region (&fs->regions, offset);
+  const struct region *last = &fs->regions.ptr[fs->regions.len-1];
+  bool read_file = false;
+  size_t i, len;
+
+  while (count > 0) {
+    /* Length to end of region. */
+    len = region->end - offset + 1;
+    if (len > count)
+      len = count;
+
+    switch (region->type) {
+    case region_file:
+      i = region->u.i;
+      assert (i < fs->nodes.len);
+      if (fdcache_pread (fs->fds, i, fs->nodes.ptr[i].host_path,
+                         buf, len, offset - region->start) == -1)
+        return -1;
+      read_file = true;
+      break;
+
+    case region_data:
+      memcpy (buf, &region->u.data[offset - region->start], len);
+      break;
+
+    case region_zero:
+      memset (buf, 0, len);
+      break;
+    }
+
+    count -= len;
+    buf += len;
+    offset += len;
+
+    /* Regions are contiguous, so move to the next region without
+     * looking it up again.
+     */
+    if (count > 0)
+      region++;
+  }
+
+  /* If the read finished at the end of a file, the client is probably
+   * reading files in order, so start reading the next file.
+   */
+  if (read_file &&
+      (region->type == region_zero || offset == region->end + 1)) {
+    for (++region; region <= last && region->type == region_zero; ++region)
+      ;
+    if (region <= last && region->type == region_file) {
+      i = region->u.i;
+      fdcache_readahead (fs->fds, i, fs->nodes.ptr[i].host_path,
+                         MIN (region->len, READAHEAD_SIZE), 0);
+    }
+  }
+
+  return 0;
+}
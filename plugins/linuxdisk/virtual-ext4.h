@@ -0,0 +1,301 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_VIRTUAL_EXT4_H
+#define NBDKIT_VIRTUAL_EXT4_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "fdcache.h"
+#include "regions.h"
+#include "vector.h"
+
+/* This constructs a read-only ext4 filesystem in memory.  Only the
+ * metadata is held in memory.  File data is read from the host files
+ * on demand.
+ *
+ * The layout uses flex_bg so that all bitmaps and inode tables are
+ * at the start of the filesystem, and sparse_super2 with no backup
+ * superblocks, so that the data of each file is contiguous and maps
+ * onto a single region:
+ *
+ *   superblock, group descriptors, block bitmaps, inode bitmaps,
+ *   inode tables, directories + extent tree blocks + symlinks,
+ *   file data, free space
+ */
+
+#define EXT4_BLOCK_SIZE 4096
+#define EXT4_BLOCKS_PER_GROUP (8 * EXT4_BLOCK_SIZE)
+#define EXT4_INODE_SIZE 256
+#define EXT4_ROOT_INO 2
+#define EXT4_FIRST_INO 11       /* First non-reserved inode (lost+found). */
+
+/* Longest extent. */
+#define EXT4_MAX_EXTENT_LEN 32768
+
+DEFINE_VECTOR_TYPE (ext4_idxs, size_t);
+DEFINE_VECTOR_TYPE (ext4_bytes, uint8_t);
+
+struct ext4_super_block {
+  uint32_t s_inodes_count;             /* 0x000 */
+  uint32_t s_blocks_count_lo;
+  uint32_t s_r_blocks_count_lo;
+  uint32_t s_free_blocks_count_lo;
+  uint32_t s_free_inodes_count;        /* 0x010 */
+  uint32_t s_first_data_block;
+  uint32_t s_log_block_size;
+  uint32_t s_log_cluster_size;
+  uint32_t s_blocks_per_group;         /* 0x020 */
+  uint32_t s_clusters_per_group;
+  uint32_t s_inodes_per_group;
+  uint32_t s_mtime;
+  uint32_t s_wtime;                    /* 0x030 */
+  uint16_t s_mnt_count;
+  uint16_t s_max_mnt_count;
+  uint16_t s_magic;
+#define EXT4_SUPER_MAGIC 0xEF53
+  uint16_t s_state;
+  uint16_t s_errors;
+  uint16_t s_minor_rev_level;
+  uint32_t s_lastcheck;                /* 0x040 */
+  uint32_t s_checkinterval;
+  uint32_t s_creator_os;
+  uint32_t s_rev_level;
+  uint16_t s_def_resuid;               /* 0x050 */
+  uint16_t s_def_resgid;
+  uint32_t s_first_ino;
+  uint16_t s_inode_size;
+  uint16_t s_block_group_nr;
+  uint32_t s_feature_compat;
+#define EXT4_FEATURE_COMPAT_SPARSE_SUPER2     0x0200
+  uint32_t s_feature_incompat;         /* 0x060 */
+#define EXT4_FEATURE_INCOMPAT_FILETYPE        0x0002
+#define EXT4_FEATURE_INCOMPAT_EXTENTS         0x0040
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG         0x0200
+  uint32_t s_feature_ro_compat;
+#define EXT4_FEATURE_RO_COMPAT_LARGE_FILE     0x0002
+#define EXT4_FEATURE_RO_COMPAT_HUGE_FILE      0x0008
+#define EXT4_FEATURE_RO_COMPAT_DIR_NLINK      0x0020
+#define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE    0x0040
+  uint8_t s_uuid[16];
+  char s_volume_name[16];              /* 0x078 */
+  char s_last_mounted[64];             /* 0x088 */
+  uint32_t s_algorithm_usage_bitmap;   /* 0x0C8 */
+  uint8_t s_prealloc_blocks;
+  uint8_t s_prealloc_dir_blocks;
+  uint16_t s_reserved_gdt_blocks;
+  uint8_t s_journal_uuid[16];          /* 0x0D0 */
+  uint32_t s_journal_inum;             /* 0x0E0 */
+  uint32_t s_journal_dev;
+  uint32_t s_last_orphan;
+  uint32_t s_hash_seed[4];             /* 0x0EC */
+  uint8_t s_def_hash_version;          /* 0x0FC */
+  uint8_t s_jnl_backup_type;
+  uint16_t s_desc_size;
+  uint32_t s_default_mount_opts;       /* 0x100 */
+  uint32_t s_first_meta_bg;
+  uint32_t s_mkfs_time;
+  uint32_t s_jnl_blocks[17];
+  uint32_t s_blocks_count_hi;          /* 0x150 */
+  uint32_t s_r_blocks_count_hi;
+  uint32_t s_free_blocks_count_hi;
+  uint16_t s_min_extra_isize;
+  uint16_t s_want_extra_isize;
+  uint32_t s_flags;                    /* 0x160 */
+#define EXT4_FLAGS_SIGNED_HASH   0x0001
+#define EXT4_FLAGS_UNSIGNED_HASH 0x0002
+  uint16_t s_raid_stride;
+  uint16_t s_mmp_interval;
+  uint64_t s_mmp_block;
+  uint32_t s_raid_stripe_width;        /* 0x170 */
+  uint8_t s_log_groups_per_flex;
+  uint8_t s_checksum_type;
+  uint16_t s_reserved_pad;
+  uint64_t s_kbytes_written;           /* 0x178 */
+  uint8_t s_unused[0x24C - 0x180];
+  uint32_t s_backup_bgs[2];            /* 0x24C */
+  uint8_t s_unused2[1024 - 0x254];
+} __attribute__ ((packed));
+
+struct ext4_group_desc {
+  uint32_t bg_block_bitmap_lo;
+  uint32_t bg_inode_bitmap_lo;
+  uint32_t bg_inode_table_lo;
+  uint16_t bg_free_blocks_count_lo;
+  uint16_t bg_free_inodes_count_lo;
+  uint16_t bg_used_dirs_count_lo;
+  uint16_t bg_flags;
+  uint32_t bg_exclude_bitmap_lo;
+  uint16_t bg_block_bitmap_csum_lo;
+  uint16_t bg_inode_bitmap_csum_lo;
+  uint16_t bg_itable_unused_lo;
+  uint16_t bg_checksum;
+} __attribute__ ((packed));
+
+struct ext4_inode {
+  uint16_t i_mode;                     /* 0x00 */
+  uint16_t i_uid;
+  uint32_t i_size_lo;
+  uint32_t i_atime;
+  uint32_t i_ctime;
+  uint32_t i_mtime;                    /* 0x10 */
+  uint32_t i_dtime;
+  uint16_t i_gid;
+  uint16_t i_links_count;
+  uint32_t i_blocks_lo;                /* in 512 byte units */
+  uint32_t i_flags;                    /* 0x20 */
+#define EXT4_EXTENTS_FL 0x00080000
+  uint32_t i_version;
+  uint32_t i_block[15];                /* 0x28 */
+  uint32_t i_generation;               /* 0x64 */
+  uint32_t i_file_acl_lo;
+  uint32_t i_size_high;
+  uint32_t i_obso_faddr;
+  uint16_t i_blocks_high;              /* 0x74 */
+  uint16_t i_file_acl_high;
+  uint16_t i_uid_high;
+  uint16_t i_gid_high;
+  uint16_t i_checksum_lo;
+  uint16_t i_reserved;
+  uint16_t i_extra_isize;              /* 0x80 */
+  uint16_t i_checksum_hi;
+  uint32_t i_ctime_extra;
+  uint32_t i_mtime_extra;
+  uint32_t i_atime_extra;
+  uint32_t i_crtime;                   /* 0x90 */
+  uint32_t i_crtime_extra;
+  uint32_t i_version_hi;
+  uint32_t i_projid;
+  uint8_t i_unused[EXT4_INODE_SIZE - 0xA0];
+} __attribute__ ((packed));
+
+struct ext4_extent_header {
+  uint16_t eh_magic;
+#define EXT4_EXTENT_MAGIC 0xF30A
+  uint16_t eh_entries;
+  uint16_t eh_max;
+  uint16_t eh_depth;
+  uint32_t eh_generation;
+} __attribute__ ((packed));
+
+/* Leaf (depth 0) entry. */
+struct ext4_extent {
+  uint32_t ee_block;                   /* first logical block */
+  uint16_t ee_len;
+  uint16_t ee_start_hi;
+  uint32_t ee_start_lo;
+} __attribute__ ((packed));
+
+/* Index (depth > 0) entry. */
+struct ext4_extent_idx {
+  uint32_t ei_block;                   /* first logical block */
+  uint32_t ei_leaf_lo;
+  uint16_t ei_leaf_hi;
+  uint16_t ei_unused;
+} __attribute__ ((packed));
+
+/* Directory entry, followed by the name. */
+struct ext4_dir_entry {
+  uint32_t inode;
+  uint16_t rec_len;
+  uint8_t name_len;
+  uint8_t file_type;
+} __attribute__ ((packed));
+
+/* A file, directory or other object found in the host directory. */
+struct ext4_node {
+  char *name;                   /* Name (for root, NULL). */
+  char *host_path;              /* Path on the host. */
+  char *target;                 /* Symbolic link target. */
+  struct stat statbuf;          /* lstat(2) information. */
+  size_t parent;                /* Index of the parent directory. */
+  size_t link;                  /* If a hard link, index of the first
+                                 * node with the same inode, else the
+                                 * index of this node. */
+  ext4_idxs children;           /* Directories only. */
+  uint32_t ino;                 /* Inode number. */
+  uint32_t nlink;               /* Link count. */
+  uint64_t block;               /* First data block. */
+  uint64_t nr_blocks;           /* Number of data blocks. */
+  uint64_t tree_block;          /* First extent tree block. */
+  uint64_t nr_tree_blocks;      /* Number of extent tree blocks. */
+};
+
+DEFINE_VECTOR_TYPE (ext4_nodes, struct ext4_node);
+DEFINE_VECTOR_TYPE (ext4_buffers, uint8_t *);
+
+struct virtual_ext4 {
+  /* Filesystem layout, starting at offset 0 of the filesystem. */
+  struct regions regions;
+
+  /* nodes[0] is the root directory, nodes[1] is lost+found. */
+  ext4_nodes nodes;
+
+  /* Node index of each inode, starting at EXT4_FIRST_INO. */
+  ext4_idxs inodes;
+
+  /* Block 0 (containing the superblock) and group descriptors. */
+  uint8_t *block0;
+  uint8_t *gdt;
+
+  /* Bitmaps.  Most groups are entirely used or free and share the
+   * first three buffers.  Other bitmaps are allocated separately.
+   */
+  uint8_t *ones, *zeroes, *inode_padding;
+  ext4_buffers bitmaps;
+
+  /* Used part of the inode tables. */
+  ext4_bytes inode_table;
+
+  /* Directories, extent tree blocks and long symbolic links. */
+  ext4_bytes metadata;
+
+  /* Open host files. */
+  fdcache *fds;
+};
+
+extern void init_virtual_ext4 (struct virtual_ext4 *fs)
+  __attribute__ ((__nonnull__ (1)));
+extern int create_virtual_ext4 (const char *dir, const char *label,
+                                int64_t size, bool size_add,
+                                struct virtual_ext4 *fs)
+  __attribute__ ((__nonnull__ (1, 5)));
+extern void free_virtual_ext4 (struct virtual_ext4 *fs)
+  __attribute__ ((__nonnull__ (1)));
+extern int pread_virtual_ext4 (struct virtual_ext4 *fs,
+                               void *buf, uint32_t count, uint64_t offset)
+  __attribute__ ((__nonnull__ (1, 2)));
+
+#endif /* NBDKIT_VIRTUAL_EXT4_H */
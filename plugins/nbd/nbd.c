@@ -82,13 +82,23 @@ struct transaction {
   nbd_completion_callback cb;
 };
 
-/* The per-connection handle */
-struct handle {
+/* One connection to the upstream server */
+struct upstream {
   /* These fields are read-only once initialized */
   struct nbd_handle *nbd;
   int fds[2]; /* Pipe for kicking the reader thread */
-  bool readonly;
   pthread_t reader;
+
+  /* Number of commands sent on this connection awaiting a reply */
+  _Atomic unsigned in_flight;
+};
+
+/* The per-connection handle */
+struct handle {
+  /* These fields are read-only once initialized */
+  bool readonly;
+  size_t nr_upstreams;
+  struct upstream *upstreams; /* upstreams[0] answers metadata queries */
 };
 
 /* Connect to server via URI */
@@ -127,6 +137,9 @@ static unsigned retry;
 static bool shared;
 static struct handle *shared_handle;
 
+/* Number of upstream connections to open per handle */
+static unsigned connections = 1;
+
 /* Control TLS settings */
 static int tls = -1;
 static char *tls_certificates;
@@ -205,6 +218,14 @@ nbdplug_config (const char *key, const char *value)
       return -1;
     shared = r;
   }
+  else if (strcmp (key, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+    if (connections == 0) {
+      nbdkit_error ("connections parameter must not be 0");
+      return -1;
+    }
+  }
   else if (strcmp (key, "tls") == 0) {
     if (ascii_strcasecmp (value, "require") == 0 ||
         ascii_strcasecmp (value, "required") == 0 ||
@@ -309,6 +330,10 @@ nbdplug_config_complete (void)
 #endif
   }
   else if (command.len > 0) {
+    if (connections > 1) {
+      nbdkit_error ("‘connections’ cannot be used with ‘command’");
+      return -1;
+    }
     /* Add NULL sentinel to the command. */
     if (const_string_vector_append (&command, NULL) == -1) {
       nbdkit_error ("realloc: %m");
@@ -317,6 +342,10 @@ nbdplug_config_complete (void)
     shared = true;
   }
   else if (socket_fd >= 0) {
+    if (connections > 1) {
+      nbdkit_error ("‘connections’ cannot be used with ‘socket-fd’");
+      return -1;
+    }
     shared = true;
   }
   else {
@@ -393,6 +422,7 @@ nbdplug_after_fork (void)
   "retry=<N>              Retry connection up to N seconds (default 0).\n" \
   "shared=<BOOL>          True to share one server connection among all clients,\n" \
   "                       rather than a connection per client (default false).\n" \
+  "connections=<N>        Open N connections to a multi-conn server (default 1).\n" \
   "tls=<MODE>             How to use TLS; one of 'off', 'on', or 'require'.\n" \
   "tls-certificates=<DIR> Directory containing files for X.509 certificates.\n" \
   "tls-verify=<BOOL>      True (default for X.509) to validate server.\n" \
@@ -424,23 +454,23 @@ nbdplug_dump_plugin (void)
 
 /* Reader loop. */
 void *
-nbdplug_reader (void *handle)
+nbdplug_reader (void *upstream)
 {
-  struct handle *h = handle;
+  struct upstream *u = upstream;
 
   if (nbd_debug_verbose)
     nbdkit_debug ("nbd: started reader thread");
 
-  while (!nbd_aio_is_dead (h->nbd) && !nbd_aio_is_closed (h->nbd)) {
+  while (!nbd_aio_is_dead (u->nbd) && !nbd_aio_is_closed (u->nbd)) {
     int r;
     struct pollfd fds[2] = {
-      [0].fd = nbd_aio_get_fd (h->nbd),
-      [1].fd = h->fds[0],
+      [0].fd = nbd_aio_get_fd (u->nbd),
+      [1].fd = u->fds[0],
       [1].events = POLLIN,
     };
     unsigned dir;
 
-    dir = nbd_aio_get_direction (h->nbd);
+    dir = nbd_aio_get_direction (u->nbd);
     if (nbd_debug_verbose)
       nbdkit_debug ("polling, dir=%d", dir);
     if (dir & LIBNBD_AIO_DIRECTION_READ)
@@ -452,13 +482,13 @@ nbdplug_reader (void *handle)
       break;
     }
 
-    dir = nbd_aio_get_direction (h->nbd);
+    dir = nbd_aio_get_direction (u->nbd);
 
     r = 0;
     if ((dir & LIBNBD_AIO_DIRECTION_READ) && (fds[0].revents & POLLIN))
-      r = nbd_aio_notify_read (h->nbd);
+      r = nbd_aio_notify_read (u->nbd);
     else if ((dir & LIBNBD_AIO_DIRECTION_WRITE) && (fds[0].revents & POLLOUT))
-      r = nbd_aio_notify_write (h->nbd);
+      r = nbd_aio_notify_write (u->nbd);
     if (r == -1) {
       nbdkit_error ("%s", nbd_get_error ());
       break;
@@ -468,7 +498,7 @@ nbdplug_reader (void *handle)
     if (fds[1].revents & POLLIN) {
       char buf[10]; /* Larger than 1 to allow reduction of any backlog */
 
-      if (read (h->fds[0], buf, sizeof buf) == -1 && errno != EAGAIN) {
+      if (read (u->fds[0], buf, sizeof buf) == -1 && errno != EAGAIN) {
         nbdkit_error ("failed to read pipe: %m");
         break;
       }
@@ -477,7 +507,7 @@ nbdplug_reader (void *handle)
 
   if (nbd_debug_verbose) {
     nbdkit_debug ("state machine changed to %s",
-                  nbd_connection_state (h->nbd));
+                  nbd_connection_state (u->nbd));
     nbdkit_debug ("exiting reader thread");
   }
   return NULL;
@@ -515,9 +545,30 @@ nbdplug_prepare (struct transaction *trans)
   trans->cb.user_data = trans;
 }
 
+/* Choose the upstream connection for the next command.  With
+ * multiple connections this is the one with the fewest commands in
+ * flight, which spreads the load while sending small commands around
+ * any connection tied up by a large transfer.  The count is dropped
+ * again in nbdplug_reply.
+ */
+static struct upstream *
+nbdplug_pick (struct handle *h)
+{
+  struct upstream *u = &h->upstreams[0];
+  size_t i;
+
+  for (i = 1; i < h->nr_upstreams && u->in_flight > 0; ++i) {
+    if (h->upstreams[i].in_flight < u->in_flight)
+      u = &h->upstreams[i];
+  }
+  u->in_flight++;
+  return u;
+}
+
 /* Register a cookie and kick the I/O thread. */
 static void
-nbdplug_register (struct handle *h, struct transaction *trans, int64_t cookie)
+nbdplug_register (struct upstream *u, struct transaction *trans,
+                  int64_t cookie)
 {
   char c = 0;
 
@@ -531,13 +582,13 @@ nbdplug_register (struct handle *h, struct transaction *trans, int64_t cookie)
     nbdkit_debug ("cookie %" PRId64 " started by state machine", cookie);
   trans->cookie = cookie;
 
-  if (write (h->fds[1], &c, 1) == -1 && errno != EAGAIN)
+  if (write (u->fds[1], &c, 1) == -1 && errno != EAGAIN)
     nbdkit_debug ("failed to kick reader thread: %m");
 }
 
 /* Perform the reply half of a transaction. */
 static int
-nbdplug_reply (struct handle *h, struct transaction *trans)
+nbdplug_reply (struct upstream *u, struct transaction *trans)
 {
   int err;
 
@@ -555,6 +606,7 @@ nbdplug_reply (struct handle *h, struct transaction *trans)
   }
   if (sem_destroy (&trans->sem))
     abort ();
+  u->in_flight--;
   errno = err;
   return err ? -1 : 0;
 }
@@ -594,60 +646,45 @@ nbdplug_connect (struct nbd_handle *nbd)
     abort ();
 }
 
-/* Create the shared or per-connection handle. */
-static struct handle *
-nbdplug_open_handle (int readonly, const char *client_export)
+/* Open one connection to the server and start its reader thread. */
+static int
+nbdplug_open_upstream (struct upstream *u, const char *client_export)
 {
-  struct handle *h;
   unsigned long retries = retry;
 
-  h = calloc (1, sizeof *h);
-  if (h == NULL) {
-    nbdkit_error ("malloc: %m");
-    return NULL;
-  }
 #ifdef HAVE_PIPE2
-  if (pipe2 (h->fds, O_NONBLOCK)) {
+  if (pipe2 (u->fds, O_NONBLOCK)) {
     nbdkit_error ("pipe2: %m");
-    free (h);
-    return NULL;
+    return -1;
   }
 #else
   /* This plugin doesn't fork, so we don't care about CLOEXEC. Our use
    * of pipe2 is merely for convenience.
    */
-  if (pipe (h->fds)) {
+  if (pipe (u->fds)) {
     nbdkit_error ("pipe: %m");
-    free (h);
-    return NULL;
+    return -1;
   }
-  if (set_nonblock (h->fds[0]) == -1) {
-    close (h->fds[1]);
-    free (h);
-    return NULL;
+  if (set_nonblock (u->fds[0]) == -1) {
+    close (u->fds[1]);
+    return -1;
   }
-  if (set_nonblock (h->fds[1]) == -1) {
-    close (h->fds[0]);
-    free (h);
-    return NULL;
+  if (set_nonblock (u->fds[1]) == -1) {
+    close (u->fds[0]);
+    return -1;
   }
 #endif
 
-  if (dynamic_export)
-    assert (client_export);
-  else
-    client_export = export;
-
  retry:
-  h->nbd = nbd_create ();
-  if (!h->nbd)
+  u->nbd = nbd_create ();
+  if (!u->nbd)
     goto errnbd;
-  if (nbd_set_export_name (h->nbd, client_export) == -1)
+  if (nbd_set_export_name (u->nbd, client_export) == -1)
     goto errnbd;
-  if (nbd_add_meta_context (h->nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1)
+  if (nbd_add_meta_context (u->nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1)
     goto errnbd;
 #if LIBNBD_HAVE_NBD_SET_FULL_INFO
-  if (nbd_set_full_info (h->nbd, 1) == -1)
+  if (nbd_set_full_info (u->nbd, 1) == -1)
     goto errnbd;
 #endif
 #if LIBNBD_HAVE_NBD_SET_PREAD_INITIALIZE
@@ -656,23 +693,23 @@ nbdplug_open_handle (int readonly, const char *client_export)
    * dereferenced if the NBD server replied with an error.  Thus, we
    * are safe opting in to this libnbd speedup.
    */
-  if (nbd_set_pread_initialize (h->nbd, false) == -1)
+  if (nbd_set_pread_initialize (u->nbd, false) == -1)
     goto errnbd;
 #endif
   if (dynamic_export && uri) {
 #if LIBNBD_HAVE_NBD_SET_OPT_MODE
-    if (nbd_set_opt_mode (h->nbd, 1) == -1)
+    if (nbd_set_opt_mode (u->nbd, 1) == -1)
       goto errnbd;
 #else
     abort (); /* Prevented by .config_complete */
 #endif
   }
-  if (nbd_set_tls (h->nbd, tls) == -1)
+  if (nbd_set_tls (u->nbd, tls) == -1)
     goto errnbd;
-  if (nbdplug_connect (h->nbd) == -1) {
+  if (nbdplug_connect (u->nbd) == -1) {
     if (retries--) {
       nbdkit_debug ("connect failed; will try again: %s", nbd_get_error ());
-      nbd_close (h->nbd);
+      nbd_close (u->nbd);
       sleep (1);
       goto retry;
     }
@@ -681,32 +718,105 @@ nbdplug_open_handle (int readonly, const char *client_export)
 
 #if LIBNBD_HAVE_NBD_SET_OPT_MODE
   /* Oldstyle servers can't change export name, but that's okay. */
-  if (uri && dynamic_export && nbd_aio_is_negotiating (h->nbd)) {
-    if (nbd_set_export_name (h->nbd, client_export) == -1)
+  if (uri && dynamic_export && nbd_aio_is_negotiating (u->nbd)) {
+    if (nbd_set_export_name (u->nbd, client_export) == -1)
       goto errnbd;
-    if (nbd_opt_go (h->nbd) == -1)
+    if (nbd_opt_go (u->nbd) == -1)
       goto errnbd;
   }
 #endif
 
-  if (readonly)
-    h->readonly = true;
-
   /* Spawn a dedicated reader thread */
-  if ((errno = pthread_create (&h->reader, NULL, nbdplug_reader, h))) {
+  if ((errno = pthread_create (&u->reader, NULL, nbdplug_reader, u))) {
     nbdkit_error ("failed to initialize reader thread: %m");
     goto err;
   }
 
-  return h;
+  return 0;
 
  errnbd:
   nbdkit_error ("%s", nbd_get_error ());
  err:
-  close (h->fds[0]);
-  close (h->fds[1]);
-  if (h->nbd)
-    nbd_close (h->nbd);
+  close (u->fds[0]);
+  close (u->fds[1]);
+  if (u->nbd)
+    nbd_close (u->nbd);
+  u->nbd = NULL;
+  return -1;
+}
+
+/* Disconnect from the server and stop the reader thread. */
+static void
+nbdplug_close_upstream (struct upstream *u)
+{
+  if (nbd_aio_disconnect (u->nbd, 0) == -1)
+    nbdkit_debug ("%s", nbd_get_error ());
+  if ((errno = pthread_join (u->reader, NULL)))
+    nbdkit_debug ("failed to join reader thread: %m");
+  close (u->fds[0]);
+  close (u->fds[1]);
+  nbd_close (u->nbd);
+}
+
+/* Create the shared or per-connection handle. */
+static struct handle *
+nbdplug_open_handle (int readonly, const char *client_export)
+{
+  struct handle *h;
+  int r;
+
+  if (dynamic_export)
+    assert (client_export);
+  else
+    client_export = export;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  h->readonly = readonly;
+  h->upstreams = calloc (connections, sizeof *h->upstreams);
+  if (h->upstreams == NULL) {
+    nbdkit_error ("calloc: %m");
+    free (h);
+    return NULL;
+  }
+
+  if (nbdplug_open_upstream (&h->upstreams[0], client_export) == -1)
+    goto err;
+  h->nr_upstreams = 1;
+
+  /* Additional connections are only safe if the server promises that
+   * a flush on any one connection covers writes completed on all of
+   * them, which is what NBD_FLAG_CAN_MULTI_CONN means.
+   */
+  if (connections > 1) {
+    r = nbd_can_multi_conn (h->upstreams[0].nbd);
+    if (r == -1) {
+      nbdkit_error ("%s", nbd_get_error ());
+      goto err;
+    }
+    if (r == 0)
+      nbdkit_debug ("server does not support multi-conn, "
+                    "using a single connection");
+    else {
+      while (h->nr_upstreams < connections) {
+        if (nbdplug_open_upstream (&h->upstreams[h->nr_upstreams],
+                                   client_export) == -1)
+          goto err;
+        h->nr_upstreams++;
+      }
+      nbdkit_debug ("opened %zu connections to server", h->nr_upstreams);
+    }
+  }
+
+  return h;
+
+ err:
+  while (h->nr_upstreams > 0)
+    nbdplug_close_upstream (&h->upstreams[--h->nr_upstreams]);
+  free (h->upstreams);
   free (h);
   return NULL;
 }
@@ -813,13 +923,11 @@ nbdplug_open (int readonly)
 static void
 nbdplug_close_handle (struct handle *h)
 {
-  if (nbd_aio_disconnect (h->nbd, 0) == -1)
-    nbdkit_debug ("%s", nbd_get_error ());
-  if ((errno = pthread_join (h->reader, NULL)))
-    nbdkit_debug ("failed to join reader thread: %m");
-  close (h->fds[0]);
-  close (h->fds[1]);
-  nbd_close (h->nbd);
+  size_t i;
+
+  for (i = 0; i < h->nr_upstreams; ++i)
+    nbdplug_close_upstream (&h->upstreams[i]);
+  free (h->upstreams);
   free (h);
 }
 
@@ -839,7 +947,7 @@ nbdplug_export_description (void *handle)
 {
 #if LIBNBD_HAVE_NBD_GET_EXPORT_DESCRIPTION
   struct handle *h = handle;
-  CLEANUP_FREE char *desc = nbd_get_export_description (h->nbd);
+  CLEANUP_FREE char *desc = nbd_get_export_description (h->upstreams[0].nbd);
   if (desc)
     return nbdkit_strdup_intern (desc);
 #endif
@@ -851,7 +959,7 @@ static int64_t
 nbdplug_get_size (void *handle)
 {
   struct handle *h = handle;
-  int64_t size = nbd_get_size (h->nbd);
+  int64_t size = nbd_get_size (h->upstreams[0].nbd);
 
   if (size == -1) {
     nbdkit_error ("%s", nbd_get_error ());
@@ -868,7 +976,7 @@ nbdplug_block_size (void *handle,
   struct handle *h = handle;
   int64_t r;
 
-  r = nbd_get_block_size (h->nbd, LIBNBD_SIZE_MINIMUM);
+  r = nbd_get_block_size (h->upstreams[0].nbd, LIBNBD_SIZE_MINIMUM);
   if (r == -1) {
     nbdkit_error ("%s", nbd_get_error ());
     return -1;
@@ -882,7 +990,7 @@ nbdplug_block_size (void *handle,
   }
   *minimum = r;
 
-  r = nbd_get_block_size (h->nbd, LIBNBD_SIZE_PREFERRED);
+  r = nbd_get_block_size (h->upstreams[0].nbd, LIBNBD_SIZE_PREFERRED);
   if (r == -1) {
     nbdkit_error ("%s", nbd_get_error ());
     return -1;
@@ -896,7 +1004,7 @@ nbdplug_block_size (void *handle,
   }
   *preferred = r;
 
-  r = nbd_get_block_size (h->nbd, LIBNBD_SIZE_MAXIMUM);
+  r = nbd_get_block_size (h->upstreams[0].nbd, LIBNBD_SIZE_MAXIMUM);
   if (r == -1) {
     nbdkit_error ("%s", nbd_get_error ());
     return -1;
@@ -928,7 +1036,7 @@ static int
 nbdplug_can_write (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_is_read_only (h->nbd);
+  int i = nbd_is_read_only (h->upstreams[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("%s", nbd_get_error ());
@@ -941,7 +1049,7 @@ static int
 nbdplug_can_flush (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_flush (h->nbd);
+  int i = nbd_can_flush (h->upstreams[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("%s", nbd_get_error ());
@@ -954,7 +1062,7 @@ static int
 nbdplug_is_rotational (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_is_rotational (h->nbd);
+  int i = nbd_is_rotational (h->upstreams[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("%s", nbd_get_error ());
@@ -967,7 +1075,7 @@ static int
 nbdplug_can_trim (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_trim (h->nbd);
+  int i = nbd_can_trim (h->upstreams[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("%s", nbd_get_error ());
@@ -980,7 +1088,7 @@ static int
 nbdplug_can_zero (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_zero (h->nbd);
+  int i = nbd_can_zero (h->upstreams[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("%s", nbd_get_error ());
@@ -994,7 +1102,7 @@ nbdplug_can_fast_zero (void *handle)
 {
 #if LIBNBD_HAVE_NBD_CAN_FAST_ZERO
   struct handle *h = handle;
-  int i = nbd_can_fast_zero (h->nbd);
+  int i = nbd_can_fast_zero (h->upstreams[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("%s", nbd_get_error ());
@@ -1011,7 +1119,7 @@ static int
 nbdplug_can_fua (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_fua (h->nbd);
+  int i = nbd_can_fua (h->upstreams[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("%s", nbd_get_error ());
@@ -1024,7 +1132,7 @@ static int
 nbdplug_can_multi_conn (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_multi_conn (h->nbd);
+  int i = nbd_can_multi_conn (h->upstreams[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("%s", nbd_get_error ());
@@ -1037,7 +1145,7 @@ static int
 nbdplug_can_cache (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_cache (h->nbd);
+  int i = nbd_can_cache (h->upstreams[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("%s", nbd_get_error ());
@@ -1050,7 +1158,7 @@ static int
 nbdplug_can_extents (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_meta_context (h->nbd, LIBNBD_CONTEXT_BASE_ALLOCATION);
+  int i = nbd_can_meta_context (h->upstreams[0].nbd, LIBNBD_CONTEXT_BASE_ALLOCATION);
 
   if (i == -1) {
     nbdkit_error ("%s", nbd_get_error ());
@@ -1065,13 +1173,14 @@ nbdplug_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
                uint32_t flags)
 {
   struct handle *h = handle;
+  struct upstream *u = nbdplug_pick (h);
   struct transaction s;
 
   assert (!flags);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_pread (h->nbd, buf, count, offset,
+  nbdplug_register (u, &s, nbd_aio_pread (u->nbd, buf, count, offset,
                                           s.cb, 0));
-  return nbdplug_reply (h, &s);
+  return nbdplug_reply (u, &s);
 }
 
 /* Write data to the file. */
@@ -1080,14 +1189,15 @@ nbdplug_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
                 uint32_t flags)
 {
   struct handle *h = handle;
+  struct upstream *u = nbdplug_pick (h);
   struct transaction s;
   uint32_t f = flags & NBDKIT_FLAG_FUA ? LIBNBD_CMD_FLAG_FUA : 0;
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_pwrite (h->nbd, buf, count, offset,
+  nbdplug_register (u, &s, nbd_aio_pwrite (u->nbd, buf, count, offset,
                                            s.cb, f));
-  return nbdplug_reply (h, &s);
+  return nbdplug_reply (u, &s);
 }
 
 /* Write zeroes to the file. */
@@ -1095,6 +1205,7 @@ static int
 nbdplug_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
+  struct upstream *u = nbdplug_pick (h);
   struct transaction s;
   uint32_t f = 0;
 
@@ -1112,8 +1223,8 @@ nbdplug_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   assert (!(flags & NBDKIT_FLAG_FAST_ZERO));
 #endif
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_zero (h->nbd, count, offset, s.cb, f));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (u, &s, nbd_aio_zero (u->nbd, count, offset, s.cb, f));
+  return nbdplug_reply (u, &s);
 }
 
 /* Trim a portion of the file. */
@@ -1121,26 +1232,34 @@ static int
 nbdplug_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
+  struct upstream *u = nbdplug_pick (h);
   struct transaction s;
   uint32_t f = flags & NBDKIT_FLAG_FUA ? LIBNBD_CMD_FLAG_FUA : 0;
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_trim (h->nbd, count, offset, s.cb, f));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (u, &s, nbd_aio_trim (u->nbd, count, offset, s.cb, f));
+  return nbdplug_reply (u, &s);
 }
 
-/* Flush the file to disk. */
+/* Flush the file to disk.  With several upstream connections it is
+ * enough to flush one of them: we only use more than one if the
+ * server advertised multi-conn, which guarantees that the flush
+ * covers every write that has completed on any connection, and
+ * nbdkit only needs the flush to cover writes we have already
+ * replied to.
+ */
 static int
 nbdplug_flush (void *handle, uint32_t flags)
 {
   struct handle *h = handle;
+  struct upstream *u = nbdplug_pick (h);
   struct transaction s;
 
   assert (!flags);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_flush (h->nbd, s.cb, 0));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (u, &s, nbd_aio_flush (u->nbd, s.cb, 0));
+  return nbdplug_reply (u, &s);
 }
 
 static int
@@ -1170,15 +1289,16 @@ nbdplug_extents (void *handle, uint32_t count, uint64_t offset,
                  uint32_t flags, struct nbdkit_extents *extents)
 {
   struct handle *h = handle;
+  struct upstream *u = nbdplug_pick (h);
   struct transaction s;
   uint32_t f = flags & NBDKIT_FLAG_REQ_ONE ? LIBNBD_CMD_FLAG_REQ_ONE : 0;
   nbd_extent_callback extcb = { nbdplug_extent, extents };
 
   assert (!(flags & ~NBDKIT_FLAG_REQ_ONE));
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_block_status (h->nbd, count, offset,
+  nbdplug_register (u, &s, nbd_aio_block_status (u->nbd, count, offset,
                                                  extcb, s.cb, f));
-  return nbdplug_reply (h, &s);
+  return nbdplug_reply (u, &s);
 }
 
 /* Cache a portion of the file. */
@@ -1186,12 +1306,13 @@ static int
 nbdplug_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
+  struct upstream *u = nbdplug_pick (h);
   struct transaction s;
 
   assert (!flags);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_cache (h->nbd, count, offset, s.cb, 0));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (u, &s, nbd_aio_cache (u->nbd, count, offset, s.cb, 0));
+  return nbdplug_reply (u, &s);
 }
 
 static struct nbdkit_plugin plugin = {
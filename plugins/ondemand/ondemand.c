@@ -57,6 +57,7 @@
 #include <nbdkit-plugin.h>
 
 #include "cleanup.h"
+#include "diskpool.h"
 #include "fdatasync.h"
 #include "utils.h"
 
@@ -64,6 +65,13 @@ static char *dir;                   /* dir parameter */
 static DIR *exportsdir;             /* opened exports dir */
 static int64_t requested_size = -1; /* size parameter on the command line */
 static int waitlock;                /* wait if locked */
+static unsigned pool_size;          /* pool parameter */
+
+/* Filesystems created in advance, if pool=N was used.  These are
+ * created in hidden directories in the exports dir and linked to the
+ * export name when a client first uses it.
+ */
+static diskpool *pool;
 
 /* Shell variables. */
 static struct var {
@@ -81,6 +89,9 @@ ondemand_unload (void)
 {
   struct var *v, *v_next;
 
+  if (pool)
+    free_diskpool (pool);
+
   for (v = vars; v != NULL; v = v_next) {
     v_next = v->next;
     free (v);
@@ -114,6 +125,11 @@ ondemand_config (const char *key, const char *value)
       return -1;
   }
 
+  else if (strcmp (key, "pool") == 0) {
+    if (nbdkit_parse_unsigned ("pool", value, &pool_size) == -1)
+      return -1;
+  }
+
   /* This parameter cannot be set on the command line since it is used
    * to pass the disk name to the command.
    */
@@ -180,6 +196,7 @@ ondemand_get_ready (void)
   "label=<LABEL>               The filesystem label.\n" \
   "type=ext4|...               The filesystem type.\n" \
   "wait=true                   Wait instead of rejecting second client.\n" \
+  "pool=N                      Number of filesystems to create in advance.\n" \
   "command=<COMMAND>           Alternate command instead of mkfs."
 
 /* Because we rewind the exportsdir handle, we need a lock to protect
@@ -355,11 +372,105 @@ block_device_size (int fd)
   return size;
 }
 
+/* Create a filesystem for the pool in a hidden temporary directory
+ * in the exports dir (so it is on the same filesystem as the exports
+ * and can be linked into place), returning the path of the disk.
+ */
+static char *
+create_pool_disk (void)
+{
+  CLEANUP_FREE char *tmp = NULL;
+  char *disk = NULL;
+
+  if (asprintf (&tmp, "%s/.poolXXXXXX", dir) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return NULL;
+  }
+  if (mkdtemp (tmp) == NULL) {
+    nbdkit_error ("%s: %m", tmp);
+    return NULL;
+  }
+  if (asprintf (&disk, "%s/disk", tmp) == -1) {
+    nbdkit_error ("asprintf: %m");
+    rmdir (tmp);
+    return NULL;
+  }
+
+  if (run_command (disk) == -1) {
+    unlink (disk);
+    rmdir (tmp);
+    free (disk);
+    return NULL;
+  }
+
+  return disk;
+}
+
+/* Remove a pool disk and its temporary directory. */
+static void
+remove_pool_disk (const char *disk)
+{
+  CLEANUP_FREE char *tmp = strdup (disk);
+  char *p;
+
+  unlink (disk);
+  if (tmp && (p = strrchr (tmp, '/')) != NULL) {
+    *p = '\0';
+    rmdir (tmp);
+  }
+}
+
+static int
+ondemand_after_fork (void)
+{
+  if (pool_size == 0)
+    return 0;
+
+  pool = new_diskpool (pool_size, create_pool_disk, remove_pool_disk);
+  if (pool == NULL)
+    return -1;
+  return diskpool_start (pool);
+}
+
+/* Create the filesystem for a new export.  If there is one ready in
+ * the pool it is linked into place, otherwise the command is run now.
+ */
+static int
+create_export (const char *exportname)
+{
+  CLEANUP_FREE char *disk = NULL;
+
+  if (pool) {
+    CLEANUP_FREE char *pool_disk = diskpool_get (pool);
+
+    if (pool_disk) {
+      /* If another client created the export in the meantime this
+       * fails with EEXIST, which is fine as we will open that.
+       */
+      if (linkat (AT_FDCWD, pool_disk, dirfd (exportsdir), exportname, 0)
+          == -1 && errno != EEXIST) {
+        nbdkit_error ("link: %s: %s/%s: %m", pool_disk, dir, exportname);
+        remove_pool_disk (pool_disk);
+        return -1;
+      }
+      remove_pool_disk (pool_disk);
+      return 0;
+    }
+  }
+
+  if (asprintf (&disk, "%s/%s", dir, exportname) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+
+  /* Now run the mkfs command. */
+  return run_command (disk);
+}
+
 static void *
 ondemand_open (int readonly)
 {
   struct handle *h;
-  CLEANUP_FREE char *disk = NULL;
   int flags, err;
   struct stat statbuf;
 #ifdef F_OFD_SETLK
@@ -408,13 +519,7 @@ ondemand_open (int readonly)
     }
 
     /* Create the filesystem. */
-    if (asprintf (&disk, "%s/%s", dir, h->exportname) == -1) {
-      nbdkit_error ("asprintf: %m");
-      goto error;
-    }
-
-    /* Now run the mkfs command. */
-    if (run_command (disk) == -1)
+    if (create_export (h->exportname) == -1)
       goto error;
 
     h->fd = openat (dirfd (exportsdir), h->exportname, flags);
@@ -467,7 +572,7 @@ ondemand_open (int readonly)
 
   /* Find the size of the disk. */
   if (fstat (h->fd, &statbuf) == -1) {
-    nbdkit_error ("fstat: %s: %m", disk);
+    nbdkit_error ("fstat: %s/%s: %m", dir, h->exportname);
     goto error;
   }
 
@@ -647,6 +752,7 @@ static struct nbdkit_plugin plugin = {
   .config_help       = ondemand_config_help,
   .magic_config_key  = "size",
   .get_ready         = ondemand_get_ready,
+  .after_fork        = ondemand_after_fork,
 
   .list_exports      = ondemand_list_exports,
   .default_export    = ondemand_default_export,
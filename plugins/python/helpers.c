@@ -41,12 +41,13 @@
 int
 callback_defined (const char *name, PyObject **obj_rtn)
 {
+  PyObject *m = interp_module ? interp_module : module;
   PyObject *obj;
 
   assert (script != NULL);
-  assert (module != NULL);
+  assert (m != NULL);
 
-  obj = PyObject_GetAttrString (module, name);
+  obj = PyObject_GetAttrString (m, name);
   if (!obj) {
     PyErr_Clear (); /* Clear the AttributeError from testing attr. */
     return 0;
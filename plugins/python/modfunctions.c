@@ -138,35 +138,15 @@ static PyMethodDef NbdkitMethods[] = {
   { NULL }
 };
 
-static struct PyModuleDef moduledef = {
-  PyModuleDef_HEAD_INIT,
-  "nbdkit",
-  "Module used to access nbdkit server API",
-  -1,
-  NbdkitMethods,
-  NULL,
-  NULL,
-  NULL,
-  NULL
-};
-
-PyMODINIT_FUNC
-create_nbdkit_module (void)
+static int
+nbdkit_module_exec (PyObject *m)
 {
-  PyObject *m;
-
-  m = PyModule_Create (&moduledef);
-  if (m == NULL) {
-    nbdkit_error ("could not create the nbdkit API module");
-    exit (EXIT_FAILURE);
-  }
-
   /* Constants corresponding to various flags. */
 #define ADD_INT_CONSTANT(name)                                      \
   if (PyModule_AddIntConstant (m, #name, NBDKIT_##name) == -1) {    \
     nbdkit_error ("could not add constant %s to nbdkit API module", \
                   #name);                                           \
-    exit (EXIT_FAILURE);                                            \
+    return -1;                                                      \
   }
   ADD_INT_CONSTANT (THREAD_MODEL_SERIALIZE_CONNECTIONS);
   ADD_INT_CONSTANT (THREAD_MODEL_SERIALIZE_ALL_REQUESTS);
@@ -190,5 +170,38 @@ create_nbdkit_module (void)
   ADD_INT_CONSTANT (EXTENT_ZERO);
 #undef ADD_INT_CONSTANT
 
-  return m;
+  return 0;
+}
+
+/* The module has no state of its own so it can be imported into
+ * sub-interpreters which have their own GIL, and it does not need the
+ * GIL on free-threaded builds of Python.
+ */
+static PyModuleDef_Slot nbdkit_module_slots[] = {
+  { Py_mod_exec, nbdkit_module_exec },
+#ifdef HAVE_PYTHON_SUBINTERPRETERS
+  { Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+  { Py_mod_gil, Py_MOD_GIL_NOT_USED },
+#endif
+  { 0, NULL }
+};
+
+static struct PyModuleDef moduledef = {
+  PyModuleDef_HEAD_INIT,
+  "nbdkit",
+  "Module used to access nbdkit server API",
+  0,
+  NbdkitMethods,
+  nbdkit_module_slots,
+  NULL,
+  NULL,
+  NULL
+};
+
+PyMODINIT_FUNC
+create_nbdkit_module (void)
+{
+  return PyModuleDef_Init (&moduledef);
 }
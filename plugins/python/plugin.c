@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
@@ -42,8 +43,10 @@
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "cleanup.h"
+#include "const-string-vector.h"
 
 #include "plugin.h"
 
@@ -59,6 +62,24 @@ const char *script;             /* The Python script name. */
 PyObject *module;               /* The imported __main__ module from script. */
 int py_api_version = 1;         /* The declared Python API version. */
 
+/* If the script sets SUBINTERPRETERS = True (and this Python supports
+ * it) then each connection runs in its own sub-interpreter with its
+ * own GIL.  The script is loaded again into every new interpreter and
+ * the config and config_complete callbacks are replayed, so we have
+ * to save the absolute path of the script and the parameters.
+ *
+ * interp_module is the __main__ module of the current connection's
+ * interpreter while a callback is running in it, else NULL.
+ */
+static bool use_subinterpreters;
+__thread PyObject *interp_module;
+#ifdef HAVE_PYTHON_SUBINTERPRETERS
+static char *script_path;
+static const_string_vector config_params = empty_vector;
+
+static void end_all_interpreters (void);
+#endif
+
 static PyThreadState *tstate;
 
 static void
@@ -73,10 +94,17 @@ static void
 py_unload (void)
 {
   if (tstate) {
+#ifdef HAVE_PYTHON_SUBINTERPRETERS
+    end_all_interpreters ();
+#endif
     PyEval_RestoreThread (tstate);
     Py_XDECREF (module);
     Py_Finalize ();
   }
+#ifdef HAVE_PYTHON_SUBINTERPRETERS
+  free (script_path);
+  const_string_vector_reset (&config_params);
+#endif
 }
 
 static void
@@ -93,6 +121,18 @@ py_dump_plugin (void)
   /* Maximum nbdkit API version supported. */
   printf ("nbdkit_python_maximum_api_version=%d\n", NBDKIT_API_VERSION);
 
+  /* Support for parallelism across cores. */
+#ifdef HAVE_PYTHON_SUBINTERPRETERS
+  printf ("python_subinterpreters=yes\n");
+#else
+  printf ("python_subinterpreters=no\n");
+#endif
+#ifdef Py_GIL_DISABLED
+  printf ("python_free_threaded=yes\n");
+#else
+  printf ("python_free_threaded=no\n");
+#endif
+
   /* If the script has a dump_plugin function, call it. */
   if (script && callback_defined ("dump_plugin", &fn)) {
     PyErr_Clear ();
@@ -127,13 +167,78 @@ get_py_api_version (void)
   return (int) value;
 }
 
+/* Returns 1 if the script set SUBINTERPRETERS = True. */
 static int
-py_config (const char *key, const char *value)
+get_py_subinterpreters (void)
+{
+  PyObject *obj;
+  int r;
+
+  obj = PyObject_GetAttrString (module, "SUBINTERPRETERS");
+  if (obj == NULL) {
+    PyErr_Clear ();
+    return 0;
+  }
+
+  r = PyObject_IsTrue (obj);
+  Py_DECREF (obj);
+  if (r == -1)
+    check_python_failure ("SUBINTERPRETERS");
+  return r;
+}
+
+/* Run the script in the current interpreter and return a new
+ * reference to its __main__ module, or NULL on error.
+ */
+static PyObject *
+load_script (const char *filename)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
   int fd;
   FILE *fp;
   PyObject *modname;
+  PyObject *m;
+
+  /* Load the Python script. Mark the file CLOEXEC, in case the act
+   * of loading the script invokes code that in turn fork()s.
+   * However, we can't rely on fopen("re"), so do it by hand.  This
+   * does not have to be atomic, because there are no threads during
+   * .config before the python interpreter is running, but it's
+   * easier to use open/fdopen than fopen/fcntl(fileno).
+   */
+  fd = open (filename, O_CLOEXEC | O_RDONLY);
+  if (fd == -1) {
+    nbdkit_error ("%s: cannot open file: %m", script);
+    return NULL;
+  }
+  fp = fdopen (fd, "r");
+  if (!fp) {
+    nbdkit_error ("%s: cannot open file: %m", script);
+    close (fd);
+    return NULL;
+  }
+
+  if (PyRun_SimpleFileEx (fp, filename, 1) == -1) {
+    nbdkit_error ("%s: error running this script", script);
+    return NULL;
+  }
+  /* Note that because closeit flag == 1, fp is now closed. */
+
+  /* The script should define a module called __main__. */
+  modname = PyUnicode_FromString ("__main__");
+  m = PyImport_Import (modname);
+  Py_DECREF (modname);
+  if (!m) {
+    nbdkit_error ("%s: cannot find __main__ module", script);
+    return NULL;
+  }
+
+  return m;
+}
+
+static int
+py_config (const char *key, const char *value)
+{
+  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
   PyObject *fn;
   PyObject *r;
 
@@ -146,39 +251,9 @@ py_config (const char *key, const char *value)
     }
     script = value;
 
-    /* Load the Python script. Mark the file CLOEXEC, in case the act
-     * of loading the script invokes code that in turn fork()s.
-     * However, we can't rely on fopen("re"), so do it by hand.  This
-     * does not have to be atomic, because there are no threads during
-     * .config before the python interpreter is running, but it's
-     * easier to use open/fdopen than fopen/fcntl(fileno).
-     */
-    fd = open (script, O_CLOEXEC | O_RDONLY);
-    if (fd == -1) {
-      nbdkit_error ("%s: cannot open file: %m", script);
-      return -1;
-    }
-    fp = fdopen (fd, "r");
-    if (!fp) {
-      nbdkit_error ("%s: cannot open file: %m", script);
-      close (fd);
-      return -1;
-    }
-
-    if (PyRun_SimpleFileEx (fp, script, 1) == -1) {
-      nbdkit_error ("%s: error running this script", script);
+    module = load_script (script);
+    if (!module)
       return -1;
-    }
-    /* Note that because closeit flag == 1, fp is now closed. */
-
-    /* The script should define a module called __main__. */
-    modname = PyUnicode_FromString ("__main__");
-    module = PyImport_Import (modname);
-    Py_DECREF (modname);
-    if (!module) {
-      nbdkit_error ("%s: cannot find __main__ module", script);
-      return -1;
-    }
 
     /* Minimal set of callbacks which are required (by nbdkit itself). */
     if (!callback_defined ("open", NULL) ||
@@ -195,6 +270,24 @@ py_config (const char *key, const char *value)
     py_api_version = get_py_api_version ();
     if (py_api_version == -1)
       return -1;
+
+    switch (get_py_subinterpreters ()) {
+    case -1:
+      return -1;
+    case 1:
+#ifdef HAVE_PYTHON_SUBINTERPRETERS
+      /* nbdkit may chdir before the first connection. */
+      script_path = nbdkit_realpath (script);
+      if (script_path == NULL)
+        return -1;
+      use_subinterpreters = true;
+      nbdkit_debug ("%s: using a sub-interpreter for each connection",
+                    script);
+#else
+      nbdkit_debug ("%s: SUBINTERPRETERS ignored because "
+                    "Python >= 3.12 is required", script);
+#endif
+    }
   }
   else if (callback_defined ("config", &fn)) {
     /* Other parameters are passed to the Python .config callback. */
@@ -205,6 +298,16 @@ py_config (const char *key, const char *value)
     if (check_python_failure ("config") == -1)
       return -1;
     Py_DECREF (r);
+
+#ifdef HAVE_PYTHON_SUBINTERPRETERS
+    /* Save the parameters so they can be replayed in sub-interpreters. */
+    if (use_subinterpreters &&
+        (const_string_vector_append (&config_params, key) == -1 ||
+         const_string_vector_append (&config_params, value) == -1)) {
+      nbdkit_error ("realloc: %m");
+      return -1;
+    }
+#endif
   }
   else {
     /* Emulate what core nbdkit does if a config callback is NULL. */
@@ -244,6 +347,12 @@ py_thread_model (void)
   PyObject *r;
   int ret = NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS;
 
+  /* Each connection has its own interpreter and GIL so connections can
+   * run in parallel, but requests on one connection are serialized.
+   */
+  if (use_subinterpreters)
+    ret = NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS;
+
   if (script && callback_defined ("thread_model", &fn)) {
     PyErr_Clear ();
 
@@ -438,69 +547,314 @@ py_preconnect (int readonly)
   return 0;
 }
 
+/* Per-connection handle. */
 struct handle {
   int can_zero;
   PyObject *py_h;
+#ifdef HAVE_PYTHON_SUBINTERPRETERS
+  /* If using sub-interpreters, the connection's interpreter, the
+   * __main__ module of the script loaded into it, and the thread
+   * state which created it, else NULL.  That thread state is kept
+   * (detached) until the interpreter is destroyed because some
+   * versions of Python cannot create a new thread state for an
+   * interpreter which has none left.
+   */
+  PyInterpreterState *interp;
+  PyObject *module;
+  PyThreadState *tstate;
+#endif
 };
 
-static void *
-py_open (int readonly)
+/* Callbacks which are passed the handle must use this macro instead
+ * of ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE.  If the connection has its
+ * own sub-interpreter then we attach a new thread state for that
+ * interpreter (since nbdkit may call us on any thread) and take its
+ * GIL.  Otherwise we take the GIL of the main interpreter as usual.
+ */
+struct handle_scope {
+  PyGILState_STATE gstate;
+  bool subinterpreter;          /* Attached to a sub-interpreter. */
+  bool nested;                  /* Already attached by the caller. */
+};
+
+static inline struct handle_scope
+enter_handle (struct handle *h)
+{
+  struct handle_scope scope = { .subinterpreter = false };
+
+#ifdef HAVE_PYTHON_SUBINTERPRETERS
+  if (h->interp) {
+    scope.subinterpreter = true;
+    /* eg. py_can_fast_zero calls py_can_zero. */
+    if (interp_module == h->module) {
+      scope.nested = true;
+      return scope;
+    }
+    PyEval_RestoreThread (PyThreadState_New (h->interp));
+    interp_module = h->module;
+    return scope;
+  }
+#endif
+
+  scope.gstate = PyGILState_Ensure ();
+  return scope;
+}
+
+static inline void
+leave_handle (struct handle_scope *scope)
+{
+#ifdef HAVE_PYTHON_SUBINTERPRETERS
+  if (scope->subinterpreter) {
+    if (!scope->nested) {
+      interp_module = NULL;
+      PyThreadState_Clear (PyThreadState_Get ());
+      PyThreadState_DeleteCurrent ();
+    }
+    return;
+  }
+#endif
+
+  PyGILState_Release (scope->gstate);
+}
+
+#define ACQUIRE_PYTHON_FOR_HANDLE(handle)               \
+  __attribute__ ((cleanup (leave_handle)))              \
+  CLANG_UNUSED_VARIABLE_WORKAROUND                      \
+  struct handle_scope hscope = enter_handle (handle)
+
+#ifdef HAVE_PYTHON_SUBINTERPRETERS
+/* Connections which have a sub-interpreter.  nbdkit does not call
+ * .close for connections which are still open when it exits, but
+ * Py_Finalize requires that all sub-interpreters are destroyed first.
+ */
+DEFINE_VECTOR_TYPE (handle_list, struct handle *);
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+static handle_list handles = empty_vector;
+
+/* Replay the config and config_complete callbacks in a new
+ * sub-interpreter.
+ */
+static int
+replay_config (void)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
   PyObject *fn;
-  struct handle *h;
+  PyObject *r;
+  size_t i;
+
+  if (callback_defined ("config", &fn)) {
+    for (i = 0; i < config_params.len; i += 2) {
+      PyErr_Clear ();
+
+      r = PyObject_CallFunction (fn, "ss",
+                                 config_params.ptr[i],
+                                 config_params.ptr[i+1]);
+      if (check_python_failure ("config") == -1) {
+        Py_DECREF (fn);
+        return -1;
+      }
+      Py_DECREF (r);
+    }
+    Py_DECREF (fn);
+  }
+
+  if (callback_defined ("config_complete", &fn)) {
+    PyErr_Clear ();
+
+    r = PyObject_CallObject (fn, NULL);
+    Py_DECREF (fn);
+    if (check_python_failure ("config_complete") == -1)
+      return -1;
+    Py_DECREF (r);
+  }
+
+  return 0;
+}
+
+/* Create a new sub-interpreter with its own GIL for the connection,
+ * load the script into it and replay the configuration.
+ */
+static int
+new_interpreter (struct handle *h)
+{
+  const PyInterpreterConfig config = {
+    .use_main_obmalloc = 0,
+    .allow_fork = 0,
+    .allow_exec = 1,
+    .allow_threads = 1,
+    .allow_daemon_threads = 0,
+    .check_multi_interp_extensions = 1,
+    .gil = PyInterpreterConfig_OWN_GIL,
+  };
+  PyGILState_STATE gstate;
+  PyThreadState *main_ts, *ts = NULL;
+  PyStatus status;
+  int r = -1;
+
+  gstate = PyGILState_Ensure ();
+  main_ts = PyThreadState_Get ();
+
+  status = Py_NewInterpreterFromConfig (&ts, &config);
+  if (PyStatus_Exception (status)) {
+    nbdkit_error ("%s: could not create sub-interpreter: %s",
+                  script, status.err_msg ? status.err_msg : "unknown error");
+    PyThreadState_Swap (main_ts);
+    PyGILState_Release (gstate);
+    return -1;
+  }
+
+  /* The new interpreter's thread state is now current and we hold
+   * its GIL.
+   */
+  h->module = load_script (script_path);
+  if (h->module) {
+    interp_module = h->module;
+    r = replay_config ();
+    interp_module = NULL;
+  }
+
+  if (r == 0) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&handles_lock);
+    if (handle_list_append (&handles, h) == -1) {
+      nbdkit_error ("realloc: %m");
+      r = -1;
+    }
+  }
+
+  if (r == 0) {
+    h->interp = PyThreadState_GetInterpreter (ts);
+    h->tstate = ts;
+  }
+  else {
+    Py_XDECREF (h->module);
+    h->module = NULL;
+    Py_EndInterpreter (ts);
+  }
+
+  PyThreadState_Swap (main_ts);
+  PyGILState_Release (gstate);
+  return r;
+}
+
+static void
+end_interpreter (struct handle *h)
+{
+  size_t i;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&handles_lock);
+    for (i = 0; i < handles.len; ++i) {
+      if (handles.ptr[i] == h) {
+        handle_list_remove (&handles, i);
+        break;
+      }
+    }
+  }
+
+  PyEval_RestoreThread (h->tstate);
+  Py_DECREF (h->module);
+  Py_EndInterpreter (h->tstate);
+  h->interp = NULL;
+  h->module = NULL;
+  h->tstate = NULL;
+}
+
+/* Called from .unload.  No other callbacks can be running. */
+static void
+end_all_interpreters (void)
+{
+  while (handles.len > 0)
+    end_interpreter (handles.ptr[0]);
+  handle_list_reset (&handles);
+}
+#endif /* HAVE_PYTHON_SUBINTERPRETERS */
+
+static int
+call_open (struct handle *h, int readonly)
+{
+  ACQUIRE_PYTHON_FOR_HANDLE (h);
+  PyObject *fn;
 
   if (!callback_defined ("open", &fn)) {
     nbdkit_error ("%s: missing callback: %s", script, "open");
-    return NULL;
+    return -1;
   }
 
-  h = malloc (sizeof *h);
+  PyErr_Clear ();
+
+  h->py_h = PyObject_CallFunctionObjArgs (fn, readonly ? Py_True : Py_False,
+                                          NULL);
+  Py_DECREF (fn);
+  if (check_python_failure ("open") == -1)
+    return -1;
+
+  assert (h->py_h);
+  return 0;
+}
+
+static void *
+py_open (int readonly)
+{
+  struct handle *h;
+
+  h = calloc (1, sizeof *h);
   if (h == NULL) {
-    nbdkit_error ("malloc: %m");
+    nbdkit_error ("calloc: %m");
     return NULL;
   }
   h->can_zero = -1;
 
-  PyErr_Clear ();
+#ifdef HAVE_PYTHON_SUBINTERPRETERS
+  if (use_subinterpreters && new_interpreter (h) == -1) {
+    free (h);
+    return NULL;
+  }
+#endif
 
-  h->py_h = PyObject_CallFunctionObjArgs (fn, readonly ? Py_True : Py_False,
-                                          NULL);
-  Py_DECREF (fn);
-  if (check_python_failure ("open") == -1) {
+  if (call_open (h, readonly) == -1) {
+#ifdef HAVE_PYTHON_SUBINTERPRETERS
+    if (h->interp)
+      end_interpreter (h);
+#endif
     free (h);
     return NULL;
   }
 
-  assert (h->py_h);
   return h;
 }
 
 static void
 py_close (void *handle)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
   struct handle *h = handle;
   PyObject *fn;
   PyObject *r;
 
-  if (callback_defined ("close", &fn)) {
-    PyErr_Clear ();
+  {
+    ACQUIRE_PYTHON_FOR_HANDLE (h);
 
-    r = PyObject_CallFunctionObjArgs (fn, h->py_h, NULL);
-    Py_DECREF (fn);
-    check_python_failure ("close");
-    Py_XDECREF (r);
+    if (callback_defined ("close", &fn)) {
+      PyErr_Clear ();
+
+      r = PyObject_CallFunctionObjArgs (fn, h->py_h, NULL);
+      Py_DECREF (fn);
+      check_python_failure ("close");
+      Py_XDECREF (r);
+    }
+
+    Py_DECREF (h->py_h);
   }
 
-  Py_DECREF (h->py_h);
+#ifdef HAVE_PYTHON_SUBINTERPRETERS
+  if (h->interp)
+    end_interpreter (h);
+#endif
   free (h);
 }
 
 static const char *
 py_export_description (void *handle)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   struct handle *h = handle;
   PyObject *fn;
   PyObject *r;
@@ -529,7 +883,7 @@ py_export_description (void *handle)
 static int64_t
 py_get_size (void *handle)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   struct handle *h = handle;
   PyObject *fn;
   PyObject *r;
@@ -559,7 +913,7 @@ static int
 py_block_size (void *handle,
                uint32_t *minimum, uint32_t *preferred, uint32_t *maximum)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   struct handle *h = handle;
   PyObject *fn;
   PyObject *r;
@@ -594,7 +948,7 @@ static int
 py_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
           uint32_t flags)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   struct handle *h = handle;
   PyObject *fn;
   PyObject *r;
@@ -657,7 +1011,7 @@ static int
 py_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
            uint32_t flags)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   struct handle *h = handle;
   PyObject *fn;
   PyObject *r;
@@ -694,7 +1048,7 @@ py_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
 static int
 py_flush (void *handle, uint32_t flags)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   struct handle *h = handle;
   PyObject *fn;
   PyObject *r;
@@ -727,7 +1081,7 @@ py_flush (void *handle, uint32_t flags)
 static int
 py_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   struct handle *h = handle;
   PyObject *fn;
   PyObject *r;
@@ -760,7 +1114,7 @@ py_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 static int
 py_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   struct handle *h = handle;
   PyObject *fn;
   PyObject *r;
@@ -807,7 +1161,7 @@ py_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 static int
 py_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   struct handle *h = handle;
   PyObject *fn;
   PyObject *r;
@@ -868,42 +1222,42 @@ boolean_callback (void *handle, const char *can_fn, const char *plain_fn)
 static int
 py_is_rotational (void *handle)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   return boolean_callback (handle, "is_rotational", NULL);
 }
 
 static int
 py_can_multi_conn (void *handle)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   return boolean_callback (handle, "can_multi_conn", NULL);
 }
 
 static int
 py_can_write (void *handle)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   return boolean_callback (handle, "can_write", "pwrite");
 }
 
 static int
 py_can_flush (void *handle)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   return boolean_callback (handle, "can_flush", "flush");
 }
 
 static int
 py_can_trim (void *handle)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   return boolean_callback (handle, "can_trim", "trim");
 }
 
 static int
 py_can_zero (void *handle)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   struct handle *h = handle;
 
   if (h->can_zero >= 0)
@@ -914,7 +1268,7 @@ py_can_zero (void *handle)
 static int
 py_can_fast_zero (void *handle)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   int r;
 
   if (callback_defined ("can_fast_zero", NULL))
@@ -932,7 +1286,7 @@ py_can_fast_zero (void *handle)
 static int
 py_can_fua (void *handle)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   struct handle *h = handle;
   PyObject *fn;
   PyObject *r;
@@ -961,7 +1315,7 @@ py_can_fua (void *handle)
 static int
 py_can_cache (void *handle)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   struct handle *h = handle;
   PyObject *fn;
   PyObject *r;
@@ -990,7 +1344,7 @@ py_can_cache (void *handle)
 static int
 py_can_extents (void *handle)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   return boolean_callback (handle, "can_extents", "extents");
 }
 
@@ -998,7 +1352,7 @@ static int
 py_extents (void *handle, uint32_t count, uint64_t offset,
             uint32_t flags, struct nbdkit_extents *extents)
 {
-  ACQUIRE_PYTHON_GIL_FOR_CURRENT_SCOPE;
+  ACQUIRE_PYTHON_FOR_HANDLE (handle);
   struct handle *h = handle;
   PyObject *fn;
   PyObject *r;
@@ -42,6 +42,13 @@
 #define NBDKIT_API_VERSION 2
 #include <nbdkit-plugin.h>
 
+/* Python >= 3.12 can run sub-interpreters which each have their own
+ * GIL (PEP 684).
+ */
+#if PY_VERSION_HEX >= 0x030C0000
+#define HAVE_PYTHON_SUBINTERPRETERS 1
+#endif
+
 /* All callbacks that want to call any Py* function should use this
  * macro.  See
  * https://docs.python.org/3/c-api/init.html#non-python-created-threads
@@ -58,6 +65,7 @@ cleanup_release (PyGILState_STATE *gstateptr)
 
 extern const char *script;
 extern PyObject *module;
+extern __thread PyObject *interp_module;
 extern int py_api_version;
 extern __thread int last_error;
 
@@ -39,11 +39,13 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
 
 #define NBDKIT_API_VERSION 2
 #include <nbdkit-plugin.h>
 
 #include "cleanup.h"
+#include "minmax.h"
 #include "random.h"
 
 /* The size of disk in bytes (initialized by size=<SIZE> parameter). */
@@ -52,6 +54,21 @@ static int64_t size = 0;
 /* Seed. */
 static uint32_t seed;
 
+/* Generator version (generator=1|2).  Version 1 is the default so
+ * that existing seeds produce the same data.
+ */
+static unsigned generator = 1;
+
+/* What to do when data written does not match (mismatch=error|count). */
+static enum { MISMATCH_ERROR, MISMATCH_COUNT } mismatch = MISMATCH_ERROR;
+
+/* With mismatch=count, the number of blocks and bytes which did not
+ * match.  Blocks are VERIFY_BLOCK bytes, aligned to the disk.
+ */
+#define VERIFY_BLOCK 4096
+static pthread_mutex_t mismatch_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t mismatched_blocks, mismatched_bytes;
+
 static void
 random_load (void)
 {
@@ -62,6 +79,20 @@ random_load (void)
   seed = time (NULL);
 }
 
+/* With mismatch=count, report the number of mismatches. */
+static void
+random_unload (void)
+{
+  if (mismatch == MISMATCH_COUNT) {
+    if (mismatched_blocks > 0)
+      nbdkit_error ("data written does not match expected: "
+                    "%" PRIu64 " blocks and %" PRIu64 " bytes differ",
+                    mismatched_blocks, mismatched_bytes);
+    else
+      nbdkit_debug ("all data written matched expected");
+  }
+}
+
 static int
 random_config (const char *key, const char *value)
 {
@@ -71,6 +102,24 @@ random_config (const char *key, const char *value)
     if (nbdkit_parse_uint32_t ("seed", value, &seed) == -1)
       return -1;
   }
+  else if (strcmp (key, "generator") == 0) {
+    if (nbdkit_parse_unsigned ("generator", value, &generator) == -1)
+      return -1;
+    if (generator < 1 || generator > 2) {
+      nbdkit_error ("generator must be 1 or 2");
+      return -1;
+    }
+  }
+  else if (strcmp (key, "mismatch") == 0) {
+    if (strcmp (value, "error") == 0)
+      mismatch = MISMATCH_ERROR;
+    else if (strcmp (value, "count") == 0)
+      mismatch = MISMATCH_COUNT;
+    else {
+      nbdkit_error ("mismatch must be 'error' or 'count'");
+      return -1;
+    }
+  }
   else if (strcmp (key, "size") == 0) {
     r = nbdkit_parse_size (value);
     if (r == -1)
@@ -87,7 +136,9 @@ random_config (const char *key, const char *value)
 
 #define random_config_help \
   "size=<SIZE>  (required) Size of the backing disk\n" \
-  "seed=<SEED>             Random number generator seed"
+  "seed=<SEED>             Random number generator seed\n" \
+  "generator=1|2           Random number generator version\n" \
+  "mismatch=error|count    Fail or count writes which do not match"
 
 #define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
@@ -131,6 +182,14 @@ random_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   unsigned char *b = buf;
   uint64_t s;
 
+  /* Version 2 uses a counter-mode generator which produces 8 bytes
+   * at a time, see xrandom_fill in common/include/random.h.
+   */
+  if (generator == 2) {
+    xrandom_fill (seed, buf, count, offset);
+    return 0;
+  }
+
   for (i = 0; i < count; ++i) {
     /* We use nbdkit common/include/random.h to make random numbers.
      *
@@ -155,30 +214,69 @@ random_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   return 0;
 }
 
+/* With mismatch=count, count the blocks which differ in a chunk. */
+static void
+count_mismatches (const unsigned char *buf, const unsigned char *expected,
+                  uint32_t count, uint64_t offset)
+{
+  uint32_t i, n, bytes;
+
+  while (count > 0) {
+    n = MIN (count, VERIFY_BLOCK - offset % VERIFY_BLOCK);
+    if (memcmp (buf, expected, n) != 0) {
+      for (i = bytes = 0; i < n; ++i)
+        bytes += buf[i] != expected[i];
+      nbdkit_debug ("data written does not match expected: "
+                    "block at offset %" PRIu64 ": %" PRIu32 " bytes differ",
+                    offset - offset % VERIFY_BLOCK, bytes);
+
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&mismatch_lock);
+      mismatched_blocks++;
+      mismatched_bytes += bytes;
+    }
+    buf += n;
+    expected += n;
+    offset += n;
+    count -= n;
+  }
+}
+
 /* Write data.
  *
  * This verifies that the data matches what is read.  This is
  * implemented by calling random_pread above internally and comparing
- * the two buffers.
+ * the two buffers.  To avoid allocating and to stay in the CPU cache
+ * this is done in chunks.
  */
+#define VERIFY_CHUNK (4 * VERIFY_BLOCK)
+
 static int
 random_pwrite (void *handle, const void *buf,
                uint32_t count, uint64_t offset,
                uint32_t flags)
 {
-  CLEANUP_FREE char *expected = malloc (count);
-  if (expected == NULL) {
-    nbdkit_error ("malloc: %m");
-    return -1;
-  }
+  const unsigned char *b = buf;
+  unsigned char expected[VERIFY_CHUNK];
+  uint32_t n;
 
-  if (random_pread (handle, expected, count, offset, flags) == -1)
-    return -1;
+  while (count > 0) {
+    /* Chunks are aligned so that blocks are not split. */
+    n = MIN (count, VERIFY_CHUNK - offset % VERIFY_CHUNK);
+    if (random_pread (handle, expected, n, offset, flags) == -1)
+      return -1;
 
-  if (memcmp (buf, expected, count) != 0) {
-    errno = EIO;
-    nbdkit_error ("data written does not match expected");
-    return -1;
+    if (memcmp (b, expected, n) != 0) {
+      if (mismatch == MISMATCH_ERROR) {
+        errno = EIO;
+        nbdkit_error ("data written does not match expected");
+        return -1;
+      }
+      count_mismatches (b, expected, n, offset);
+    }
+
+    b += n;
+    offset += n;
+    count -= n;
   }
 
   return 0;
@@ -201,6 +299,7 @@ static struct nbdkit_plugin plugin = {
   .name              = "random",
   .version           = PACKAGE_VERSION,
   .load              = random_load,
+  .unload            = random_unload,
   .config            = random_config,
   .config_help       = random_config_help,
   .magic_config_key  = "size",
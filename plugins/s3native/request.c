@@ -0,0 +1,519 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Running S3 requests.
+ *
+ * There is a pool of up to 'connections' curl easy handles.  All the
+ * handles share one connection cache (using a curl share handle), so
+ * HTTP keep-alive connections are reused between requests.
+ *
+ * run_requests takes an array of requests and runs as many of them in
+ * parallel as it can get handles for, using a curl multi handle in
+ * the calling thread.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#include <nbdkit-plugin.h>
+
+#include "array-size.h"
+#include "cleanup.h"
+#include "minmax.h"
+#include "open_memstream.h"
+#include "vector.h"
+
+#include "s3native.h"
+
+/* Maximum number of requests run at the same time by one thread. */
+#define MAX_PARALLEL 64
+
+/* Keep at most this much of an error or POST response body. */
+#define MAX_RESPONSE 65536
+
+/* The SHA-256 of an empty payload. */
+static const char empty_sha256[] =
+  "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+
+static CURLSH *share;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+/* The handle pool.  This lock protects the fields below. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+DEFINE_VECTOR_TYPE (handle_list, CURL *);
+static handle_list free_handles = empty_vector;
+static size_t nr_handles;       /* Total allocated, in use or free. */
+
+static void
+share_lock (CURL *c, curl_lock_data data, curl_lock_access access, void *vp)
+{
+  pthread_mutex_lock (&share_locks[data]);
+}
+
+static void
+share_unlock (CURL *c, curl_lock_data data, void *vp)
+{
+  pthread_mutex_unlock (&share_locks[data]);
+}
+
+int
+request_init (void)
+{
+  size_t i;
+
+  for (i = 0; i < ARRAY_SIZE (share_locks); ++i)
+    pthread_mutex_init (&share_locks[i], NULL);
+
+  share = curl_share_init ();
+  if (share == NULL) {
+    nbdkit_error ("curl_share_init: failed");
+    return -1;
+  }
+  curl_share_setopt (share, CURLSHOPT_LOCKFUNC, share_lock);
+  curl_share_setopt (share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+  curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#ifdef HAVE_CURL_LOCK_DATA_CONNECT
+  curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+  return 0;
+}
+
+void
+request_free (void)
+{
+  size_t i;
+
+  assert (free_handles.len == nr_handles);
+  for (i = 0; i < free_handles.len; ++i)
+    curl_easy_cleanup (free_handles.ptr[i]);
+  handle_list_reset (&free_handles);
+  nr_handles = 0;
+
+  if (share) {
+    curl_share_cleanup (share);
+    share = NULL;
+  }
+  for (i = 0; i < ARRAY_SIZE (share_locks); ++i)
+    pthread_mutex_destroy (&share_locks[i]);
+}
+
+/* Get a handle from the pool.  If wait is false and all handles are
+ * in use, returns NULL without setting an error.
+ */
+static CURL *
+get_handle (bool wait)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  CURL *c;
+
+  for (;;) {
+    if (free_handles.len > 0)
+      return free_handles.ptr[--free_handles.len];
+
+    if (nr_handles < connections) {
+      c = curl_easy_init ();
+      if (c == NULL) {
+        nbdkit_error ("curl_easy_init: failed: %m");
+        return NULL;
+      }
+      /* Make sure that put_handle cannot fail. */
+      if (handle_list_reserve (&free_handles, nr_handles+1) == -1) {
+        nbdkit_error ("realloc: %m");
+        curl_easy_cleanup (c);
+        return NULL;
+      }
+      nr_handles++;
+      return c;
+    }
+
+    if (!wait)
+      return NULL;
+    pthread_cond_wait (&cond, &lock);
+  }
+}
+
+static void
+put_handle (CURL *c)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  int r;
+
+  r = handle_list_append (&free_handles, c);
+  assert (r == 0);
+  pthread_cond_signal (&cond);
+}
+
+/* When using CURLOPT_VERBOSE, redirect messages to nbdkit_debug. */
+static int
+debug_cb (CURL *c, curl_infotype type, const char *data, size_t size,
+          void *opaque)
+{
+  while (size > 0 && (data[size-1] == '\n' || data[size-1] == '\r'))
+    size--;
+
+  switch (type) {
+  case CURLINFO_TEXT:
+    nbdkit_debug ("%.*s", (int) size, data);
+    break;
+  case CURLINFO_HEADER_IN:
+    nbdkit_debug ("S: %.*s", (int) size, data);
+    break;
+  case CURLINFO_HEADER_OUT:
+    nbdkit_debug ("C: %.*s", (int) size, data);
+    break;
+  default:
+    break;
+  }
+  return 0;
+}
+
+/* Append to the (truncated) response string. */
+static void
+append_response (struct request *req, const char *ptr, size_t len)
+{
+  len = MIN (len, MAX_RESPONSE - req->response.len);
+  if (len == 0 || string_reserve (&req->response, len + 1) == -1)
+    return;
+  memcpy (&req->response.ptr[req->response.len], ptr, len);
+  req->response.len += len;
+  req->response.ptr[req->response.len] = '\0';
+}
+
+/* Response body. */
+static size_t
+write_cb (char *ptr, size_t size, size_t nmemb, void *opaque)
+{
+  struct request *req = opaque;
+  size_t realsize = size * nmemb;
+  long status = 0;
+  uint64_t len;
+
+  curl_easy_getinfo (req->c, CURLINFO_RESPONSE_CODE, &status);
+
+  /* Error responses and POST responses are saved in req->response.
+   * Only successful GET data goes into the caller's buffer.
+   */
+  if (req->buf == NULL || status < 200 || status >= 300) {
+    append_response (req, ptr, realsize);
+    return realsize;
+  }
+
+  /* If the server ignored the Range header then it sends the whole
+   * object with status 200.  That is only the data we asked for if
+   * the range started at the beginning of the object, otherwise
+   * abort the transfer rather than return the wrong data.
+   */
+  if (status != 206 && req->offset != 0) {
+    req->ignored_range = true;
+    return 0;
+  }
+
+  /* Don't write more than the requested amount of data. */
+  len = MIN (realsize, req->count - req->received);
+  memcpy (&req->buf[req->received], ptr, len);
+  req->received += len;
+  return realsize;
+}
+
+/* Request body for PUT. */
+static size_t
+read_cb (char *ptr, size_t size, size_t nmemb, void *opaque)
+{
+  struct request *req = opaque;
+  size_t len = MIN (size * nmemb, req->bodysize - req->received);
+
+  memcpy (ptr, &req->body[req->received], len);
+  req->received += len;
+  return len;
+}
+
+/* Set up handle c to run request req. */
+static int
+setup_request (struct request *req, CURL *c)
+{
+  CLEANUP_FREE char *uri = NULL, *url = NULL;
+  size_t len;
+  FILE *fp;
+  char payload_hash[65];
+  char range[64];
+
+  req->c = c;
+  req->headers = NULL;
+  req->status = 0;
+  req->received = 0;
+  req->ignored_range = false;
+  req->content_length = -1;
+  req->response = (string) empty_vector;
+  req->errbuf[0] = '\0';
+
+  /* Reset the handle, but keep its connections and the share. */
+  curl_easy_reset (c);
+  curl_easy_setopt (c, CURLOPT_SHARE, share);
+  curl_easy_setopt (c, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt (c, CURLOPT_ERRORBUFFER, req->errbuf);
+  if (s3native_debug_verbose) {
+    curl_easy_setopt (c, CURLOPT_VERBOSE, 1L);
+    curl_easy_setopt (c, CURLOPT_DEBUGFUNCTION, debug_cb);
+  }
+  if (!sslverify) {
+    curl_easy_setopt (c, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt (c, CURLOPT_SSL_VERIFYHOST, 0L);
+  }
+  if (timeout > 0)
+    curl_easy_setopt (c, CURLOPT_TIMEOUT, (long) timeout);
+
+  /* The canonical URI, also used to construct the URL. */
+  fp = open_memstream (&uri, &len);
+  if (fp == NULL) {
+    nbdkit_error ("open_memstream: %m");
+    return -1;
+  }
+  fprintf (fp, "%s/", endpoint_path);
+  uri_encode (fp, bucket, true);
+  putc ('/', fp);
+  uri_encode (fp, req->object, false);
+  if (close_memstream (fp) == EOF) {
+    nbdkit_error ("close_memstream: %m");
+    return -1;
+  }
+  if (asprintf (&url, "%s%s%s%s", endpoint, uri,
+                req->query ? "?" : "", req->query ? req->query : "") == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+  curl_easy_setopt (c, CURLOPT_URL, url);
+
+  curl_easy_setopt (c, CURLOPT_WRITEFUNCTION, write_cb);
+  curl_easy_setopt (c, CURLOPT_WRITEDATA, req);
+
+  if (strcmp (req->method, "GET") == 0) {
+    curl_easy_setopt (c, CURLOPT_HTTPGET, 1L);
+    if (req->buf) {
+      snprintf (range, sizeof range, "%" PRIu64 "-%" PRIu64,
+                req->offset, req->offset + req->count - 1);
+      curl_easy_setopt (c, CURLOPT_RANGE, range);
+    }
+    strcpy (payload_hash, empty_sha256);
+  }
+  else if (strcmp (req->method, "HEAD") == 0) {
+    curl_easy_setopt (c, CURLOPT_NOBODY, 1L);
+    strcpy (payload_hash, empty_sha256);
+  }
+  else if (strcmp (req->method, "PUT") == 0) {
+    curl_easy_setopt (c, CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt (c, CURLOPT_INFILESIZE_LARGE,
+                      (curl_off_t) req->bodysize);
+    curl_easy_setopt (c, CURLOPT_READFUNCTION, read_cb);
+    curl_easy_setopt (c, CURLOPT_READDATA, req);
+    /* Hashing every block would cost more CPU than the request, and
+     * S3 allows unsigned payloads.
+     */
+    strcpy (payload_hash, "UNSIGNED-PAYLOAD");
+  }
+  else if (strcmp (req->method, "POST") == 0) {
+    curl_easy_setopt (c, CURLOPT_POST, 1L);
+    curl_easy_setopt (c, CURLOPT_POSTFIELDS, req->body);
+    curl_easy_setopt (c, CURLOPT_POSTFIELDSIZE_LARGE,
+                      (curl_off_t) req->bodysize);
+    sha256_hex (req->body, req->bodysize, payload_hash);
+  }
+  else
+    abort ();
+
+  if (sigv4_sign (&req->headers, req->method, uri, req->query,
+                  payload_hash) == -1)
+    return -1;
+
+  /* Don't wait for 100-continue before sending the body. */
+  req->headers = curl_slist_append (req->headers, "Expect:");
+  if (req->body)
+    req->headers = curl_slist_append (req->headers,
+                                      "Content-Type: application/octet-stream");
+  if (req->headers && req->content_md5) {
+    CLEANUP_FREE char *h = NULL;
+    if (asprintf (&h, "Content-MD5: %s", req->content_md5) == -1) {
+      nbdkit_error ("asprintf: %m");
+      return -1;
+    }
+    req->headers = curl_slist_append (req->headers, h);
+  }
+  if (req->headers == NULL) {
+    nbdkit_error ("curl_slist_append: %m");
+    return -1;
+  }
+  curl_easy_setopt (c, CURLOPT_HTTPHEADER, req->headers);
+
+  return 0;
+}
+
+/* Run n requests in parallel using handles cs[0..n-1]. */
+static int
+run_batch (struct request *reqs, CURL **cs, size_t n)
+{
+  CURLM *multi;
+  CURLMcode mc;
+  CURLMsg *msg;
+  int running, msgs_left, ret = 0;
+  size_t i, added = 0;
+
+  multi = curl_multi_init ();
+  if (multi == NULL) {
+    nbdkit_error ("curl_multi_init: failed");
+    return -1;
+  }
+
+  for (i = 0; i < n; ++i) {
+    if (setup_request (&reqs[i], cs[i]) == -1) {
+      ret = -1;
+      goto out;
+    }
+    curl_easy_setopt (cs[i], CURLOPT_PRIVATE, (char *) &reqs[i]);
+    mc = curl_multi_add_handle (multi, cs[i]);
+    if (mc != CURLM_OK) {
+      nbdkit_error ("curl_multi_add_handle: %s", curl_multi_strerror (mc));
+      ret = -1;
+      goto out;
+    }
+    added++;
+  }
+
+  do {
+    mc = curl_multi_perform (multi, &running);
+    if (mc == CURLM_OK && running > 0)
+      mc = curl_multi_wait (multi, NULL, 0, 1000, NULL);
+    if (mc != CURLM_OK) {
+      nbdkit_error ("curl_multi_perform: %s", curl_multi_strerror (mc));
+      ret = -1;
+      goto out;
+    }
+  } while (running > 0);
+
+  while ((msg = curl_multi_info_read (multi, &msgs_left)) != NULL) {
+    struct request *req;
+    char *p;
+
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+    curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, &p);
+    req = (struct request *) p;
+    if (req->ignored_range) {
+      nbdkit_error ("%s %s: server does not support ranged requests",
+                    req->method, req->object);
+      ret = -1;
+      continue;
+    }
+    if (msg->data.result != CURLE_OK) {
+      nbdkit_error ("%s %s: %s: %s", req->method, req->object,
+                    curl_easy_strerror (msg->data.result), req->errbuf);
+      ret = -1;
+      continue;
+    }
+    curl_easy_getinfo (req->c, CURLINFO_RESPONSE_CODE, &req->status);
+    if (strcmp (req->method, "HEAD") == 0) {
+#ifdef HAVE_CURLINFO_CONTENT_LENGTH_DOWNLOAD_T
+      curl_off_t o = -1;
+      curl_easy_getinfo (req->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &o);
+#else
+      double o = -1;
+      curl_easy_getinfo (req->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &o);
+#endif
+      req->content_length = o;
+    }
+  }
+
+ out:
+  for (i = 0; i < added; ++i)
+    curl_multi_remove_handle (multi, cs[i]);
+  curl_multi_cleanup (multi);
+  return ret;
+}
+
+/* Run the requests, as many in parallel as possible.  The requests
+ * must be zero-initialized apart from the fields set by the caller.
+ * Returns -1 if any request could not be made.  Otherwise the caller
+ * must check req->status of each request.  In both cases the caller
+ * must call free_requests afterwards.
+ */
+int
+run_requests (struct request *reqs, size_t n)
+{
+  CURL *cs[MAX_PARALLEL];
+  size_t i = 0, j, k;
+  int r;
+
+  while (i < n) {
+    /* Wait for one handle, but never for more, since other threads
+     * may be holding some handles while waiting for more.
+     */
+    cs[0] = get_handle (true);
+    if (cs[0] == NULL)
+      return -1;
+    k = 1;
+    while (k < MAX_PARALLEL && i+k < n && (cs[k] = get_handle (false)) != NULL)
+      k++;
+
+    r = run_batch (&reqs[i], cs, k);
+    for (j = 0; j < k; ++j) {
+      curl_slist_free_all (reqs[i+j].headers);
+      reqs[i+j].headers = NULL;
+      put_handle (cs[j]);
+    }
+    if (r == -1)
+      return -1;
+    i += k;
+  }
+
+  return 0;
+}
+
+void
+free_requests (struct request *reqs, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; ++i) {
+    free (reqs[i].object);
+    string_reset (&reqs[i].response);
+  }
+}
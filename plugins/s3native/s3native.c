@@ -0,0 +1,926 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Native S3 plugin.
+ *
+ * Like nbdkit-S3-plugin this can serve a single object (read-only),
+ * or a disk made of many fixed-size objects, one per block, named
+ * KEY/%016x after the block number.  Blocks which do not exist read
+ * as zeroes, so trimming and zeroing delete whole blocks.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+#include <curl/curl.h>
+
+#define NBDKIT_API_VERSION 2
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+#include "ispowerof2.h"
+#include "minmax.h"
+#include "open_memstream.h"
+#include "vector.h"
+
+#include "s3native.h"
+
+/* Plugin configuration. */
+char *access_key = NULL;
+char *secret_key = NULL;
+char *session_token = NULL;
+const char *bucket = NULL;      /* required */
+const char *key_name = NULL;    /* required */
+const char *region = NULL;
+unsigned connections = 16;
+bool sslverify = true;
+uint32_t timeout = 0;
+static const char *endpoint_url = NULL;
+static int64_t dev_size = -1;
+static uint32_t obj_size = 0;
+
+char *endpoint = NULL;
+char *endpoint_host = NULL;
+char *endpoint_path = NULL;
+
+/* Use '-D s3native.verbose=1' to set. */
+NBDKIT_DLL_PUBLIC int s3native_debug_verbose = 0;
+
+/* In single object mode, reads larger than this are split into
+ * several ranged GETs which run in parallel.
+ */
+#define PIECE_SIZE (8 * 1024 * 1024)
+
+/* DeleteObjects can delete at most this many objects per request. */
+#define MAX_DELETE 1000
+
+static void
+s3native_load (void)
+{
+  CURLcode r;
+
+  r = curl_global_init (CURL_GLOBAL_DEFAULT);
+  if (r != CURLE_OK) {
+    nbdkit_error ("libcurl initialization failed: %d", (int) r);
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+s3native_unload (void)
+{
+  request_free ();
+  free (access_key);
+  free (secret_key);
+  free (session_token);
+  free (endpoint);
+  free (endpoint_host);
+  free (endpoint_path);
+  curl_global_cleanup ();
+}
+
+static int
+read_secret (const char *value, char **ret)
+{
+  free (*ret);
+  *ret = NULL;
+  return nbdkit_read_password (value, ret);
+}
+
+static int
+s3native_config (const char *k, const char *value)
+{
+  int r;
+  int64_t v;
+
+  if (strcmp (k, "access-key") == 0 || strcmp (k, "access_key") == 0) {
+    free (access_key);
+    access_key = strdup (value);
+    if (access_key == NULL) {
+      nbdkit_error ("strdup: %m");
+      return -1;
+    }
+  }
+  else if (strcmp (k, "secret-key") == 0 || strcmp (k, "secret_key") == 0) {
+    if (read_secret (value, &secret_key) == -1)
+      return -1;
+  }
+  else if (strcmp (k, "session-token") == 0 ||
+           strcmp (k, "session_token") == 0) {
+    if (read_secret (value, &session_token) == -1)
+      return -1;
+  }
+  else if (strcmp (k, "endpoint-url") == 0 ||
+           strcmp (k, "endpoint_url") == 0)
+    endpoint_url = value;
+  else if (strcmp (k, "region") == 0)
+    region = value;
+  else if (strcmp (k, "bucket") == 0)
+    bucket = value;
+  else if (strcmp (k, "key") == 0)
+    key_name = value;
+  else if (strcmp (k, "size") == 0) {
+    dev_size = nbdkit_parse_size (value);
+    if (dev_size == -1)
+      return -1;
+  }
+  else if (strcmp (k, "object-size") == 0) {
+    v = nbdkit_parse_size (value);
+    if (v == -1)
+      return -1;
+    if (v == 0 || v > 1024 * 1024 * 1024) {
+      nbdkit_error ("object-size must be between 1 and 1G");
+      return -1;
+    }
+    obj_size = v;
+  }
+  else if (strcmp (k, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+    if (connections == 0) {
+      nbdkit_error ("connections parameter must not be 0");
+      return -1;
+    }
+  }
+  else if (strcmp (k, "sslverify") == 0) {
+    r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    sslverify = r;
+  }
+  else if (strcmp (k, "timeout") == 0) {
+    if (nbdkit_parse_uint32_t ("timeout", value, &timeout) == -1)
+      return -1;
+  }
+  else {
+    nbdkit_error ("unknown parameter '%s'", k);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Take a value from the environment if it was not set on the command
+ * line, like the AWS SDKs do.
+ */
+static int
+default_from_env (char **value, const char *env)
+{
+  const char *s;
+
+  if (*value == NULL && (s = getenv (env)) != NULL) {
+    *value = strdup (s);
+    if (*value == NULL) {
+      nbdkit_error ("strdup: %m");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Split the endpoint URL into the parts needed for signing. */
+static int
+parse_endpoint (void)
+{
+  const char *p, *host, *path;
+  size_t len;
+
+  if (endpoint_url)
+    endpoint = strdup (endpoint_url);
+  else if (asprintf (&endpoint, "https://s3.%s.amazonaws.com", region) == -1)
+    endpoint = NULL;
+  if (endpoint == NULL) {
+    nbdkit_error ("strdup: %m");
+    return -1;
+  }
+
+  /* Remove any trailing slashes. */
+  len = strlen (endpoint);
+  while (len > 0 && endpoint[len-1] == '/')
+    endpoint[--len] = '\0';
+
+  p = strstr (endpoint, "://");
+  if (p == NULL) {
+    nbdkit_error ("endpoint-url must be a URL like https://host[:port]");
+    return -1;
+  }
+  host = p + 3;
+  path = strchr (host, '/');
+  if (path == NULL)
+    path = host + strlen (host);
+
+  endpoint_host = strndup (host, path - host);
+  endpoint_path = strdup (path);
+  if (endpoint_host == NULL || endpoint_path == NULL) {
+    nbdkit_error ("strdup: %m");
+    return -1;
+  }
+
+  /* Remove the path from endpoint, since it is part of the canonical
+   * URI which request.c appends.
+   */
+  endpoint[path - endpoint] = '\0';
+  return 0;
+}
+
+static int
+s3native_config_complete (void)
+{
+  if (bucket == NULL || key_name == NULL) {
+    nbdkit_error ("bucket and key parameters are required");
+    return -1;
+  }
+  if ((dev_size >= 0) != (obj_size > 0)) {
+    nbdkit_error ("size and object-size parameters must always be "
+                  "specified together");
+    return -1;
+  }
+  if (obj_size > 0 && dev_size % obj_size != 0) {
+    nbdkit_error ("size must be a multiple of object-size");
+    return -1;
+  }
+
+  if (default_from_env (&access_key, "AWS_ACCESS_KEY_ID") == -1 ||
+      default_from_env (&secret_key, "AWS_SECRET_ACCESS_KEY") == -1 ||
+      default_from_env (&session_token, "AWS_SESSION_TOKEN") == -1)
+    return -1;
+  if (access_key && !secret_key) {
+    nbdkit_error ("secret-key is required with access-key");
+    return -1;
+  }
+  if (region == NULL)
+    region = getenv ("AWS_REGION");
+  if (region == NULL)
+    region = getenv ("AWS_DEFAULT_REGION");
+  if (region == NULL)
+    region = "us-east-1";
+
+  if (parse_endpoint () == -1)
+    return -1;
+
+  return request_init ();
+}
+
+#define s3native_config_help \
+  "bucket=<BUCKET>  (required) The bucket containing the object(s).\n" \
+  "key=<KEY>        (required) The object, or prefix of block objects.\n" \
+  "access-key=<KEY>            The AWS access key.\n" \
+  "secret-key=<SECRET>         The AWS secret access key.\n" \
+  "session-token=<TOKEN>       The AWS session token.\n" \
+  "endpoint-url=<URL>          The S3 endpoint to connect to.\n" \
+  "region=<REGION>             The region used when signing requests.\n" \
+  "size=<SIZE>                 Size of the disk (with object-size).\n" \
+  "object-size=<SIZE>          Store the disk as objects of SIZE bytes.\n" \
+  "connections=<N>             Maximum number of HTTP connections.\n" \
+  "sslverify=false             Do not verify the server certificate.\n" \
+  "timeout=<SECS>              Set the timeout for requests (seconds)."
+
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+
+static void *
+s3native_open (int readonly)
+{
+  return NBDKIT_HANDLE_NOT_NEEDED;
+}
+
+/* Check the HTTP status of a finished request.  If allow_missing is
+ * true then a missing object is not an error, and *missing is set.
+ */
+static int
+check_status (struct request *req, bool allow_missing, bool *missing)
+{
+  if (missing)
+    *missing = false;
+
+  if (req->status >= 200 && req->status < 300)
+    return 0;
+
+  if (allow_missing && req->status == 404 &&
+      (req->response.ptr == NULL ||
+       strstr (req->response.ptr, "NoSuchBucket") == NULL)) {
+    *missing = true;
+    return 0;
+  }
+
+  nbdkit_error ("%s %s: HTTP status %ld: %s",
+                req->method, req->object, req->status,
+                req->response.ptr ? req->response.ptr : "");
+  return -1;
+}
+
+static char *
+block_object (uint64_t blknum)
+{
+  char *s;
+
+  if (asprintf (&s, "%s/%016" PRIx64, key_name, blknum) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return NULL;
+  }
+  return s;
+}
+
+static int64_t
+s3native_get_size (void *handle)
+{
+  struct request req = { .method = "HEAD" };
+  int64_t r = -1;
+
+  if (dev_size >= 0)
+    return dev_size;
+
+  req.object = strdup (key_name);
+  if (req.object == NULL) {
+    nbdkit_error ("strdup: %m");
+    return -1;
+  }
+  if (run_requests (&req, 1) == -1 || check_status (&req, false, NULL) == -1)
+    goto out;
+  if (req.content_length < 0) {
+    nbdkit_error ("could not get the size of %s", key_name);
+    goto out;
+  }
+  r = req.content_length;
+
+ out:
+  free_requests (&req, 1);
+  return r;
+}
+
+static int
+s3native_can_write (void *handle)
+{
+  return obj_size > 0;
+}
+
+static int
+s3native_can_multi_conn (void *handle)
+{
+  return 1;
+}
+
+static int
+s3native_can_flush (void *handle)
+{
+  return 1;
+}
+
+/* Every write is complete when the PUT returns. */
+static int
+s3native_can_fua (void *handle)
+{
+  return NBDKIT_FUA_NATIVE;
+}
+
+static int
+s3native_can_trim (void *handle)
+{
+  return obj_size > 0;
+}
+
+static int
+s3native_can_zero (void *handle)
+{
+  return obj_size > 0;
+}
+
+static int
+s3native_can_fast_zero (void *handle)
+{
+  return obj_size > 0;
+}
+
+static int
+s3native_block_size (void *handle,
+                     uint32_t *minimum, uint32_t *preferred, uint32_t *maximum)
+{
+  if (obj_size == 0) {
+    *minimum = 1;
+    *preferred = 512 * 1024;
+    *maximum = 0xffffffff;
+  }
+  else {
+    /* The plugin can handle any size of request, but partial blocks
+     * require a read-modify-write cycle so we ask the client to send
+     * whole blocks where NBD allows it: the minimum must be a power
+     * of 2 up to 64K and the preferred size a power of 2 between 512
+     * and 32M.
+     */
+    if (is_power_of_2 (obj_size) && obj_size <= 65536)
+      *minimum = obj_size;
+    else
+      *minimum = 1;
+    *preferred = 1 << log_2_bits (MIN (obj_size, 32 * 1024 * 1024));
+    *preferred = MAX (*preferred, 512);
+    *maximum = 0xffffffff;
+  }
+  return 0;
+}
+
+/* Read from the single object, in parallel pieces. */
+static int
+pread_single (char *buf, uint32_t count, uint64_t offset)
+{
+  const size_t n = (count + PIECE_SIZE - 1) / PIECE_SIZE;
+  CLEANUP_FREE struct request *reqs = NULL;
+  size_t i;
+  int r = -1;
+
+  reqs = calloc (n, sizeof *reqs);
+  if (reqs == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  for (i = 0; i < n; ++i) {
+    reqs[i].method = "GET";
+    reqs[i].object = strdup (key_name);
+    if (reqs[i].object == NULL) {
+      nbdkit_error ("strdup: %m");
+      goto out;
+    }
+    reqs[i].buf = buf + i * PIECE_SIZE;
+    reqs[i].offset = offset + i * PIECE_SIZE;
+    reqs[i].count = MIN (PIECE_SIZE, count - i * PIECE_SIZE);
+  }
+
+  if (run_requests (reqs, n) == -1)
+    goto out;
+  for (i = 0; i < n; ++i) {
+    if (check_status (&reqs[i], false, NULL) == -1)
+      goto out;
+    if (reqs[i].received != reqs[i].count) {
+      nbdkit_error ("GET %s: short read", key_name);
+      goto out;
+    }
+  }
+  r = 0;
+
+ out:
+  free_requests (reqs, n);
+  return r;
+}
+
+/* Read parts of blocks [first, last] into buf.  Each block is a
+ * ranged GET, and they all run in parallel.
+ */
+static int
+pread_blocks (char *buf, uint32_t count, uint64_t offset)
+{
+  const uint64_t first = offset / obj_size;
+  const uint64_t last = (offset + count - 1) / obj_size;
+  const size_t n = last - first + 1;
+  CLEANUP_FREE struct request *reqs = NULL;
+  size_t i;
+  bool missing;
+  int r = -1;
+
+  reqs = calloc (n, sizeof *reqs);
+  if (reqs == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  for (i = 0; i < n; ++i) {
+    const uint64_t start = MAX ((first + i) * obj_size, offset);
+    const uint64_t end = MIN ((first + i + 1) * obj_size, offset + count);
+
+    reqs[i].method = "GET";
+    reqs[i].object = block_object (first + i);
+    if (reqs[i].object == NULL)
+      goto out;
+    reqs[i].buf = buf + (start - offset);
+    reqs[i].offset = start - (first + i) * obj_size;
+    reqs[i].count = end - start;
+  }
+
+  if (run_requests (reqs, n) == -1)
+    goto out;
+  for (i = 0; i < n; ++i) {
+    if (check_status (&reqs[i], true, &missing) == -1)
+      goto out;
+    if (missing)
+      memset (reqs[i].buf, 0, reqs[i].count);
+    else if (reqs[i].received != reqs[i].count) {
+      nbdkit_error ("GET %s: short read", reqs[i].object);
+      goto out;
+    }
+  }
+  r = 0;
+
+ out:
+  free_requests (reqs, n);
+  return r;
+}
+
+static int
+s3native_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+                uint32_t flags)
+{
+  if (obj_size == 0)
+    return pread_single (buf, count, offset);
+  else
+    return pread_blocks (buf, count, offset);
+}
+
+/* Blocks which are being read, modified and written back.  Partial
+ * writes to the same block must not overlap, else one would lose the
+ * other's data.
+ */
+static pthread_mutex_t rmw_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rmw_cond = PTHREAD_COND_INITIALIZER;
+DEFINE_VECTOR_TYPE (blknum_list, uint64_t);
+static blknum_list rmw_blocks = empty_vector;
+
+static int
+lock_block (uint64_t blknum)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
+  size_t i;
+
+ again:
+  for (i = 0; i < rmw_blocks.len; ++i) {
+    if (rmw_blocks.ptr[i] == blknum) {
+      pthread_cond_wait (&rmw_cond, &rmw_lock);
+      goto again;
+    }
+  }
+  if (blknum_list_append (&rmw_blocks, blknum) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  return 0;
+}
+
+static void
+unlock_block (uint64_t blknum)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
+  size_t i;
+
+  for (i = 0; i < rmw_blocks.len; ++i) {
+    if (rmw_blocks.ptr[i] == blknum) {
+      blknum_list_remove (&rmw_blocks, i);
+      break;
+    }
+  }
+  pthread_cond_broadcast (&rmw_cond);
+}
+
+/* Write buf to [offset, offset+count).  Whole blocks are written
+ * directly from buf.  Partial blocks at either end are read, patched
+ * and written back.  All the PUTs run in parallel.
+ */
+static int
+write_blocks (const char *buf, uint32_t count, uint64_t offset)
+{
+  const uint64_t first = offset / obj_size;
+  const uint64_t last = (offset + count - 1) / obj_size;
+  const size_t n = last - first + 1;
+  CLEANUP_FREE struct request *reqs = NULL;
+  struct request gets[2] = { { 0 }, { 0 } };
+  char *partial[2] = { NULL, NULL };
+  uint64_t partial_blk[2];
+  size_t i, nr_partial = 0;
+  bool missing;
+  int r = -1;
+
+  /* Find the partial blocks, at most one at each end. */
+  if (first * obj_size < offset || (first + 1) * obj_size > offset + count)
+    partial_blk[nr_partial++] = first;
+  if (last != first && (last + 1) * obj_size > offset + count)
+    partial_blk[nr_partial++] = last;
+
+  /* Lock them (in increasing order) and read the old contents. */
+  for (i = 0; i < nr_partial; ++i) {
+    if (lock_block (partial_blk[i]) == -1) {
+      nr_partial = i;
+      goto out;
+    }
+  }
+  for (i = 0; i < nr_partial; ++i) {
+    partial[i] = malloc (obj_size);
+    if (partial[i] == NULL) {
+      nbdkit_error ("malloc: %m");
+      goto out;
+    }
+    gets[i].method = "GET";
+    gets[i].object = block_object (partial_blk[i]);
+    if (gets[i].object == NULL)
+      goto out;
+    gets[i].buf = partial[i];
+    gets[i].offset = 0;
+    gets[i].count = obj_size;
+  }
+  if (nr_partial > 0) {
+    if (run_requests (gets, nr_partial) == -1)
+      goto out;
+    for (i = 0; i < nr_partial; ++i) {
+      if (check_status (&gets[i], true, &missing) == -1)
+        goto out;
+      if (missing)
+        memset (partial[i], 0, obj_size);
+      else if (gets[i].received != obj_size) {
+        nbdkit_error ("GET %s: short read", gets[i].object);
+        goto out;
+      }
+    }
+  }
+
+  reqs = calloc (n, sizeof *reqs);
+  if (reqs == NULL) {
+    nbdkit_error ("calloc: %m");
+    goto out;
+  }
+  for (i = 0; i < n; ++i) {
+    const uint64_t blk = first + i;
+    const uint64_t blkstart = blk * obj_size;
+    const uint64_t start = MAX (blkstart, offset);
+    const uint64_t end = MIN (blkstart + obj_size, offset + count);
+    size_t j;
+
+    reqs[i].method = "PUT";
+    reqs[i].object = block_object (blk);
+    if (reqs[i].object == NULL)
+      goto out;
+    reqs[i].body = buf + (start - offset);
+    for (j = 0; j < nr_partial; ++j) {
+      if (partial_blk[j] == blk) {
+        memcpy (partial[j] + (start - blkstart), buf + (start - offset),
+                end - start);
+        reqs[i].body = partial[j];
+      }
+    }
+    reqs[i].bodysize = obj_size;
+  }
+
+  if (run_requests (reqs, n) == -1)
+    goto out;
+  for (i = 0; i < n; ++i) {
+    if (check_status (&reqs[i], false, NULL) == -1)
+      goto out;
+  }
+  r = 0;
+
+ out:
+  if (reqs)
+    free_requests (reqs, n);
+  free_requests (gets, 2);
+  for (i = 0; i < nr_partial; ++i) {
+    unlock_block (partial_blk[i]);
+    free (partial[i]);
+  }
+  return r;
+}
+
+static int
+s3native_pwrite (void *handle, const void *buf, uint32_t count,
+                 uint64_t offset, uint32_t flags)
+{
+  return write_blocks (buf, count, offset);
+}
+
+static int
+s3native_flush (void *handle, uint32_t flags)
+{
+  /* Every write is flushed when the PUT returns. */
+  return 0;
+}
+
+static void
+xml_escape (FILE *fp, const char *str)
+{
+  for (; *str; ++str) {
+    switch (*str) {
+    case '&': fputs ("&amp;", fp); break;
+    case '<': fputs ("&lt;", fp); break;
+    case '>': fputs ("&gt;", fp); break;
+    case '"': fputs ("&quot;", fp); break;
+    case '\'': fputs ("&apos;", fp); break;
+    default: putc (*str, fp);
+    }
+  }
+}
+
+/* Set up a DeleteObjects request for blocks [first, first+n). */
+static int
+setup_delete (struct request *req, uint64_t first, uint64_t n)
+{
+  char *body = NULL;
+  size_t len;
+  FILE *fp;
+  uint64_t i;
+  unsigned char md5[16];
+  gnutls_datum_t in, out;
+  int err;
+
+  fp = open_memstream (&body, &len);
+  if (fp == NULL) {
+    nbdkit_error ("open_memstream: %m");
+    return -1;
+  }
+  fprintf (fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+           "<Delete><Quiet>true</Quiet>");
+  for (i = first; i < first + n; ++i) {
+    fprintf (fp, "<Object><Key>");
+    xml_escape (fp, key_name);
+    fprintf (fp, "/%016" PRIx64 "</Key></Object>", i);
+  }
+  fprintf (fp, "</Delete>");
+  if (close_memstream (fp) == EOF) {
+    nbdkit_error ("close_memstream: %m");
+    free (body);
+    return -1;
+  }
+
+  req->method = "POST";
+  req->query = "delete=";
+  req->body = body;
+  req->bodysize = len;
+
+  /* DeleteObjects requires Content-MD5. */
+  gnutls_hash_fast (GNUTLS_DIG_MD5, body, len, md5);
+  in.data = md5;
+  in.size = sizeof md5;
+  err = gnutls_base64_encode2 (&in, &out);
+  if (err < 0) {
+    nbdkit_error ("gnutls_base64_encode2: %s", gnutls_strerror (err));
+    return -1;
+  }
+  req->content_md5 = strndup ((char *) out.data, out.size);
+  gnutls_free (out.data);
+  if (req->content_md5 == NULL) {
+    nbdkit_error ("strndup: %m");
+    return -1;
+  }
+
+  req->object = strdup ("");
+  if (req->object == NULL) {
+    nbdkit_error ("strdup: %m");
+    return -1;
+  }
+  return 0;
+}
+
+/* Delete blocks [first, last).  Objects which do not exist are not
+ * an error.  The DeleteObjects requests run in parallel.
+ */
+static int
+delete_blocks (uint64_t first, uint64_t last)
+{
+  const size_t n = (last - first + MAX_DELETE - 1) / MAX_DELETE;
+  CLEANUP_FREE struct request *reqs = NULL;
+  size_t i;
+  int r = -1;
+
+  if (first >= last)
+    return 0;
+
+  reqs = calloc (n, sizeof *reqs);
+  if (reqs == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  for (i = 0; i < n; ++i) {
+    const uint64_t start = first + i * MAX_DELETE;
+
+    if (setup_delete (&reqs[i], start, MIN (MAX_DELETE, last - start)) == -1)
+      goto out;
+  }
+
+  if (run_requests (reqs, n) == -1)
+    goto out;
+  for (i = 0; i < n; ++i) {
+    if (check_status (&reqs[i], false, NULL) == -1)
+      goto out;
+    if (reqs[i].response.ptr && strstr (reqs[i].response.ptr, "<Error>")) {
+      nbdkit_error ("DeleteObjects: %s", reqs[i].response.ptr);
+      goto out;
+    }
+  }
+  r = 0;
+
+ out:
+  for (i = 0; i < n; ++i) {
+    free ((char *) reqs[i].body);
+    free ((char *) reqs[i].content_md5);
+  }
+  free_requests (reqs, n);
+  return r;
+}
+
+/* Trim deletes the blocks which are entirely inside the range. */
+static int
+s3native_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+  const uint64_t first = (offset + obj_size - 1) / obj_size;
+  const uint64_t last = (offset + count) / obj_size;
+
+  return delete_blocks (first, last);
+}
+
+/* Zero deletes the blocks which are entirely inside the range, and
+ * writes zeroes to the partial blocks at either end.
+ */
+static int
+s3native_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+  uint64_t first = (offset + obj_size - 1) / obj_size;
+  uint64_t last = (offset + count) / obj_size;
+  CLEANUP_FREE char *zeroes = NULL;
+  uint64_t head, tail;
+
+  if (first >= last) {
+    /* No whole blocks. */
+    first = last = offset / obj_size;
+    head = count;
+    tail = 0;
+  }
+  else {
+    head = first * obj_size - offset;
+    tail = offset + count - last * obj_size;
+  }
+
+  if (head > 0 || tail > 0) {
+    if (flags & NBDKIT_FLAG_FAST_ZERO) {
+      nbdkit_set_error (ENOTSUP);
+      return -1;
+    }
+    zeroes = calloc (1, MAX (head, tail));
+    if (zeroes == NULL) {
+      nbdkit_error ("calloc: %m");
+      return -1;
+    }
+    if (head > 0 && write_blocks (zeroes, head, offset) == -1)
+      return -1;
+    if (tail > 0 && write_blocks (zeroes, tail, last * obj_size) == -1)
+      return -1;
+  }
+
+  return delete_blocks (first, last);
+}
+
+static struct nbdkit_plugin plugin = {
+  .name              = "s3native",
+  .version           = PACKAGE_VERSION,
+  .load              = s3native_load,
+  .unload            = s3native_unload,
+  .config            = s3native_config,
+  .config_complete   = s3native_config_complete,
+  .config_help       = s3native_config_help,
+  .open              = s3native_open,
+  .get_size          = s3native_get_size,
+  .block_size        = s3native_block_size,
+  .can_write         = s3native_can_write,
+  .can_multi_conn    = s3native_can_multi_conn,
+  .can_flush         = s3native_can_flush,
+  .can_fua           = s3native_can_fua,
+  .can_trim          = s3native_can_trim,
+  .can_zero          = s3native_can_zero,
+  .can_fast_zero     = s3native_can_fast_zero,
+  .pread             = s3native_pread,
+  .pwrite            = s3native_pwrite,
+  .flush             = s3native_flush,
+  .trim              = s3native_trim,
+  .zero              = s3native_zero,
+};
+
+NBDKIT_REGISTER_PLUGIN (plugin)
@@ -0,0 +1,119 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_S3NATIVE_H
+#define NBDKIT_S3NATIVE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <curl/curl.h>
+
+#include "nbdkit-string.h"
+
+#ifdef CURL_AT_LEAST_VERSION
+#if CURL_AT_LEAST_VERSION (7, 55, 0)
+#define HAVE_CURLINFO_CONTENT_LENGTH_DOWNLOAD_T
+#endif
+#if CURL_AT_LEAST_VERSION (7, 57, 0)
+#define HAVE_CURL_LOCK_DATA_CONNECT
+#endif
+#endif
+
+/* Plugin configuration. */
+extern char *access_key;
+extern char *secret_key;
+extern char *session_token;
+extern const char *bucket;
+extern const char *key_name;
+extern const char *region;
+extern unsigned connections;
+extern bool sslverify;
+extern uint32_t timeout;
+
+/* Parsed from the endpoint-url parameter. */
+extern char *endpoint;          /* scheme://host[:port], no trailing / */
+extern char *endpoint_host;     /* host[:port] */
+extern char *endpoint_path;     /* path prefix, or "" */
+
+extern int s3native_debug_verbose;
+
+/* An S3 request.  The caller fills in the first group of fields and
+ * passes an array of requests to run_requests, which runs them in
+ * parallel.
+ */
+struct request {
+  const char *method;           /* "GET", "HEAD", "PUT" or "POST" */
+  char *object;                 /* Object key (not URI-encoded).  This
+                                 * is freed by free_requests.
+                                 */
+  const char *query;            /* Canonical query string, or NULL. */
+
+  /* For GET, read count bytes at offset into buf. */
+  char *buf;
+  uint64_t offset;
+  uint64_t count;
+
+  /* For PUT and POST, the body to send. */
+  const char *body;
+  size_t bodysize;
+  const char *content_md5;      /* Optional Content-MD5 header. */
+
+  /* Set by run_requests. */
+  long status;                  /* HTTP status code. */
+  uint64_t received;            /* Bytes written into buf. */
+  bool ignored_range;           /* Server ignored the Range header. */
+  int64_t content_length;       /* For HEAD. */
+  string response;              /* Error or POST response (truncated). */
+
+  /* Private to request.c. */
+  CURL *c;
+  struct curl_slist *headers;
+  char errbuf[CURL_ERROR_SIZE];
+};
+
+/* request.c */
+extern int request_init (void);
+extern void request_free (void);
+extern int run_requests (struct request *reqs, size_t n);
+extern void free_requests (struct request *reqs, size_t n);
+
+/* sigv4.c */
+extern void sha256_hex (const void *data, size_t len, char *hex);
+extern int sigv4_sign (struct curl_slist **headers, const char *method,
+                       const char *canonical_uri,
+                       const char *canonical_query,
+                       const char *payload_hash);
+extern void uri_encode (FILE *fp, const char *str, bool encode_slash);
+
+#endif /* NBDKIT_S3NATIVE_H */
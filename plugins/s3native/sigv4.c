@@ -0,0 +1,209 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* AWS Signature Version 4 request signing.  See:
+ * https://docs.aws.amazon.com/AmazonS3/latest/API/sig-v4-authenticating-requests.html
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+#include <curl/curl.h>
+
+#include <nbdkit-plugin.h>
+
+#include "ascii-ctype.h"
+#include "cleanup.h"
+#include "open_memstream.h"
+
+#include "s3native.h"
+
+#define SHA256_LEN 32
+
+static void
+to_hex (const unsigned char *bytes, size_t len, char *hex)
+{
+  static const char hexdigits[] = "0123456789abcdef";
+  size_t i;
+
+  for (i = 0; i < len; ++i) {
+    hex[2*i] = hexdigits[bytes[i] >> 4];
+    hex[2*i+1] = hexdigits[bytes[i] & 0xf];
+  }
+  hex[2*len] = '\0';
+}
+
+/* Write the lowercase hex SHA-256 of data into hex, which must have
+ * space for 65 bytes.
+ */
+void
+sha256_hex (const void *data, size_t len, char *hex)
+{
+  unsigned char digest[SHA256_LEN];
+
+  gnutls_hash_fast (GNUTLS_DIG_SHA256, data, len, digest);
+  to_hex (digest, SHA256_LEN, hex);
+}
+
+static void
+hmac_sha256 (const void *k, size_t klen, const char *data,
+             unsigned char *out)
+{
+  gnutls_hmac_fast (GNUTLS_MAC_SHA256, k, klen, data, strlen (data), out);
+}
+
+/* URI-encode str as described in the SigV4 documentation.  Only
+ * unreserved characters are left alone, and '/' unless encode_slash
+ * is true.
+ */
+void
+uri_encode (FILE *fp, const char *str, bool encode_slash)
+{
+  for (; *str; ++str) {
+    const unsigned char c = *str;
+
+    if (ascii_isalnum (c) || c == '-' || c == '.' || c == '_' || c == '~' ||
+        (c == '/' && !encode_slash))
+      putc (c, fp);
+    else
+      fprintf (fp, "%%%02X", c);
+  }
+}
+
+/* Sign a request, appending the host, x-amz-* and Authorization
+ * headers to *headers.  If no access key was given, the request is
+ * sent anonymously (only the host header is added).
+ */
+int
+sigv4_sign (struct curl_slist **headers, const char *method,
+            const char *canonical_uri, const char *canonical_query,
+            const char *payload_hash)
+{
+  time_t t = time (NULL);
+  struct tm tm;
+  char date[16], amzdate[32];
+  CLEANUP_FREE char *creq = NULL, *sts = NULL, *header = NULL;
+  CLEANUP_FREE char *secret = NULL;
+  size_t len;
+  FILE *fp;
+  char creq_hash[2*SHA256_LEN+1];
+  unsigned char k1[SHA256_LEN], k2[SHA256_LEN];
+  char signature[2*SHA256_LEN+1];
+  const char *signed_headers;
+  struct curl_slist *list = *headers;
+
+#define APPEND_HEADER(fs, ...)                                  \
+  do {                                                          \
+    free (header);                                              \
+    if (asprintf (&header, fs, ##__VA_ARGS__) == -1) {          \
+      nbdkit_error ("asprintf: %m");                            \
+      return -1;                                                \
+    }                                                           \
+    list = curl_slist_append (list, header);                    \
+    if (list == NULL) {                                         \
+      nbdkit_error ("curl_slist_append: %m");                   \
+      return -1;                                                \
+    }                                                           \
+    *headers = list;                                            \
+  } while (0)
+
+  APPEND_HEADER ("Host: %s", endpoint_host);
+  if (access_key == NULL)
+    return 0;
+
+  gmtime_r (&t, &tm);
+  strftime (date, sizeof date, "%Y%m%d", &tm);
+  strftime (amzdate, sizeof amzdate, "%Y%m%dT%H%M%SZ", &tm);
+
+  signed_headers =
+    session_token ? "host;x-amz-content-sha256;x-amz-date;x-amz-security-token"
+    : "host;x-amz-content-sha256;x-amz-date";
+
+  /* Canonical request. */
+  fp = open_memstream (&creq, &len);
+  if (fp == NULL) {
+    nbdkit_error ("open_memstream: %m");
+    return -1;
+  }
+  fprintf (fp, "%s\n%s\n%s\n", method, canonical_uri,
+           canonical_query ? canonical_query : "");
+  fprintf (fp, "host:%s\n", endpoint_host);
+  fprintf (fp, "x-amz-content-sha256:%s\n", payload_hash);
+  fprintf (fp, "x-amz-date:%s\n", amzdate);
+  if (session_token)
+    fprintf (fp, "x-amz-security-token:%s\n", session_token);
+  fprintf (fp, "\n%s\n%s", signed_headers, payload_hash);
+  if (close_memstream (fp) == EOF) {
+    nbdkit_error ("close_memstream: %m");
+    return -1;
+  }
+  sha256_hex (creq, len, creq_hash);
+
+  /* String to sign. */
+  if (asprintf (&sts, "AWS4-HMAC-SHA256\n%s\n%s/%s/s3/aws4_request\n%s",
+                amzdate, date, region, creq_hash) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+
+  /* Signing key. */
+  if (asprintf (&secret, "AWS4%s", secret_key ? secret_key : "") == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+  hmac_sha256 (secret, strlen (secret), date, k1);
+  hmac_sha256 (k1, SHA256_LEN, region, k2);
+  hmac_sha256 (k2, SHA256_LEN, "s3", k1);
+  hmac_sha256 (k1, SHA256_LEN, "aws4_request", k2);
+  hmac_sha256 (k2, SHA256_LEN, sts, k1);
+  to_hex (k1, SHA256_LEN, signature);
+
+  APPEND_HEADER ("x-amz-content-sha256: %s", payload_hash);
+  APPEND_HEADER ("x-amz-date: %s", amzdate);
+  if (session_token)
+    APPEND_HEADER ("x-amz-security-token: %s", session_token);
+  APPEND_HEADER ("Authorization: AWS4-HMAC-SHA256 "
+                 "Credential=%s/%s/%s/s3/aws4_request, "
+                 "SignedHeaders=%s, Signature=%s",
+                 access_key, date, region, signed_headers, signature);
+  return 0;
+#undef APPEND_HEADER
+}
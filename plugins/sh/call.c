@@ -36,13 +36,17 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
 #include <poll.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <nbdkit-plugin.h>
@@ -50,10 +54,12 @@
 #include "ascii-ctype.h"
 #include "ascii-string.h"
 #include "cleanup.h"
+#include "rounding.h"
 #include "utils.h"
 #include "vector.h"
 
 #include "call.h"
+#include "methods.h"
 
 #ifndef HAVE_ENVIRON_DECL
 extern char **environ;
@@ -123,6 +129,60 @@ debug_call (const char **argv)
   nbdkit_debug ("%s", debug);
 }
 
+#ifndef __GLIBC__
+/* glibc contains a workaround for scripts which don't have a shebang.
+ * See maybe_script_execute in glibc posix/execvpe.c.  We rely on this
+ * in nbdkit, so if not using glibc we emulate it.  Note this is tested
+ * when we do CI on Alpine (which uses musl).
+ *
+ * This must be called before forking.  The caller must free the
+ * returned array (but not the strings).
+ */
+static const char **
+make_sh_argv (const char **argv)
+{
+  const char **sh_argv;
+  size_t i;
+
+  /* Count the number of arguments, ignoring script name. */
+  for (i = 2; argv[i]; i++)
+    ;
+  sh_argv = calloc (i + 2 /* /bin/sh + NULL */, sizeof (const char *));
+  if (sh_argv == NULL) {
+    nbdkit_error ("%s: calloc: %m", argv[0]);
+    return NULL;
+  }
+  sh_argv[0] = "/bin/sh";
+  for (i = 0; argv[i]; i++)
+    sh_argv[i+1] = argv[i];
+  return sh_argv;
+}
+#endif
+
+/* Called in the child after fork, with stdin/stdout/stderr already
+ * set up.  This does not return.
+ */
+static void __attribute__ ((noreturn))
+exec_script (const char **argv, const char **sh_argv)
+{
+  /* Restore SIGPIPE back to SIG_DFL, since shell can't undo SIG_IGN */
+  signal (SIGPIPE, SIG_DFL);
+
+  /* Note the assignment of environ avoids using execvpe which is a
+   * GNU extension.  See also:
+   * https://github.com/libguestfs/libnbd/commit/dc64ac5cdd0bc80ca4e18935ad0e8801d11a8644
+   */
+  environ = env;
+  execvp (argv[0], (char **) argv);
+#ifndef __GLIBC__
+  /* Non-glibc workaround for missing shebang - see above. */
+  if (errno == ENOEXEC)
+    execvp (sh_argv[0], (char **) sh_argv);
+#endif
+  perror (argv[0]);
+  _exit (EXIT_FAILURE);
+}
+
 /* This is the generic function that calls the script.  It can
  * optionally write to the script's stdin and read from the script's
  * stdout and stderr.  It returns the raw error code and does no error
@@ -137,7 +197,6 @@ call3 (const char *wbuf, size_t wbuflen, /* sent to stdin (can be NULL) */
   const char *argv0 = argv[0]; /* script name, used in error messages */
 #ifndef __GLIBC__
   CLEANUP_FREE const char **sh_argv = NULL;
-  size_t i;
 #endif
   pid_t pid = -1;
   int status;
@@ -197,22 +256,9 @@ call3 (const char *wbuf, size_t wbuflen, /* sent to stdin (can be NULL) */
           err_fd[0] > STDERR_FILENO && err_fd[1] > STDERR_FILENO);
 
 #ifndef __GLIBC__
-  /* glibc contains a workaround for scripts which don't have a
-   * shebang.  See maybe_script_execute in glibc posix/execvpe.c.
-   * We rely on this in nbdkit, so if not using glibc we emulate it.
-   * Note this is tested when we do CI on Alpine (which uses musl).
-   */
-  /* Count the number of arguments, ignoring script name. */
-  for (i = 2; argv[i]; i++)
-    ;
-  sh_argv = calloc (i + 2 /* /bin/sh + NULL */, sizeof (const char *));
-  if (sh_argv == NULL) {
-    nbdkit_error ("%s: calloc: %m", argv0);
+  sh_argv = make_sh_argv (argv);
+  if (sh_argv == NULL)
     goto error;
-  }
-  sh_argv[0] = "/bin/sh";
-  for (i = 0; argv[i]; i++)
-    sh_argv[i+1] = argv[i];
 #endif
 
   pid = fork ();
@@ -232,22 +278,11 @@ call3 (const char *wbuf, size_t wbuflen, /* sent to stdin (can be NULL) */
     close (out_fd[1]);
     close (err_fd[1]);
 
-    /* Restore SIGPIPE back to SIG_DFL, since shell can't undo SIG_IGN */
-    signal (SIGPIPE, SIG_DFL);
-
-    /* Note the assignment of environ avoids using execvpe which is a
-     * GNU extension.  See also:
-     * https://github.com/libguestfs/libnbd/commit/dc64ac5cdd0bc80ca4e18935ad0e8801d11a8644
-     */
-    environ = env;
-    execvp (argv[0], (char **) argv);
-#ifndef __GLIBC__
-    /* Non-glibc workaround for missing shebang - see above. */
-    if (errno == ENOEXEC)
-      execvp (sh_argv[0], (char **) sh_argv);
+#ifdef __GLIBC__
+    exec_script (argv, NULL);
+#else
+    exec_script (argv, sh_argv);
 #endif
-    perror (argv[0]);
-    _exit (EXIT_FAILURE);
   }
 
   /* Parent. */
@@ -544,6 +579,558 @@ handle_script_error (const char *argv0, string *ebuf, exit_code code)
   return ERROR;
 }
 
+/* Coprocess mode.
+ *
+ * Forking the script for every call is very slow.  After .after_fork
+ * we instead try to start the script as:
+ *
+ *   /path/to/script coprocess <datafile>
+ *
+ * and send it framed requests on stdin, reading framed replies from
+ * stdout.  Each request is a line containing the number of following
+ * lines, then the method name and each parameter on a line of its
+ * own.  Each reply is a line "<status> <length>" followed by <length>
+ * bytes, which is what the script would have printed on stdout (or
+ * on stderr if the status is an error).  Bulk data is not sent over
+ * the pipes: pwrite data is placed in <datafile> before the request
+ * is sent, and a successful pread reply leaves the data in
+ * <datafile>, with <length> being the number of bytes.  nbdkit maps
+ * <datafile> so that the data is shared without extra copies through
+ * the pipes.
+ *
+ * Coprocesses are kept in a pool shared by all connections.  Each one
+ * handles a single request at a time, and a new one is started when a
+ * request arrives and all existing coprocesses are busy.
+ *
+ * If the script exits, prints something which is not a reply, or does
+ * not reply within COPROCESS_FIRST_REPLY_TIMEOUT seconds to the first
+ * request then it does not support coprocess mode (a script that does
+ * not know about the coprocess method will normally exit with status
+ * 2, perhaps after printing a message), so we disable coprocess mode
+ * and go back to forking for every call.
+ */
+struct coprocess {
+  unsigned id;
+  pid_t pid;
+  int in_fd;                    /* Connected to coprocess stdin. */
+  FILE *out_fp;                 /* Connected to coprocess stdout. */
+  char *data_path;              /* Shared data file. */
+  int data_fd;
+  char *map;                    /* Shared mapping of the data file. */
+  size_t map_size;
+  bool replied;                 /* Has replied to at least one request. */
+};
+DEFINE_VECTOR_TYPE (coprocess_list, struct coprocess *);
+
+/* The data file mapping is grown in multiples of this size. */
+#define DATA_MAP_ALIGNMENT (1024 * 1024)
+
+/* How long to wait for the first reply from a new coprocess. */
+#define COPROCESS_FIRST_REPLY_TIMEOUT 10
+
+static pthread_mutex_t coprocess_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool coprocess_enabled;  /* Protected by coprocess_lock. */
+static unsigned coprocess_next_id; /* Protected by coprocess_lock. */
+static coprocess_list idle_coprocesses = empty_vector; /* Ditto. */
+
+void
+call_enable_coprocess (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&coprocess_lock);
+  coprocess_enabled = true;
+}
+
+static void
+free_coprocess (struct coprocess *cp, bool terminate)
+{
+  if (cp->out_fp)
+    fclose (cp->out_fp);
+  if (cp->in_fd >= 0)
+    close (cp->in_fd);
+  if (cp->pid > 0) {
+    /* Normally closing stdin is enough to make the coprocess exit.
+     * After errors it may be in an unknown state so kill it.
+     */
+    if (terminate)
+      kill (cp->pid, SIGTERM);
+    waitpid (cp->pid, NULL, 0);
+  }
+  if (cp->map)
+    munmap (cp->map, cp->map_size);
+  if (cp->data_fd >= 0)
+    close (cp->data_fd);
+  if (cp->data_path) {
+    unlink (cp->data_path);
+    free (cp->data_path);
+  }
+  free (cp);
+}
+
+void
+call_stop_coprocess (void)
+{
+  coprocess_list list;
+  size_t i;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&coprocess_lock);
+    coprocess_enabled = false;
+    list = idle_coprocesses;
+    idle_coprocesses = (coprocess_list) empty_vector;
+  }
+
+  for (i = 0; i < list.len; ++i)
+    free_coprocess (list.ptr[i], false);
+  free (list.ptr);
+}
+
+static struct coprocess *
+start_coprocess (const char *script)
+{
+  struct coprocess *cp;
+  const char *argv[] = { script, "coprocess", NULL, NULL };
+#ifndef __GLIBC__
+  CLEANUP_FREE const char **sh_argv = NULL;
+#endif
+  int in_fd[2] = { -1, -1 };
+  int out_fd[2] = { -1, -1 };
+  pid_t pid;
+
+  cp = calloc (1, sizeof *cp);
+  if (cp == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  cp->in_fd = cp->data_fd = -1;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&coprocess_lock);
+    cp->id = coprocess_next_id++;
+  }
+
+  if (asprintf (&cp->data_path, "%s/coprocess%u.data",
+                tmpdir, cp->id) == -1) {
+    nbdkit_error ("asprintf: %m");
+    cp->data_path = NULL;
+    goto error;
+  }
+  cp->data_fd = open (cp->data_path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+  if (cp->data_fd == -1) {
+    nbdkit_error ("open: %s: %m", cp->data_path);
+    goto error;
+  }
+  argv[2] = cp->data_path;
+
+  /* Unlike call3, these pipes outlive the call, so they must not leak
+   * into any other subprocess that we fork.
+   */
+#ifdef HAVE_PIPE2
+  if (pipe2 (in_fd, O_CLOEXEC) == -1 || pipe2 (out_fd, O_CLOEXEC) == -1) {
+    nbdkit_error ("%s: pipe2: %m", script);
+    goto error;
+  }
+#else
+  /* See the comment in call3 about serialize_all_requests. */
+  if (pipe (in_fd) == -1 || pipe (out_fd) == -1) {
+    nbdkit_error ("%s: pipe: %m", script);
+    goto error;
+  }
+  if (fcntl (in_fd[1], F_SETFD, FD_CLOEXEC) == -1 ||
+      fcntl (out_fd[0], F_SETFD, FD_CLOEXEC) == -1) {
+    nbdkit_error ("%s: fcntl: %m", script);
+    goto error;
+  }
+#endif
+  assert (in_fd[0] > STDERR_FILENO && in_fd[1] > STDERR_FILENO &&
+          out_fd[0] > STDERR_FILENO && out_fd[1] > STDERR_FILENO);
+
+#ifndef __GLIBC__
+  sh_argv = make_sh_argv (argv);
+  if (sh_argv == NULL)
+    goto error;
+#endif
+
+  debug_call (argv);
+
+  pid = fork ();
+  if (pid == -1) {
+    nbdkit_error ("%s: fork: %m", script);
+    goto error;
+  }
+
+  if (pid == 0) {               /* Child. */
+    close (in_fd[1]);
+    close (out_fd[0]);
+    dup2 (in_fd[0], 0);
+    dup2 (out_fd[1], 1);
+    close (in_fd[0]);
+    close (out_fd[1]);
+    /* stderr is inherited from nbdkit. */
+#ifdef __GLIBC__
+    exec_script (argv, NULL);
+#else
+    exec_script (argv, sh_argv);
+#endif
+  }
+
+  /* Parent. */
+  cp->pid = pid;
+  close (in_fd[0]);
+  close (out_fd[1]);
+  cp->in_fd = in_fd[1];
+  cp->out_fp = fdopen (out_fd[0], "r");
+  if (cp->out_fp == NULL) {
+    nbdkit_error ("fdopen: %m");
+    close (out_fd[0]);
+    free_coprocess (cp, true);
+    return NULL;
+  }
+
+  nbdkit_debug ("%s: started coprocess %u (pid %d)",
+                script, cp->id, (int) pid);
+  return cp;
+
+ error:
+  if (in_fd[0] >= 0)
+    close (in_fd[0]);
+  if (in_fd[1] >= 0)
+    close (in_fd[1]);
+  if (out_fd[0] >= 0)
+    close (out_fd[0]);
+  if (out_fd[1] >= 0)
+    close (out_fd[1]);
+  free_coprocess (cp, false);
+  return NULL;
+}
+
+/* Get an idle coprocess from the pool, starting a new one if
+ * necessary.  Returns NULL if coprocess mode is disabled, with *errp
+ * set if there was an error.
+ */
+static struct coprocess *
+get_coprocess (bool *errp)
+{
+  struct coprocess *cp;
+
+  *errp = false;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&coprocess_lock);
+    if (!coprocess_enabled)
+      return NULL;
+    if (idle_coprocesses.len > 0) {
+      cp = idle_coprocesses.ptr[idle_coprocesses.len-1];
+      coprocess_list_remove (&idle_coprocesses, idle_coprocesses.len-1);
+      return cp;
+    }
+  }
+
+  cp = start_coprocess (get_script ("coprocess"));
+  if (cp == NULL)
+    *errp = true;
+  return cp;
+}
+
+static void
+put_coprocess (struct coprocess *cp)
+{
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&coprocess_lock);
+    if (coprocess_enabled &&
+        coprocess_list_append (&idle_coprocesses, cp) == 0)
+      return;
+  }
+
+  free_coprocess (cp, false);
+}
+
+/* Make sure the data file has at least @size bytes and that they are
+ * mapped.  If @extend is false (data returned from the script) then
+ * it is an error if the file is too short.  Always checking the file
+ * size also stops us from touching the mapping beyond the end of the
+ * file (which would cause SIGBUS) if the script truncated it.
+ */
+static int
+map_data_file (struct coprocess *cp, const char *argv0,
+               size_t size, bool extend)
+{
+  struct stat statbuf;
+  size_t map_size;
+  void *map;
+
+  if (size == 0)
+    return 0;
+
+  if (fstat (cp->data_fd, &statbuf) == -1) {
+    nbdkit_error ("fstat: %s: %m", cp->data_path);
+    return -1;
+  }
+  if (statbuf.st_size < size) {
+    if (!extend) {
+      nbdkit_error ("%s: coprocess replied with %zu bytes of data, "
+                    "but the data file only contains %" PRIi64 " bytes",
+                    argv0, size, (int64_t) statbuf.st_size);
+      return -1;
+    }
+    if (ftruncate (cp->data_fd, size) == -1) {
+      nbdkit_error ("ftruncate: %s: %m", cp->data_path);
+      return -1;
+    }
+  }
+
+  if (size > cp->map_size) {
+    map_size = ROUND_UP (size, DATA_MAP_ALIGNMENT);
+    map = mmap (NULL, map_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+                cp->data_fd, 0);
+    if (map == MAP_FAILED) {
+      nbdkit_error ("mmap: %s: %m", cp->data_path);
+      return -1;
+    }
+    if (cp->map)
+      munmap (cp->map, cp->map_size);
+    cp->map = map;
+    cp->map_size = map_size;
+  }
+
+  return 0;
+}
+
+static int
+send_request (struct coprocess *cp, const char **argv)
+{
+  CLEANUP_FREE char *req = NULL;
+  size_t i, n, len = 0;
+  const char *p;
+  ssize_t r;
+  FILE *fp;
+
+  for (n = 0; argv[n+1] != NULL; ++n)
+    ;
+
+  fp = open_memstream (&req, &len);
+  if (fp == NULL) {
+    nbdkit_error ("open_memstream: %m");
+    return -1;
+  }
+  fprintf (fp, "%zu\n", n);
+  for (i = 1; argv[i] != NULL; ++i)
+    fprintf (fp, "%s\n", argv[i]);
+  if (fclose (fp) == EOF) {
+    nbdkit_error ("memstream failed: %m");
+    return -1;
+  }
+
+  for (p = req; len > 0; p += r, len -= r) {
+    r = write (cp->in_fd, p, len);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;                /* Caller handles EPIPE. */
+    }
+  }
+  return 0;
+}
+
+/* Which buffer a reply goes into, see handle_script_error. */
+static bool
+is_error_status (int status)
+{
+  switch (status) {
+  case OK:
+  case MISSING:
+  case RET_FALSE:
+  case SHUTDOWN_OK:
+  case DISC_FORCE:
+  case DISC_SOFT_OK:
+    return false;
+  default:
+    return true;
+  }
+}
+
+/* \0-terminate a reply buffer (for convenience, as call3 does). */
+static int
+terminate_buffer (string *buf)
+{
+  if (buf->cap <= buf->len && string_reserve (buf, 1) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  buf->ptr[buf->len] = '\0';
+  return 0;
+}
+
+/* Wait until the first reply from a new coprocess can be read.
+ * Returns false on timeout.
+ */
+static bool
+wait_first_reply (struct coprocess *cp)
+{
+  struct pollfd pfd = { .fd = fileno (cp->out_fp), .events = POLLIN };
+  int r;
+
+  do
+    r = poll (&pfd, 1, COPROCESS_FIRST_REPLY_TIMEOUT * 1000);
+  while (r == -1 && errno == EINTR);
+  return r != 0;
+}
+
+/* Try to make the call using a coprocess.  This returns the exit
+ * code from the script, or -1 if coprocess mode is not available in
+ * which case the caller should fall back to call3.
+ */
+static int
+coprocess_call (const char *wbuf, size_t wbuflen, bool data_out,
+                string *rbuf, string *ebuf, const char **argv)
+{
+  const char *argv0 = argv[0];
+  struct coprocess *cp;
+  CLEANUP_FREE char *line = NULL;
+  size_t i, linelen = 0, len;
+  string *buf;
+  int status;
+  bool err;
+
+  /* Parameters are sent one per line so the (unusual) ones containing
+   * newlines must be passed by forking the script.
+   */
+  for (i = 1; argv[i] != NULL; ++i)
+    if (strchr (argv[i], '\n'))
+      return -1;
+
+  cp = get_coprocess (&err);
+  if (cp == NULL)
+    return err ? ERROR : -1;
+
+  string_reset (rbuf);
+  string_reset (ebuf);
+
+  debug_call (argv);
+
+  if (wbuflen > 0) {
+    if (map_data_file (cp, argv0, wbuflen, true) == -1)
+      goto error;
+    memcpy (cp->map, wbuf, wbuflen);
+  }
+
+  if (send_request (cp, argv) == -1) {
+    if (errno == EPIPE)
+      goto exited;
+    nbdkit_error ("%s: write: %m", argv0);
+    goto error;
+  }
+
+  if (!cp->replied && !wait_first_reply (cp)) {
+    nbdkit_debug ("%s: no reply from coprocess after %d seconds",
+                  argv0, COPROCESS_FIRST_REPLY_TIMEOUT);
+    goto unsupported;
+  }
+  if (getline (&line, &linelen, cp->out_fp) == -1) {
+    if (feof (cp->out_fp))
+      goto exited;
+    nbdkit_error ("%s: read: %m", argv0);
+    goto error;
+  }
+  if (sscanf (line, "%d %zu", &status, &len) != 2 || status < 0) {
+    if (!cp->replied) {
+      nbdkit_debug ("%s: could not parse reply from coprocess: %s",
+                    argv0, line);
+      goto unsupported;
+    }
+    nbdkit_error ("%s: could not parse reply from coprocess: %s",
+                  argv0, line);
+    goto error;
+  }
+  cp->replied = true;
+
+  buf = is_error_status (status) ? ebuf : rbuf;
+  if (data_out && status == OK) {
+    if (map_data_file (cp, argv0, len, false) == -1)
+      goto error;
+    if (string_reserve (rbuf, len) == -1) {
+      nbdkit_error ("realloc: %m");
+      goto error;
+    }
+    memcpy (rbuf->ptr, cp->map, len);
+    rbuf->len = len;
+  }
+  else if (len > 0) {
+    if (string_reserve (buf, len) == -1) {
+      nbdkit_error ("realloc: %m");
+      goto error;
+    }
+    if (fread (buf->ptr, 1, len, cp->out_fp) != len) {
+      nbdkit_error ("%s: short reply from coprocess", argv0);
+      goto error;
+    }
+    buf->len = len;
+  }
+
+  if (terminate_buffer (rbuf) == -1 || terminate_buffer (ebuf) == -1)
+    goto error;
+
+  nbdkit_debug ("completed: %s %s: status %d", argv0, argv[1], status);
+  put_coprocess (cp);
+  return status;
+
+ exited:
+  /* The coprocess exited, reap it to find out why. */
+  fclose (cp->out_fp);
+  cp->out_fp = NULL;
+  close (cp->in_fd);
+  cp->in_fd = -1;
+  if (waitpid (cp->pid, &status, 0) == -1) {
+    nbdkit_error ("%s: waitpid: %m", argv0);
+    goto error;
+  }
+  cp->pid = -1;
+  if (!cp->replied && WIFEXITED (status)) {
+    nbdkit_debug ("%s: coprocess exited with status %d",
+                  argv0, WEXITSTATUS (status));
+    goto unsupported;
+  }
+  if (WIFSIGNALED (status))
+    nbdkit_error ("%s: coprocess terminated by signal %d",
+                  argv0, WTERMSIG (status));
+  else
+    nbdkit_error ("%s: coprocess exited unexpectedly with status %d",
+                  argv0, WEXITSTATUS (status));
+  goto error;
+
+ unsupported:
+  /* The coprocess never replied, so the request has not been handled
+   * and the caller can safely make it again by forking the script.
+   */
+  nbdkit_debug ("%s: script does not support coprocess mode, "
+                "forking for each call instead", argv0);
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&coprocess_lock);
+    coprocess_enabled = false;
+  }
+  free_coprocess (cp, true);
+  string_reset (rbuf);
+  string_reset (ebuf);
+  return -1;
+
+ error:
+  free_coprocess (cp, true);
+  string_reset (rbuf);
+  string_reset (ebuf);
+  return ERROR;
+}
+
+static int
+call_script (const char *wbuf, size_t wbuflen, bool data_out,
+             string *rbuf, string *ebuf, const char **argv)
+{
+  int r;
+
+  r = coprocess_call (wbuf, wbuflen, data_out, rbuf, ebuf, argv);
+  if (r == -1)
+    r = call3 (wbuf, wbuflen, rbuf, ebuf, argv);
+  return r;
+}
+
 /* Call the script with parameters.  Don't write to stdin or read from
  * stdout, but handle stderr if an error occurs.  Returns the exit
  * code from the script.
@@ -555,7 +1142,7 @@ call (const char **argv)
   CLEANUP_FREE_STRING string rbuf = empty_vector;
   CLEANUP_FREE_STRING string ebuf = empty_vector;
 
-  r = call3 (NULL, 0, &rbuf, &ebuf, argv);
+  r = call_script (NULL, 0, false, &rbuf, &ebuf, argv);
   return handle_script_error (argv[0], &ebuf, r);
 }
 
@@ -568,7 +1155,24 @@ call_read (string *rbuf, const char **argv)
   int r;
   CLEANUP_FREE_STRING string ebuf = empty_vector;
 
-  r = call3 (NULL, 0, rbuf, &ebuf, argv);
+  r = call_script (NULL, 0, false, rbuf, &ebuf, argv);
+  r = handle_script_error (argv[0], &ebuf, r);
+  if (r == ERROR)
+    string_reset (rbuf);
+  return r;
+}
+
+/* Same as call_read, but the output is bulk data (ie. from pread).
+ * In coprocess mode it is returned through the data file instead of
+ * stdout.
+ */
+exit_code
+call_read_data (string *rbuf, const char **argv)
+{
+  int r;
+  CLEANUP_FREE_STRING string ebuf = empty_vector;
+
+  r = call_script (NULL, 0, true, rbuf, &ebuf, argv);
   r = handle_script_error (argv[0], &ebuf, r);
   if (r == ERROR)
     string_reset (rbuf);
@@ -585,6 +1189,6 @@ call_write (const char *wbuf, size_t wbuflen, const char **argv)
   CLEANUP_FREE_STRING string rbuf = empty_vector;
   CLEANUP_FREE_STRING string ebuf = empty_vector;
 
-  r = call3 (wbuf, wbuflen, &rbuf, &ebuf, argv);
+  r = call_script (wbuf, wbuflen, false, &rbuf, &ebuf, argv);
   return handle_script_error (argv[0], &ebuf, r);
 }
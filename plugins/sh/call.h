@@ -46,6 +46,15 @@ extern char tmpdir[];
  */
 extern void call_unload (void);
 
+/* The plugins call this from .after_fork() to allow methods to be
+ * sent to a long-running coprocess instead of forking the script for
+ * every call.  The first call after this probes whether the script
+ * supports coprocess mode.  call_stop_coprocess should be called in
+ * .unload() before running the script's unload method.
+ */
+extern void call_enable_coprocess (void);
+extern void call_stop_coprocess (void);
+
 /* Exit codes. */
 typedef enum exit_code {
   OK = 0,
@@ -68,5 +77,7 @@ extern exit_code call_read (string *rbuf, const char **argv)
 extern exit_code call_write (const char *wbuf, size_t wbuflen,
                              const char **argv)
   __attribute__ ((__nonnull__ (1, 3)));
+extern exit_code call_read_data (string *rbuf, const char **argv)
+  __attribute__ ((__nonnull__ (1, 2)));
 
 #endif /* NBDKIT_CALL_H */
@@ -177,6 +177,8 @@ sh_after_fork (void)
   switch (call (args)) {
   case OK:
   case MISSING:
+    /* From now on it is safe to start long-running coprocesses. */
+    call_enable_coprocess ();
     return 0;
 
   case ERROR:
@@ -600,7 +602,7 @@ sh_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   snprintf (cbuf, sizeof cbuf, "%" PRIu32, count);
   snprintf (obuf, sizeof obuf, "%" PRIu64, offset);
 
-  switch (call_read (&data, args)) {
+  switch (call_read_data (&data, args)) {
   case OK:
     if (count != data.len) {
       nbdkit_error ("%s: incorrect amount of data read: "
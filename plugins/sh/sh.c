@@ -73,6 +73,8 @@ sh_unload (void)
 {
   const char *method = "unload";
 
+  call_stop_coprocess ();
+
   /* Run the unload method.  Ignore all errors. */
   if (script) {
     const char *args[] = { script, method, NULL };
@@ -56,6 +56,7 @@
 #include "cleanup.h"
 #include "const-string-vector.h"
 #include "minmax.h"
+#include "vector.h"
 
 static const char *host = NULL;
 static const char *path = NULL;
@@ -70,6 +71,7 @@ static bool compression = false;
 static bool create = false;
 static int64_t create_size = -1;
 static unsigned create_mode = S_IRUSR | S_IWUSR /* 0600 */;
+static unsigned connections = 1;
 
 /* config can be:
  * NULL => parse options from default file
@@ -173,6 +175,14 @@ ssh_config (const char *key, const char *value)
       return -1;
     compression = r;
   }
+  else if (strcmp (key, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+    if (connections == 0) {
+      nbdkit_error ("connections parameter must not be 0");
+      return -1;
+    }
+  }
   else if (strcmp (key, "create") == 0) {
     r = nbdkit_parse_bool (value);
     if (r == -1)
@@ -235,31 +245,56 @@ ssh_config_complete (void)
   "timeout=SECS               Set SSH connection timeout.\n" \
   "verify-remote-host=false   Ignore known_hosts.\n" \
   "compression=true           Enable compression.\n" \
+  "connections=N              Number of SSH connections per client.\n" \
   "create=true                Create the remote file.\n" \
   "create-mode=MODE           Set the permissions of the remote file.\n" \
   "create-size=SIZE           Set the size of the remote file."
 
-/* Since we must simulate atomic pread and pwrite using seek +
- * read/write, calls on each handle must be serialized.
+/* We must simulate atomic pread and pwrite using seek + read/write,
+ * and libssh sessions are not thread safe, so each request takes an
+ * SSH connection from the handle's pool for its whole duration.
+ * Requests can run in parallel when connections > 1.
  */
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
-/* The per-connection handle. */
-struct ssh_handle {
+/* Largest read and write requests we send if the server does not
+ * tell us its limits.  OpenSSH has a maximum packet size of 256K, so
+ * any write requests larger than this will fail in a peculiar way.
+ * (This limit doesn't seem to include the SFTP protocol overhead).
+ * I don't know whether 256K is a limit that applies to all servers.
+ */
+#define DEFAULT_MAX_RW (128*1024)
+
+/* One SSH connection with an SFTP channel and the remote file open. */
+struct ssh_conn {
   ssh_session session;
   sftp_session sftp;
   sftp_file file;
+  uint32_t max_read, max_write; /* largest single SFTP read/write */
+};
+
+DEFINE_VECTOR_TYPE (conn_list, struct ssh_conn *);
+
+/* The per-connection handle. */
+struct ssh_handle {
+  struct ssh_conn *conns;
+  size_t nr_conns;              /* number of connections opened */
+
+  /* Connections not in use by a request.  The lock protects this. */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;          /* signalled when one is returned */
+  conn_list free_conns;
 };
 
 /* Verify the remote host.
  * See: http://api.libssh.org/master/libssh_tutor_guided_tour.html
  */
 static int
-do_verify_remote_host (struct ssh_handle *h)
+do_verify_remote_host (struct ssh_conn *c)
 {
   enum ssh_known_hosts_e state;
 
-  state = ssh_session_is_known_server (h->session);
+  state = ssh_session_is_known_server (c->session);
   switch (state) {
   case SSH_KNOWN_HOSTS_OK:
     /* OK */
@@ -290,7 +325,7 @@ do_verify_remote_host (struct ssh_handle *h)
     return -1;
 
   case SSH_KNOWN_HOSTS_ERROR:
-    nbdkit_error ("known hosts error: %s", ssh_get_error (h->session));
+    nbdkit_error ("known hosts error: %s", ssh_get_error (c->session));
     return -1;
   }
 
@@ -326,17 +361,17 @@ authenticate_password (ssh_session session, const char *pass)
 }
 
 static int
-authenticate (struct ssh_handle *h)
+authenticate (struct ssh_conn *c)
 {
   int method, rc;
 
-  rc = ssh_userauth_none (h->session, NULL);
+  rc = ssh_userauth_none (c->session, NULL);
   if (rc == SSH_AUTH_SUCCESS)
     return 0;
   if (rc == SSH_AUTH_ERROR)
     return -1;
 
-  method = ssh_userauth_list (h->session, NULL);
+  method = ssh_userauth_list (c->session, NULL);
   nbdkit_debug ("authentication methods offered by the server [0x%x]: "
                 "%s%s%s%s%s%s%s",
                 method,
@@ -352,12 +387,12 @@ authenticate (struct ssh_handle *h)
                        ? " (and other unknown methods)" : "");
 
   if (method & SSH_AUTH_METHOD_PUBLICKEY) {
-    rc = authenticate_pubkey (h->session);
+    rc = authenticate_pubkey (c->session);
     if (rc == SSH_AUTH_SUCCESS) return 0;
   }
 
   if (password != NULL && (method & SSH_AUTH_METHOD_PASSWORD)) {
-    rc = authenticate_password (h->session, password);
+    rc = authenticate_password (c->session, password);
     if (rc == SSH_AUTH_SUCCESS) return 0;
   }
 
@@ -446,30 +481,23 @@ open_or_create_path (ssh_session session, sftp_session sftp, int readonly)
   return file;
 }
 
-/* Create the per-connection handle. */
-static void *
-ssh_open (int readonly)
+/* Open one SSH connection to the server and the remote file. */
+static int
+open_conn (struct ssh_conn *c, int readonly)
 {
-  struct ssh_handle *h;
   const int set = 1;
   size_t i;
   int r;
 
-  h = calloc (1, sizeof *h);
-  if (h == NULL) {
-    nbdkit_error ("calloc: %m");
-    return NULL;
-  }
-
   /* Set up the SSH session. */
-  h->session = ssh_new ();
-  if (!h->session) {
+  c->session = ssh_new ();
+  if (!c->session) {
     nbdkit_error ("failed to initialize libssh session");
     goto err;
   }
 
   if (ssh_debug_log > 0) {
-    ssh_options_set (h->session, SSH_OPTIONS_LOG_VERBOSITY, &ssh_debug_log);
+    ssh_options_set (c->session, SSH_OPTIONS_LOG_VERBOSITY, &ssh_debug_log);
     /* Even though this is setting a "global", we must call it every
      * time we set the session otherwise messages go to stderr.
      */
@@ -480,35 +508,35 @@ ssh_open (int readonly)
    * developers to improve performance of sftp.  Ignore any error if
    * we fail to set this.
    */
-  ssh_options_set (h->session, SSH_OPTIONS_NODELAY, &set);
+  ssh_options_set (c->session, SSH_OPTIONS_NODELAY, &set);
 
-  r = ssh_options_set (h->session, SSH_OPTIONS_HOST, host);
+  r = ssh_options_set (c->session, SSH_OPTIONS_HOST, host);
   if (r != SSH_OK) {
     nbdkit_error ("failed to set host in libssh session: %s: %s",
-                  host, ssh_get_error (h->session));
+                  host, ssh_get_error (c->session));
     goto err;
   }
   if (port != NULL) {
-    r = ssh_options_set (h->session, SSH_OPTIONS_PORT_STR, port);
+    r = ssh_options_set (c->session, SSH_OPTIONS_PORT_STR, port);
     if (r != SSH_OK) {
       nbdkit_error ("failed to set port in libssh session: %s: %s",
-                    port, ssh_get_error (h->session));
+                    port, ssh_get_error (c->session));
       goto err;
     }
   }
   if (user != NULL) {
-    r = ssh_options_set (h->session, SSH_OPTIONS_USER, user);
+    r = ssh_options_set (c->session, SSH_OPTIONS_USER, user);
     if (r != SSH_OK) {
       nbdkit_error ("failed to set user in libssh session: %s: %s",
-                    user, ssh_get_error (h->session));
+                    user, ssh_get_error (c->session));
       goto err;
     }
   }
   if (known_hosts != NULL) {
-    r = ssh_options_set (h->session, SSH_OPTIONS_KNOWNHOSTS, known_hosts);
+    r = ssh_options_set (c->session, SSH_OPTIONS_KNOWNHOSTS, known_hosts);
     if (r != SSH_OK) {
       nbdkit_error ("failed to set known_hosts in libssh session: %s: %s",
-                    known_hosts, ssh_get_error (h->session));
+                    known_hosts, ssh_get_error (c->session));
       goto err;
     }
     /* XXX This is still going to read the global file, and there
@@ -517,29 +545,29 @@ ssh_open (int readonly)
      */
   }
   for (i = 0; i < identities.len; ++i) {
-    r = ssh_options_set (h->session,
+    r = ssh_options_set (c->session,
                          SSH_OPTIONS_ADD_IDENTITY, identities.ptr[i]);
     if (r != SSH_OK) {
       nbdkit_error ("failed to add identity in libssh session: %s: %s",
-                    identities.ptr[i], ssh_get_error (h->session));
+                    identities.ptr[i], ssh_get_error (c->session));
       goto err;
     }
   }
   if (timeout > 0) {
     long arg = timeout;
-    r = ssh_options_set (h->session, SSH_OPTIONS_TIMEOUT, &arg);
+    r = ssh_options_set (c->session, SSH_OPTIONS_TIMEOUT, &arg);
     if (r != SSH_OK) {
       nbdkit_error ("failed to set timeout in libssh session: %" PRIu32 ": %s",
-                    timeout, ssh_get_error (h->session));
+                    timeout, ssh_get_error (c->session));
       goto err;
     }
   }
 
   if (compression) {
-    r = ssh_options_set (h->session, SSH_OPTIONS_COMPRESSION, "yes");
+    r = ssh_options_set (c->session, SSH_OPTIONS_COMPRESSION, "yes");
     if (r != SSH_OK) {
       nbdkit_error ("failed to enable compression in libssh session: %s",
-                    ssh_get_error (h->session));
+                    ssh_get_error (c->session));
       goto err;
     }
   }
@@ -552,10 +580,10 @@ ssh_open (int readonly)
      * /etc/ssh/ssh_config.  If either are missing then they are
      * ignored.
      */
-    r = ssh_options_parse_config (h->session, NULL);
+    r = ssh_options_parse_config (c->session, NULL);
     if (r != SSH_OK) {
       nbdkit_error ("failed to parse local SSH configuration: %s",
-                    ssh_get_error (h->session));
+                    ssh_get_error (c->session));
       goto err;
     }
   }
@@ -563,63 +591,140 @@ ssh_open (int readonly)
     /* User has specified a single file.  This function ignores the
      * case where the file is missing - should we check this? XXX
      */
-    r = ssh_options_parse_config (h->session, config);
+    r = ssh_options_parse_config (c->session, config);
     if (r != SSH_OK) {
       nbdkit_error ("failed to parse SSH configuration: %s: %s",
-                    config, ssh_get_error (h->session));
+                    config, ssh_get_error (c->session));
       goto err;
     }
   }
 
   /* Connect. */
-  r = ssh_connect (h->session);
+  r = ssh_connect (c->session);
   if (r != SSH_OK) {
     nbdkit_error ("failed to connect to remote host: %s: %s",
-                  host, ssh_get_error (h->session));
+                  host, ssh_get_error (c->session));
     goto err;
   }
 
   /* Verify the remote host. */
-  if (verify_remote_host && do_verify_remote_host (h) == -1)
+  if (verify_remote_host && do_verify_remote_host (c) == -1)
     goto err;
 
   /* Authenticate. */
-  if (authenticate (h) == -1)
+  if (authenticate (c) == -1)
     goto err;
 
   /* Open the SFTP connection. */
-  h->sftp = sftp_new (h->session);
-  if (!h->sftp) {
+  c->sftp = sftp_new (c->session);
+  if (!c->sftp) {
     nbdkit_error ("failed to allocate sftp session: %s",
-                  ssh_get_error (h->session));
+                  ssh_get_error (c->session));
     goto err;
   }
-  r = sftp_init (h->sftp);
+  r = sftp_init (c->sftp);
   if (r != SSH_OK) {
     nbdkit_error ("failed to initialize sftp session: %s",
-                  ssh_get_error (h->session));
+                  ssh_get_error (c->session));
     goto err;
   }
 
   /* Open or create the remote file. */
-  h->file = open_or_create_path (h->session, h->sftp, readonly);
-  if (!h->file)
+  c->file = open_or_create_path (c->session, c->sftp, readonly);
+  if (!c->file)
     goto err;
 
+  /* Find out the largest reads and writes the server accepts. */
+  c->max_read = c->max_write = DEFAULT_MAX_RW;
+#ifdef HAVE_SFTP_AIO_BEGIN_READ
+  {
+    sftp_limits_t limits = sftp_limits (c->sftp);
+
+    if (limits) {
+      if (limits->max_read_length > 0)
+        c->max_read = MIN (limits->max_read_length, UINT32_MAX);
+      if (limits->max_write_length > 0)
+        c->max_write = MIN (limits->max_write_length, UINT32_MAX);
+      sftp_limits_free (limits);
+    }
+  }
+#endif
+
   nbdkit_debug ("opened libssh handle");
 
-  return h;
+  return 0;
 
  err:
-  if (h->file)
-    sftp_close (h->file);
-  if (h->sftp)
-    sftp_free (h->sftp);
-  if (h->session) {
-    ssh_disconnect (h->session);
-    ssh_free (h->session);
+  if (c->file)
+    sftp_close (c->file);
+  if (c->sftp)
+    sftp_free (c->sftp);
+  if (c->session) {
+    ssh_disconnect (c->session);
+    ssh_free (c->session);
   }
+  return -1;
+}
+
+static void
+close_conn (struct ssh_conn *c)
+{
+  int r;
+
+  r = sftp_close (c->file);
+  if (r != SSH_OK)
+    nbdkit_error ("cannot close file: %s", ssh_get_error (c->session));
+
+  sftp_free (c->sftp);
+  ssh_disconnect (c->session);
+  ssh_free (c->session);
+}
+
+static void
+free_handle (struct ssh_handle *h)
+{
+  size_t i;
+
+  for (i = 0; i < h->nr_conns; ++i)
+    close_conn (&h->conns[i]);
+  free (h->conns);
+  conn_list_reset (&h->free_conns);
+  pthread_mutex_destroy (&h->lock);
+  pthread_cond_destroy (&h->cond);
   free (h);
+}
+
+/* Create the per-connection handle. */
+static void *
+ssh_open (int readonly)
+{
+  struct ssh_handle *h;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  pthread_mutex_init (&h->lock, NULL);
+  pthread_cond_init (&h->cond, NULL);
+
+  h->conns = calloc (connections, sizeof h->conns[0]);
+  if (h->conns == NULL ||
+      conn_list_reserve (&h->free_conns, connections) == -1) {
+    nbdkit_error ("calloc: %m");
+    goto err;
+  }
+  for (; h->nr_conns < connections; ++h->nr_conns) {
+    if (open_conn (&h->conns[h->nr_conns], readonly) == -1)
+      goto err;
+    /* Cannot fail because we reserved enough space above. */
+    conn_list_append (&h->free_conns, &h->conns[h->nr_conns]);
+  }
+
+  return h;
+
+ err:
+  free_handle (h);
   return NULL;
 }
 
@@ -627,17 +732,31 @@ ssh_open (int readonly)
 static void
 ssh_close (void *handle)
 {
-  struct ssh_handle *h = handle;
-  int r;
+  free_handle (handle);
+}
 
-  r = sftp_close (h->file);
-  if (r != SSH_OK)
-    nbdkit_error ("cannot close file: %s", ssh_get_error (h->session));
+/* Take a connection from the pool, waiting if they are all in use. */
+static struct ssh_conn *
+get_conn (struct ssh_handle *h)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+  struct ssh_conn *c;
+
+  while (h->free_conns.len == 0)
+    pthread_cond_wait (&h->cond, &h->lock);
+  c = h->free_conns.ptr[h->free_conns.len-1];
+  conn_list_remove (&h->free_conns, h->free_conns.len-1);
+  return c;
+}
 
-  sftp_free (h->sftp);
-  ssh_disconnect (h->session);
-  ssh_free (h->session);
-  free (h);
+static void
+put_conn (struct ssh_handle *h, struct ssh_conn *c)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+
+  /* Cannot fail because we reserved enough space in ssh_open. */
+  conn_list_append (&h->free_conns, c);
+  pthread_cond_signal (&h->cond);
 }
 
 /* Get the file size. */
@@ -645,34 +764,184 @@ static int64_t
 ssh_get_size (void *handle)
 {
   struct ssh_handle *h = handle;
+  struct ssh_conn *c = get_conn (h);
   sftp_attributes attrs;
   int64_t r;
 
-  attrs = sftp_fstat (h->file);
+  attrs = sftp_fstat (c->file);
+  if (attrs == NULL) {
+    nbdkit_error ("fstat failed: %s", ssh_get_error (c->session));
+    put_conn (h, c);
+    return -1;
+  }
   r = attrs->size;
   sftp_attributes_free (attrs);
+  put_conn (h, c);
 
   return r;
 }
 
-/* Read data from the remote server. */
+#ifdef HAVE_SFTP_AIO_BEGIN_READ
+
+/* Maximum number of SFTP requests in flight on one connection for a
+ * single nbdkit request.  Large requests are split into chunks of
+ * max_read or max_write bytes which are all sent before waiting for
+ * the first reply, so a request costs about one round trip rather
+ * than one per chunk.
+ */
+#define MAX_IN_FLIGHT 64
+
+/* Read data using pipelined asynchronous SFTP reads. */
 static int
-ssh_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+do_pread (struct ssh_conn *c, char *buf, uint32_t count, uint64_t offset)
+{
+  sftp_aio aio[MAX_IN_FLIGHT];
+  uint32_t pos[MAX_IN_FLIGHT], len[MAX_IN_FLIGHT];
+  size_t head = 0, n = 0;       /* ring of requests in flight */
+  uint32_t requested = 0, done = 0;
+  ssize_t rs;
+  int ret = -1;
+
+  if (sftp_seek64 (c->file, offset) != SSH_OK) {
+    nbdkit_error ("seek64 failed: %s", ssh_get_error (c->session));
+    return -1;
+  }
+
+  while (done < count) {
+    /* Keep the pipeline full.  Each read advances the file offset. */
+    while (n < MAX_IN_FLIGHT && requested < count) {
+      size_t i = (head + n) % MAX_IN_FLIGHT;
+
+      pos[i] = requested;
+      len[i] = MIN (count - requested, c->max_read);
+      if (sftp_aio_begin_read (c->file, len[i], &aio[i]) == SSH_ERROR) {
+        nbdkit_error ("read failed: %s", ssh_get_error (c->session));
+        goto out;
+      }
+      requested += len[i];
+      n++;
+    }
+
+    /* Replies are matched by id, so we can wait for them in order. */
+    rs = sftp_aio_wait_read (&aio[head], buf + pos[head], len[head]);
+    n--;
+    if (rs < 0) {
+      nbdkit_error ("read failed: %s (%zd)", ssh_get_error (c->session), rs);
+      head = (head + 1) % MAX_IN_FLIGHT;
+      goto out;
+    }
+    if (rs == 0) {
+      nbdkit_error ("read failed: unexpected end of file");
+      head = (head + 1) % MAX_IN_FLIGHT;
+      goto out;
+    }
+    done += rs;
+    if (rs < len[head]) {
+      /* Short read.  Collect the replies still in flight, then
+       * restart the pipeline from the first missing byte.  This
+       * rereads some data but short reads should be rare.
+       */
+      head = (head + 1) % MAX_IN_FLIGHT;
+      while (n > 0) {
+        rs = sftp_aio_wait_read (&aio[head], buf + pos[head], len[head]);
+        head = (head + 1) % MAX_IN_FLIGHT;
+        n--;
+        if (rs < 0) {
+          nbdkit_error ("read failed: %s (%zd)",
+                        ssh_get_error (c->session), rs);
+          goto out;
+        }
+      }
+      if (sftp_seek64 (c->file, offset + done) != SSH_OK) {
+        nbdkit_error ("seek64 failed: %s", ssh_get_error (c->session));
+        goto out;
+      }
+      requested = done;
+    }
+    else
+      head = (head + 1) % MAX_IN_FLIGHT;
+  }
+  ret = 0;
+
+ out:
+  /* Only reached with requests in flight on error. */
+  for (; n > 0; --n) {
+    sftp_aio_free (aio[head]);
+    head = (head + 1) % MAX_IN_FLIGHT;
+  }
+  return ret;
+}
+
+/* Write data using pipelined asynchronous SFTP writes. */
+static int
+do_pwrite (struct ssh_conn *c, const char *buf, uint32_t count,
+           uint64_t offset)
+{
+  sftp_aio aio[MAX_IN_FLIGHT];
+  size_t head = 0, n = 0;       /* ring of requests in flight */
+  uint32_t requested = 0;
+  ssize_t rs;
+  int ret = -1;
+
+  if (sftp_seek64 (c->file, offset) != SSH_OK) {
+    nbdkit_error ("seek64 failed: %s", ssh_get_error (c->session));
+    return -1;
+  }
+
+  while (requested < count || n > 0) {
+    while (n < MAX_IN_FLIGHT && requested < count) {
+      size_t i = (head + n) % MAX_IN_FLIGHT;
+      uint32_t len = MIN (count - requested, c->max_write);
+
+      rs = sftp_aio_begin_write (c->file, buf + requested, len, &aio[i]);
+      if (rs < 0) {
+        nbdkit_error ("write failed: %s (%zd)",
+                      ssh_get_error (c->session), rs);
+        goto out;
+      }
+      requested += len;
+      n++;
+    }
+
+    rs = sftp_aio_wait_write (&aio[head]);
+    head = (head + 1) % MAX_IN_FLIGHT;
+    n--;
+    if (rs < 0) {
+      nbdkit_error ("write failed: %s (%zd)", ssh_get_error (c->session), rs);
+      goto out;
+    }
+  }
+  ret = 0;
+
+ out:
+  for (; n > 0; --n) {
+    sftp_aio_free (aio[head]);
+    head = (head + 1) % MAX_IN_FLIGHT;
+  }
+  return ret;
+}
+
+#else /* !HAVE_SFTP_AIO_BEGIN_READ */
+
+/* libssh < 0.11 lacks the sftp_aio API, so read and write
+ * synchronously one chunk at a time.
+ */
+static int
+do_pread (struct ssh_conn *c, char *buf, uint32_t count, uint64_t offset)
 {
-  struct ssh_handle *h = handle;
   int r;
   ssize_t rs;
 
-  r = sftp_seek64 (h->file, offset);
+  r = sftp_seek64 (c->file, offset);
   if (r != SSH_OK) {
-    nbdkit_error ("seek64 failed: %s", ssh_get_error (h->session));
+    nbdkit_error ("seek64 failed: %s", ssh_get_error (c->session));
     return -1;
   }
 
   while (count > 0) {
-    rs = sftp_read (h->file, buf, count);
+    rs = sftp_read (c->file, buf, count);
     if (rs < 0) {
-      nbdkit_error ("read failed: %s (%zd)", ssh_get_error (h->session), rs);
+      nbdkit_error ("read failed: %s (%zd)", ssh_get_error (c->session), rs);
       return -1;
     }
     buf += rs;
@@ -682,31 +951,23 @@ ssh_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   return 0;
 }
 
-/* Write data to the remote server. */
 static int
-ssh_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
+do_pwrite (struct ssh_conn *c, const char *buf, uint32_t count,
+           uint64_t offset)
 {
-  struct ssh_handle *h = handle;
   int r;
   ssize_t rs;
 
-  r = sftp_seek64 (h->file, offset);
+  r = sftp_seek64 (c->file, offset);
   if (r != SSH_OK) {
-    nbdkit_error ("seek64 failed: %s", ssh_get_error (h->session));
+    nbdkit_error ("seek64 failed: %s", ssh_get_error (c->session));
     return -1;
   }
 
   while (count > 0) {
-    /* Openssh has a maximum packet size of 256K, so any write
-     * requests larger than this will fail in a peculiar way.  (This
-     * limit doesn't seem to include the SFTP protocol overhead).
-     * Therefore if the count is larger than 128K, reduce the size of
-     * the request.  I don't know whether 256K is a limit that applies
-     * to all servers.
-     */
-    rs = sftp_write (h->file, buf, MIN (count, 128*1024));
+    rs = sftp_write (c->file, buf, MIN (count, c->max_write));
     if (rs < 0) {
-      nbdkit_error ("write failed: %s (%zd)", ssh_get_error (h->session), rs);
+      nbdkit_error ("write failed: %s (%zd)", ssh_get_error (c->session), rs);
       return -1;
     }
     buf += rs;
@@ -716,6 +977,34 @@ ssh_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
   return 0;
 }
 
+#endif /* !HAVE_SFTP_AIO_BEGIN_READ */
+
+/* Read data from the remote server. */
+static int
+ssh_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+{
+  struct ssh_handle *h = handle;
+  struct ssh_conn *c = get_conn (h);
+  int r;
+
+  r = do_pread (c, buf, count, offset);
+  put_conn (h, c);
+  return r;
+}
+
+/* Write data to the remote server. */
+static int
+ssh_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
+{
+  struct ssh_handle *h = handle;
+  struct ssh_conn *c = get_conn (h);
+  int r;
+
+  r = do_pwrite (c, buf, count, offset);
+  put_conn (h, c);
+  return r;
+}
+
 static int
 ssh_can_flush (void *handle)
 {
@@ -724,7 +1013,8 @@ ssh_can_flush (void *handle)
   /* I added this extension to openssh 6.5 (April 2013).  It may not
    * be available in other SSH servers.
    */
-  return sftp_extension_supported (h->sftp, "fsync@openssh.com", "1");
+  return sftp_extension_supported (h->conns[0].sftp,
+                                   "fsync@openssh.com", "1");
 }
 
 static int
@@ -737,24 +1027,32 @@ ssh_can_multi_conn (void *handle)
    * multi-conn.  Other servers may not be safe.  Use the
    * fsync@openssh.com feature as a proxy.
    */
-  return sftp_extension_supported (h->sftp, "fsync@openssh.com", "1");
+  return sftp_extension_supported (h->conns[0].sftp,
+                                   "fsync@openssh.com", "1");
 }
 
+/* With several connections each has its own sftp-server process and
+ * file descriptor, but fsync(2) on the server flushes the file
+ * whichever descriptor is used, so flushing one connection is enough.
+ */
 static int
 ssh_flush (void *handle)
 {
   struct ssh_handle *h = handle;
+  struct ssh_conn *c = get_conn (h);
   int r;
 
  again:
-  r = sftp_fsync (h->file);
+  r = sftp_fsync (c->file);
   if (r == SSH_AGAIN)
     goto again;
   else if (r != SSH_OK) {
-    nbdkit_error ("fsync failed: %s", ssh_get_error (h->session));
+    nbdkit_error ("fsync failed: %s", ssh_get_error (c->session));
+    put_conn (h, c);
     return -1;
   }
 
+  put_conn (h, c);
   return 0;
 }
 
@@ -50,10 +50,15 @@
 #include <nbdkit-plugin.h>
 
 #include "cleanup.h"
+#include "diskpool.h"
 #include "utils.h"
 
 static const char *tmpdir = LARGE_TMPDIR;
 static int64_t requested_size = -1; /* size parameter on the command line */
+static unsigned pool_size;          /* pool parameter */
+
+/* Disks created in advance, if pool=N was used. */
+static diskpool *pool;
 
 /* Shell variables. */
 static struct var {
@@ -81,6 +86,9 @@ tmpdisk_unload (void)
 {
   struct var *v, *v_next;
 
+  if (pool)
+    free_diskpool (pool);
+
   for (v = vars; v != NULL; v = v_next) {
     v_next = v->next;
     free (v);
@@ -98,6 +106,10 @@ tmpdisk_config (const char *key, const char *value)
     if (requested_size == -1)
       return -1;
   }
+  else if (strcmp (key, "pool") == 0) {
+    if (nbdkit_parse_unsigned ("pool", value, &pool_size) == -1)
+      return -1;
+  }
 
   /* This parameter cannot be set on the command line since it is used
    * to pass the disk name to the command.
@@ -151,6 +163,7 @@ tmpdisk_config_complete (void)
   "size=<SIZE>      (required) Virtual filesystem size.\n" \
   "label=<LABEL>               The filesystem label.\n" \
   "type=ext4|...               The filesystem type.\n" \
+  "pool=N                      Number of disks to create in advance.\n" \
   "command=<COMMAND>           Alternate command instead of mkfs."
 
 struct handle {
@@ -278,22 +291,14 @@ block_device_size (int fd)
   return size;
 }
 
-static void *
-tmpdisk_open (int readonly)
+/* Create a new disk in a temporary directory, returning the path of
+ * the disk.  This is called from .open, or from the pool thread.
+ */
+static char *
+create_disk (void)
 {
-  struct handle *h;
-  CLEANUP_FREE char *dir = NULL, *disk = NULL;
-  int flags;
-  struct stat statbuf;
-
-  h = malloc (sizeof *h);
-  if (h == NULL) {
-    nbdkit_error ("malloc: %m");
-    goto error;
-  }
-  h->fd = -1;
-  h->size = -1;
-  h->can_punch_hole = true;
+  CLEANUP_FREE char *dir = NULL;
+  char *disk = NULL;
 
   /* For security reasons we have to create a temporary directory
    * under tmpdir that only the current user can access.  If we
@@ -303,20 +308,82 @@ tmpdisk_open (int readonly)
    */
   if (asprintf (&dir, "%s/tmpdiskXXXXXX", tmpdir) == -1) {
     nbdkit_error ("asprintf: %m");
-    goto error;
+    return NULL;
   }
   if (mkdtemp (dir) == NULL) {
     nbdkit_error ("%s: %m", dir);
-    goto error;
+    return NULL;
   }
   if (asprintf (&disk, "%s/disk", dir) == -1) {
     nbdkit_error ("asprintf: %m");
-    goto error;
+    rmdir (dir);
+    return NULL;
   }
 
   /* Now run the mkfs command. */
-  if (run_command (disk) == -1)
+  if (run_command (disk) == -1) {
+    unlink (disk);
+    rmdir (dir);
+    free (disk);
+    return NULL;
+  }
+
+  return disk;
+}
+
+/* Remove the disk and its temporary directory. */
+static void
+remove_disk (const char *disk)
+{
+  CLEANUP_FREE char *dir = strdup (disk);
+  char *p;
+
+  unlink (disk);
+  if (dir && (p = strrchr (dir, '/')) != NULL) {
+    *p = '\0';
+    rmdir (dir);
+  }
+}
+
+static int
+tmpdisk_after_fork (void)
+{
+  if (pool_size == 0)
+    return 0;
+
+  pool = new_diskpool (pool_size, create_disk, remove_disk);
+  if (pool == NULL)
+    return -1;
+  return diskpool_start (pool);
+}
+
+static void *
+tmpdisk_open (int readonly)
+{
+  struct handle *h;
+  CLEANUP_FREE char *disk = NULL;
+  int flags;
+  struct stat statbuf;
+
+  h = malloc (sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("malloc: %m");
     goto error;
+  }
+  h->fd = -1;
+  h->size = -1;
+  h->can_punch_hole = true;
+
+  /* Take a disk from the pool if there is one ready, else create it
+   * now.
+   */
+  if (pool)
+    disk = diskpool_get (pool);
+  if (disk == NULL) {
+    disk = create_disk ();
+    if (disk == NULL)
+      goto error;
+  }
 
   /* The external command must have created the disk, and then we must
    * find the true size.
@@ -353,18 +420,17 @@ tmpdisk_open (int readonly)
    * a file descriptor and access it through that, so unlink the disk.
    * This also ensures it is always cleaned up.
    */
-  unlink (disk);
-  rmdir (dir);
+  remove_disk (disk);
 
   /* Return the handle. */
   return h;
 
  error:
+  if (disk)
+    remove_disk (disk);
   if (h) {
-    if (h->fd >= 0) {
+    if (h->fd >= 0)
       close (h->fd);
-      unlink (disk);
-    }
     free (h);
   }
   return NULL;
@@ -504,6 +570,7 @@ static struct nbdkit_plugin plugin = {
   .config_complete   = tmpdisk_config_complete,
   .config_help       = tmpdisk_config_help,
   .magic_config_key  = "size",
+  .after_fork        = tmpdisk_after_fork,
 
   .can_multi_conn    = tmpdisk_can_multi_conn,
   .can_trim          = tmpdisk_can_trim,
@@ -35,6 +35,7 @@
 #include <cstdlib>
 #include <iostream>
 #include <atomic>
+#include <map>
 
 #include <inttypes.h>
 #include <assert.h>
@@ -46,7 +47,6 @@
 
 #include <libtorrent/alert.hpp>
 #include <libtorrent/alert_types.hpp>
-#include <libtorrent/download_priority.hpp>
 #include <libtorrent/magnet_uri.hpp>
 #include <libtorrent/session.hpp>
 #include <libtorrent/torrent_info.hpp>
@@ -54,12 +54,23 @@
 
 #include "array-size.h"
 #include "cleanup.h"
+#include "tvdiff.h"
 
 static bool seen_torrent = false;
 
 static char *cache;
 static bool clean_cache_on_exit = true;
 
+/* Size of the streaming window ahead of the current read position.
+ * It's called readahead_ because of the function from <fcntl.h>.
+ */
+static int64_t readahead_ = 32 * 1024 * 1024;
+
+/* Deadline (in milliseconds) of each successive piece in the window.
+ * The piece being read has deadline 0.
+ */
+#define DEADLINE_STEP 200
+
 /* This lock protects all the static fields that might be accessed by
  * the background thread, as well as the condition.
  */
@@ -73,6 +84,12 @@ static char *file;
 static std::atomic_int index_(-1);
 static int64_t size = -1;
 
+/* Last piece of the file, and the size of the streaming window in
+ * pieces.
+ */
+static int last_piece = -1;
+static int window_pieces;
+
 static libtorrent::session *session;
 static libtorrent::torrent_handle handle;
 
@@ -107,16 +124,45 @@ static libtorrent::alert_category_t alert_cats =
   | libtorrent::alert_category::storage
   ;
 
-/* This condition is used to signal the plugin when a piece has been
- * downloaded.
+/* This condition is used to signal the plugin when any piece has
+ * been downloaded.  It is only used while waiting for the metadata
+ * and the file to appear.
  */
 static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 
+/* Reads blocked on a piece wait on a condition for that piece, so
+ * that each downloaded piece only wakes up the readers waiting for
+ * it.  Protected by the lock.
+ */
+struct piece_waiters {
+  pthread_cond_t cond;
+  unsigned nr_waiters;
+};
+static std::map<int, struct piece_waiters *> waiters;
+
+/* Number of connection windows covering each piece.  A piece's
+ * deadline is only removed when no window covers it any longer, so
+ * one connection seeking away does not slow down the others.
+ * Protected by window_lock.
+ */
+static pthread_mutex_t window_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<int, unsigned> window_refs;
+
+/* Statistics, printed on unload.  A read of a piece which was already
+ * downloaded is a hit, otherwise it is a stall.
+ */
+static std::atomic<uint64_t> hits (0), stalls (0), stall_usec (0);
+
 static void
 torrent_unload (void)
 {
   libtorrent::remove_flags_t flags;
 
+  nbdkit_debug ("torrent: piece reads: %" PRIu64 " hits, %" PRIu64 " stalls "
+                "(total stall time %" PRIu64 ".%06" PRIu64 "s)",
+                hits.load (), stalls.load (),
+                stall_usec.load () / 1000000, stall_usec.load () % 1000000);
+
   if (session && handle.is_valid()) {
     if (clean_cache_on_exit)
       flags = libtorrent::session_handle::delete_files;
@@ -207,6 +253,13 @@ torrent_config (const char *key, const char *value)
     return 0;
   }
 
+  else if (strcmp (key, "readahead") == 0) {
+    readahead_ = nbdkit_parse_size (value);
+    if (readahead_ == -1)
+      return -1;
+    return 0;
+  }
+
   else if (strcmp (key, "cache") == 0) {
     free (cache);
     cache = nbdkit_realpath (value);
@@ -295,6 +348,7 @@ torrent_config_complete (void)
   "download-rate-limit=BPS        Set download rate limit (bps)\n" \
   "listen-interfaces=IP:PORT,...  Set listening ports\n" \
   "outgoing-interfaces=IP,IP,...  Set outgoing IP addresses\n" \
+  "readahead=SIZE                 Size of streaming window (dflt: 32M)\n" \
   "upload-rate-limit=BPS          Set upload rate limit (bps)\n" \
   "user-agent=STRING              Set the user-agent"
 
@@ -348,6 +402,12 @@ got_metadata (void)
     exit (EXIT_FAILURE);
   }
 
+  if (size > 0)
+    last_piece =
+      static_cast<int> (ti->map_file (index_.load(), size-1, 1).piece);
+  window_pieces =
+    (int) ((readahead_ + ti->piece_length() - 1) / ti->piece_length());
+
   nbdkit_debug ("torrent: serving file index %d: %s",
                 index_.load(), file);
 }
@@ -371,8 +431,13 @@ handle_alert (libtorrent::alert *alert)
       got_metadata ();
   }
 
-  else if (/*piece_finished_alert *p = */
+  else if (piece_finished_alert *p3 =
            alert_cast<piece_finished_alert>(alert)) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    auto it = waiters.find (static_cast<int> (p3->piece_index));
+
+    if (it != waiters.end ())
+      pthread_cond_broadcast (&it->second->cond);
     pthread_cond_broadcast (&cond);
   }
 
@@ -450,6 +515,19 @@ torrent_preconnect (int readonly)
 
 struct handle {
   int fd;
+
+  /* Parallel requests on the same connection update the window and
+   * the statistics, so they are protected by this lock.
+   */
+  pthread_mutex_t lock;
+
+  /* Pieces [window_first, window_last] have had a deadline set by
+   * this connection.  window_first == -1 if there is no window.
+   */
+  int window_first, window_last;
+
+  /* Per-connection statistics. */
+  uint64_t hits, stalls;
 };
 
 static void *
@@ -484,15 +562,64 @@ torrent_open (int readonly)
     return NULL;
   }
   h->fd = fd;
+  pthread_mutex_init (&h->lock, NULL);
+  h->window_first = h->window_last = -1;
 
   return h;
 }
 
+/* Add pieces [first, last] to a connection window. */
+static void
+hold_pieces (int first, int last)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&window_lock);
+  for (int i = first; i <= last; ++i)
+    window_refs[i]++;
+}
+
+/* Remove pieces [first, last] from a connection window, and remove
+ * the deadlines of the pieces which are no longer in any window.
+ * This does nothing for pieces which have been downloaded already.
+ */
+static void
+release_pieces (int first, int last)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&window_lock);
+  for (int i = first; i <= last; ++i) {
+    auto it = window_refs.find (i);
+
+    assert (it != window_refs.end ());
+    if (--it->second == 0) {
+      window_refs.erase (it);
+      handle.reset_piece_deadline (libtorrent::piece_index_t (i));
+    }
+  }
+}
+
+/* Forget the window of this connection.  Must be called with
+ * h->lock held.
+ */
+static void
+reset_window (struct handle *h)
+{
+  if (h->window_first >= 0)
+    release_pieces (h->window_first, h->window_last);
+  h->window_first = h->window_last = -1;
+}
+
 static void
 torrent_close (void *hv)
 {
   struct handle *h = (struct handle *) hv;
 
+  nbdkit_debug ("torrent: connection piece reads: "
+                "%" PRIu64 " hits, %" PRIu64 " stalls",
+                h->hits, h->stalls);
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+    reset_window (h);
+  }
+  pthread_mutex_destroy (&h->lock);
   close (h->fd);
   free (h);
 }
@@ -506,6 +633,99 @@ torrent_get_size (void *hv)
   return size;
 }
 
+/* Set deadlines on the pieces [first, last] covered by a read (which
+ * are needed now) and on the pieces in the streaming window after
+ * them, with increasing deadlines so they are downloaded in order.
+ * Deadlines are only set once for each piece in the window, so
+ * sequential reads only add the pieces at the end of the window.
+ * (libtorrent ignores deadlines on pieces that we already have, so we
+ * don't need to check, which would be a synchronous call.)
+ */
+static void
+update_window (struct handle *h, int first, int last)
+{
+  const int window_end = std::min (last_piece, last + window_pieces);
+  int i;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+
+  /* If the client has moved out of the window, forget the old
+   * window so we are not downloading pieces it no longer needs.
+   * Otherwise drop the pieces which the client has read past.
+   */
+  if (h->window_first >= 0 &&
+      (first < h->window_first || first > h->window_last + 1))
+    reset_window (h);
+  if (h->window_first == -1)
+    h->window_last = first - 1;
+  else if (first > h->window_first)
+    release_pieces (h->window_first, first - 1);
+  h->window_first = first;
+  if (window_end > h->window_last)
+    hold_pieces (h->window_last + 1, window_end);
+
+  for (i = first; i <= last; ++i)
+    handle.set_piece_deadline (libtorrent::piece_index_t (i), 0);
+
+  for (i = std::max (last + 1, h->window_last + 1); i <= window_end; ++i)
+    handle.set_piece_deadline (libtorrent::piece_index_t (i),
+                               (i - last) * DEADLINE_STEP);
+  h->window_last = std::max (h->window_last, window_end);
+}
+
+/* Wait until a piece has been downloaded. */
+static void
+wait_for_piece (struct handle *h, libtorrent::piece_index_t piece)
+{
+  const int i = static_cast<int> (piece);
+  struct timeval start_t, end_t;
+  struct piece_waiters *w;
+
+  if (handle.have_piece (piece)) {
+    hits++;
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+    h->hits++;
+    return;
+  }
+
+  stalls++;
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+    h->stalls++;
+  }
+  gettimeofday (&start_t, NULL);
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    auto it = waiters.find (i);
+
+    if (it != waiters.end ())
+      w = it->second;
+    else {
+      w = new piece_waiters;
+      pthread_cond_init (&w->cond, NULL);
+      w->nr_waiters = 0;
+      waiters[i] = w;
+    }
+
+    /* have_piece becomes true before piece_finished_alert is
+     * handled, and the alert thread needs the lock to signal, so
+     * checking it here with the lock held cannot miss the wakeup.
+     */
+    w->nr_waiters++;
+    while (! handle.have_piece (piece))
+      pthread_cond_wait (&w->cond, &lock);
+    if (--w->nr_waiters == 0) {
+      waiters.erase (i);
+      pthread_cond_destroy (&w->cond);
+      delete w;
+    }
+  }
+
+  gettimeofday (&end_t, NULL);
+  stall_usec += tvdiff_usec (&start_t, &end_t);
+}
+
 /* Read data from the file. */
 static int
 torrent_pread (void *hv, void *buf, uint32_t count, uint64_t offset,
@@ -514,6 +734,15 @@ torrent_pread (void *hv, void *buf, uint32_t count, uint64_t offset,
   struct handle *h = (struct handle *) hv;
   auto ti = handle.torrent_file();
 
+  if (count > 0) {
+    const int first =
+      static_cast<int> (ti->map_file (index_.load(), offset, 1).piece);
+    const int last =
+      static_cast<int> (ti->map_file (index_.load(),
+                                      offset + count - 1, 1).piece);
+    update_window (h, first, last);
+  }
+
   while (count > 0) {
     libtorrent::peer_request part =
       ti->map_file (index_.load(), offset, (int) count);
@@ -521,14 +750,7 @@ torrent_pread (void *hv, void *buf, uint32_t count, uint64_t offset,
     part.length = std::min (ti->piece_size (part.piece) - part.start,
                             part.length);
 
-    while (! handle.have_piece (part.piece)) {
-      /* Tell the picker that we want this piece sooner. */
-      handle.piece_priority (part.piece, libtorrent::top_priority);
-
-      /* Wait for a piece to be downloaded. */
-      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-      pthread_cond_wait (&cond, &lock);
-    }
+    wait_for_piece (h, part.piece);
 
     /* We've got this piece in full (on disk), so we can copy it to
      * the buffer.
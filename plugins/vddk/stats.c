@@ -42,6 +42,7 @@
 #define NBDKIT_API_VERSION 2
 #include <nbdkit-plugin.h>
 
+#include "cleanup.h"
 #include "vector.h"
 
 #include "vddk.h"
@@ -60,6 +61,56 @@ pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 #undef STUB
 #undef OPTIONAL_STUB
 
+/* Latency histogram for each command type.  This is the time from
+ * when the nbdkit thread sends the command to when it completes, so
+ * it includes time spent waiting in the command queue.  Bucket i
+ * counts commands which took [2^i, 2^(i+1)) µs (bucket 0 also
+ * counts commands which took < 1 µs).
+ */
+#define NR_LATENCY_BUCKETS 32
+
+struct latency {
+  uint64_t calls;
+  int64_t usecs;                /* total */
+  int64_t max_usecs;
+  uint64_t buckets[NR_LATENCY_BUCKETS];
+};
+static struct latency latencies[STOP+1];
+
+/* Number of read commands merged with a neighbour, and the number of
+ * VixDiskLib_ReadAsync calls they were merged into.
+ */
+static uint64_t reads_merged, merged_read_calls;
+
+void
+record_latency (enum command_type type, int64_t usecs)
+{
+  struct latency *l = &latencies[type];
+  size_t i = 0;
+
+  if (!vddk_debug_stats) return;
+
+  while (i < NR_LATENCY_BUCKETS-1 && usecs >= (INT64_C (2) << i))
+    i++;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&stats_lock);
+  l->calls++;
+  l->usecs += usecs;
+  if (usecs > l->max_usecs)
+    l->max_usecs = usecs;
+  l->buckets[i]++;
+}
+
+void
+record_merged_reads (size_t nr_commands)
+{
+  if (!vddk_debug_stats) return;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&stats_lock);
+  reads_merged += nr_commands;
+  merged_read_calls++;
+}
+
 DEFINE_VECTOR_TYPE (statlist, struct vddk_stat);
 
 static int
@@ -115,4 +166,26 @@ display_stats (void)
     }
   }
   statlist_reset (&stats);
+
+  nbdkit_debug ("VDDK command latency (-D vddk.stats=1):");
+  for (i = 0; i <= STOP; ++i) {
+    const struct latency *l = &latencies[i];
+    size_t j;
+
+    if (l->calls == 0)
+      continue;
+    nbdkit_debug ("  %-12s %" PRIu64 " calls, "
+                  "average %" PRIi64 " µs, max %" PRIi64 " µs",
+                  command_type_string (i), l->calls,
+                  l->usecs / (int64_t) l->calls, l->max_usecs);
+    for (j = 0; j < NR_LATENCY_BUCKETS; ++j) {
+      if (l->buckets[j])
+        nbdkit_debug ("    %12" PRIu64 " - %12" PRIu64 " µs: %" PRIu64,
+                      j == 0 ? 0 : UINT64_C (1) << j,
+                      (UINT64_C (2) << j) - 1, l->buckets[j]);
+    }
+  }
+  if (reads_merged > 0)
+    nbdkit_debug ("  %" PRIu64 " reads merged into %" PRIu64 " calls",
+                  reads_merged, merged_read_calls);
 }
@@ -96,6 +96,7 @@ char *libdir;                          /* libdir */
 uint16_t nfc_host_port;                /* nfchostport */
 char *password;                        /* password */
 uint16_t port;                         /* port */
+unsigned queue_depth = 64;             /* queue-depth */
 const char *server_name;               /* server */
 bool single_link;                      /* single-link */
 const char *snapshot_moref;            /* snapshot */
@@ -270,6 +271,14 @@ vddk_config (const char *key, const char *value)
     if (nbdkit_parse_uint16_t ("port", value, &port) == -1)
       return -1;
   }
+  else if (strcmp (key, "queue-depth") == 0) {
+    if (nbdkit_parse_unsigned ("queue-depth", value, &queue_depth) == -1)
+      return -1;
+    if (queue_depth == 0) {
+      nbdkit_error ("queue-depth must be >= 1");
+      return -1;
+    }
+  }
   else if (strcmp (key, "reexeced_") == 0) {
     /* Special name because it is only for internal use. */
     reexeced = (char *)value;
@@ -72,6 +72,7 @@ extern const char *snapshot_moref;
 extern const char *thumb_print;
 extern const char *transport_modes;
 extern bool unbuffered;
+extern unsigned queue_depth;
 extern const char *username;
 extern const char *vmx_spec;
 
@@ -141,6 +142,7 @@ struct command {
   uint64_t id;                  /* serial number */
 
   /* These fields are used by the internal implementation. */
+  struct vddk_handle *h;        /* handle this command was sent on */
   pthread_mutex_t mutex;        /* completion mutex */
   pthread_cond_t cond;          /* completion condition */
   enum { SUBMITTED, SUCCEEDED, FAILED } status;
@@ -165,6 +167,7 @@ struct vddk_handle {
   command_queue commands;          /* command queue */
   pthread_cond_t commands_cond;    /* condition (queue size 0 -> 1) */
   uint64_t id;                     /* next command ID */
+  unsigned in_flight;              /* asynchronous reads/writes running */
 };
 
 /* reexec.c */
@@ -186,6 +189,8 @@ extern pthread_mutex_t stats_lock;
 #include "vddk-stubs.h"
 #undef STUB
 #undef OPTIONAL_STUB
+extern void record_latency (enum command_type type, int64_t usecs);
+extern void record_merged_reads (size_t nr_commands);
 extern void display_stats (void);
 
 /* utils.c */
@@ -35,7 +35,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <inttypes.h>
+#include <assert.h>
 
 #include <pthread.h>
 
@@ -72,10 +74,16 @@ command_type_string (enum command_type type)
 int
 send_command_and_wait (struct vddk_handle *h, struct command *cmd)
 {
+  struct timeval start_t, end_t;
+
+  if (vddk_debug_stats)
+    gettimeofday (&start_t, NULL);
+
   /* Add the command to the command queue. */
   {
     ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->commands_lock);
     cmd->id = h->id++;
+    cmd->h = h;
 
     if (command_queue_append (&h->commands, cmd) == -1)
       /* On error command_queue_append will call nbdkit_error. */
@@ -100,6 +108,11 @@ send_command_and_wait (struct vddk_handle *h, struct command *cmd)
   pthread_mutex_destroy (&cmd->mutex);
   pthread_cond_destroy (&cmd->cond);
 
+  if (vddk_debug_stats) {
+    gettimeofday (&end_t, NULL);
+    record_latency (cmd->type, tvdiff_usec (&start_t, &end_t));
+  }
+
   /* On error the background thread will call nbdkit_error. */
   switch (cmd->status) {
   case SUCCEEDED: return 0;
@@ -108,26 +121,41 @@ send_command_and_wait (struct vddk_handle *h, struct command *cmd)
   }
 }
 
+/* Retire a command and wake up the nbdkit thread waiting for it. */
+static void
+retire_command (struct command *cmd, bool ok)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cmd->mutex);
+  cmd->status = ok ? SUCCEEDED : FAILED;
+  pthread_cond_signal (&cmd->cond);
+}
+
+/* An asynchronous read or write has finished. */
+static void
+async_done (struct vddk_handle *h)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->commands_lock);
+  assert (h->in_flight > 0);
+  h->in_flight--;
+}
+
 /* Asynchronous commands are completed when this function is called. */
 static void
 complete_command (void *vp, VixError result)
 {
   struct command *cmd = vp;
+  struct vddk_handle *h = cmd->h;
 
   if (vddk_debug_datapath)
     nbdkit_debug ("command %" PRIu64 " completed", cmd->id);
 
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cmd->mutex);
-
-  if (result == VIX_OK) {
-    cmd->status = SUCCEEDED;
-  } else {
+  if (result != VIX_OK)
     VDDK_ERROR (result, "command %" PRIu64 ": asynchronous %s failed",
                 cmd->id, command_type_string (cmd->type));
-    cmd->status = FAILED;
-  }
 
-  pthread_cond_signal (&cmd->cond);
+  /* cmd may be freed as soon as it is retired. */
+  retire_command (cmd, result == VIX_OK);
+  async_done (h);
 }
 
 /* Wait for any asynchronous commands to complete. */
@@ -231,6 +259,161 @@ do_read (struct command *cmd, struct vddk_handle *h)
   return 0;
 }
 
+/* Adjacent reads waiting in the command queue are merged into a
+ * single VixDiskLib_ReadAsync call of up to this many bytes.
+ */
+#define MAX_MERGED_READ (4 * 1024 * 1024)
+
+/* A read covering several adjacent read commands. */
+struct merged_read {
+  struct vddk_handle *h;
+  command_queue cmds;           /* commands in order of offset */
+  uint64_t offset;
+  uint32_t count;
+  unsigned char *buf;
+};
+
+static void
+free_merged_read (struct merged_read *m)
+{
+  command_queue_reset (&m->cmds);
+  free (m->buf);
+  free (m);
+}
+
+static void
+complete_merged_read (void *vp, VixError result)
+{
+  struct merged_read *m = vp;
+  struct vddk_handle *h = m->h;
+  size_t i;
+
+  if (vddk_debug_datapath)
+    nbdkit_debug ("merged read of %zu commands completed", m->cmds.len);
+
+  if (result != VIX_OK)
+    VDDK_ERROR (result, "asynchronous merged read failed");
+
+  for (i = 0; i < m->cmds.len; ++i) {
+    struct command *cmd = m->cmds.ptr[i];
+
+    if (result == VIX_OK)
+      memcpy (cmd->ptr, m->buf + (cmd->offset - m->offset), cmd->count);
+    retire_command (cmd, result == VIX_OK);
+  }
+  free_merged_read (m);
+  async_done (h);
+}
+
+/* Called with commands_lock held.  Look for reads in the queue which
+ * directly follow cmd and remove them from the queue.  Returns NULL
+ * if there are none (or on error, when cmd is sent on its own).
+ */
+static struct merged_read *
+find_adjacent_reads (struct vddk_handle *h, struct command *cmd)
+{
+  struct merged_read *m;
+  uint64_t end = cmd->offset + cmd->count;
+  bool found;
+  size_t i;
+
+  if (!IS_ALIGNED (cmd->offset | cmd->count, VIXDISKLIB_SECTOR_SIZE))
+    return NULL;
+
+  m = calloc (1, sizeof *m);
+  if (m == NULL)
+    return NULL;
+  m->h = h;
+  m->offset = cmd->offset;
+  m->count = cmd->count;
+  if (command_queue_append (&m->cmds, cmd) == -1) {
+    free (m);
+    return NULL;
+  }
+
+  do {
+    found = false;
+    for (i = 0; i < h->commands.len; ++i) {
+      struct command *next = h->commands.ptr[i];
+
+      if (next->type == READ && next->offset == end &&
+          IS_ALIGNED (next->count, VIXDISKLIB_SECTOR_SIZE) &&
+          (uint64_t) m->count + next->count <= MAX_MERGED_READ) {
+        if (command_queue_append (&m->cmds, next) == -1)
+          break;
+        command_queue_remove (&h->commands, i);
+        m->count += next->count;
+        end += next->count;
+        found = true;
+        break;
+      }
+    }
+  } while (found);
+
+  if (m->cmds.len == 1) {
+    free_merged_read (m);
+    return NULL;
+  }
+  return m;
+}
+
+static int
+do_merged_read (struct merged_read *m, struct vddk_handle *h)
+{
+  VixError err;
+  uint64_t offset = m->offset / VIXDISKLIB_SECTOR_SIZE;
+  uint32_t count = m->count / VIXDISKLIB_SECTOR_SIZE;
+  size_t nr_cmds = m->cmds.len;
+
+  m->buf = malloc (m->count);
+  if (m->buf == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+
+  /* Once submitted, m is owned (and freed) by the callback. */
+  VDDK_CALL_START (VixDiskLib_ReadAsync,
+                   "handle, %" PRIu64 " sectors, "
+                   "%" PRIu32 " sectors, buffer, callback, "
+                   "%zu merged commands",
+                   offset, count, nr_cmds)
+    err = VixDiskLib_ReadAsync (h->handle, offset, count, m->buf,
+                                complete_merged_read, m);
+  VDDK_CALL_END (VixDiskLib_ReadAsync, count * VIXDISKLIB_SECTOR_SIZE);
+  if (err != VIX_ASYNC) {
+    VDDK_ERROR (err, "VixDiskLib_ReadAsync");
+    return -1;
+  }
+
+  record_merged_reads (nr_cmds);
+  return 0;
+}
+
+/* Limit the number of asynchronous reads and writes in flight.  VDDK
+ * may only run completion callbacks from inside VDDK calls made by
+ * this thread, so we cannot simply sleep until the count drops.
+ * Instead wait for all outstanding requests to finish.
+ */
+static void
+limit_in_flight (struct vddk_handle *h)
+{
+  VixError err;
+  unsigned n;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->commands_lock);
+    n = h->in_flight;
+  }
+  if (n < queue_depth)
+    return;
+
+  VDDK_CALL_START (VixDiskLib_Wait, "handle")
+    err = VixDiskLib_Wait (h->handle);
+  VDDK_CALL_END (VixDiskLib_Wait, 0);
+  if (err != VIX_OK)
+    VDDK_ERROR (err, "VixDiskLib_Wait");
+}
+
 static int
 do_write (struct command *cmd, struct vddk_handle *h)
 {
@@ -487,6 +670,7 @@ vddk_worker_thread (void *handle)
 
   while (!stop) {
     struct command *cmd;
+    struct merged_read *m = NULL;
     int r;
     bool async = false;
 
@@ -499,6 +683,15 @@ vddk_worker_thread (void *handle)
       command_queue_remove (&h->commands, 0);
     }
 
+    if (cmd->type == READ || cmd->type == WRITE) {
+      limit_in_flight (h);
+
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->commands_lock);
+      if (cmd->type == READ)
+        m = find_adjacent_reads (h, cmd);
+      h->in_flight++;
+    }
+
     switch (cmd->type) {
     case STOP:
       r = do_stop (cmd, h);
@@ -510,15 +703,33 @@ vddk_worker_thread (void *handle)
       break;
 
     case READ:
-      r = do_read (cmd, h);
+      if (m) {
+        r = do_merged_read (m, h);
+        if (r == -1) {
+          /* Fail all the merged commands here.  The first command
+           * (cmd) is retired below.
+           */
+          size_t i;
+
+          for (i = 1; i < m->cmds.len; ++i)
+            retire_command (m->cmds.ptr[i], false);
+          free_merged_read (m);
+        }
+      }
+      else
+        r = do_read (cmd, h);
       /* If async is true, don't retire this command now. */
       async = r == 0;
+      if (!async)
+        async_done (h);
       break;
 
     case WRITE:
       r = do_write (cmd, h);
       /* If async is true, don't retire this command now. */
       async = r == 0;
+      if (!async)
+        async_done (h);
       break;
 
     case FLUSH:
@@ -538,17 +749,12 @@ vddk_worker_thread (void *handle)
     default: abort (); /* impossible, but keeps GCC happy */
     } /* switch */
 
-    if (!async) {
-      /* Update the command status. */
-      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cmd->mutex);
-      cmd->status = r >= 0 ? SUCCEEDED : FAILED;
-
-      /* For synchronous commands signal the caller thread that the
-       * command has completed.  (Asynchronous commands are completed in
-       * the callback handler).
-       */
-      pthread_cond_signal (&cmd->cond);
-    }
+    /* For synchronous commands signal the caller thread that the
+     * command has completed.  (Asynchronous commands are completed in
+     * the callback handler).
+     */
+    if (!async)
+      retire_command (cmd, r >= 0);
   } /* while (!stop) */
 
   /* Exit the worker thread. */
@@ -174,12 +174,15 @@ run_command (void)
     case 0:
       /* Captive nbdkit is still running; kill it.  We want to wait
        * for nbdkit to exit since that ensures all cleanup is done in
-       * the plugin before we return.  However we don't care if nbdkit
-       * returns an error, the exit code we return always comes from
-       * the --run command.
+       * the plugin before we return.  The exit code normally comes
+       * from the --run command, but if the command succeeded and
+       * nbdkit failed during cleanup (eg. a plugin or filter reported
+       * an error from .cleanup) then we must not report success.
        */
       kill (pid, SIGTERM);
-      waitpid (pid, NULL, 0);
+      if (waitpid (pid, &status, 0) == pid &&
+          r == 0 && WIFEXITED (status))
+        r = WEXITSTATUS (status);
       break;
     default:
       /* Captive nbdkit exited unexpectedly; update the exit status. */
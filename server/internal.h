@@ -319,6 +319,8 @@ extern void apply_debug_flags (void *dl, const char *name);
 extern void free_debug_flags (void);
 
 /* log.c */
+extern void log_start_cleanup (void);
+extern bool log_end_cleanup (void);
 extern void log_verror (const char *fs, va_list args);
 
 /* log-*.c */
@@ -40,6 +40,31 @@
 
 #include "internal.h"
 
+/* While the backends are being cleaned up, any error reported (from
+ * any thread) is recorded so that nbdkit can exit with a non-zero
+ * status.  Plugins and filters can have no other way to report that
+ * their .cleanup callback failed.
+ */
+static pthread_mutex_t cleanup_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool in_cleanup;         /* Protected by cleanup_lock. */
+static bool cleanup_failed;     /* Protected by cleanup_lock. */
+
+void
+log_start_cleanup (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cleanup_lock);
+  in_cleanup = true;
+}
+
+/* Returns true if any error was reported since log_start_cleanup. */
+bool
+log_end_cleanup (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cleanup_lock);
+  in_cleanup = false;
+  return cleanup_failed;
+}
+
 /* Call the right log_*_verror function depending on log_sink.
  * Note: preserves the previous value of errno.
  */
@@ -69,6 +94,11 @@ log_verror (const char *fs, va_list args)
 NBDKIT_DLL_PUBLIC void
 nbdkit_verror (const char *fs, va_list args)
 {
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cleanup_lock);
+    if (in_cleanup)
+      cleanup_failed = true;
+  }
   log_verror (fs, args);
 }
 
@@ -215,6 +215,7 @@ main (int argc, char *argv[])
   bool help = false, version = false, dump_plugin = false;
   int tls_set_on_cli = false;
   bool short_name;
+  bool cleanup_failed;
   const char *filename;
   char *p;
   static struct filter_filename {
@@ -754,7 +755,9 @@ main (int argc, char *argv[])
 
   start_serving ();
 
+  log_start_cleanup ();
   top->cleanup (top);
+  cleanup_failed = log_end_cleanup ();
   top->free (top);
   top = NULL;
 
@@ -779,7 +782,7 @@ main (int argc, char *argv[])
   /* Note: Don't exit here, otherwise this won't work when compiled
    * for libFuzzer.
    */
-  return EXIT_SUCCESS;
+  return cleanup_failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 /* Implementation of '-U -' */
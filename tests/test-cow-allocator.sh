@@ -0,0 +1,74 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter cow
+requires_plugin memory
+requires_nbdsh_uri
+
+# Test the in-memory overlay, with and without spilling to the
+# temporary file.
+for args in "cow-allocator=sparse" \
+            "cow-allocator=malloc" \
+            "cow-allocator=sparse cow-memory-limit=128K" \
+            "cow-allocator=sparse cow-memory-limit=128K cow-on-read=true"
+do
+    nbdkit -U - --filter=cow memory 1M $args \
+           --run '
+nbdsh -u "$uri" -c "
+# Write enough data to exceed cow-memory-limit.
+buf = b\"abcd\" * 131072
+h.pwrite(buf, 65536)
+assert h.pread(65536, 0) == bytearray(65536)
+assert h.pread(len(buf), 65536) == buf
+
+# Trim must release the blocks and read back as zeroes.
+h.trim(262144, 65536)
+assert h.pread(262144, 65536) == bytearray(262144)
+assert h.pread(65536, 327680) == b\"abcd\" * 16384
+
+# Unaligned writes.
+h.pwrite(b\"hello\", 65541)
+assert h.pread(10, 65536) == bytearray(5) + b\"hello\"
+"
+'
+done
+
+# cow-memory-limit is only valid with an in-memory allocator.
+if nbdkit -U - --filter=cow memory 1M cow-memory-limit=128K --run true; then
+    echo "$0: expected cow-memory-limit with cow-allocator=file to fail"
+    exit 1
+fi
@@ -0,0 +1,106 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter cow
+requires_plugin file
+requires_plugin pattern
+requires_nbdsh_uri
+requires truncate --version
+requires cmp --version
+
+files="cow-save.img cow-save.orig cow-save.overlay cow-save.overlay.tmp"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Create a base image containing some non-zero data.  The second
+# region is trimmed below so that the trim is visible.
+truncate -s 4M cow-save.img
+printf 'base%.0s' {1..1024} | dd of=cow-save.img conv=notrunc
+printf 'trim%.0s' {1..1024} |
+    dd of=cow-save.img bs=1M seek=1 conv=notrunc
+cp cow-save.img cow-save.orig
+
+# Make some changes and save the overlay on exit.
+nbdkit -U - --filter=cow file cow-save.img cow-save=cow-save.overlay \
+       --run '
+nbdsh -u "$uri" -c "
+h.pwrite(b\"hello\" * 1000, 65536 + 1)
+h.trim(1048576, 1048576)
+"
+'
+test -f cow-save.overlay
+cmp cow-save.img cow-save.orig
+
+# Reload the overlay and check the changes are visible.
+nbdkit -U - --filter=cow file cow-save.img cow-load=cow-save.overlay \
+       --run '
+nbdsh -u "$uri" -c "
+assert h.pread(4, 0) == b\"base\"
+assert h.pread(5000, 65536 + 1) == b\"hello\" * 1000
+assert h.pread(1048576, 1048576) == bytearray(1048576)
+"
+'
+cmp cow-save.img cow-save.orig
+
+# Commit the overlay back to the base image.
+nbdkit -U - --filter=cow file cow-save.img \
+       cow-load=cow-save.overlay cow-commit=true cow-commit-threads=2 \
+       --run true
+if cmp cow-save.img cow-save.orig; then
+    echo "$0: expected the base image to be modified by cow-commit"
+    exit 1
+fi
+nbdkit -U - file cow-save.img --run '
+nbdsh -u "$uri" -c "
+assert h.pread(4, 0) == b\"base\"
+assert h.pread(5000, 65536 + 1) == b\"hello\" * 1000
+assert h.pread(1048576, 1048576) == bytearray(1048576)
+"
+'
+
+# Failing to commit or save the overlay must make nbdkit exit with an
+# error, even when the --run command succeeded.
+if nbdkit -U - --filter=cow pattern 4M cow-commit=true --run true; then
+    echo "$0: expected cow-commit to a read-only plugin to fail"
+    exit 1
+fi
+if nbdkit -U - --filter=cow file cow-save.img \
+          cow-save=cow-save.d/missing/cow-save.overlay \
+          --run 'nbdsh -u "$uri" -c "h.pwrite(b\"x\", 0)"'; then
+    echo "$0: expected cow-save to a missing directory to fail"
+    exit 1
+fi
@@ -0,0 +1,88 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test lazy evaluation of large repeats, fills and files in the data
+# plugin, including writes over the lazily evaluated regions.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_run
+requires_nbdsh_uri
+
+file=data-lazy.bin
+rm -f $file
+cleanup_fn rm -f $file
+
+# 3 MB file containing an incrementing pattern.
+for i in {0..199999}; do printf "%014d\n" $i; done > $file
+
+# This 1 TB disk could not be created if the repeat was expanded.
+nbdkit -U - -v \
+       data '( 0x55 0xAA ) * 549755813888' \
+       --run 'nbdsh -u "$uri" -c "
+assert h.get_size() == 2**40
+assert h.pread(5, 2**39 + 1) == b\"\xaa\x55\xaa\x55\xaa\"
+h.pwrite(b\"hello\", 1000001)
+assert h.pread(7, 1000000) == b\"\x55hello\x55\"
+h.zero(10, 5)
+assert h.pread(12, 4) == b\"\x55\" + bytes(10) + b\"\xaa\"
+"'
+
+for allocator in sparse malloc; do
+    nbdkit -U - -v \
+           data "
+             <$file
+             0x11 * 2000000 @-1000000 \"hello\"
+             ( 1 * 1500000 \"x\" ) * 3
+             ( \"abc\" ) * 1000000 [10:2999990]
+             <$file[100:2000000]
+           " allocator=$allocator \
+           --run 'nbdsh -u "$uri" -c "
+f = open(\"'$file'\", \"rb\").read()
+b = bytearray(b\"\x11\" * 2000000)
+b[1000000:1000005] = b\"hello\"
+expected = f + bytes(b[:1000005]) + (b\"\x01\" * 1500000 + b\"x\") * 3 + \
+    (b\"abc\" * 1000000)[10:2999990] + f[100:2000000]
+assert h.get_size() == len(expected)
+assert h.pread(len(expected), 0) == expected
+
+# Write across the boundaries of lazily evaluated regions.
+for off in [len(f) - 10, 4000000, len(expected) - 2000005]:
+    h.pwrite(b\"W\" * 1000, off)
+    expected = expected[:off] + b\"W\" * 1000 + expected[off+1000:]
+h.trim(65536, 5000000)
+expected = expected[:5000000] + bytes(65536) + expected[5065536:]
+assert h.pread(len(expected), 0) == expected
+"'
+done
@@ -0,0 +1,87 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the floppy plugin serving more host files than it keeps open,
+# with reads which span several files.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin floppy
+requires_nbdsh_uri
+
+d=floppy-many-files.d
+log=floppy-many-files.log
+rm -rf $d $log
+cleanup_fn rm -rf $d $log
+mkdir $d
+
+# Create 100 files each the size of one cluster (16K) so that they
+# are stored contiguously, each with different content.  The plugin
+# only keeps 64 files open at a time.
+for i in $(seq 100 199); do
+    yes "file$i" | head -c 16384 > $d/file$i
+done
+
+nbdkit -fv -U - floppy $d --run 'nbdsh -u "$uri" -c "
+import os
+
+d = \"'$d'\"
+files = {}
+for name in os.listdir(d):
+    with open(os.path.join(d, name), \"rb\") as f:
+        files[name] = f.read()
+
+# Read the whole disk in large requests, so most reads span several
+# files, and find where each file is stored.
+size = h.get_size()
+disk = bytearray()
+for offset in range(0, size, 3 * 1024 * 1024):
+    disk += h.pread(min(3 * 1024 * 1024, size - offset), offset)
+offsets = {}
+for name, data in files.items():
+    offsets[name] = disk.find(data)
+    assert offsets[name] >= 0, name
+
+# Read across the boundaries between files in random order, which
+# causes files to be opened and closed again.
+names = sorted(files, key=lambda n: offsets[n])
+for j in range(200):
+    k = (j * 37) % (len(names) - 2)
+    start = offsets[names[k]] + 1000
+    end = offsets[names[k+2]] + 1000
+    assert h.pread(end - start, start) == disk[start:end]
+"' 2>$log
+
+cat $log
+grep "fdcache: .* evictions [1-9]" $log
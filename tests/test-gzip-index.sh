@@ -0,0 +1,99 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+set -x
+
+# Test the gzip filter random access index, and saving and loading
+# the index file.
+
+requires_filter gzip
+requires_nbdcopy
+requires gzip --version
+requires cmp --version
+
+files="gzip-index.img gzip-index.img.gz gzip-index.idx gzip-index.out"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Create a partly compressible file.
+for i in $(seq 1 50000); do echo "line $i of the gzip index test"; done \
+    > gzip-index.img
+dd if=/dev/urandom bs=1024 count=512 >> gzip-index.img
+gzip -9 --keep gzip-index.img
+
+# The first run builds the index and saves it.
+nbdkit -U - --filter=gzip file gzip-index.img.gz \
+       gzip-span=64K gzip-index=gzip-index.idx \
+       --run 'nbdcopy --connections=2 --request-size=20000 \
+                      "$uri" gzip-index.out'
+test -f gzip-index.idx
+cmp gzip-index.img gzip-index.out
+
+# The second run loads the index.
+rm gzip-index.out
+nbdkit -U - --filter=gzip file gzip-index.img.gz \
+       gzip-index=gzip-index.idx \
+       --run 'nbdcopy "$uri" gzip-index.out'
+cmp gzip-index.img gzip-index.out
+
+# Corrupt index files must be rejected.  The header is 48 bytes,
+# followed by each access point (24 bytes) and its 32K window.
+cp gzip-index.idx gzip-index.good
+cleanup_fn rm -f gzip-index.good
+corrupt ()
+{
+    cp gzip-index.good gzip-index.idx
+    printf "$1" | dd of=gzip-index.idx bs=1 seek=$2 conv=notrunc
+    if nbdkit -U - --filter=gzip file gzip-index.img.gz \
+              gzip-index=gzip-index.idx \
+              --run 'nbdcopy "$uri" gzip-index.out'; then
+        echo "$0: expected corrupt index to be rejected"
+        exit 1
+    fi
+}
+# First access point does not start at offset 0.
+corrupt '\001' 55
+# Second access point has a smaller compressed offset than the first.
+corrupt '\000\000\000\000\000\000\000\000' $(( 48 + 24 + 32768 + 8 ))
+# Uncompressed size is implausibly large, so the last span would be.
+corrupt '\001' 26
+# Truncated.
+cp gzip-index.good gzip-index.idx
+truncate -s -1 gzip-index.idx
+if nbdkit -U - --filter=gzip file gzip-index.img.gz \
+          gzip-index=gzip-index.idx \
+          --run 'nbdcopy "$uri" gzip-index.out'; then
+    echo "$0: expected truncated index to be rejected"
+    exit 1
+fi
@@ -0,0 +1,167 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the ISO plugin with the image built in-process.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin iso
+requires_nbdsh_uri
+
+d=iso-native.d
+rm -rf $d
+cleanup_fn rm -rf $d
+
+mkdir -p $d/dir1/sub $d/dir2/sub
+echo hello > $d/dir1/hello.txt
+echo merged > $d/dir2/sub/merged.txt
+: > $d/dir1/empty
+export long=$(printf 'x%.0s' {1..200})
+echo long > $d/dir1/sub/$long
+
+# Walk the directory records in the primary tree using the Rock Ridge
+# names, and check the file contents.
+nbdkit -U - iso $d/dir1 $d/dir2 label=testlabel \
+       --run 'nbdsh -u "$uri" -c "
+import struct
+
+def pread(count, offset):
+    return h.pread(count, offset) if count > 0 else b\"\"
+
+pvd = pread(2048, 16*2048)
+assert pvd[1:6] == b\"CD001\"
+assert pvd[40:72].rstrip() == b\"TESTLABEL\"
+assert pread(2048, 17*2048)[1:6] == b\"CD001\"
+assert pread(2048, 18*2048)[0] == 255
+
+def su_entries(su):
+    while len(su) >= 4 and su[2] > 0:
+        yield su[0:2], su[4:su[2]]
+        if su[0:2] == b\"CE\":
+            ext, off, n = [struct.unpack(\"<I\", su[i:i+4])[0]
+                           for i in (4, 12, 20)]
+            yield from su_entries(pread(n, ext*2048 + off))
+        su = su[su[2]:]
+
+def readdir(ext, size):
+    data = pread(size, ext*2048)
+    i = 0
+    while i < len(data):
+        n = data[i]
+        if n == 0:
+            i = (i // 2048 + 1) * 2048
+            continue
+        r = data[i:i+n]
+        ext, size = struct.unpack(\"<I\", r[2:6])[0], struct.unpack(\"<I\", r[10:14])[0]
+        id_len = r[32]
+        su = r[33 + id_len + (0 if id_len & 1 else 1):]
+        name = b\"\".join(v[1:] for k, v in su_entries(su) if k == b\"NM\")
+        if name:
+            yield name.decode(), ext, size, r[25] & 2
+        i += n
+
+def walk(ext, size, path):
+    for name, ext, size, is_dir in readdir(ext, size):
+        if is_dir:
+            yield from walk(ext, size, path + name + \"/\")
+        else:
+            yield path + name, pread(size, ext*2048)
+
+root = struct.unpack(\"<I\", pvd[158:162])[0], struct.unpack(\"<I\", pvd[166:170])[0]
+files = dict(walk(*root, \"/\"))
+print(files)
+assert files == {
+    \"/hello.txt\": b\"hello\\n\",
+    \"/empty\": b\"\",
+    \"/sub/merged.txt\": b\"merged\\n\",
+    \"/sub/$long\": b\"long\\n\",
+}
+"'
+
+# If bsdtar is available, check the image with a real ISO reader:
+# the Rock Ridge tree, the Joliet tree (used by bsdtar when Rock Ridge
+# is disabled), and a file larger than 4G which has to be split into
+# several extents.
+if bsdtar --version >/dev/null 2>&1 &&
+   nbdcopy --version >/dev/null 2>&1 &&
+   mkdir $d/dir4 &&
+   truncate -s 4G $d/dir4/big; then
+    echo tail >> $d/dir4/big
+
+    nbdkit -U - iso $d/dir1 $d/dir2 --run "nbdcopy \"\$uri\" $d/small.iso"
+    bsdtar -tf $d/small.iso | LC_ALL=C sort > $d/rr
+    cat $d/rr
+    diff -u - $d/rr <<EOF
+.
+empty
+hello.txt
+sub
+sub/merged.txt
+sub/$long
+EOF
+    test "$(bsdtar -xOf $d/small.iso hello.txt)" = "hello"
+
+    # Joliet names are truncated to 64 characters including ";1".
+    bsdtar --options '!rockridge' -tf $d/small.iso |
+        LC_ALL=C sort > $d/joliet
+    cat $d/joliet
+    diff -u - $d/joliet <<EOF
+.
+empty
+hello.txt
+sub
+sub/merged.txt
+sub/${long:0:62}
+EOF
+    test "$(bsdtar --options '!rockridge' -xOf $d/small.iso \
+                   sub/merged.txt)" = "merged"
+
+    nbdkit -U - iso $d/dir4 --run "nbdcopy \"\$uri\" $d/big.iso"
+    for opts in rockridge '!rockridge'; do
+        bsdtar --options "$opts" -tvf $d/big.iso | grep ' 4294967301 .* big$'
+        test "$(bsdtar --options "$opts" -xOf $d/big.iso big | tail -c 5)" = \
+             "tail"
+    done
+else
+    echo "$0: bsdtar, nbdcopy or large sparse files not available,"
+    echo "$0: not checking the image with bsdtar"
+fi
+
+# Merging a file and a directory with the same name is an error.
+mkdir $d/dir3
+echo file > $d/dir3/sub
+if nbdkit -U - iso $d/dir1 $d/dir3 --run true; then
+    echo "$0: expected nbdkit to fail"
+    exit 1
+fi
@@ -36,6 +36,7 @@ source ./functions.sh
 set -e
 
 requires_plugin iso
+requires sh -c 'nbdkit iso --dump-plugin | grep ^iso_prog='
 requires guestfish --version
 
 sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
@@ -0,0 +1,88 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the linuxdisk plugin with virtual=true, which synthesizes the
+# ext4 filesystem instead of running mke2fs.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin linuxdisk
+requires_nbdcopy
+requires e2fsck -V
+requires debugfs -V
+requires mkfifo --version
+requires truncate --version
+
+d=linuxdisk-virtual.d
+img=linuxdisk-virtual.img
+rm -rf $d $img
+cleanup_fn rm -rf $d $img
+
+# Create a test directory with some regular files, subdirectories and
+# special files.  The large sparse file needs an extent tree block.
+mkdir $d
+mkfifo $d/fifo
+mkdir $d/sub $d/empty
+cp $srcdir/Makefile.am $d/sub/Makefile.am
+ln $d/sub/Makefile.am $d/sub/hardlink
+ln -s Makefile.am $d/sub/symlink
+ln -s "$(printf 'x/%.0s' {1..50})target" $d/sub/longlink
+truncate -s 600M $d/sparse
+echo end >> $d/sparse
+for i in {1..300}; do echo $i > $d/sub/file-with-a-long-name-$i; done
+
+nbdkit -f -v -U - \
+       --filter=partition \
+       linuxdisk $d virtual=true label=VIRTUAL partition=1 \
+       --run 'nbdcopy "$uri" '$img
+
+# The filesystem must be clean.
+e2fsck -fn $img
+
+# Check the file contents.
+debugfs -R "dump /sub/Makefile.am $d/Makefile.am" $img
+cmp $d/Makefile.am $srcdir/Makefile.am
+debugfs -R "dump /sparse $d/sparse.out" $img
+cmp $d/sparse $d/sparse.out
+debugfs -R "cat /sub/file-with-a-long-name-300" $img | grep '^300$'
+
+# Check hard links, symbolic links and special files.
+debugfs -R "stat /sub/hardlink" $img > $d/stat
+grep "Links: 2" $d/stat
+debugfs -R "stat /sub/symlink" $img > $d/stat
+grep 'Fast link dest: "Makefile.am"' $d/stat
+debugfs -R "cat /sub/longlink" $img | grep 'x/x/target'
+debugfs -R "stat /fifo" $img > $d/stat
+grep "Type: FIFO" $d/stat
+debugfs -R "ls -l /empty" $img
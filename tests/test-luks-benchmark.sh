@@ -0,0 +1,73 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Benchmark decryption through the luks filter (XTS-AES-256), with
+# and without the crypto worker threads.  This only reports the
+# throughput, it does not fail if one is slower than the other.  It
+# is only run by 'make bench'.
+
+source ./functions.sh
+set -e
+set -x
+
+requires test "x$NBDKIT_BENCH" = "x1"
+requires_run
+requires_nbdcopy
+requires qemu-img --version
+requires_filter luks
+requires_plugin file
+
+# Test fails on macOS (darwin) because of:
+# qemu-img: luks-copy-zero1.img: Unsupported cipher mode xts
+requires_not test "$(uname)" = "Darwin"
+
+disk=luks-benchmark.img
+cleanup_fn rm -f $disk
+rm -f $disk
+
+size_mb=256
+
+qemu-img create -f luks \
+         --object secret,data=123456,id=sec0 \
+         -o key-secret=sec0,cipher-alg=aes-256,cipher-mode=xts \
+         $disk ${size_mb}M
+
+# Use large requests so the filter can batch and split the work.
+for threads in 1 4; do
+    TIMEFORMAT=%R
+    secs="$( { time nbdkit -U - file $disk \
+                    --filter=luks passphrase=123456 luks-threads=$threads \
+                    --run 'nbdcopy --request-size=4194304 "$uri" null:' \
+                    >&2 ; } 2>&1 | tail -1 )"
+    echo "$0: luks-threads=$threads: decrypted $size_mb MB in $secs s," \
+         "$(awk "BEGIN { printf \"%.1f\", $size_mb / ($secs + 0.001) }") MB/s"
+done
@@ -0,0 +1,97 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test unaligned writes through the luks filter, which have to read,
+# decrypt, modify, encrypt and write back the partial sectors.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdsh --version
+requires_nbdsh_uri
+requires qemu-img --version
+requires bash -c 'qemu-img --help | grep -- --target-image-opts'
+requires cmp --version
+requires $TRUNCATE --version
+requires_filter luks
+
+# Test fails on macOS (darwin) because of:
+# qemu-img: luks-copy-zero1.img: Unsupported cipher mode xts
+requires_not test "$(uname)" = "Darwin"
+
+encrypt_disk=luks-unaligned1.img
+plain_disk=luks-unaligned2.img
+expected=luks-unaligned3.img
+files="$encrypt_disk $plain_disk $expected"
+cleanup_fn rm -f $files
+rm -f $files
+
+# Create an encrypted disk containing known plaintext, so that any
+# corruption of the parts of sectors which are not written is seen.
+qemu-img create -f luks \
+         --object secret,data=123456,id=sec0 \
+         -o key-secret=sec0 \
+         $encrypt_disk 1M
+for i in $(seq 0 4095); do printf '%0255d\n' $i; done > $plain_disk
+qemu-img convert --target-image-opts -n \
+         --object secret,data=123456,id=sec0 \
+         $plain_disk \
+         driver=luks,file.filename=$encrypt_disk,key-secret=sec0
+
+# Make unaligned writes: within a sector, across two sectors, and
+# with an unaligned head and tail around an aligned body.  Keep a
+# copy of the expected plaintext and compare it with what we read
+# back through the filter.
+nbdkit -U - file $encrypt_disk --filter=luks passphrase=123456 \
+       --run 'nbdsh -u "$uri" -c "
+with open(\"'$plain_disk'\", \"rb\") as f:
+    data = bytearray(f.read())
+for (c, n, offset) in [(b\"A\", 100, 1),
+                       (b\"B\", 1000, 4000),
+                       (b\"C\", 9000, 10000),
+                       (b\"D\", 511, 1048576 - 511)]:
+    h.pwrite(c * n, offset)
+    data[offset:offset+n] = c * n
+assert h.pread(len(data), 0) == data
+h.flush()
+with open(\"'$expected'\", \"wb\") as f:
+    f.write(data)
+"'
+
+# Check the result using qemu as well.
+rm $plain_disk
+qemu-img convert --image-opts \
+         --object secret,data=123456,id=sec0 \
+         driver=luks,file.filename=$encrypt_disk,key-secret=sec0 \
+         $plain_disk
+cmp $plain_disk $expected
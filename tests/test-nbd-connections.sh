@@ -0,0 +1,92 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the nbd plugin connections parameter.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin nbd
+requires_filter multi-conn
+requires_filter log
+requires_filter delay
+requires nbdsh --version
+requires_nbdsh_uri
+
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+pid=test-nbd-connections.pid
+log=test-nbd-connections.log
+ulog=test-nbd-connections-upstream.log
+files="$sock $pid $log $ulog"
+rm -f $files
+cleanup_fn rm -f $files
+
+# The memory plugin advertises multi-conn, so all the connections
+# should be opened and the data written across them should read back
+# consistently after a flush.  The writes are issued concurrently and
+# delayed by the server, so that they are spread over more than one
+# upstream connection.
+start_nbdkit -P $pid -U $sock \
+             --filter=log --filter=delay memory 1M \
+             logfile=$ulog delay-write=100ms
+
+nbdkit -U - -v nbd socket=$sock connections=4 \
+       --run '
+    nbdsh -u "$uri" -c "
+for i in range(64):
+    h.aio_pwrite(bytes([i]) * 4096, i * 4096)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+h.flush()
+for i in range(64):
+    assert h.pread(4096, i * 4096) == bytes([i]) * 4096
+"
+' 2>$log
+cat $log
+grep "opened 4 connections to server" $log
+
+# Check that more than one upstream connection carried writes.
+cat $ulog
+test "$(grep -o 'connection=[0-9]* Write ' $ulog | sort -u | wc -l)" -gt 1
+
+kill $(cat $pid)
+rm -f $sock $pid
+
+# Without multi-conn the plugin must fall back to one connection.
+start_nbdkit -P $pid -U $sock \
+             --filter=multi-conn memory 1M multi-conn-mode=disable
+
+nbdkit -U - -v nbd socket=$sock connections=4 \
+       --run 'nbdsh -u "$uri" -c "h.pwrite(b\"x\" * 512, 0)"' 2>$log
+cat $log
+grep "server does not support multi-conn" $log
@@ -0,0 +1 @@
+script=test-old-plugins-i686-Linux-v1.2.8-3-g0560f8f.sh exec $srcdir/test-old-plugins.sh i686-Linux-v1.2.8-3-g0560f8f
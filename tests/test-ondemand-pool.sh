@@ -0,0 +1,131 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the ondemand plugin pool=N parameter.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin ondemand
+requires_nbdsh_uri
+
+dir=$(mktemp -d /tmp/nbdkit-test-dir.XXXXXX)
+cleanup_fn rm -rf $dir
+
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+log=ondemand-pool.log
+files="ondemand-pool.pid $sock $log"
+rm -f $files
+cleanup_fn rm -f $files
+
+# The command logs each disk it creates, so we can tell which exports
+# were taken from the pool.
+start_nbdkit -P ondemand-pool.pid -U $sock \
+             ondemand dir=$dir size=1M wait=true pool=3 \
+             log=$PWD/$log \
+             command='truncate -s $size "$disk"; echo "$disk" >> "$log"'
+
+# Wait for the pool to fill up.
+for i in {1..60}; do
+    if [ "$(grep -c '/\.pool.*/disk$' $log)" -ge 3 ]; then break; fi
+    sleep 1
+done
+cat $log
+test "$(grep -c '/\.pool.*/disk$' $log)" -ge 3
+
+# The pool disks must not be listed as exports.
+nbdsh -c '
+h.set_opt_mode(True)
+h.connect_uri("nbd+unix://?socket='$sock'")
+exports = []
+h.opt_list(lambda name, desc: exports.append(name))
+h.opt_abort()
+print(exports)
+assert not any(e.startswith(".") for e in exports)
+'
+
+# Create three new exports.  These should all come from the pool.
+for e in export1 export2 export3; do
+    nbdsh -u "nbd+unix:///$e?socket=$sock" -c '
+assert h.get_size() == 1024 * 1024
+assert h.pread(1024 * 1024, 0) == bytearray(1024 * 1024)
+h.pwrite(b"hello", 0)
+'
+done
+ls -la $dir
+test -f $dir/export1
+test -f $dir/export2
+test -f $dir/export3
+cat $log
+if grep -E "/export[123]$" $log; then
+    echo "$0: expected exports to be created from the pool"
+    exit 1
+fi
+
+# Connect to the same new export from many clients at once.  Clients
+# which take a disk from the pool after another client has created
+# the export find that linking it into place fails with EEXIST.  Each
+# client writes at its own offset, so if any client was given a
+# different disk some of the data would be missing.
+pids=
+for i in {0..15}; do
+    nbdsh -u "nbd+unix:///race?socket=$sock" \
+          -c "h.pwrite(b\"client$i\".ljust(512), $i * 512)" &
+    pids="$pids $!"
+done
+for pid in $pids; do wait $pid; done
+
+nbdsh -u "nbd+unix:///race?socket=$sock" -c '
+for i in range(16):
+    assert h.pread(512, i * 512) == ("client%d" % i).encode().ljust(512)
+'
+
+# A dangling symlink makes opening the export fail with ENOENT, but
+# then linking the pool disk into place fails with EEXIST.  The
+# connection fails but the pool disk must still be removed.
+ln -s nonexistent $dir/dangling
+if nbdsh -u "nbd+unix:///dangling?socket=$sock" -c 'pass'; then
+    echo "$0: expected connection to dangling symlink to fail"
+    exit 1
+fi
+
+# The temporary directories of disks taken from the pool must have
+# been removed, leaving only the disks which are still in the pool.
+for i in {1..60}; do
+    if [ "$(ls -d $dir/.pool* | wc -l)" -eq 3 ]; then break; fi
+    sleep 1
+done
+ls -la $dir $dir/.pool*
+test "$(ls -d $dir/.pool* | wc -l)" -eq 3
+test "$(ls $dir | tr '\n' ' ')" = "dangling export1 export2 export3 race "
@@ -0,0 +1,70 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+set -x
+
+SCRIPT="$SRCDIR/python-subinterpreters.py"
+if ! test -d "$SRCDIR" || ! test -f "$SCRIPT"; then
+    echo "$0: could not locate python-subinterpreters.py"
+    exit 1
+fi
+
+skip_if_valgrind "because Python code leaks memory"
+requires nbdsh --version
+requires sh -c "nbdkit python --dump-plugin |
+                grep '^python_subinterpreters=yes'"
+
+pid=test-python-subinterpreters.pid
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="$pid $sock"
+rm -f $files
+cleanup_fn rm -f $files
+
+start_nbdkit -P $pid -U $sock python $SCRIPT greeting=hello
+
+export sock
+nbdsh -c '
+import os
+
+h.connect_unix(os.environ["sock"])
+h2 = nbd.NBD()
+h2.connect_unix(os.environ["sock"])
+
+# If the connections shared an interpreter then the second one
+# would see 2 opens.
+assert h.pread(8, 0) == b"hello 1\0"
+assert h2.pread(8, 0) == b"hello 1\0"
+
+h2.shutdown()
+'
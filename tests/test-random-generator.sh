@@ -0,0 +1,74 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the random plugin generator=2, checking that the output
+# matches the stream documented in nbdkit-random-plugin(1).
+
+source ./functions.sh
+set -e
+set -x
+
+requires_run
+requires_nbdsh_uri
+requires_plugin random
+
+nbdkit -U - random size=1M seed=12345 generator=2 \
+       --run 'nbdsh -u "$uri" -c "
+import errno
+
+def splitmix64(z):
+    M = 2**64 - 1
+    z = ((z ^ (z >> 30)) * 0xbf58476d1ce4e5b9) & M
+    z = ((z ^ (z >> 27)) * 0x94d049bb133111eb) & M
+    return z ^ (z >> 31)
+
+def expected(count, offset):
+    b = bytearray()
+    for i in range(offset // 8, (offset + count + 7) // 8):
+        z = (12345 + (i + 1) * 0x9e3779b97f4a7c15) & (2**64 - 1)
+        b += splitmix64(z).to_bytes(8, \"little\")
+    o = offset % 8
+    return bytes(b[o:o+count])
+
+# Aligned and unaligned requests.
+for count, offset in [(65536, 0), (1, 7), (13, 3), (4096, 512 * 1024 + 5),
+                      (8, 1024 * 1024 - 8), (3, 1024 * 1024 - 3)]:
+    assert h.pread(count, offset) == expected(count, offset)
+
+# Writing back the same data is allowed, anything else is an error.
+h.pwrite(expected(1000, 1001), 1001)
+try:
+    h.pwrite(bytes(1000), 1001)
+    assert False
+except nbd.Error as ex:
+    assert ex.errnum == errno.EIO
+"'
@@ -0,0 +1,87 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+set -x
+
+# Test the readahead filter with a plugin which does not support
+# parallel requests or caching.  The filter should prefetch into its
+# own buffer using a separate plugin context.
+
+requires_plugin sh
+requires_nbdsh_uri
+requires dd iflag=count_bytes,skip_bytes </dev/null
+
+files="readahead-buffer.out readahead-buffer.img"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Random data so we can check reads are served from the right place.
+dd if=/dev/urandom of=readahead-buffer.img bs=1M count=1
+
+nbdkit -fv -U - sh - \
+       --filter=readahead \
+       --run 'nbdsh --uri "$uri" -c "
+data = open(\"readahead-buffer.img\", \"rb\").read()
+for i in range(0, 4096*64, 4096):
+    assert h.pread(4096, i) == data[i:i+4096]
+# Reads which are not aligned to the prefetches.
+assert h.pread(10000, 3000) == data[3000:13000]
+assert h.pread(100000, 200000) == data[200000:300000]
+"' <<'EOF2'
+case "$1" in
+     thread_model)
+         echo serialize_requests
+         ;;
+     get_size)
+         echo 1M
+         ;;
+     pread)
+         echo "$@" >> readahead-buffer.out
+         dd if=readahead-buffer.img skip=$4 count=$3 \
+            iflag=count_bytes,skip_bytes
+         ;;
+     *)
+         exit 2
+         ;;
+esac
+EOF2
+
+cat readahead-buffer.out
+
+# Most of the 4K reads should have been served from the buffer, so we
+# should see far fewer than 64 small reads reaching the plugin, and
+# some larger prefetch reads.
+n="$(grep -c 'pread  4096 ' readahead-buffer.out)"
+test "$n" -lt 32
+grep 'pread  32768 4096' readahead-buffer.out
@@ -0,0 +1,102 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin sh
+requires_nbdsh_uri
+requires dd iflag=count_bytes </dev/null
+
+files="readahead-streams.out"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Two interleaved sequential readers on the same connection should be
+# detected as separate streams, each getting its own prefetches.
+nbdkit -fv -U - sh - \
+       --filter=readahead readahead-min=8K readahead-max=64K \
+       --run 'nbdsh --uri "$uri" -c "
+import time
+for i in range(0, 512*100, 512):
+    h.pread(512, i)
+    h.pread(512, 524288 + i)
+# Give some time for bgthread to finish.
+time.sleep(5)
+"' <<'EOF2'
+case "$1" in
+     block_size)
+         echo 512 512 512
+         ;;
+     thread_model)
+         echo parallel
+         ;;
+     can_cache)
+         echo native
+         ;;
+     get_size)
+         echo 1M
+         ;;
+     cache)
+         echo "$@" >> readahead-streams.out
+         ;;
+     pread)
+         echo "$@" >> readahead-streams.out
+         dd if=/dev/zero count=$3 iflag=count_bytes
+         ;;
+     *)
+         exit 2
+         ;;
+esac
+EOF2
+
+cat readahead-streams.out
+
+# The first prefetch of each stream uses readahead-min.
+grep "cache  8192 512" readahead-streams.out
+grep "cache  8192 524800" readahead-streams.out
+
+# Check that the window grew, and that no prefetch was larger than
+# readahead-max or overlapped another prefetch.
+grep cache readahead-streams.out |
+    sort -n -k3 |
+    awk '
+BEGIN { end = 0; max = 0 }
+{
+    if ($2 > 65536) { print "prefetch too large: " $0; exit 1 }
+    if ($3 < end) { print "overlapping prefetch: " $0; exit 1 }
+    end = $3 + $2
+    if ($2 > max) max = $2
+}
+END { if (max <= 8192) { print "window did not grow"; exit 1 } }
+'
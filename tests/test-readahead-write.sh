@@ -0,0 +1,81 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+set -x
+
+# Test that a prefetch which overlaps a slow write cannot leave stale
+# data in the readahead buffer after the write has completed.
+
+requires_plugin sh
+requires_nbdsh_uri
+requires dd iflag=count_bytes,skip_bytes </dev/null
+
+img=readahead-write.img
+rm -f $img
+cleanup_fn rm -f $img
+
+printf 'AAAA%.0s' {1..65536} > $img
+
+nbdkit -fv -U - sh - \
+       --filter=readahead \
+       --run 'nbdsh --uri "$uri" -c "
+# The write is slow, so the prefetch triggered by the read below
+# runs while it is in flight.
+c = h.aio_pwrite(b\"BBBB\" * 1024, 8192)
+assert h.pread(4096, 0) == b\"AAAA\" * 1024
+while not h.aio_command_completed(c):
+    h.poll(-1)
+assert h.pread(4096, 8192) == b\"BBBB\" * 1024
+"' <<'EOF2'
+case "$1" in
+     thread_model)
+         echo parallel
+         ;;
+     get_size)
+         echo 256K
+         ;;
+     can_write)
+         ;;
+     pread)
+         dd if=readahead-write.img skip=$4 count=$3 iflag=count_bytes,skip_bytes
+         ;;
+     pwrite)
+         sleep 2
+         dd of=readahead-write.img seek=$4 conv=notrunc oflag=seek_bytes
+         ;;
+     *)
+         exit 2
+         ;;
+esac
+EOF2
@@ -0,0 +1,147 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test nbdkit-s3native-plugin against a minimal S3-compatible server
+# (test-s3native/server.py) which checks the request signatures.
+
+source ./functions.sh
+set -e
+set -x
+
+requires $PYTHON --version
+requires_nbdcopy
+requires_plugin s3native
+
+portfile=s3native.port
+portfile2=s3native.port2
+log=s3native.log
+in=s3native.in
+out=s3native.out
+files="$portfile $portfile2 $log $in $out"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Some data which is not a multiple of the object size.
+$PYTHON -c 'import os, sys; sys.stdout.buffer.write(os.urandom(3000000))' > $in
+
+# Start a server and wait for it to write the port number.
+start_server ()
+{
+    local portfile="$1"; shift
+    $PYTHON $srcdir/test-s3native/server.py $portfile AK SK "$@" &
+    cleanup_fn kill $!
+    for i in {1..60}; do
+        if test -s $portfile; then break; fi
+        sleep 1
+    done
+}
+
+start_server $portfile --log=$log disk.img=$in
+endpoint="http://localhost:$(cat $portfile)"
+
+common="endpoint-url=$endpoint access-key=AK secret-key=SK bucket=b"
+
+# Single object mode.
+nbdkit -U - s3native $common key=disk.img \
+       --run 'nbdcopy --request-size=10000000 "$uri" s3native.out'
+cmp $in $out
+rm $out
+
+# A bad secret key must fail.
+if nbdkit -U - s3native $common secret-key=BAD key=disk.img \
+          --run 'nbdcopy "$uri" s3native.out'; then
+    echo "$0: expected failure with the wrong secret key"
+    exit 1
+fi
+rm -f $out
+
+# Object-per-block mode.  Write with requests which are not aligned
+# to objects, then read it back.
+truncate -s 4M $in
+nbdkit -U - s3native $common key=disk size=4M object-size=64K \
+       --run 'nbdcopy --request-size=100000 s3native.in "$uri" &&
+              nbdcopy "$uri" s3native.out'
+cmp $in $out
+
+# Trim deletes whole objects, and zero deletes whole objects and
+# writes zeroes to the partial objects at either end.
+nbdkit -U - s3native $common key=disk size=4M object-size=64K \
+       --run 'nbdsh -u "$uri" -c "
+h.trim(131072, 131072)
+h.zero(100000, 300000)
+"'
+cat $log
+grep "^DELETE disk/0000000000000002$" $log
+grep "^DELETE disk/0000000000000003$" $log
+grep "^DELETE disk/0000000000000005$" $log
+$PYTHON -c '
+import sys
+with open(sys.argv[1], "r+b") as fp:
+    fp.seek(131072); fp.write(bytes(131072))
+    fp.seek(300000); fp.write(bytes(100000))
+' $in
+nbdkit -U - s3native $common key=disk size=4M object-size=64K \
+       --run 'nbdcopy "$uri" s3native.out'
+cmp $in $out
+
+# Object sizes larger than the NBD maximum minimum block size, or
+# which are not powers of 2, must still work and advertise valid
+# block size constraints.
+nbdkit -U - s3native $common key=disk1m size=4M object-size=1M \
+       --run 'nbdsh -u "$uri" -c "
+assert h.get_block_size(nbd.SIZE_MINIMUM) == 1
+assert h.get_block_size(nbd.SIZE_PREFERRED) == 1024 * 1024
+assert h.get_block_size(nbd.SIZE_MAXIMUM) == 0xffffffff
+" &&
+              nbdcopy --request-size=100000 s3native.in "$uri" &&
+              nbdcopy "$uri" s3native.out'
+cmp $in $out
+truncate -s 3000000 $in
+nbdkit -U - s3native $common key=disk100k size=3000000 object-size=100000 \
+       --run 'nbdsh -u "$uri" -c "
+assert h.get_block_size(nbd.SIZE_MINIMUM) == 1
+assert h.get_block_size(nbd.SIZE_PREFERRED) == 65536
+" &&
+              nbdcopy --request-size=65536 s3native.in "$uri" &&
+              nbdcopy "$uri" s3native.out'
+cmp $in $out
+
+# A server which ignores the Range header must not return the wrong
+# data from a ranged GET.
+start_server $portfile2 --ignore-range disk.img=$in
+endpoint2="http://localhost:$(cat $portfile2)"
+if nbdkit -U - s3native endpoint-url=$endpoint2 access-key=AK \
+          secret-key=SK bucket=b key=disk.img \
+          --run 'nbdsh -u "$uri" -c "h.pread(4096, 1000000)"'; then
+    echo "$0: expected failure when the server ignores the Range header"
+    exit 1
+fi
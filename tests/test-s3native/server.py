@@ -0,0 +1,183 @@
+# -*- python -*-
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# A minimal S3-compatible server used to test nbdkit-s3native-plugin.
+#
+# Usage: server.py PORTFILE ACCESS_KEY SECRET_KEY [OPTION|KEY=FILE ...]
+#
+# It listens on a random port on localhost and writes the port number
+# to PORTFILE.  Objects are kept in memory.  KEY=FILE preloads object
+# KEY in any bucket with the contents of FILE.  Every request must be
+# signed with AWS Signature Version 4 using the given keys.
+#
+# Options:
+#   --ignore-range  Ignore Range headers, like some simple web servers.
+#   --log=FILE      Append "DELETE key" to FILE for each deleted object.
+
+import base64
+import hashlib
+import hmac
+import http.server
+import os
+import re
+import sys
+import threading
+import urllib.parse
+
+portfile, access_key, secret_key = sys.argv[1:4]
+objects = {}
+lock = threading.Lock()
+ignore_range = False
+logfile = None
+
+for arg in sys.argv[4:]:
+    if arg == "--ignore-range":
+        ignore_range = True
+        continue
+    if arg.startswith("--log="):
+        logfile = arg[6:]
+        continue
+    k, f = arg.split("=", 1)
+    with open(f, "rb") as fp:
+        objects[k] = fp.read()
+
+
+def hmac_sha256(k, msg):
+    return hmac.new(k, msg.encode(), hashlib.sha256).digest()
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, *args):
+        pass
+
+    def reply(self, status, body=b"", headers={}):
+        self.send_response(status)
+        for h, v in headers.items():
+            self.send_header(h, v)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if self.command != "HEAD":
+            self.wfile.write(body)
+
+    def error(self, status, code):
+        body = ("<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+                "<Error><Code>%s</Code></Error>" % code).encode()
+        self.reply(status, body)
+
+    def check_signature(self, body):
+        auth = self.headers.get("Authorization", "")
+        m = re.match(r"AWS4-HMAC-SHA256 Credential=([^/]+)/(\d+)/([^/]+)/s3/"
+                     r"aws4_request, SignedHeaders=([^,]+), "
+                     r"Signature=([0-9a-f]+)$", auth)
+        if not m or m.group(1) != access_key:
+            return False
+        date, region, signed, signature = m.group(2, 3, 4, 5)
+
+        payload_hash = self.headers["x-amz-content-sha256"]
+        if (payload_hash != "UNSIGNED-PAYLOAD" and
+                payload_hash != hashlib.sha256(body).hexdigest()):
+            return False
+
+        path, _, query = self.path.partition("?")
+        params = sorted(urllib.parse.parse_qsl(query,
+                                               keep_blank_values=True))
+        cquery = "&".join("%s=%s" % (urllib.parse.quote(k, safe="-_.~"),
+                                     urllib.parse.quote(v, safe="-_.~"))
+                          for k, v in params)
+        cheaders = "".join("%s:%s\n" % (h, self.headers[h].strip())
+                           for h in signed.split(";"))
+        creq = "\n".join([self.command, path, cquery, cheaders, signed,
+                          payload_hash])
+        sts = "\n".join(["AWS4-HMAC-SHA256", self.headers["x-amz-date"],
+                         "%s/%s/s3/aws4_request" % (date, region),
+                         hashlib.sha256(creq.encode()).hexdigest()])
+        k = hmac_sha256(("AWS4" + secret_key).encode(), date)
+        k = hmac_sha256(k, region)
+        k = hmac_sha256(k, "s3")
+        k = hmac_sha256(k, "aws4_request")
+        expected = hmac.new(k, sts.encode(), hashlib.sha256).hexdigest()
+        return hmac.compare_digest(expected, signature)
+
+    def handle_request(self):
+        length = int(self.headers.get("Content-Length", 0))
+        body = self.rfile.read(length) if length else b""
+        if not self.check_signature(body):
+            return self.error(403, "SignatureDoesNotMatch")
+
+        path, _, query = self.path.partition("?")
+        _, bucket, key = path.split("/", 2)
+        key = urllib.parse.unquote(key)
+
+        if self.command == "POST" and query in ("delete", "delete="):
+            md5 = base64.b64encode(hashlib.md5(body).digest()).decode()
+            if self.headers.get("Content-MD5") != md5:
+                return self.error(400, "InvalidDigest")
+            keys = re.findall(r"<Key>(.*?)</Key>", body.decode())
+            with lock:
+                for k in keys:
+                    k = k.replace("&amp;", "&")
+                    objects.pop(k, None)
+                    if logfile:
+                        with open(logfile, "a") as fp:
+                            fp.write("DELETE %s\n" % k)
+            return self.reply(200, b"<DeleteResult></DeleteResult>")
+
+        if self.command == "PUT":
+            with lock:
+                objects[key] = body
+            return self.reply(200)
+
+        with lock:
+            data = objects.get(key)
+        if data is None:
+            return self.error(404, "NoSuchKey")
+
+        rng = self.headers.get("Range")
+        if rng is None or ignore_range:
+            return self.reply(200, data)
+        m = re.match(r"bytes=(\d+)-(\d+)$", rng)
+        start, end = int(m.group(1)), min(int(m.group(2)), len(data) - 1)
+        self.reply(206, data[start:end+1], {
+            "Content-Range": "bytes %d-%d/%d" % (start, end, len(data))
+        })
+
+    do_GET = do_HEAD = do_PUT = do_POST = handle_request
+
+
+server = http.server.ThreadingHTTPServer(("localhost", 0), Handler)
+with open(portfile + ".tmp", "w") as fp:
+    fp.write("%d\n" % server.server_address[1])
+# Rename so the test never sees a partially written file.
+os.rename(portfile + ".tmp", portfile)
+server.serve_forever()
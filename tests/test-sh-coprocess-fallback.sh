@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test that scripts which do not support coprocess mode still work,
+# either because they print a message for unknown methods, or because
+# they consume stdin without ever replying (which hits the timeout).
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin sh
+requires_nbdsh_uri
+
+script=test-sh-coprocess-fallback.script
+disk=test-sh-coprocess-fallback.img
+files="$script $disk"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 1M $disk
+
+for unknown in '*) echo "unknown method $1"; exit 2 ;;' \
+               'coprocess) cat >/dev/null ;; *) exit 2 ;;'
+do
+    cat > $script <<EOF2
+#!/usr/bin/env bash
+disk=$PWD/$disk
+EOF2
+    cat >> $script <<'EOF2'
+case "$1" in
+    get_size) stat -L -c '%s' $disk ;;
+    can_write) ;;
+    pread)
+        dd if=$disk skip=$4 count=$3 iflag=skip_bytes,count_bytes status=none ;;
+    pwrite)
+        dd of=$disk seek=$4 count=$3 \
+           iflag=count_bytes oflag=seek_bytes conv=notrunc status=none ;;
+EOF2
+    cat >> $script <<EOF2
+    $unknown
+esac
+EOF2
+    chmod +x $script
+
+    nbdkit -v -U - sh ./$script \
+           --run 'nbdsh -u "$uri" -c "
+assert h.get_size() == 1024 * 1024
+h.pwrite(b\"hello\" * 1000, 4096)
+assert h.pread(5000, 4096) == b\"hello\" * 1000
+"'
+done
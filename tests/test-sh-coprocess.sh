@@ -0,0 +1,121 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the sh plugin coprocess mode.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin sh
+requires_nbdsh_uri
+
+script=test-sh-coprocess.script
+disk=test-sh-coprocess.img
+log=test-sh-coprocess.log
+files="$script $disk $log"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 1M $disk
+
+cat > $script <<EOF
+#!/usr/bin/env bash
+disk=$PWD/$disk
+log=$PWD/$log
+EOF
+cat >> $script <<'EOF'
+export LC_ALL=C
+
+# Log every time the script is started.
+echo "$1" >> $log
+
+main ()
+{
+    case "$1" in
+        thread_model) echo parallel ;;
+        get_size) stat -L -c '%s' $disk ;;
+        can_write|can_flush) ;;
+        pread)
+            dd if=$disk of="${data:-/dev/stdout}" skip=$4 count=$3 \
+               iflag=skip_bytes,count_bytes conv=notrunc status=none ;;
+        pwrite)
+            dd if="${data:-/dev/stdin}" of=$disk seek=$4 count=$3 \
+               iflag=count_bytes oflag=seek_bytes conv=notrunc status=none ;;
+        flush) echo "ENOSPC flush failed" >&2; return 1 ;;
+        *) return 2 ;;
+    esac
+}
+
+if [ "$1" = coprocess ]; then
+    data="$2"
+    while read -r n; do
+        set --
+        for (( ; n > 0; n-- )); do read -r a; set -- "$@" "$a"; done
+        out="$(main "$@" </dev/null 2>"$data.err")"; status=$?
+        if [ $status -ne 0 ]; then
+            out="$(cat "$data.err")"
+        elif [ "$1" = pread ]; then
+            echo 0 $3; continue
+        fi
+        printf '%d %d\n%s' $status ${#out} "$out"
+    done
+    exit 0
+fi
+main "$@"
+EOF
+chmod +x $script
+
+nbdkit -v -U - sh ./$script \
+       --run 'nbdsh -u "$uri" -c "
+import errno
+
+assert h.get_size() == 1024 * 1024
+h.pwrite(b\"hello\" * 1000, 4096)
+assert h.pread(5000, 4096) == b\"hello\" * 1000
+assert h.pread(4096, 0) == bytes(4096)
+try:
+    h.flush()
+    assert False
+except nbd.Error as ex:
+    assert ex.errnum == errno.ENOSPC
+"'
+
+cat $log
+
+# The script was started in coprocess mode, and none of the data
+# methods were called by starting the script.
+grep '^coprocess$' $log
+if grep -E '^(get_size|pread|pwrite|flush)$' $log; then
+    echo "$0: data methods were not handled by the coprocess"
+    exit 1
+fi
@@ -49,7 +49,7 @@ then
     exit 77
 fi
 
-files="ssh.img ssh2.img"
+files="ssh.img ssh2.img ssh3.img"
 rm -f $files
 cleanup_fn rm -f $files
 
@@ -70,3 +70,10 @@ nbdkit -v -D ssh.log=2 -U - \
 
 # The output should be identical.
 cmp disk ssh2.img
+
+# Same again using several SSH connections so requests run in parallel.
+nbdkit -v -D ssh.log=2 -U - \
+       ssh host=localhost $PWD/ssh3.img \
+       create=true create-size=$size connections=4 \
+       --run 'nbdcopy ssh.img "$uri"'
+cmp disk ssh3.img
@@ -0,0 +1,85 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test tmpdisk pool=N creates disks in advance.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin tmpdisk
+requires_nbdsh_uri
+
+d=tmpdisk-pool.d
+log=tmpdisk-pool.log
+err=tmpdisk-pool.err
+rm -rf $d $log $err
+cleanup_fn rm -rf $d $log $err
+mkdir $d
+
+# The command logs every disk it creates.
+export TMPDIR=$PWD/$d log=$PWD/$log
+nbdkit -f -v -U - tmpdisk 1M pool=2 \
+       TRUNCATE="$TRUNCATE" \
+       command='
+set -e
+echo "$disk" >> "$log"
+$TRUNCATE -s $size "$disk"
+' \
+       --run '
+# Wait for the pool to be filled.
+for i in {1..60}; do
+    if [ -f "$log" ] && [ "$(wc -l < "$log")" -ge 2 ]; then break; fi
+    sleep 1
+done
+cat "$log"
+
+# Every connection gets a new empty disk.
+for i in 1 2 3; do
+    nbdsh -u "$uri" -c "
+assert h.get_size() == 1024 * 1024
+assert h.pread(512, 0) == bytes(512)
+h.pwrite(b\"hello\" * 100, 0)
+"
+done
+' 2> $err
+
+cat $log $err
+
+# The pool was filled before the first connection, so at least the
+# first two connections must have been served disks from the pool
+# (the third may miss if the pool has not been refilled yet).
+grep 'diskpool: hits [2-9]' $err
+
+# All the disks and temporary directories must have been removed.
+ls -la $d
+test -z "$(ls $d)"
@@ -0,0 +1,73 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the VDDK command latency histograms (-D vddk.stats=1).
+
+source ./functions.sh
+set -e
+set -x
+
+skip_if_valgrind "because setting LD_LIBRARY_PATH breaks valgrind"
+requires nbdsh --version
+requires_nbdsh_uri
+
+out=test-vddk-stats.out
+rm -f $out
+cleanup_fn rm -f $out
+
+# Write a pattern, then issue some pipelined adjacent reads of
+# different sizes, which may be merged into a single VDDK read.
+# Check that each read gets its own part of the data back.
+nbdkit -U - -v -D vddk.stats=1 vddk libdir=.libs /dev/null queue-depth=4 \
+       --run '
+    nbdsh -u "$uri" -c "
+data = bytes((i * 7 + i // 512) & 255 for i in range(512 * 1024))
+h.pwrite(data, 0)
+
+reads = []
+offset = 0
+for i in range(64):
+    n = 512 * (1 + i % 8)
+    buf = nbd.Buffer(n)
+    h.aio_pread(buf, offset)
+    reads.append((buf, offset, n))
+    offset += n
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+for buf, offset, n in reads:
+    assert buf.to_bytearray() == data[offset:offset+n]
+"
+' 2>$out
+cat $out
+
+grep "VDDK command latency" $out
+grep -E "read +64 calls" $out
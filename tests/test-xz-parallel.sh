@@ -0,0 +1,60 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+set -x
+
+# Test the xz filter uncompressing several blocks in parallel, with
+# prefetching and a block cache too small to hold every block.
+
+requires_filter xz
+requires_nbdcopy
+requires xz --version
+requires cmp --version
+
+files="xz-parallel.img xz-parallel.img.xz xz-parallel.out"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Create a compressible file and compress it with many small blocks.
+for i in $(seq 1 20000); do echo "line $i of the xz parallel test"; done \
+    > xz-parallel.img
+truncate -s 1M xz-parallel.img
+xz --keep --block-size=16384 xz-parallel.img
+
+nbdkit -U - --filter=xz file xz-parallel.img.xz \
+       xz-prefetch=true xz-cache-size=64K \
+       --run 'nbdcopy --connections=2 --requests=16 \
+                      --request-size=8192 "$uri" xz-parallel.out'
+
+cmp xz-parallel.img xz-parallel.out
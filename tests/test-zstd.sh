@@ -0,0 +1,81 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+set -x
+
+# Test the zstd filter with a seekable zstd file.
+
+requires_filter zstd
+requires_nbdcopy
+requires $PYTHON --version
+requires zstd --version
+requires cmp --version
+
+files="zstd.img zstd.img.zst zstd.out"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Create a partly compressible file.
+for i in $(seq 1 50000); do echo "line $i of the zstd test"; done > zstd.img
+dd if=/dev/urandom bs=1024 count=512 >> zstd.img
+
+# Create a seekable zstd file by compressing each frame separately
+# with the zstd command and appending the seek table.
+$PYTHON - <<'EOF2'
+import struct, subprocess
+data = open("zstd.img", "rb").read()
+frame_size = 65536
+entries = []
+with open("zstd.img.zst", "wb") as out:
+    for i in range(0, len(data), frame_size):
+        frame = data[i:i+frame_size]
+        c = subprocess.run(["zstd", "-q", "-c"], input=frame,
+                           stdout=subprocess.PIPE, check=True).stdout
+        out.write(c)
+        entries.append(struct.pack("<II", len(c), len(frame)))
+    table = b"".join(entries)
+    footer = struct.pack("<IBI", len(entries), 0, 0x8F92EAB1)
+    out.write(struct.pack("<II", 0x184D2A5E, len(table) + len(footer)))
+    out.write(table + footer)
+EOF2
+
+# The seekable file can still be uncompressed by zstd.
+zstd -d -c zstd.img.zst | cmp zstd.img -
+
+# Use large requests so that several frames are uncompressed in
+# parallel, and a small cache so that frames are evicted.
+nbdkit -U - --filter=zstd file zstd.img.zst \
+       zstd-cache-size=256K zstd-threads=4 \
+       --run 'nbdcopy --connections=2 --request-size=1M "$uri" zstd.out'
+cmp zstd.img zstd.out